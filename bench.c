@@ -0,0 +1,751 @@
+// Benchmark harness
+//
+// Times every kernel of matrix.h over a sweep of square sizes, training
+// steps and predictions of whole networks, and tiled inference of an image,
+// then prints a table and writes the results as JSON so that two versions can
+// be compared.
+//
+// Every measurement is a number of samples, each timing enough calls to last
+// at least BENCH_MIN_SAMPLE_TIME, after warmup samples that are thrown away.
+// The reported time is the median time of one call over the samples.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "src/Matrix/matrix.h"
+#include "src/Matrix/gemm.h"
+#include "src/Matrix/qgemm.h"
+#include "src/Matrix/random.h"
+#include "src/Matrix/expression.h"
+#include "src/Matrix/sparse.h"
+#include "src/NeuralNetwork/neuralNetwork.h"
+#include "src/NeuralNetwork/tiling.h"
+#include "src/ThreadPool/threadPool.h"
+#include "src/Profiler/profiler.h"
+
+#define BENCH_VERSION 1
+
+// Shortest sample, in seconds
+#define BENCH_MIN_SAMPLE_TIME 0.002
+
+// Steps of a training measurement
+#define BENCH_TRAIN_STEPS 16
+
+// Tiled inference: an image whose last tiles are moved back onto its border
+#define BENCH_TILED_CHANNELS 3
+#define BENCH_TILED_HEIGHT 41
+#define BENCH_TILED_WIDTH 53
+#define BENCH_TILED_TILE_HEIGHT 12
+#define BENCH_TILED_TILE_WIDTH 16
+#define BENCH_TILED_OVERLAP 8
+#define BENCH_TILED_BATCH 8
+
+#define BENCH_MAX_ITEMS 16
+
+// Density of the sparse operand of the kernels
+#define BENCH_SPARSE_DENSITY 0.1f
+
+// Trace events kept by --trace
+#define BENCH_TRACE_EVENTS (1 << 20)
+
+typedef struct bench_options{
+    size_t sizes[BENCH_MAX_ITEMS];
+    size_t nb_sizes;
+    const char *topologies[BENCH_MAX_ITEMS];
+    size_t nb_topologies;
+    size_t train_batch;
+    size_t predict_batches[BENCH_MAX_ITEMS];
+    size_t nb_predict_batches;
+    parallel_mode mode;
+    matrix_type precision;
+    optimizer_type optimizer;
+    float density;
+    size_t warmup;
+    size_t repeat;
+    size_t nb_threads;
+    const char *filter;
+    const char *json;
+    const char *trace;
+} bench_options;
+
+typedef struct bench_stats{
+    double median;      // seconds per call
+    double stddev;
+    double min;
+} bench_stats;
+
+typedef struct bench_result{
+    const char *group;  // "matrix", "train", "predict" or "tiled"
+    const char *name;
+    size_t size;        // matrix side, or batch size
+    bench_stats stats;
+    double gflops;      // 0 when not meaningful
+    double gbps;
+    double samples_per_s;
+} bench_result;
+
+static bench_result *results = NULL;
+static size_t nb_results = 0;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Times run(arg) as configured by the options
+static bench_stats bench_measure(const bench_options *options, void (*run)(void*), void *arg){
+    // Calls per sample, doubled during the warmup until a sample is long enough
+    size_t calls = 1;
+    for(size_t w = 0; w < options->warmup || calls == 1; w++){
+        double start = now();
+        for(size_t c = 0; c < calls; c++)
+            run(arg);
+        if(now() - start >= BENCH_MIN_SAMPLE_TIME)
+            break;
+        calls *= 2;
+    }
+
+    double *times = malloc(options->repeat * sizeof(double));
+    double sum = 0;
+    for(size_t r = 0; r < options->repeat; r++){
+        double start = now();
+        for(size_t c = 0; c < calls; c++)
+            run(arg);
+        times[r] = (now() - start) / calls;
+        sum += times[r];
+    }
+
+    qsort(times, options->repeat, sizeof(double), compare_doubles);
+    double mean = sum / options->repeat, var = 0;
+    for(size_t r = 0; r < options->repeat; r++)
+        var += (times[r] - mean) * (times[r] - mean);
+
+    bench_stats stats = {
+        .median = options->repeat % 2 ? times[options->repeat / 2] : (times[options->repeat / 2 - 1] + times[options->repeat / 2]) / 2,
+        .stddev = options->repeat > 1 ? sqrt(var / (options->repeat - 1)) : 0,
+        .min = times[0],
+    };
+    free(times);
+    return stats;
+}
+
+static void bench_record(bench_result result){
+    results = realloc(results, (nb_results + 1) * sizeof(bench_result));
+    if(results == NULL){
+        fprintf(stderr, "bench: Unable to allocate memory for the results\n");
+        exit(1);
+    }
+    results[nb_results++] = result;
+
+    printf("%-8s %-32s %6zu %12.3f us %9.3f us", result.group, result.name, result.size,
+           result.stats.median * 1e6, result.stats.stddev * 1e6);
+    if(result.gflops > 0)
+        printf(" %9.2f GFLOP/s", result.gflops);
+    if(result.gbps > 0)
+        printf(" %9.2f GB/s", result.gbps);
+    if(result.samples_per_s > 0)
+        printf(" %12.0f samples/s", result.samples_per_s);
+    printf("\n");
+}
+
+// Matrix kernels
+
+// Operands of the kernels, all n x n
+typedef struct bench_operands{
+    size_t n;
+    matrix *a;
+    matrix *b;
+    matrix *c;
+    matrix *ones;       // right operand of the repeated in-place products, which must not drift
+    matrix *sums;       // n x 1
+    size_t *cols;       // a permutation of the columns
+    float *vector;      // n values
+    matrix_csr *sparse; // a pruned to BENCH_SPARSE_DENSITY of its elements
+} bench_operands;
+
+static float bench_affine(float x){
+    return 0.5f * x + 0.25f;
+}
+
+#define BENCH_NEW(expr) matrix_destroy(expr)
+
+static void run_create(void *p){ bench_operands *o = p; BENCH_NEW(matrix_create(o->n, o->n, 1)); }
+static void run_create_random(void *p){ bench_operands *o = p; BENCH_NEW(matrix_create_random(o->n, o->n, -1, 1)); }
+static void run_zeros(void *p){ bench_operands *o = p; BENCH_NEW(matrix_zeros(o->n, o->n)); }
+static void run_zeros_padded(void *p){ bench_operands *o = p; BENCH_NEW(matrix_zeros_padded(o->n, o->n)); }
+static void run_identity(void *p){ bench_operands *o = p; BENCH_NEW(matrix_identity(o->n)); }
+static void run_add(void *p){ bench_operands *o = p; BENCH_NEW(matrix_add(o->a, o->b)); }
+static void run_add_inplace(void *p){ bench_operands *o = p; matrix_add_inplace(o->c, o->b); }
+static void run_add_scaled_inplace(void *p){ bench_operands *o = p; matrix_add_scaled_inplace(o->c, o->b, 0.5f); }
+static void run_sub(void *p){ bench_operands *o = p; BENCH_NEW(matrix_sub(o->a, o->b)); }
+static void run_sub_inplace(void *p){ bench_operands *o = p; matrix_sub_inplace(o->c, o->b); }
+static void run_mul(void *p){ bench_operands *o = p; BENCH_NEW(matrix_mul(o->a, o->b)); }
+static void run_mul_nt(void *p){ bench_operands *o = p; BENCH_NEW(matrix_mul_nt(o->a, o->b)); }
+static void run_mul_tn(void *p){ bench_operands *o = p; BENCH_NEW(matrix_mul_tn(o->a, o->b)); }
+static void run_mul_tt(void *p){ bench_operands *o = p; BENCH_NEW(matrix_mul_tt(o->a, o->b)); }
+static void run_mul_to(void *p){ bench_operands *o = p; matrix_mul_to(o->c, o->a, false, o->b, false, 1, 0); }
+static void run_mul_add_nt(void *p){ bench_operands *o = p; matrix_mul_add_nt(o->c, 1e-3f, o->a, o->b); }
+static void run_scalar_add(void *p){ bench_operands *o = p; BENCH_NEW(matrix_scalar_add(o->a, 1)); }
+static void run_scalar_add_inplace(void *p){ bench_operands *o = p; matrix_scalar_add_inplace(o->c, 1); }
+static void run_scalar_sub(void *p){ bench_operands *o = p; BENCH_NEW(matrix_scalar_sub(o->a, 1)); }
+static void run_scalar_sub_inplace(void *p){ bench_operands *o = p; matrix_scalar_sub_inplace(o->c, 1); }
+static void run_scalar_mul(void *p){ bench_operands *o = p; BENCH_NEW(matrix_scalar_mul(o->a, 2)); }
+static void run_scalar_mul_inplace(void *p){ bench_operands *o = p; matrix_scalar_mul_inplace(o->c, 1); }
+static void run_scalar_div(void *p){ bench_operands *o = p; BENCH_NEW(matrix_scalar_div(o->a, 2)); }
+static void run_scalar_div_inplace(void *p){ bench_operands *o = p; matrix_scalar_div_inplace(o->c, 1); }
+static void run_dot(void *p){ bench_operands *o = p; BENCH_NEW(matrix_dot(o->a, o->b)); }
+static void run_dot_inplace(void *p){ bench_operands *o = p; matrix_dot_inplace(o->c, o->ones); }
+static void run_transpose(void *p){ bench_operands *o = p; BENCH_NEW(matrix_transpose(o->a)); }
+static void run_apply(void *p){ bench_operands *o = p; matrix_apply(o->c, bench_affine); }
+static void run_row_sums_to(void *p){ bench_operands *o = p; matrix_row_sums_to(o->sums, o->a, 1, 0); }
+static void run_equals(void *p){ bench_operands *o = p; matrix_equals(o->a, o->a); }
+static void run_get_row(void *p){ bench_operands *o = p; BENCH_NEW(matrix_get_row(o->a, o->n / 2)); }
+static void run_get_col(void *p){ bench_operands *o = p; BENCH_NEW(matrix_get_col(o->a, o->n / 2)); }
+static void run_gather_cols_to(void *p){ bench_operands *o = p; matrix_gather_cols_to(o->a, o->cols, o->c); }
+static void run_set_row(void *p){ bench_operands *o = p; matrix_set_row(o->c, o->vector, o->n / 2); }
+static void run_set_col(void *p){ bench_operands *o = p; matrix_set_col(o->c, o->vector, o->n / 2); }
+static void run_fill(void *p){ bench_operands *o = p; matrix_fill(o->c, 1); }
+static void run_fill_random(void *p){ bench_operands *o = p; matrix_fill_random(o->c, -1, 1); }
+static void run_copy_to(void *p){ bench_operands *o = p; matrix_copy_to(o->a, o->c); }
+static void run_get_copy(void *p){ bench_operands *o = p; BENCH_NEW(matrix_get_copy(o->a)); }
+
+// c = (a * b + a) * 0.5, in one pass
+static void run_expr_eval(void *p){
+    bench_operands *o = p;
+    matrix_expr e;
+    matrix_expr_init(&e);
+    int a = matrix_expr_matrix(&e, o->a);
+    int ab = matrix_expr_mul(&e, a, matrix_expr_matrix(&e, o->b));
+    int root = matrix_expr_mul(&e, matrix_expr_add(&e, ab, a), matrix_expr_scalar(&e, 0.5f));
+    matrix_expr_eval(&e, root, o->c);
+}
+
+static void run_csr_mul_to(void *p){
+    bench_operands *o = p;
+    matrix_view b = matrix_view_of(o->b);
+    matrix_csr_mul_to(o->c, o->sparse, &b);
+}
+
+static void run_view_copy(void *p){
+    bench_operands *o = p;
+    matrix_view v = matrix_view_of(o->a);
+    matrix_view t = matrix_view_transpose(&v);
+    BENCH_NEW(matrix_view_copy(&t));
+}
+
+// The view kernels run on the top-left (n - 1) x (n - 1) blocks, so the rows are not contiguous
+static matrix_view bench_block(const matrix *m){
+    matrix_view v = matrix_view_of(m);
+    return matrix_view_block(&v, 0, 0, m->row - 1, m->col - 1);
+}
+
+static void run_view_add(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c), a = bench_block(o->a), b = bench_block(o->b); matrix_view_add(&d, &a, &b); }
+static void run_view_sub(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c), a = bench_block(o->a), b = bench_block(o->b); matrix_view_sub(&d, &a, &b); }
+static void run_view_dot(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c), a = bench_block(o->a), b = bench_block(o->b); matrix_view_dot(&d, &a, &b); }
+static void run_view_add_scaled(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c), b = bench_block(o->b); matrix_view_add_scaled(&d, &b, 0.5f); }
+static void run_view_scalar_mul(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c); matrix_view_scalar_mul(&d, 1); }
+static void run_view_apply(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c); matrix_view_apply(&d, bench_affine); }
+static void run_view_fill(void *p){ bench_operands *o = p; matrix_view d = bench_block(o->c); matrix_view_fill(&d, 1); }
+
+static void run_view_copy_to(void *p){
+    bench_operands *o = p;
+    matrix_view a = bench_block(o->a), d = bench_block(o->c);
+    matrix_view t = matrix_view_transpose(&a);
+    matrix_view_copy_to(&t, &d);
+}
+
+static void run_view_mul_to(void *p){
+    bench_operands *o = p;
+    matrix_view d = bench_block(o->c), a = bench_block(o->a), b = bench_block(o->b);
+    matrix_view_mul_to(&d, &a, &b, 1, 0);
+}
+
+// Work of a kernel on n x n operands: flops = flop_coeff * n^flop_order,
+// bytes = float_moves * n^move_order floats (the least traffic the kernel needs)
+typedef struct bench_kernel{
+    const char *name;
+    void (*run)(void*);
+    double flop_coeff;
+    int flop_order;
+    double float_moves;
+    int move_order;
+} bench_kernel;
+
+static const bench_kernel bench_kernels[] = {
+    {"matrix_create", run_create, 0, 0, 1, 2},
+    {"matrix_create_random", run_create_random, 0, 0, 1, 2},
+    {"matrix_zeros", run_zeros, 0, 0, 1, 2},
+    {"matrix_zeros_padded", run_zeros_padded, 0, 0, 1, 2},
+    {"matrix_identity", run_identity, 0, 0, 1, 2},
+    {"matrix_add", run_add, 1, 2, 3, 2},
+    {"matrix_add_inplace", run_add_inplace, 1, 2, 3, 2},
+    {"matrix_add_scaled_inplace", run_add_scaled_inplace, 2, 2, 3, 2},
+    {"matrix_sub", run_sub, 1, 2, 3, 2},
+    {"matrix_sub_inplace", run_sub_inplace, 1, 2, 3, 2},
+    {"matrix_mul", run_mul, 2, 3, 3, 2},
+    {"matrix_mul_nt", run_mul_nt, 2, 3, 3, 2},
+    {"matrix_mul_tn", run_mul_tn, 2, 3, 3, 2},
+    {"matrix_mul_tt", run_mul_tt, 2, 3, 3, 2},
+    {"matrix_mul_to", run_mul_to, 2, 3, 3, 2},
+    {"matrix_mul_add_nt", run_mul_add_nt, 2, 3, 4, 2},
+    {"matrix_scalar_add", run_scalar_add, 1, 2, 2, 2},
+    {"matrix_scalar_add_inplace", run_scalar_add_inplace, 1, 2, 2, 2},
+    {"matrix_scalar_sub", run_scalar_sub, 1, 2, 2, 2},
+    {"matrix_scalar_sub_inplace", run_scalar_sub_inplace, 1, 2, 2, 2},
+    {"matrix_scalar_mul", run_scalar_mul, 1, 2, 2, 2},
+    {"matrix_scalar_mul_inplace", run_scalar_mul_inplace, 1, 2, 2, 2},
+    {"matrix_scalar_div", run_scalar_div, 1, 2, 2, 2},
+    {"matrix_scalar_div_inplace", run_scalar_div_inplace, 1, 2, 2, 2},
+    {"matrix_dot", run_dot, 1, 2, 3, 2},
+    {"matrix_dot_inplace", run_dot_inplace, 1, 2, 3, 2},
+    {"matrix_transpose", run_transpose, 0, 0, 2, 2},
+    {"matrix_apply", run_apply, 2, 2, 2, 2},
+    {"matrix_row_sums_to", run_row_sums_to, 1, 2, 1, 2},
+    {"matrix_equals", run_equals, 1, 2, 2, 2},
+    {"matrix_get_row", run_get_row, 0, 0, 2, 1},
+    {"matrix_get_col", run_get_col, 0, 0, 2, 1},
+    {"matrix_gather_cols_to", run_gather_cols_to, 0, 0, 2, 2},
+    {"matrix_set_row", run_set_row, 0, 0, 2, 1},
+    {"matrix_set_col", run_set_col, 0, 0, 2, 1},
+    {"matrix_fill", run_fill, 0, 0, 1, 2},
+    {"matrix_fill_random", run_fill_random, 0, 0, 1, 2},
+    {"matrix_copy_to", run_copy_to, 0, 0, 2, 2},
+    {"matrix_get_copy", run_get_copy, 0, 0, 2, 2},
+    {"matrix_expr_eval", run_expr_eval, 3, 2, 3, 2},
+    {"matrix_csr_mul_to", run_csr_mul_to, 2 * BENCH_SPARSE_DENSITY, 3, 2 + 2 * BENCH_SPARSE_DENSITY, 2},
+    {"matrix_view_copy", run_view_copy, 0, 0, 2, 2},
+    {"matrix_view_add", run_view_add, 1, 2, 3, 2},
+    {"matrix_view_sub", run_view_sub, 1, 2, 3, 2},
+    {"matrix_view_dot", run_view_dot, 1, 2, 3, 2},
+    {"matrix_view_add_scaled", run_view_add_scaled, 2, 2, 3, 2},
+    {"matrix_view_scalar_mul", run_view_scalar_mul, 1, 2, 2, 2},
+    {"matrix_view_apply", run_view_apply, 2, 2, 2, 2},
+    {"matrix_view_fill", run_view_fill, 0, 0, 1, 2},
+    {"matrix_view_copy_to", run_view_copy_to, 0, 0, 2, 2},
+    {"matrix_view_mul_to", run_view_mul_to, 2, 3, 3, 2},
+};
+
+static bool bench_selected(const bench_options *options, const char *name){
+    return options->filter == NULL || strstr(name, options->filter) != NULL;
+}
+
+static void bench_matrix_kernels(const bench_options *options){
+    for(size_t s = 0; s < options->nb_sizes; s++){
+        size_t n = options->sizes[s];
+        bench_operands o = {
+            .n = n,
+            .a = matrix_create_random(n, n, -1, 1),
+            .b = matrix_create_random(n, n, -1, 1),
+            .c = matrix_create_random(n, n, -1, 1),
+            .ones = matrix_create(n, n, 1),
+            .sums = matrix_zeros(n, 1),
+            .cols = malloc(n * sizeof(size_t)),
+            .vector = malloc(n * sizeof(float)),
+        };
+        if(o.a == NULL || o.b == NULL || o.c == NULL || o.ones == NULL || o.sums == NULL || o.cols == NULL || o.vector == NULL){
+            fprintf(stderr, "bench: Unable to allocate memory for the operands\n");
+            exit(1);
+        }
+        for(size_t i = 0; i < n; i++){
+            o.cols[i] = (i * 7919) % n;
+            o.vector[i] = 1;
+        }
+        matrix *pruned = matrix_get_copy(o.a);
+        if(pruned == NULL){
+            fprintf(stderr, "bench: Unable to allocate memory for the operands\n");
+            exit(1);
+        }
+        matrix_prune(pruned, BENCH_SPARSE_DENSITY);
+        o.sparse = matrix_csr_from(pruned);
+        matrix_destroy(pruned);
+        if(o.sparse == NULL)
+            exit(1);
+
+        for(size_t k = 0; k < sizeof(bench_kernels) / sizeof(bench_kernels[0]); k++){
+            const bench_kernel *kernel = &bench_kernels[k];
+            if(!bench_selected(options, kernel->name))
+                continue;
+
+            // start every kernel from the same destination
+            matrix_copy_to(o.b, o.c);
+            bench_stats stats = bench_measure(options, kernel->run, &o);
+            double flops = kernel->flop_coeff * pow(n, kernel->flop_order);
+            double bytes = kernel->float_moves * pow(n, kernel->move_order) * sizeof(float);
+            bench_record((bench_result){
+                .group = "matrix",
+                .name = kernel->name,
+                .size = n,
+                .stats = stats,
+                .gflops = flops / stats.median * 1e-9,
+                .gbps = bytes / stats.median * 1e-9,
+            });
+        }
+
+        matrix_destroy(o.a);
+        matrix_destroy(o.b);
+        matrix_destroy(o.c);
+        matrix_destroy(o.ones);
+        matrix_destroy(o.sums);
+        free(o.cols);
+        free(o.vector);
+        matrix_csr_destroy(o.sparse);
+    }
+}
+
+// Networks
+
+typedef struct bench_network{
+    neural_network *nn;
+    matrix *X;
+    matrix *T;
+    matrix *Y;
+    nn_context *ctx;
+} bench_network;
+
+static void run_train(void *p){
+    bench_network *b = p;
+    nn_train(b->nn, b->X, b->T, 1);
+}
+
+static void run_predict(void *p){
+    bench_network *b = p;
+    nn_predict_into(b->nn, b->X, b->Y, b->ctx);
+}
+
+static neural_network* bench_create_network(const bench_options *options, const char *topology){
+    neural_network *nn = nn_create_from_spec(topology);
+    nn_set_batch_size(nn, options->train_batch);
+    nn_set_parallel_mode(nn, options->mode);
+    nn_set_precision(nn, options->precision);
+    nn_set_optimizer(nn, options->optimizer);
+    // small steps, so that repeated epochs do not saturate the outputs
+    nn_set_learning_rate(nn, 1e-3f);
+    return nn;
+}
+
+static void bench_networks(const bench_options *options){
+    for(size_t t = 0; t < options->nb_topologies; t++){
+        const char *topology = options->topologies[t];
+        if(!bench_selected(options, topology) && !bench_selected(options, "train") && !bench_selected(options, "predict"))
+            continue;
+
+        neural_network *nn = bench_create_network(options, topology);
+        size_t input_size = nn->layers[0]->input_size;
+        size_t output_size = nn->layers[nn->nb_layers - 1]->nb_neurons;
+
+        // One epoch of BENCH_TRAIN_STEPS batches
+        if(bench_selected(options, "train") || bench_selected(options, topology)){
+            size_t nb_samples = options->train_batch * BENCH_TRAIN_STEPS;
+            bench_network b = {
+                .nn = nn,
+                .X = matrix_create_random(input_size, nb_samples, 0, 1),
+                .T = matrix_create_random(output_size, nb_samples, 0, 1),
+            };
+            bench_stats stats = bench_measure(options, run_train, &b);
+            bench_record((bench_result){
+                .group = "train",
+                .name = topology,
+                .size = options->train_batch,
+                .stats = {stats.median / BENCH_TRAIN_STEPS, stats.stddev / BENCH_TRAIN_STEPS, stats.min / BENCH_TRAIN_STEPS},
+                .samples_per_s = nb_samples / stats.median,
+            });
+            matrix_destroy(b.X);
+            matrix_destroy(b.T);
+        }
+
+        if(bench_selected(options, "predict") || bench_selected(options, topology)){
+            // the layers switch to the sparse kernel below the crossover density
+            if(options->density < 1)
+                nn_prune(nn, options->density);
+            for(size_t i = 0; i < options->nb_predict_batches; i++){
+                size_t batch = options->predict_batches[i];
+                bench_network b = {
+                    .nn = nn,
+                    .X = matrix_create_random(input_size, batch, 0, 1),
+                    .Y = matrix_zeros(output_size, batch),
+                    .ctx = nn_context_create(nn, batch),
+                };
+                bench_stats stats = bench_measure(options, run_predict, &b);
+                bench_record((bench_result){
+                    .group = "predict",
+                    .name = topology,
+                    .size = batch,
+                    .stats = stats,
+                    .samples_per_s = batch / stats.median,
+                });
+                matrix_destroy(b.X);
+                matrix_destroy(b.Y);
+                nn_context_destroy(b.ctx);
+            }
+        }
+
+        nn_destroy(nn);
+    }
+}
+
+typedef struct bench_tiled{
+    neural_network *nn;
+    const matrix *image;
+    matrix *out;
+    nn_tiling tiling;
+} bench_tiled;
+
+static void run_tiled(void *p){
+    bench_tiled *b = p;
+    nn_predict_tiled(b->nn, b->image, b->out, &b->tiling);
+}
+
+// Two 3 x 3 convolutions keeping the size of the tiles
+static neural_network* bench_conv_network(void){
+    conv_shape first = {.in_channels = BENCH_TILED_CHANNELS, .in_height = BENCH_TILED_TILE_HEIGHT,
+                        .in_width = BENCH_TILED_TILE_WIDTH, .out_channels = 8,
+                        .kernel_height = 3, .kernel_width = 3, .stride = 1, .padding = 1, .dilation = 1};
+    conv_shape second = first;
+    second.in_channels = 8;
+    second.out_channels = 2;
+
+    neural_network *nn = neural_network_create();
+    nn_set_input_conv2d_layer(nn, first, ACTIVATION_RELU);
+    nn_set_output_conv2d_layer(nn, second, ACTIVATION_IDENTITY);
+    nn_compile(nn, BENCH_TILED_CHANNELS * BENCH_TILED_TILE_HEIGHT * BENCH_TILED_TILE_WIDTH);
+    return nn;
+}
+
+static void bench_tiled_inference(const bench_options *options){
+    if(!bench_selected(options, "tiled"))
+        return;
+
+    neural_network *nn = bench_conv_network();
+    bench_tiled b = {
+        .nn = nn,
+        .image = matrix_create_random(BENCH_TILED_CHANNELS * BENCH_TILED_HEIGHT, BENCH_TILED_WIDTH, -1, 1),
+        .tiling = nn_tiling_of(nn, BENCH_TILED_OVERLAP, BENCH_TILED_BATCH),
+    };
+    size_t out_channels = nn_tiling_out_channels(nn, &b.tiling);
+    b.out = matrix_zeros(out_channels * BENCH_TILED_HEIGHT, BENCH_TILED_WIDTH);
+    if(b.image == NULL || b.out == NULL){
+        fprintf(stderr, "bench: Unable to allocate memory for the image\n");
+        exit(1);
+    }
+    bench_stats stats = bench_measure(options, run_tiled, &b);
+    bench_record((bench_result){
+        .group = "tiled",
+        .name = "41x53 image, 12x16 tiles",
+        .size = BENCH_TILED_OVERLAP,
+        .stats = stats,
+        .samples_per_s = 1 / stats.median,
+    });
+
+    matrix_destroy((matrix*) b.image);
+    matrix_destroy(b.out);
+    nn_destroy(nn);
+}
+
+// Output
+
+static void json_string(FILE *f, const char *s){
+    fputc('"', f);
+    for(; *s != '\0'; s++){
+        if(*s == '"' || *s == '\\')
+            fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static bool bench_write_json(const bench_options *options, const char *path){
+    FILE *f = fopen(path, "w");
+    if(f == NULL){
+        fprintf(stderr, "bench: Unable to open %s\n", path);
+        return false;
+    }
+
+    fprintf(f, "{\n  \"version\": %d,\n  \"timestamp\": %lld,\n", BENCH_VERSION, (long long) time(NULL));
+    fprintf(f, "  \"threads\": %zu,\n  \"gemm_kernel\": \"%s\",\n  \"qgemm_kernel\": \"%s\",\n",
+            thread_pool_get_nb_threads(), gemm_kernel_name(), qgemm_kernel_name());
+    fprintf(f, "  \"precision\": \"%s\",\n  \"optimizer\": \"%s\",\n  \"density\": %g,\n  \"warmup\": %zu,\n  \"repeat\": %zu,\n  \"results\": [\n",
+            matrix_type_name(options->precision), optimizer_name(options->optimizer), options->density, options->warmup, options->repeat);
+
+    for(size_t i = 0; i < nb_results; i++){
+        const bench_result *r = &results[i];
+        fprintf(f, "    {\"group\": \"%s\", \"name\": ", r->group);
+        json_string(f, r->name);
+        fprintf(f, ", \"size\": %zu, \"median_s\": %.9g, \"stddev_s\": %.9g, \"min_s\": %.9g",
+                r->size, r->stats.median, r->stats.stddev, r->stats.min);
+        if(r->gflops > 0)
+            fprintf(f, ", \"gflops\": %.6g", r->gflops);
+        if(r->gbps > 0)
+            fprintf(f, ", \"gbps\": %.6g", r->gbps);
+        if(r->samples_per_s > 0)
+            fprintf(f, ", \"samples_per_s\": %.6g", r->samples_per_s);
+        fprintf(f, "}%s\n", i + 1 < nb_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    return fclose(f) == 0;
+}
+
+// Options
+
+static void usage(const char *name){
+    fprintf(stderr,
+            "usage: %s [--sizes N,...] [--topology SPEC]... [--train-batch N] [--predict-batches N,...]\n"
+            "          [--mode none|data|hogwild] [--precision fp32|fp16|bf16] [--optimizer NAME] [--density F]\n"
+            "          [--warmup N] [--repeat N] [--threads N] [--filter TEXT] [--json PATH]\n"
+            "  --sizes            sides of the square matrices of the kernels (default 64,256,1024)\n"
+            "  --topology         network as input size then layers, e.g. 784,128:relu,10:softmax;\n"
+            "                     repeat it to measure several networks\n"
+            "  --train-batch      batch size of the training steps (default 64)\n"
+            "  --predict-batches  batch sizes of the predictions (default 1,64)\n"
+            "  --mode             parallel training mode (default none)\n"
+            "  --precision        storage of the weights of the networks (default fp32)\n"
+            "  --optimizer        sgd, nesterov, adam or adamw, updating the weights (default sgd)\n"
+            "  --density          fraction of the weights of the dense layers kept by pruning\n"
+            "                     the networks before the predictions (default 1)\n"
+            "  --warmup           samples run before measuring (default 3)\n"
+            "  --repeat           samples measured (default 10)\n"
+            "  --threads          number of worker threads\n"
+            "  --filter           only run the benchmarks whose name contains TEXT\n"
+            "                     (\"matrix_\", \"train\", \"predict\", \"tiled\" or a topology select whole groups)\n"
+            "  --json             write the results to PATH\n"
+            "  --trace            print the per-layer profile of the networks and write their\n"
+            "                     Chrome trace to PATH (needs a build with make PROFILE=1)\n", name);
+    exit(1);
+}
+
+static size_t parse_list(const char *text, size_t *values, const char *name){
+    size_t n = 0;
+    const char *p = text;
+
+    while(*p != '\0'){
+        char *end;
+        unsigned long v = strtoul(p, &end, 10);
+        if(end == p || v == 0 || n == BENCH_MAX_ITEMS || (*end != ',' && *end != '\0')){
+            fprintf(stderr, "bench: Invalid %s '%s'\n", name, text);
+            exit(1);
+        }
+        values[n++] = v;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char **argv){
+    bench_options options = {
+        .sizes = {64, 256, 1024},
+        .nb_sizes = 3,
+        .train_batch = 64,
+        .predict_batches = {1, 64},
+        .nb_predict_batches = 2,
+        .mode = PARALLEL_NONE,
+        .precision = MATRIX_FLOAT,
+        .optimizer = OPTIMIZER_SGD,
+        .density = 1,
+        .warmup = 3,
+        .repeat = 10,
+    };
+
+    for(int i = 1; i < argc; i++){
+        if(i + 1 >= argc)
+            usage(argv[0]);
+        if(strcmp(argv[i], "--sizes") == 0)
+            options.nb_sizes = parse_list(argv[++i], options.sizes, "size list");
+        else if(strcmp(argv[i], "--topology") == 0){
+            if(options.nb_topologies == BENCH_MAX_ITEMS)
+                usage(argv[0]);
+            options.topologies[options.nb_topologies++] = argv[++i];
+        }
+        else if(strcmp(argv[i], "--train-batch") == 0)
+            options.train_batch = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--predict-batches") == 0)
+            options.nb_predict_batches = parse_list(argv[++i], options.predict_batches, "batch list");
+        else if(strcmp(argv[i], "--mode") == 0){
+            const char *mode = argv[++i];
+            if(strcmp(mode, "none") == 0)
+                options.mode = PARALLEL_NONE;
+            else if(strcmp(mode, "data") == 0)
+                options.mode = PARALLEL_DATA;
+            else if(strcmp(mode, "hogwild") == 0)
+                options.mode = PARALLEL_HOGWILD;
+            else
+                usage(argv[0]);
+        }
+        else if(strcmp(argv[i], "--precision") == 0){
+            int precision = matrix_type_from_name(argv[++i]);
+            if(precision < 0)
+                usage(argv[0]);
+            options.precision = precision;
+        }
+        else if(strcmp(argv[i], "--optimizer") == 0){
+            int optimizer = optimizer_from_name(argv[++i]);
+            if(optimizer < 0)
+                usage(argv[0]);
+            options.optimizer = optimizer;
+        }
+        else if(strcmp(argv[i], "--density") == 0){
+            options.density = strtof(argv[++i], NULL);
+            if(!(options.density > 0 && options.density <= 1))
+                usage(argv[0]);
+        }
+        else if(strcmp(argv[i], "--warmup") == 0)
+            options.warmup = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--repeat") == 0)
+            options.repeat = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--threads") == 0)
+            options.nb_threads = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--filter") == 0)
+            options.filter = argv[++i];
+        else if(strcmp(argv[i], "--json") == 0)
+            options.json = argv[++i];
+        else if(strcmp(argv[i], "--trace") == 0)
+            options.trace = argv[++i];
+        else
+            usage(argv[0]);
+    }
+    if(options.train_batch == 0 || options.repeat == 0)
+        usage(argv[0]);
+    if(options.trace != NULL && !profile_enabled()){
+        fprintf(stderr, "bench: --trace needs the profiler, build with make PROFILE=1\n");
+        return 1;
+    }
+    if(options.nb_topologies == 0){
+        options.topologies[0] = "784,128:relu,10:softmax";
+        options.topologies[1] = "784,512:relu,512:relu,10:softmax";
+        options.nb_topologies = 2;
+    }
+
+    if(options.nb_threads > 0)
+        thread_pool_init(options.nb_threads);
+    random_seed(1);
+
+    printf("%-8s %-32s %6s %15s %12s\n", "group", "name", "size", "median", "stddev");
+    bench_matrix_kernels(&options);
+
+    if(options.trace != NULL){
+        profile_reset();
+        if(!profile_trace_start(BENCH_TRACE_EVENTS))
+            return 1;
+    }
+    bench_networks(&options);
+    bench_tiled_inference(&options);
+
+    bool ok = options.json == NULL || bench_write_json(&options, options.json);
+    if(options.trace != NULL){
+        printf("\n");
+        profile_print(stdout);
+        ok = profile_trace_write(options.trace) && ok;
+        profile_trace_stop();
+    }
+    free(results);
+    thread_pool_destroy();
+    return ok ? 0 : 1;
+}
@@ -1,25 +1,8 @@
 #include <stdio.h>
-#include <math.h>
 
 #include "src/Matrix/matrix.h"
 #include "src/NeuralNetwork/neuralNetwork.h"
 
-float sigmoid(float x){
-    return 1 / (1 + expf(-x));
-}
-
-float sigmoid_prime(float x){
-    return x * (1 - x);
-}
-
-float relu(float x){
-    return x > 0 ? x : 0;
-}
-
-float relu_prime(float x){
-    return x > 0 ? 1 : 0;
-}
-
 int main(){
     matrix* a = matrix_create(1, 3, 1);
     matrix_set_row(a, (float[]){1, 3, 1}, 0);
@@ -44,8 +27,8 @@ int main(){
     neural_network *nn = neural_network_create();
     nn_set_learning_rate(nn, 0.1);
     nn_set_loss_function(nn, MEAN_SQUARED_ERROR);
-    nn_set_input_layer(nn, 5, sigmoid, sigmoid_prime);
-    nn_set_output_layer(nn, 1, sigmoid, sigmoid_prime);
+    nn_set_input_layer_builtin(nn, 5, ACTIVATION_SIGMOID);
+    nn_set_output_layer_builtin(nn, 1, ACTIVATION_SIGMOID);
 
     //nn_train(nn, X, y, 1);
 
@@ -0,0 +1,196 @@
+// Quantization drift report
+//
+// Quantizes a model to int8, calibrating it on samples of a dataset, then
+// runs both versions over the dataset and reports how far the int8 outputs
+// drift from the fp32 ones, the accuracy of both, their weight memory and
+// their throughput.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "src/NeuralNetwork/neuralNetwork.h"
+#include "src/NeuralNetwork/modelFile.h"
+#include "src/NeuralNetwork/quantization.h"
+#include "src/Matrix/gemm.h"
+#include "src/ThreadPool/threadPool.h"
+
+// Samples evaluated at once
+#define QUANTIZE_CHUNK 1024
+
+typedef struct quantize_options{
+    const char *model;
+    const char *inputs;
+    const char *targets;
+    bool raw;
+    size_t nb_classes;
+    size_t nb_calibration;
+    size_t nb_threads;
+} quantize_options;
+
+static void usage(const char *name){
+    fprintf(stderr,
+            "usage: %s --model PATH --inputs PATH --targets PATH [--raw] [--classes N] [--calibration N] [--threads N]\n"
+            "  --model        model file written by nn_save\n"
+            "  --inputs       IDX file of the inputs\n"
+            "  --targets      IDX file of the labels or targets\n"
+            "  --raw          the files hold raw little-endian floats instead, sized from the model\n"
+            "  --classes      number of classes of IDX labels (default: the output size of the model)\n"
+            "  --calibration  number of samples used to calibrate the activation ranges (default 1000)\n"
+            "  --threads      number of worker threads of the GEMM\n", name);
+    exit(1);
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t column_argmax(const matrix *m, size_t j){
+    size_t best = 0;
+    for(size_t i = 1; i < m->row; i++){
+        if(m->data[i * m->stride + j] > m->data[best * m->stride + j])
+            best = i;
+    }
+    return best;
+}
+
+int main(int argc, char **argv){
+    quantize_options options = {.nb_calibration = 1000};
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--raw") == 0){
+            options.raw = true;
+            continue;
+        }
+        if(i + 1 >= argc)
+            usage(argv[0]);
+        if(strcmp(argv[i], "--model") == 0)
+            options.model = argv[++i];
+        else if(strcmp(argv[i], "--inputs") == 0)
+            options.inputs = argv[++i];
+        else if(strcmp(argv[i], "--targets") == 0)
+            options.targets = argv[++i];
+        else if(strcmp(argv[i], "--classes") == 0)
+            options.nb_classes = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--calibration") == 0)
+            options.nb_calibration = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--threads") == 0)
+            options.nb_threads = strtoul(argv[++i], NULL, 10);
+        else
+            usage(argv[0]);
+    }
+    if(options.model == NULL || options.inputs == NULL || options.targets == NULL || options.nb_calibration == 0)
+        usage(argv[0]);
+
+    if(options.nb_threads > 0)
+        thread_pool_init(options.nb_threads);
+
+    neural_network *nn = nn_load(options.model);
+    if(nn == NULL)
+        return 1;
+    size_t input_size = nn->layers[0]->input_size;
+    size_t output_size = nn->layers[nn->nb_layers - 1]->nb_neurons;
+
+    dataset *ds = options.raw ? dataset_open_raw(options.inputs, options.targets, input_size, output_size)
+                              : dataset_open_idx(options.inputs, options.targets, options.nb_classes > 0 ? options.nb_classes : output_size);
+    if(ds == NULL)
+        return 1;
+    if(ds->input_size != input_size || ds->output_size != output_size){
+        fprintf(stderr, "quantize: The dataset has %zu inputs and %zu outputs, the model %zu and %zu\n",
+                ds->input_size, ds->output_size, input_size, output_size);
+        return 1;
+    }
+
+    // Calibration samples spread evenly over the dataset
+    size_t nb_calibration = options.nb_calibration < ds->nb_samples ? options.nb_calibration : ds->nb_samples;
+    size_t *samples = malloc((nb_calibration > QUANTIZE_CHUNK ? nb_calibration : QUANTIZE_CHUNK) * sizeof(size_t));
+    matrix *C = matrix_zeros(input_size, nb_calibration);
+    matrix *CT = matrix_zeros(output_size, nb_calibration);
+    if(samples == NULL || C == NULL || CT == NULL){
+        fprintf(stderr, "quantize: Unable to allocate memory for the calibration samples\n");
+        return 1;
+    }
+    for(size_t i = 0; i < nb_calibration; i++)
+        samples[i] = i * ds->nb_samples / nb_calibration;
+    dataset_gather(ds, samples, nb_calibration, C, CT);
+
+    nn_quantized *q = nn_quantize(nn, C);
+    if(q == NULL)
+        return 1;
+    matrix_destroy(C);
+    matrix_destroy(CT);
+
+    size_t fp32_size = 0;
+    for(size_t i = 0; i < nn->nb_layers; i++)
+        fp32_size += nn->layers[i]->nb_neurons * (nn->layers[i]->input_size + 1) * sizeof(float);
+
+    // Both versions over the whole dataset, a chunk at a time
+    matrix *X = matrix_zeros_padded(input_size, QUANTIZE_CHUNK);
+    matrix *T = matrix_zeros_padded(output_size, QUANTIZE_CHUNK);
+    matrix *Y = matrix_zeros_padded(output_size, QUANTIZE_CHUNK);
+    matrix *YQ = matrix_zeros_padded(output_size, QUANTIZE_CHUNK);
+    nn_context *ctx = nn_context_create(nn, QUANTIZE_CHUNK);
+    nn_quantized_context *qctx = nn_quantized_context_create(q, QUANTIZE_CHUNK);
+
+    double fp32_time = 0, int8_time = 0, sum_diff = 0, max_diff = 0;
+    size_t agree = 0, fp32_correct = 0, int8_correct = 0;
+    for(size_t b = 0; b < ds->nb_samples; b += QUANTIZE_CHUNK){
+        size_t n = ds->nb_samples - b < QUANTIZE_CHUNK ? ds->nb_samples - b : QUANTIZE_CHUNK;
+        for(size_t j = 0; j < n; j++)
+            samples[j] = b + j;
+        dataset_gather(ds, samples, n, X, T);
+        Y->col = YQ->col = n;
+
+        double start = now();
+        nn_predict_into(nn, X, Y, ctx);
+        double middle = now();
+        nn_quantized_predict_into(q, X, YQ, qctx);
+        double end = now();
+        fp32_time += middle - start;
+        int8_time += end - middle;
+
+        for(size_t i = 0; i < output_size; i++){
+            for(size_t j = 0; j < n; j++){
+                double diff = fabs(Y->data[i * Y->stride + j] - YQ->data[i * YQ->stride + j]);
+                sum_diff += diff;
+                if(diff > max_diff)
+                    max_diff = diff;
+            }
+        }
+        for(size_t j = 0; j < n; j++){
+            size_t expected = column_argmax(T, j), fp32 = column_argmax(Y, j), int8 = column_argmax(YQ, j);
+            agree += fp32 == int8;
+            fp32_correct += fp32 == expected;
+            int8_correct += int8 == expected;
+        }
+    }
+
+    double nb = ds->nb_samples;
+    printf("samples:            %zu (%zu used for calibration)\n", ds->nb_samples, nb_calibration);
+    printf("kernels:            gemm %s, qgemm %s\n", gemm_kernel_name(), qgemm_kernel_name());
+    printf("weights:            fp32 %zu bytes, int8 %zu bytes (%.2fx smaller)\n",
+           fp32_size, nn_quantized_size(q), (double) fp32_size / nn_quantized_size(q));
+    printf("output drift:       max %.6f, mean %.6f\n", max_diff, sum_diff / (nb * output_size));
+    if(output_size > 1){
+        printf("argmax agreement:   %.2f%%\n", 100 * agree / nb);
+        printf("accuracy:           fp32 %.2f%%, int8 %.2f%%\n", 100 * fp32_correct / nb, 100 * int8_correct / nb);
+    }
+    printf("throughput:         fp32 %.0f samples/s, int8 %.0f samples/s\n", nb / fp32_time, nb / int8_time);
+
+    nn_quantized_context_destroy(qctx);
+    nn_context_destroy(ctx);
+    matrix_destroy(X);
+    matrix_destroy(T);
+    matrix_destroy(Y);
+    matrix_destroy(YQ);
+    free(samples);
+    nn_quantized_destroy(q);
+    dataset_close(ds);
+    nn_destroy(nn);
+    thread_pool_destroy();
+    return 0;
+}
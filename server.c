@@ -0,0 +1,491 @@
+// Inference server
+//
+// Loads a model once, then answers one request per line: the input values
+// separated by spaces or commas. Each answer is one line with the output
+// values, or a line starting with "error:" for a malformed request.
+// Requests come from stdin, or from the clients of a Unix domain socket.
+// Concurrent requests are batched together (see src/Server/inferenceServer.h).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "src/NeuralNetwork/neuralNetwork.h"
+#include "src/NeuralNetwork/modelFile.h"
+#include "src/ThreadPool/threadPool.h"
+#include "src/Server/inferenceServer.h"
+
+typedef struct server_options{
+    const char *model;
+    const char *layers;
+    const char *socket_path;
+    size_t max_batch;
+    double max_delay_ms;
+    size_t nb_threads;
+    matrix_type precision;
+} server_options;
+
+static void usage(const char *name){
+    fprintf(stderr,
+            "usage: %s (--model PATH | --layers SPEC) [--socket PATH] [--max-batch N] [--max-delay MS] [--threads N] [--precision TYPE]\n"
+            "  --model      model file written by nn_save\n"
+            "  --layers     random network for testing: input size then layers, e.g. 784,128:relu,10:softmax\n"
+            "               (the last layer is the output layer, sigmoid by default)\n"
+            "  --socket     serve the clients of a Unix domain socket instead of stdin\n"
+            "  --max-batch  largest batch run at once (default 64)\n"
+            "  --max-delay  longest wait for a batch to fill, in ms (default 2)\n"
+            "  --threads    number of worker threads of the GEMM\n"
+            "  --precision  storage of the weights: fp32 (default), fp16 or bf16\n", name);
+    exit(1);
+}
+
+// Parses one request line into values, returns the number of values found
+// (may exceed size, in which case only the first size values are stored)
+static size_t parse_values(const char *line, float *values, size_t size, bool *valid){
+    size_t n = 0;
+    const char *p = line;
+    *valid = true;
+
+    for(;;){
+        while(*p == ' ' || *p == '\t' || *p == ',' || *p == '\r' || *p == '\n')
+            p++;
+        if(*p == '\0')
+            break;
+
+        char *end;
+        float v = strtof(p, &end);
+        if(end == p){
+            *valid = false;
+            break;
+        }
+        if(n < size)
+            values[n] = v;
+        n++;
+        p = end;
+    }
+    return n;
+}
+
+// Parses a request line and runs it, then writes the answer to out
+static void serve_line(inference_server *server, const char *line, float *input, float *output, FILE *out){
+    size_t input_size = server->nn->layers[0]->input_size;
+    size_t output_size = server->nn->layers[server->nn->nb_layers - 1]->nb_neurons;
+
+    bool valid;
+    size_t n = parse_values(line, input, input_size, &valid);
+    if(!valid){
+        fprintf(out, "error: invalid number\n");
+        return;
+    }
+    if(n != input_size){
+        fprintf(out, "error: expected %zu values, got %zu\n", input_size, n);
+        return;
+    }
+
+    inference_request request = {.input = input, .output = output};
+    inference_server_submit(server, &request);
+    inference_server_wait(server, &request);
+
+    for(size_t i = 0; i < output_size; i++)
+        fprintf(out, i == 0 ? "%g" : " %g", output[i]);
+    fputc('\n', out);
+}
+
+// stdin mode
+// A reader thread submits the lines as they come, without waiting for the
+// answers, so a piped stream of requests is batched. The main thread writes
+// the answers in the order of the requests.
+
+typedef struct pending_line{
+    inference_request request;
+    float *input;
+    float *output;
+    char *error;                // answer of a malformed request, NULL otherwise
+    struct pending_line *next;
+} pending_line;
+
+typedef struct stdin_queue{
+    inference_server *server;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pending_line *head;
+    pending_line *tail;
+    size_t nb_pending;
+    size_t max_pending;
+    bool eof;
+} stdin_queue;
+
+static void* stdin_reader(void *arg){
+    stdin_queue *queue = arg;
+    inference_server *server = queue->server;
+    size_t input_size = server->nn->layers[0]->input_size;
+    size_t output_size = server->nn->layers[server->nn->nb_layers - 1]->nb_neurons;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    while(getline(&line, &capacity, stdin) != -1){
+        if(line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+
+        pending_line *p = malloc(sizeof(pending_line));
+        if(p == NULL || (p->input = malloc(input_size * sizeof(float))) == NULL || (p->output = malloc(output_size * sizeof(float))) == NULL){
+            fprintf(stderr, "stdin_reader: Unable to allocate memory for the request\n");
+            exit(1);
+        }
+        p->error = NULL;
+        p->next = NULL;
+
+        bool valid;
+        size_t n = parse_values(line, p->input, input_size, &valid);
+        if(!valid || n != input_size){
+            char message[96];
+            if(!valid)
+                snprintf(message, sizeof(message), "error: invalid number");
+            else
+                snprintf(message, sizeof(message), "error: expected %zu values, got %zu", input_size, n);
+            p->error = strdup(message);
+        }
+
+        // Bound the number of requests in flight
+        pthread_mutex_lock(&queue->lock);
+        while(queue->nb_pending >= queue->max_pending)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+
+        if(p->error == NULL){
+            p->request.input = p->input;
+            p->request.output = p->output;
+            inference_server_submit(server, &p->request);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if(queue->tail == NULL)
+            queue->head = p;
+        else
+            queue->tail->next = p;
+        queue->tail = p;
+        queue->nb_pending++;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    free(line);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->eof = true;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+static void serve_stdin(inference_server *server){
+    size_t output_size = server->nn->layers[server->nn->nb_layers - 1]->nb_neurons;
+    stdin_queue queue = {.server = server, .max_pending = 4 * server->max_batch};
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+
+    pthread_t reader;
+    if(pthread_create(&reader, NULL, stdin_reader, &queue) != 0){
+        fprintf(stderr, "serve_stdin: Unable to start the reader thread\n");
+        exit(1);
+    }
+
+    for(;;){
+        pthread_mutex_lock(&queue.lock);
+        while(queue.head == NULL && !queue.eof)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        pending_line *p = queue.head;
+        pthread_mutex_unlock(&queue.lock);
+        if(p == NULL)
+            break;
+
+        if(p->error != NULL)
+            printf("%s\n", p->error);
+        else{
+            inference_server_wait(server, &p->request);
+            for(size_t i = 0; i < output_size; i++)
+                printf(i == 0 ? "%g" : " %g", p->output[i]);
+            putchar('\n');
+        }
+
+        // Flush when no answer is ready, so an interactive client sees it
+        pthread_mutex_lock(&queue.lock);
+        queue.head = p->next;
+        if(queue.head == NULL)
+            queue.tail = NULL;
+        queue.nb_pending--;
+        bool idle = queue.head == NULL;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+        if(idle)
+            fflush(stdout);
+
+        free(p->input);
+        free(p->output);
+        free(p->error);
+        free(p);
+    }
+    fflush(stdout);
+
+    pthread_join(reader, NULL);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.cond);
+}
+
+// Unix domain socket mode
+// Every connection is served by its own thread, one request at a time, and
+// the requests of concurrent connections are batched together.
+
+typedef struct socket_state{
+    inference_server *server;
+    int listen_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int *clients;               // connected sockets, -1 for a free slot
+    size_t nb_clients;
+    size_t max_clients;
+    bool stopping;
+} socket_state;
+
+typedef struct connection{
+    socket_state *state;
+    int fd;
+} connection;
+
+static void socket_state_remove(socket_state *state, int fd){
+    pthread_mutex_lock(&state->lock);
+    for(size_t i = 0; i < state->max_clients; i++){
+        if(state->clients[i] == fd){
+            state->clients[i] = -1;
+            break;
+        }
+    }
+    state->nb_clients--;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void* serve_connection(void *arg){
+    connection *c = arg;
+    socket_state *state = c->state;
+    inference_server *server = state->server;
+    size_t input_size = server->nn->layers[0]->input_size;
+    size_t output_size = server->nn->layers[server->nn->nb_layers - 1]->nb_neurons;
+
+    int out_fd = dup(c->fd);
+    FILE *in = fdopen(c->fd, "r");
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    float *input = malloc(input_size * sizeof(float));
+    float *output = malloc(output_size * sizeof(float));
+
+    if(in != NULL && out != NULL && input != NULL && output != NULL){
+        char *line = NULL;
+        size_t capacity = 0;
+        while(getline(&line, &capacity, in) != -1){
+            if(line[strspn(line, " \t\r\n")] == '\0')
+                continue;
+            serve_line(server, line, input, output, out);
+            if(fflush(out) != 0)
+                break;
+        }
+        free(line);
+    }
+    else
+        fprintf(stderr, "serve_connection: Unable to allocate memory for the connection\n");
+
+    socket_state_remove(state, c->fd);
+    if(in != NULL)
+        fclose(in);
+    else
+        close(c->fd);
+    if(out != NULL)
+        fclose(out);
+    else if(out_fd >= 0)
+        close(out_fd);
+    free(input);
+    free(output);
+    free(c);
+    return NULL;
+}
+
+// Waits for SIGINT or SIGTERM, then stops accepting and disconnects the clients
+static void* signal_handler(void *arg){
+    socket_state *state = arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    int sig;
+    sigwait(&set, &sig);
+
+    pthread_mutex_lock(&state->lock);
+    state->stopping = true;
+    shutdown(state->listen_fd, SHUT_RDWR);
+    for(size_t i = 0; i < state->max_clients; i++){
+        if(state->clients[i] >= 0)
+            shutdown(state->clients[i], SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+static void serve_socket(inference_server *server, const char *path){
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "serve_socket: Socket path too long\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listen_fd, 128) != 0){
+        fprintf(stderr, "serve_socket: Unable to listen on %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    socket_state state = {.server = server, .listen_fd = listen_fd, .max_clients = 16};
+    state.clients = malloc(state.max_clients * sizeof(int));
+    for(size_t i = 0; i < state.max_clients; i++)
+        state.clients[i] = -1;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, NULL, signal_handler, &state);
+    fprintf(stderr, "listening on %s\n", path);
+
+    for(;;){
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        pthread_mutex_lock(&state.lock);
+        if(state.stopping){
+            pthread_mutex_unlock(&state.lock);
+            close(fd);
+            break;
+        }
+        // Register the client so it can be disconnected at shutdown
+        if(state.nb_clients == state.max_clients){
+            int *clients = realloc(state.clients, 2 * state.max_clients * sizeof(int));
+            if(clients == NULL){
+                fprintf(stderr, "serve_socket: Unable to allocate memory for the clients\n");
+                exit(1);
+            }
+            for(size_t i = state.max_clients; i < 2 * state.max_clients; i++)
+                clients[i] = -1;
+            state.clients = clients;
+            state.max_clients *= 2;
+        }
+        for(size_t i = 0; i < state.max_clients; i++){
+            if(state.clients[i] < 0){
+                state.clients[i] = fd;
+                break;
+            }
+        }
+        state.nb_clients++;
+        pthread_mutex_unlock(&state.lock);
+
+        connection *c = malloc(sizeof(connection));
+        pthread_t thread;
+        if(c == NULL){
+            socket_state_remove(&state, fd);
+            close(fd);
+            continue;
+        }
+        c->state = &state;
+        c->fd = fd;
+        if(pthread_create(&thread, NULL, serve_connection, c) != 0){
+            socket_state_remove(&state, fd);
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // Wait for the connections to finish their current request
+    pthread_mutex_lock(&state.lock);
+    if(!state.stopping)
+        pthread_kill(signal_thread, SIGTERM);
+    while(state.nb_clients > 0)
+        pthread_cond_wait(&state.cond, &state.lock);
+    pthread_mutex_unlock(&state.lock);
+
+    pthread_join(signal_thread, NULL);
+    close(listen_fd);
+    unlink(path);
+    free(state.clients);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+}
+
+int main(int argc, char **argv){
+    server_options options = {.max_batch = 64, .max_delay_ms = 2};
+
+    for(int i = 1; i < argc; i++){
+        if(i + 1 >= argc)
+            usage(argv[0]);
+        if(strcmp(argv[i], "--model") == 0)
+            options.model = argv[++i];
+        else if(strcmp(argv[i], "--layers") == 0)
+            options.layers = argv[++i];
+        else if(strcmp(argv[i], "--socket") == 0)
+            options.socket_path = argv[++i];
+        else if(strcmp(argv[i], "--max-batch") == 0)
+            options.max_batch = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--max-delay") == 0)
+            options.max_delay_ms = strtod(argv[++i], NULL);
+        else if(strcmp(argv[i], "--threads") == 0)
+            options.nb_threads = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--precision") == 0){
+            int precision = matrix_type_from_name(argv[++i]);
+            if(precision < 0)
+                usage(argv[0]);
+            options.precision = precision;
+        }
+        else
+            usage(argv[0]);
+    }
+    if((options.model == NULL) == (options.layers == NULL) || options.max_batch == 0 || options.max_delay_ms < 0)
+        usage(argv[0]);
+
+    // The signals are only received by the signal handler thread
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if(options.socket_path != NULL)
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(options.nb_threads > 0)
+        thread_pool_init(options.nb_threads);
+
+    neural_network *nn = options.model != NULL ? nn_load(options.model) : nn_create_from_spec(options.layers);
+    if(nn == NULL)
+        return 1;
+    nn_set_precision(nn, options.precision);
+    inference_server *server = inference_server_create(nn, options.max_batch, options.max_delay_ms);
+
+    if(options.socket_path != NULL)
+        serve_socket(server, options.socket_path);
+    else
+        serve_stdin(server);
+
+    inference_server_print_stats(server, stderr);
+    inference_server_destroy(server);
+    nn_destroy(nn);
+    thread_pool_destroy();
+    return 0;
+}
@@ -0,0 +1,428 @@
+/**
+ * @file dataset.c
+ * @brief Memory-mapped datasets and background batch assembly.
+ *
+ * The files are mapped instead of read, so a dataset larger than the memory
+ * only costs the pages of the batches being assembled. Samples are stored
+ * one after the other in the files while the batches hold one sample per
+ * column, so assembling a batch is a tiled transposition.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataset.h"
+
+// Number of features copied per sample before moving to the next sample
+#define DATASET_GATHER_BLOCK 64
+
+// Float storage read without swapping the bytes
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DATASET_F32_NATIVE DATASET_F32_BE
+#else
+#define DATASET_F32_NATIVE DATASET_F32_LE
+#endif
+
+// IDX element type codes
+#define IDX_U8 0x08
+#define IDX_F32 0x0D
+
+/**
+ * @brief Maps a whole file in read-only mode.
+ *
+ * @return false if the file cannot be opened or mapped.
+ */
+static bool dataset_map(const char *path, dataset_array *a){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "dataset_map: Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        fprintf(stderr, "dataset_map: Unable to read %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    a->mapping_size = st.st_size;
+    a->mapping = mmap(NULL, a->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(a->mapping == MAP_FAILED){
+        fprintf(stderr, "dataset_map: Unable to map %s: %s\n", path, strerror(errno));
+        a->mapping = NULL;
+        return false;
+    }
+    a->data = a->mapping;
+    return true;
+}
+
+static void dataset_unmap(dataset_array *a){
+    if(a->mapping != NULL)
+        munmap(a->mapping, a->mapping_size);
+    a->mapping = NULL;
+}
+
+static uint32_t read_be32(const unsigned char *p){
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Parses the header of a mapped IDX file.
+ *
+ * The first dimension is the number of samples, the others make one sample.
+ *
+ * @return false if the header is invalid.
+ */
+static bool dataset_parse_idx(const char *path, dataset_array *a, size_t *nb_samples, size_t *nb_dims){
+    const unsigned char *p = a->data;
+    if(a->mapping_size < 4 || p[0] != 0 || p[1] != 0 || (p[2] != IDX_U8 && p[2] != IDX_F32) || p[3] == 0
+       || a->mapping_size < 4 + 4 * (size_t) p[3]){
+        fprintf(stderr, "dataset_open_idx: %s is not an IDX file of bytes or floats\n", path);
+        return false;
+    }
+
+    *nb_dims = p[3];
+    *nb_samples = read_be32(p + 4);
+    a->sample_size = 1;
+    for(size_t d = 1; d < *nb_dims; d++)
+        a->sample_size *= read_be32(p + 4 + 4 * d);
+    a->type = p[2] == IDX_U8 ? DATASET_U8 : DATASET_F32_BE;
+    a->data = p + 4 + 4 * *nb_dims;
+
+    size_t element_size = a->type == DATASET_U8 ? 1 : 4;
+    size_t available = a->mapping_size - (a->data - p);
+    if(a->sample_size == 0 || *nb_samples > available / element_size / a->sample_size){
+        fprintf(stderr, "dataset_open_idx: %s is truncated\n", path);
+        return false;
+    }
+    return true;
+}
+
+static dataset* dataset_alloc(void){
+    dataset *ds = calloc(1, sizeof(dataset));
+    if(ds == NULL){
+        fprintf(stderr, "dataset_alloc: Unable to allocate memory for the dataset\n");
+        exit(1);
+    }
+    return ds;
+}
+
+// Dataset creation and destruction
+
+/**
+ * @brief Opens a dataset stored as a pair of IDX files (MNIST format).
+ *
+ * @param inputs_path The file of the inputs, one sample per entry of the first dimension.
+ * @param labels_path The file of the labels or targets.
+ * @param nb_classes The number of classes when the labels are class indices.
+ * @return The dataset, or NULL on failure.
+ */
+dataset* dataset_open_idx(const char *inputs_path, const char *labels_path, size_t nb_classes){
+    dataset *ds = dataset_alloc();
+    size_t nb_inputs, nb_labels, input_dims, label_dims;
+
+    if(!dataset_map(inputs_path, &ds->inputs) || !dataset_parse_idx(inputs_path, &ds->inputs, &nb_inputs, &input_dims)
+       || !dataset_map(labels_path, &ds->targets) || !dataset_parse_idx(labels_path, &ds->targets, &nb_labels, &label_dims)){
+        dataset_close(ds);
+        return NULL;
+    }
+    if(nb_inputs != nb_labels){
+        fprintf(stderr, "dataset_open_idx: %zu inputs but %zu labels\n", nb_inputs, nb_labels);
+        dataset_close(ds);
+        return NULL;
+    }
+
+    ds->nb_samples = nb_inputs;
+    ds->input_size = ds->inputs.sample_size;
+    ds->inputs.scale = ds->inputs.type == DATASET_U8 ? 1.0f / 255 : 1;
+    ds->targets.scale = 1;
+
+    if(ds->targets.type == DATASET_U8 && label_dims == 1){
+        // class indices, checked once here rather than for every batch
+        for(size_t i = 0; i < nb_labels; i++){
+            if(ds->targets.data[i] >= nb_classes){
+                fprintf(stderr, "dataset_open_idx: Label %u out of the %zu classes\n", ds->targets.data[i], nb_classes);
+                dataset_close(ds);
+                return NULL;
+            }
+        }
+        ds->nb_classes = nb_classes;
+        ds->output_size = nb_classes;
+    }
+    else
+        ds->output_size = ds->targets.sample_size;
+
+    return ds;
+}
+
+/**
+ * @brief Opens a dataset stored as a pair of raw float files.
+ *
+ * The files hold little-endian floats without header, the values of every
+ * sample being contiguous. They are byte swapped on big-endian hosts.
+ *
+ * @param inputs_path The file of the inputs.
+ * @param targets_path The file of the targets.
+ * @param input_size The number of inputs of a sample.
+ * @param output_size The number of targets of a sample.
+ * @return The dataset, or NULL on failure.
+ */
+dataset* dataset_open_raw(const char *inputs_path, const char *targets_path, size_t input_size, size_t output_size){
+    if(input_size == 0 || output_size == 0){
+        fprintf(stderr, "dataset_open_raw: The sample sizes must be at least 1\n");
+        return NULL;
+    }
+
+    dataset *ds = dataset_alloc();
+    if(!dataset_map(inputs_path, &ds->inputs) || !dataset_map(targets_path, &ds->targets)){
+        dataset_close(ds);
+        return NULL;
+    }
+
+    ds->inputs.type = DATASET_F32_LE;
+    ds->inputs.sample_size = input_size;
+    ds->inputs.scale = 1;
+    ds->targets.type = DATASET_F32_LE;
+    ds->targets.sample_size = output_size;
+    ds->targets.scale = 1;
+
+    size_t nb_inputs = ds->inputs.mapping_size / (input_size * sizeof(float));
+    size_t nb_targets = ds->targets.mapping_size / (output_size * sizeof(float));
+    if(nb_inputs * input_size * sizeof(float) != ds->inputs.mapping_size
+       || nb_targets * output_size * sizeof(float) != ds->targets.mapping_size || nb_inputs != nb_targets){
+        fprintf(stderr, "dataset_open_raw: The file sizes do not match the sample sizes\n");
+        dataset_close(ds);
+        return NULL;
+    }
+
+    ds->nb_samples = nb_inputs;
+    ds->input_size = input_size;
+    ds->output_size = output_size;
+    return ds;
+}
+
+void dataset_close(dataset *ds){
+    dataset_unmap(&ds->inputs);
+    dataset_unmap(&ds->targets);
+    free(ds);
+}
+
+// Batch assembly
+
+static inline float dataset_value(const dataset_array *a, size_t index){
+    uint32_t bits;
+    float v;
+
+    switch(a->type){
+        case DATASET_U8:
+            return a->data[index] * a->scale;
+        default:
+            memcpy(&bits, a->data + 4 * index, 4);
+            if(a->type != DATASET_F32_NATIVE)
+                bits = __builtin_bswap32(bits);
+            memcpy(&v, &bits, 4);
+            return v * a->scale;
+    }
+}
+
+// dest[i * stride + j] = value i of sample samples[j], a block of features at a time
+static void dataset_gather_array(const dataset_array *a, const size_t *samples, size_t n, float *dest, size_t stride){
+    size_t size = a->sample_size;
+
+    for(size_t i0 = 0; i0 < size; i0 += DATASET_GATHER_BLOCK){
+        size_t i1 = i0 + DATASET_GATHER_BLOCK < size ? i0 + DATASET_GATHER_BLOCK : size;
+        for(size_t j = 0; j < n; j++){
+            size_t first = samples[j] * size;
+            for(size_t i = i0; i < i1; i++)
+                dest[i * stride + j] = dataset_value(a, first + i);
+        }
+    }
+}
+
+void dataset_gather(const dataset *ds, const size_t *samples, size_t n, matrix *X, matrix *T){
+    X->col = n;
+    T->col = n;
+    dataset_gather_array(&ds->inputs, samples, n, X->data, X->stride);
+
+    if(ds->nb_classes > 0){
+        matrix_fill(T, 0);
+        for(size_t j = 0; j < n; j++)
+            T->data[ds->targets.data[samples[j]] * T->stride + j] = 1;
+    }
+    else
+        dataset_gather_array(&ds->targets, samples, n, T->data, T->stride);
+}
+
+// Loader
+
+/**
+ * @brief Shuffles the n indices of order in place (Fisher-Yates).
+ */
+static void dataset_shuffle(size_t *order, size_t n, random_generator *rng){
+    for(size_t i = n; i > 1; i--){
+        size_t j = random_below(rng, i);
+        size_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+}
+
+// Background thread: fills the two batches in turn, one epoch after the other
+static void* dataset_loader_run(void *arg){
+    dataset_loader *loader = arg;
+    const dataset *ds = loader->ds;
+    size_t slot = 0;
+
+    for(size_t e = 0; e < loader->nb_epochs; e++){
+        if(loader->shuffle)
+            dataset_shuffle(loader->order, ds->nb_samples, &loader->rng);
+
+        for(size_t b = 0; b < ds->nb_samples; b += loader->batch_size){
+            size_t n = ds->nb_samples - b < loader->batch_size ? ds->nb_samples - b : loader->batch_size;
+
+            // Wait until the caller is done with the batch of this slot
+            pthread_mutex_lock(&loader->lock);
+            while((loader->ready[slot] || loader->in_use == (int) slot) && !loader->stopping)
+                pthread_cond_wait(&loader->cond, &loader->lock);
+            bool stopping = loader->stopping;
+            pthread_mutex_unlock(&loader->lock);
+            if(stopping)
+                return NULL;
+
+            dataset_batch *batch = &loader->batches[slot];
+            dataset_gather(ds, loader->order + b, n, batch->X, batch->T);
+            batch->epoch = e;
+            batch->last = b + n == ds->nb_samples;
+
+            pthread_mutex_lock(&loader->lock);
+            loader->ready[slot] = true;
+            pthread_cond_broadcast(&loader->cond);
+            pthread_mutex_unlock(&loader->lock);
+            slot ^= 1;
+        }
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    loader->finished = true;
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+// Loader creation and destruction
+
+/**
+ * @brief Starts assembling the batches of a dataset in the background.
+ *
+ * @param ds The dataset.
+ * @param batch_size The number of samples of a batch, the last batch of an epoch may be smaller.
+ * @param shuffle Whether every epoch visits the samples in a new random order.
+ * @param nb_epochs The number of passes over the dataset.
+ * @return The loader.
+ */
+dataset_loader* dataset_loader_create(const dataset *ds, size_t batch_size, bool shuffle, size_t nb_epochs){
+    if(batch_size == 0 || ds->nb_samples == 0){
+        fprintf(stderr, "dataset_loader_create: Empty batches\n");
+        exit(1);
+    }
+
+    dataset_loader *loader = malloc(sizeof(dataset_loader));
+    if(loader == NULL){
+        fprintf(stderr, "dataset_loader_create: Unable to allocate memory for the loader\n");
+        exit(1);
+    }
+
+    if(batch_size > ds->nb_samples)
+        batch_size = ds->nb_samples;
+
+    loader->ds = ds;
+    loader->batch_size = batch_size;
+    loader->nb_epochs = nb_epochs;
+    loader->shuffle = shuffle;
+    random_generator_init(&loader->rng, random_new_stream());
+    loader->in_use = -1;
+    loader->next = 0;
+    loader->finished = false;
+    loader->stopping = false;
+
+    loader->order = malloc(ds->nb_samples * sizeof(size_t));
+    if(loader->order == NULL){
+        fprintf(stderr, "dataset_loader_create: Unable to allocate memory for the sample order\n");
+        exit(1);
+    }
+    for(size_t i = 0; i < ds->nb_samples; i++)
+        loader->order[i] = i;
+
+    for(size_t s = 0; s < 2; s++){
+        loader->batches[s].X = matrix_zeros_padded(ds->input_size, batch_size);
+        loader->batches[s].T = matrix_zeros_padded(ds->output_size, batch_size);
+        if(loader->batches[s].X == NULL || loader->batches[s].T == NULL){
+            fprintf(stderr, "dataset_loader_create: Unable to allocate memory for the batches\n");
+            exit(1);
+        }
+        loader->ready[s] = false;
+    }
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->cond, NULL);
+    if(pthread_create(&loader->thread, NULL, dataset_loader_run, loader) != 0){
+        fprintf(stderr, "dataset_loader_create: Unable to start the loader thread\n");
+        exit(1);
+    }
+    return loader;
+}
+
+void dataset_loader_destroy(dataset_loader *loader){
+    pthread_mutex_lock(&loader->lock);
+    loader->stopping = true;
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->lock);
+    pthread_join(loader->thread, NULL);
+
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->cond);
+    for(size_t s = 0; s < 2; s++){
+        matrix_destroy(loader->batches[s].X);
+        matrix_destroy(loader->batches[s].T);
+    }
+    free(loader->order);
+    free(loader);
+}
+
+/**
+ * @brief Hands the next batch to the caller and gives the previous one back to the loader.
+ *
+ * @param loader The loader.
+ * @return The batch, valid until the next call, or NULL after the last epoch.
+ */
+dataset_batch* dataset_loader_next(dataset_loader *loader){
+    pthread_mutex_lock(&loader->lock);
+    if(loader->in_use >= 0){
+        loader->ready[loader->in_use] = false;
+        loader->in_use = -1;
+        pthread_cond_broadcast(&loader->cond);
+    }
+
+    // The batches are produced and consumed in the same order
+    size_t slot = loader->next % 2;
+    while(!loader->ready[slot] && !loader->finished)
+        pthread_cond_wait(&loader->cond, &loader->lock);
+
+    dataset_batch *batch = NULL;
+    if(loader->ready[slot]){
+        loader->in_use = slot;
+        loader->next++;
+        batch = &loader->batches[slot];
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return batch;
+}
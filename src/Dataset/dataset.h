@@ -0,0 +1,85 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "../Matrix/matrix.h"
+#include "../Matrix/random.h"
+
+// Storage of the values of a mapped file
+typedef enum dataset_element{
+    DATASET_U8,
+    DATASET_F32_LE,
+    DATASET_F32_BE      // IDX files store floats big-endian, swapped on little-endian hosts
+} dataset_element;
+
+// One mapped file, holding the sample_size values of every sample one after the other
+typedef struct dataset_array{
+    void *mapping;
+    size_t mapping_size;
+    const unsigned char *data;  // first value, after the file header
+    dataset_element type;
+    size_t sample_size;
+    float scale;                // applied to every value when a batch is assembled
+} dataset_array;
+
+// Samples stay in the mapped files, only the batches are copied into memory
+typedef struct dataset{
+    size_t nb_samples;
+    size_t input_size;
+    size_t output_size;
+    dataset_array inputs;
+    dataset_array targets;
+    size_t nb_classes;          // > 0 when the targets are class indices, one-hot encoded in the batches
+} dataset;
+
+// A batch of the loader: one column per sample
+typedef struct dataset_batch{
+    matrix *X;                  // input_size x batch
+    matrix *T;                  // output_size x batch
+    size_t epoch;
+    bool last;                  // last batch of its epoch
+} dataset_batch;
+
+// Assembles the batches of a dataset on a background thread
+// Two batches are used alternately: the next one is filled while the caller
+// trains on the current one.
+typedef struct dataset_loader{
+    const dataset *ds;
+    size_t batch_size;
+    size_t nb_epochs;
+    bool shuffle;
+    size_t *order;
+    random_generator rng;       // order of the epochs
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dataset_batch batches[2];
+    bool ready[2];
+    int in_use;                 // batch held by the caller, -1 for none
+    size_t next;                // number of batches handed to the caller
+    bool finished;
+    bool stopping;
+} dataset_loader;
+
+// Dataset creation and destruction
+// IDX files (MNIST format) of unsigned bytes or floats. Byte images are scaled
+// to [0, 1]. Byte labels with a single dimension are class indices, one-hot
+// encoded over nb_classes outputs; other label files are used as targets as is.
+dataset* dataset_open_idx(const char *inputs_path, const char *labels_path, size_t nb_classes);
+// Raw little-endian floats, input_size (output_size) values per sample,
+// whatever the byte order of the host
+dataset* dataset_open_raw(const char *inputs_path, const char *targets_path, size_t input_size, size_t output_size);
+void dataset_close(dataset *ds);
+
+// Copies the samples samples[0..n) into X and T, whose number of columns becomes n
+void dataset_gather(const dataset *ds, const size_t *samples, size_t n, matrix *X, matrix *T);
+
+// Loader creation and destruction
+dataset_loader* dataset_loader_create(const dataset *ds, size_t batch_size, bool shuffle, size_t nb_epochs);
+void dataset_loader_destroy(dataset_loader *loader);
+
+// Next batch, NULL after the last epoch
+// The batch stays valid until the next call.
+dataset_batch* dataset_loader_next(dataset_loader *loader);
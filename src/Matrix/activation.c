@@ -0,0 +1,663 @@
+/**
+ * @file activation.c
+ * @brief Vectorized built-in activation functions, their derivatives and the output losses.
+ *
+ * Each kernel has an AVX2/FMA version, picked at runtime from CPUID, and a
+ * plain C fallback. Exponentials and logarithms use polynomial approximations
+ * (Cephes expf and logf, relative error around 1e-7) so sigmoid, tanh,
+ * softmax and the losses vectorize. Large matrices are split over the thread pool.
+ */
+
+#include "activation.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ACTIVATION_X86 1
+#endif
+
+// Below this many elements, a kernel stays on the calling thread
+#define ACTIVATION_PARALLEL_THRESHOLD (1 << 15)
+#define ACTIVATION_PARALLEL_GRAIN (1 << 12)
+
+// Most column chunks a loss is summed over. The chunks do not depend on the
+// threads, so neither does the rounding of the sum.
+#define LOSS_CHUNKS 64
+// Probabilities are kept this far from 0 and 1 by the binary cross-entropy
+#define LOSS_EPSILON 1e-7f
+
+static bool activation_use_avx2(void){
+#ifdef ACTIVATION_X86
+    static int supported = -1;
+    if(supported < 0){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Scalar kernels
+
+static inline float sigmoid_scalar(float x){
+    return 1 / (1 + expf(-x));
+}
+
+static inline float derivative_scalar(activation_type type, float y){
+    switch(type){
+        case ACTIVATION_SIGMOID:
+        case ACTIVATION_SOFTMAX:
+            return y * (1 - y);
+        case ACTIVATION_TANH:
+            return 1 - y * y;
+        case ACTIVATION_RELU:
+            return y > 0 ? 1 : 0;
+        case ACTIVATION_LEAKY_RELU:
+            return y > 0 ? 1 : ACTIVATION_LEAKY_RELU_SLOPE;
+        default:
+            return 1;
+    }
+}
+
+static void forward_scalar(activation_type type, float *x, size_t n){
+    switch(type){
+        case ACTIVATION_SIGMOID:
+            for(size_t i = 0; i < n; i++)
+                x[i] = sigmoid_scalar(x[i]);
+            break;
+        case ACTIVATION_TANH:
+            for(size_t i = 0; i < n; i++)
+                x[i] = tanhf(x[i]);
+            break;
+        case ACTIVATION_RELU:
+            for(size_t i = 0; i < n; i++)
+                x[i] = x[i] > 0 ? x[i] : 0;
+            break;
+        case ACTIVATION_LEAKY_RELU:
+            for(size_t i = 0; i < n; i++)
+                x[i] = x[i] > 0 ? x[i] : ACTIVATION_LEAKY_RELU_SLOPE * x[i];
+            break;
+        default:
+            break;
+    }
+}
+
+static void backward_scalar(activation_type type, const float *y, const float *error, float *delta, size_t n){
+    for(size_t i = 0; i < n; i++)
+        delta[i] = error[i] * derivative_scalar(type, y[i]);
+}
+
+// Softmax over the columns [begin, end) of a row-major rows x ld block
+static void softmax_scalar(float *x, size_t rows, size_t ld, size_t begin, size_t end){
+    for(size_t j = begin; j < end; j++){
+        float max = x[j];
+        for(size_t i = 1; i < rows; i++)
+            max = x[i * ld + j] > max ? x[i * ld + j] : max;
+
+        float sum = 0;
+        for(size_t i = 0; i < rows; i++){
+            x[i * ld + j] = expf(x[i * ld + j] - max);
+            sum += x[i * ld + j];
+        }
+        for(size_t i = 0; i < rows; i++)
+            x[i * ld + j] /= sum;
+    }
+}
+
+// Operands of a loss over the columns (samples) of a batch
+typedef struct loss_args{
+    activation_type type;
+    bool cross_entropy;
+    const matrix *y;
+    const matrix_view *T;
+    matrix *delta;
+    size_t chunk;                   // columns per chunk, a multiple of 8
+    double partial[LOSS_CHUNKS];    // loss of every chunk
+} loss_args;
+
+// Mean squared error of the columns [begin, end), delta = (t - y) * f'(y)
+static double mse_scalar(const loss_args *a, size_t begin, size_t end){
+    const matrix *y = a->y;
+    const matrix_view *T = a->T;
+    double loss = 0;
+    for(size_t i = 0; i < y->row; i++){
+        for(size_t j = begin; j < end; j++){
+            float yv = y->data[i * y->stride + j];
+            float e = T->data[i * T->rs + j * T->cs] - yv;
+            loss += e * e;
+            a->delta->data[i * a->delta->stride + j] = e * derivative_scalar(a->type, yv);
+        }
+    }
+    return loss / 2;
+}
+
+// Softmax cross-entropy of the columns [begin, end) from the logits v:
+// sum t * (max - v) + sum t * log(sum exp(v - max)), delta = t - softmax(v) * sum t
+static double softmax_cross_entropy_scalar(const loss_args *a, size_t begin, size_t end){
+    const matrix *y = a->y;
+    const matrix_view *T = a->T;
+    float *delta = a->delta->data;
+    size_t ld = a->delta->stride;
+    double loss = 0;
+    for(size_t j = begin; j < end; j++){
+        float max = y->data[j];
+        for(size_t i = 1; i < y->row; i++)
+            max = y->data[i * y->stride + j] > max ? y->data[i * y->stride + j] : max;
+
+        // delta holds the exponentials until the sum is known
+        float sum = 0, t_sum = 0, t_gap = 0;
+        for(size_t i = 0; i < y->row; i++){
+            float v = y->data[i * y->stride + j], t = T->data[i * T->rs + j * T->cs];
+            delta[i * ld + j] = expf(v - max);
+            sum += delta[i * ld + j];
+            t_sum += t;
+            t_gap += t * (max - v);
+        }
+        float scale = t_sum / sum;
+        for(size_t i = 0; i < y->row; i++)
+            delta[i * ld + j] = T->data[i * T->rs + j * T->cs] - delta[i * ld + j] * scale;
+        loss += t_gap + t_sum * logf(sum);
+    }
+    return loss;
+}
+
+// Binary cross-entropy of every output of the columns [begin, end), delta = t - y
+static double binary_cross_entropy_scalar(const loss_args *a, size_t begin, size_t end){
+    const matrix *y = a->y;
+    const matrix_view *T = a->T;
+    double loss = 0;
+    for(size_t i = 0; i < y->row; i++){
+        for(size_t j = begin; j < end; j++){
+            float yv = y->data[i * y->stride + j], t = T->data[i * T->rs + j * T->cs];
+            float p = yv < LOSS_EPSILON ? LOSS_EPSILON : yv > 1 - LOSS_EPSILON ? 1 - LOSS_EPSILON : yv;
+            loss -= t * logf(p) + (1 - t) * logf(1 - p);
+            a->delta->data[i * a->delta->stride + j] = t - yv;
+        }
+    }
+    return loss;
+}
+
+static double loss_scalar(const loss_args *a, size_t begin, size_t end){
+    if(!a->cross_entropy)
+        return mse_scalar(a, begin, end);
+    if(a->type == ACTIVATION_SOFTMAX)
+        return softmax_cross_entropy_scalar(a, begin, end);
+    return binary_cross_entropy_scalar(a, begin, end);
+}
+
+// AVX2 kernels
+
+#ifdef ACTIVATION_X86
+__attribute__((target("avx2,fma")))
+static void add_bias_avx2(float *x, size_t n, float bias){
+    __m256 b = _mm256_set1_ps(bias);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_loadu_ps(x + i), b));
+    for(; i < n; i++)
+        x[i] += bias;
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 exp_avx2(__m256 x){
+    // exp(x) = 2^n * exp(r) with n = round(x / ln 2) and |r| <= ln 2 / 2
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.3365447504f));
+
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1)));
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 log_avx2(__m256 x){
+    // log(x) = e * ln 2 + log(m) with x = 2^e * m and sqrt(1/2) <= m < sqrt(2), x > 0
+    const __m256 one = _mm256_set1_ps(1);
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_castps_si256(one)));
+    __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356237f), _CMP_GT_OQ);
+    m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), big);
+    e = _mm256_add_ps(e, _mm256_and_ps(big, one));
+
+    __m256 f = _mm256_sub_ps(m, one);
+    __m256 z = _mm256_mul_ps(f, f);
+    __m256 p = _mm256_set1_ps(7.0376836292e-2f);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.1514610310e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.1676998740e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.2420140846e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.4249322787e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.6668057665e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.0000714765e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-2.4999993993e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(3.3333331174e-1f));
+    p = _mm256_mul_ps(_mm256_mul_ps(p, f), z);
+    p = _mm256_fmadd_ps(e, _mm256_set1_ps(-2.12194440e-4f), p);
+    p = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, p);
+    return _mm256_fmadd_ps(e, _mm256_set1_ps(0.693359375f), _mm256_add_ps(f, p));
+}
+
+// Sum of the lanes, converted to double before they are added
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256 v){
+    __m256d d = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(d), _mm256_extractf128_pd(d, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 forward_avx2_vec(activation_type type, __m256 x){
+    const __m256 one = _mm256_set1_ps(1);
+
+    switch(type){
+        case ACTIVATION_SIGMOID:
+            return _mm256_div_ps(one, _mm256_add_ps(one, exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+        case ACTIVATION_TANH:
+            // tanh(x) = 1 - 2 / (exp(2x) + 1)
+            return _mm256_sub_ps(one, _mm256_div_ps(_mm256_set1_ps(2), _mm256_add_ps(exp_avx2(_mm256_add_ps(x, x)), one)));
+        case ACTIVATION_RELU:
+            return _mm256_max_ps(x, _mm256_setzero_ps());
+        case ACTIVATION_LEAKY_RELU:
+            return _mm256_max_ps(x, _mm256_mul_ps(x, _mm256_set1_ps(ACTIVATION_LEAKY_RELU_SLOPE)));
+        default:
+            return x;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 derivative_avx2_vec(activation_type type, __m256 y){
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 zero = _mm256_setzero_ps();
+
+    switch(type){
+        case ACTIVATION_SIGMOID:
+        case ACTIVATION_SOFTMAX:
+            return _mm256_mul_ps(y, _mm256_sub_ps(one, y));
+        case ACTIVATION_TANH:
+            return _mm256_fnmadd_ps(y, y, one);
+        case ACTIVATION_RELU:
+            return _mm256_and_ps(_mm256_cmp_ps(y, zero, _CMP_GT_OQ), one);
+        case ACTIVATION_LEAKY_RELU:
+            return _mm256_blendv_ps(_mm256_set1_ps(ACTIVATION_LEAKY_RELU_SLOPE), one, _mm256_cmp_ps(y, zero, _CMP_GT_OQ));
+        default:
+            return one;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void forward_avx2(activation_type type, float *x, size_t n){
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(x + i, forward_avx2_vec(type, _mm256_loadu_ps(x + i)));
+    forward_scalar(type, x + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void forward_bias_avx2(activation_type type, float *x, size_t n, float bias){
+    __m256 b = _mm256_set1_ps(bias);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(x + i, forward_avx2_vec(type, _mm256_add_ps(_mm256_loadu_ps(x + i), b)));
+    for(; i < n; i++)
+        x[i] += bias;
+    forward_scalar(type, x + (n & ~(size_t)7), n & 7);
+}
+
+__attribute__((target("avx2,fma")))
+static void backward_avx2(activation_type type, const float *y, const float *error, float *delta, size_t n){
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256 d = derivative_avx2_vec(type, _mm256_loadu_ps(y + i));
+        _mm256_storeu_ps(delta + i, _mm256_mul_ps(_mm256_loadu_ps(error + i), d));
+    }
+    backward_scalar(type, y + i, error + i, delta + i, n - i);
+}
+
+// Softmax vectorized across 8 columns (samples) at a time
+__attribute__((target("avx2,fma")))
+static void softmax_avx2(float *x, size_t rows, size_t ld, size_t begin, size_t end){
+    size_t j = begin;
+    for(; j + 8 <= end; j += 8){
+        __m256 max = _mm256_loadu_ps(x + j);
+        for(size_t i = 1; i < rows; i++)
+            max = _mm256_max_ps(max, _mm256_loadu_ps(x + i * ld + j));
+
+        __m256 sum = _mm256_setzero_ps();
+        for(size_t i = 0; i < rows; i++){
+            __m256 e = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i * ld + j), max));
+            _mm256_storeu_ps(x + i * ld + j, e);
+            sum = _mm256_add_ps(sum, e);
+        }
+
+        __m256 inv = _mm256_div_ps(_mm256_set1_ps(1), sum);
+        for(size_t i = 0; i < rows; i++)
+            _mm256_storeu_ps(x + i * ld + j, _mm256_mul_ps(_mm256_loadu_ps(x + i * ld + j), inv));
+    }
+    softmax_scalar(x, rows, ld, j, end);
+}
+
+// Losses over 8 columns at a time, T being read with unit column stride
+__attribute__((target("avx2,fma")))
+static double mse_avx2(const loss_args *a, size_t begin, size_t end){
+    const matrix *y = a->y;
+    const matrix_view *T = a->T;
+    size_t last = begin + (end - begin) / 8 * 8;
+    double loss = 0;
+    for(size_t i = 0; i < y->row; i++){
+        const float *yr = y->data + i * y->stride, *tr = T->data + i * T->rs;
+        float *dr = a->delta->data + i * a->delta->stride;
+        __m256 sum = _mm256_setzero_ps();
+        for(size_t j = begin; j < last; j += 8){
+            __m256 yv = _mm256_loadu_ps(yr + j);
+            __m256 e = _mm256_sub_ps(_mm256_loadu_ps(tr + j), yv);
+            sum = _mm256_fmadd_ps(e, e, sum);
+            _mm256_storeu_ps(dr + j, _mm256_mul_ps(e, derivative_avx2_vec(a->type, yv)));
+        }
+        loss += hsum_avx2(sum);
+    }
+    return loss / 2 + mse_scalar(a, last, end);
+}
+
+__attribute__((target("avx2,fma")))
+static double softmax_cross_entropy_avx2(const loss_args *a, size_t begin, size_t end){
+    const matrix *y = a->y;
+    const matrix_view *T = a->T;
+    float *delta = a->delta->data;
+    size_t ld = a->delta->stride, ys = y->stride, ts = T->rs;
+    double loss = 0;
+    size_t j = begin;
+    for(; j + 8 <= end; j += 8){
+        __m256 max = _mm256_loadu_ps(y->data + j);
+        for(size_t i = 1; i < y->row; i++)
+            max = _mm256_max_ps(max, _mm256_loadu_ps(y->data + i * ys + j));
+
+        __m256 sum = _mm256_setzero_ps(), t_sum = _mm256_setzero_ps(), t_gap = _mm256_setzero_ps();
+        for(size_t i = 0; i < y->row; i++){
+            __m256 v = _mm256_loadu_ps(y->data + i * ys + j), t = _mm256_loadu_ps(T->data + i * ts + j);
+            __m256 e = exp_avx2(_mm256_sub_ps(v, max));
+            _mm256_storeu_ps(delta + i * ld + j, e);
+            sum = _mm256_add_ps(sum, e);
+            t_sum = _mm256_add_ps(t_sum, t);
+            t_gap = _mm256_fmadd_ps(t, _mm256_sub_ps(max, v), t_gap);
+        }
+
+        __m256 scale = _mm256_div_ps(t_sum, sum);
+        for(size_t i = 0; i < y->row; i++){
+            __m256 t = _mm256_loadu_ps(T->data + i * ts + j);
+            _mm256_storeu_ps(delta + i * ld + j, _mm256_fnmadd_ps(_mm256_loadu_ps(delta + i * ld + j), scale, t));
+        }
+        loss += hsum_avx2(_mm256_fmadd_ps(t_sum, log_avx2(sum), t_gap));
+    }
+    return loss + softmax_cross_entropy_scalar(a, j, end);
+}
+
+__attribute__((target("avx2,fma")))
+static double binary_cross_entropy_avx2(const loss_args *a, size_t begin, size_t end){
+    const matrix *y = a->y;
+    const matrix_view *T = a->T;
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 low = _mm256_set1_ps(LOSS_EPSILON), high = _mm256_set1_ps(1 - LOSS_EPSILON);
+    size_t last = begin + (end - begin) / 8 * 8;
+    double loss = 0;
+    for(size_t i = 0; i < y->row; i++){
+        const float *yr = y->data + i * y->stride, *tr = T->data + i * T->rs;
+        float *dr = a->delta->data + i * a->delta->stride;
+        __m256 sum = _mm256_setzero_ps();
+        for(size_t j = begin; j < last; j += 8){
+            __m256 yv = _mm256_loadu_ps(yr + j), t = _mm256_loadu_ps(tr + j);
+            __m256 p = _mm256_min_ps(_mm256_max_ps(yv, low), high);
+            // t * log(p) + (1 - t) * log(1 - p)
+            __m256 lp = log_avx2(p), lq = log_avx2(_mm256_sub_ps(one, p));
+            sum = _mm256_add_ps(sum, _mm256_fmadd_ps(t, _mm256_sub_ps(lp, lq), lq));
+            _mm256_storeu_ps(dr + j, _mm256_sub_ps(t, yv));
+        }
+        loss -= hsum_avx2(sum);
+    }
+    return loss + binary_cross_entropy_scalar(a, last, end);
+}
+#endif
+
+// Dispatch
+
+typedef struct activation_args{
+    activation_type type;
+    float *x;
+    const float *y;
+    const float *error;
+    size_t rows;
+    size_t ld;
+} activation_args;
+
+static void forward_range(void *arg, size_t begin, size_t end){
+    const activation_args *a = arg;
+#ifdef ACTIVATION_X86
+    if(activation_use_avx2()){
+        forward_avx2(a->type, a->x + begin, end - begin);
+        return;
+    }
+#endif
+    forward_scalar(a->type, a->x + begin, end - begin);
+}
+
+static void backward_range(void *arg, size_t begin, size_t end){
+    const activation_args *a = arg;
+#ifdef ACTIVATION_X86
+    if(activation_use_avx2()){
+        backward_avx2(a->type, a->y + begin, a->error + begin, a->x + begin, end - begin);
+        return;
+    }
+#endif
+    backward_scalar(a->type, a->y + begin, a->error + begin, a->x + begin, end - begin);
+}
+
+static void softmax_range(void *arg, size_t begin, size_t end){
+    const activation_args *a = arg;
+#ifdef ACTIVATION_X86
+    if(activation_use_avx2()){
+        softmax_avx2(a->x, a->rows, a->ld, begin, end);
+        return;
+    }
+#endif
+    softmax_scalar(a->x, a->rows, a->ld, begin, end);
+}
+
+// Loss of the column chunks [begin, end)
+static void loss_range(void *arg, size_t begin, size_t end){
+    loss_args *a = arg;
+    for(size_t c = begin; c < end; c++){
+        size_t first = c * a->chunk;
+        size_t last = first + a->chunk < a->y->col ? first + a->chunk : a->y->col;
+#ifdef ACTIVATION_X86
+        if(activation_use_avx2() && a->T->cs == 1){
+            if(!a->cross_entropy)
+                a->partial[c] = mse_avx2(a, first, last);
+            else if(a->type == ACTIVATION_SOFTMAX)
+                a->partial[c] = softmax_cross_entropy_avx2(a, first, last);
+            else
+                a->partial[c] = binary_cross_entropy_avx2(a, first, last);
+            continue;
+        }
+#endif
+        a->partial[c] = loss_scalar(a, first, last);
+    }
+}
+
+static float matrix_loss(loss_args *a, const char *name){
+    const matrix *y = a->y;
+    if(y->row != a->T->row || y->col != a->T->col || y->row != a->delta->row || y->col != a->delta->col){
+        fprintf(stderr, "%s: Matrix dimensions do not match\n", name);
+        return 0;
+    }
+    if(y->col == 0 || y->row == 0)
+        return 0;
+
+    // Chunks of whole vectors, big enough to be worth a task
+    size_t chunk = (y->col + LOSS_CHUNKS - 1) / LOSS_CHUNKS;
+    size_t min_chunk = (ACTIVATION_PARALLEL_GRAIN + y->row - 1) / y->row;
+    chunk = chunk > min_chunk ? chunk : min_chunk;
+    a->chunk = (chunk + 7) / 8 * 8;
+    size_t nb_chunks = (y->col + a->chunk - 1) / a->chunk;
+
+    if(y->row * y->col < ACTIVATION_PARALLEL_THRESHOLD)
+        loss_range(a, 0, nb_chunks);
+    else
+        thread_pool_parallel_for(nb_chunks, 1, loss_range, a);
+
+    double loss = 0;
+    for(size_t c = 0; c < nb_chunks; c++)
+        loss += a->partial[c];
+    return (float) loss;
+}
+
+float matrix_mse_loss(const matrix *y, const matrix_view *T, matrix *delta, activation_type type){
+    if(type == ACTIVATION_CUSTOM){
+        fprintf(stderr, "matrix_mse_loss: A custom activation has no built-in kernel\n");
+        return 0;
+    }
+    loss_args args = {.type = type, .cross_entropy = false, .y = y, .T = T, .delta = delta};
+    return matrix_loss(&args, "matrix_mse_loss");
+}
+
+float matrix_cross_entropy_loss(const matrix *y, const matrix_view *T, matrix *delta, activation_type type){
+    loss_args args = {.type = type, .cross_entropy = true, .y = y, .T = T, .delta = delta};
+    return matrix_loss(&args, "matrix_cross_entropy_loss");
+}
+
+void matrix_apply_activation(matrix *m, activation_type type){
+    activation_args args = {type, m->data, NULL, NULL, m->row, m->stride};
+    // The elementwise kernels also run over the padding of the rows
+    size_t n = m->row * m->stride;
+
+    if(type == ACTIVATION_IDENTITY)
+        return;
+
+    if(type == ACTIVATION_CUSTOM){
+        fprintf(stderr, "matrix_apply_activation: A custom activation has no built-in kernel\n");
+        return;
+    }
+
+    if(type == ACTIVATION_SOFTMAX){
+        // Columns are independent, split them over the threads
+        size_t grain = (ACTIVATION_PARALLEL_GRAIN + m->row - 1) / (m->row > 0 ? m->row : 1);
+        if(n < ACTIVATION_PARALLEL_THRESHOLD)
+            softmax_range(&args, 0, m->col);
+        else
+            thread_pool_parallel_for(m->col, grain, softmax_range, &args);
+        return;
+    }
+
+    if(n < ACTIVATION_PARALLEL_THRESHOLD)
+        forward_range(&args, 0, n);
+    else
+        thread_pool_parallel_for(n, ACTIVATION_PARALLEL_GRAIN, forward_range, &args);
+}
+
+void matrix_activation_backward(const matrix *y, const matrix *error, matrix *delta, activation_type type){
+    if(y->row != error->row || y->col != error->col || y->row != delta->row || y->col != delta->col){
+        fprintf(stderr, "matrix_activation_backward: Matrix dimensions do not match\n");
+        return;
+    }
+
+    if(type == ACTIVATION_CUSTOM){
+        fprintf(stderr, "matrix_activation_backward: A custom activation has no built-in kernel\n");
+        return;
+    }
+
+    if(y->stride != error->stride || y->stride != delta->stride){
+        // Different layouts: one row at a time
+        for(size_t i = 0; i < y->row; i++){
+            activation_args row = {type, delta->data + i * delta->stride, y->data + i * y->stride, error->data + i * error->stride, 1, y->col};
+            backward_range(&row, 0, y->col);
+        }
+        return;
+    }
+
+    activation_args args = {type, delta->data, y->data, error->data, y->row, y->stride};
+    size_t n = y->row * y->stride;
+
+    if(n < ACTIVATION_PARALLEL_THRESHOLD)
+        backward_range(&args, 0, n);
+    else
+        thread_pool_parallel_for(n, ACTIVATION_PARALLEL_GRAIN, backward_range, &args);
+}
+
+void activation_forward_row(activation_type type, float *x, size_t n, float bias){
+    // Not elementwise, applied by the caller once the whole matrix is computed
+    bool bias_only = type == ACTIVATION_SOFTMAX || type == ACTIVATION_CUSTOM || type == ACTIVATION_IDENTITY;
+
+#ifdef ACTIVATION_X86
+    if(activation_use_avx2()){
+        if(bias_only){
+            if(bias != 0)
+                add_bias_avx2(x, n, bias);
+        }else{
+            forward_bias_avx2(type, x, n, bias);
+        }
+        return;
+    }
+#endif
+    if(bias != 0){
+        for(size_t i = 0; i < n; i++)
+            x[i] += bias;
+    }
+    if(!bias_only)
+        forward_scalar(type, x, n);
+}
+
+void activation_backward_row(activation_type type, const float *y, float *delta, size_t n){
+    if(type == ACTIVATION_IDENTITY || type == ACTIVATION_CUSTOM)
+        return;
+
+#ifdef ACTIVATION_X86
+    if(activation_use_avx2()){
+        backward_avx2(type, y, delta, delta, n);
+        return;
+    }
+#endif
+    backward_scalar(type, y, delta, delta, n);
+}
+
+const char* activation_name(activation_type type){
+    switch(type){
+        case ACTIVATION_SIGMOID:
+            return "sigmoid";
+        case ACTIVATION_TANH:
+            return "tanh";
+        case ACTIVATION_RELU:
+            return "relu";
+        case ACTIVATION_LEAKY_RELU:
+            return "leaky_relu";
+        case ACTIVATION_SOFTMAX:
+            return "softmax";
+        case ACTIVATION_IDENTITY:
+            return "identity";
+        default:
+            return "custom";
+    }
+}
+
+activation_type activation_from_name(const char *name){
+    for(activation_type t = ACTIVATION_SIGMOID; t <= ACTIVATION_IDENTITY; t++){
+        if(strcmp(name, activation_name(t)) == 0)
+            return t;
+    }
+    return ACTIVATION_CUSTOM;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include "matrix.h"
+
+// Built-in activation functions
+// ACTIVATION_CUSTOM means the layer uses its own function pointers instead.
+typedef enum activation_type{
+    ACTIVATION_CUSTOM,
+    ACTIVATION_SIGMOID,
+    ACTIVATION_TANH,
+    ACTIVATION_RELU,
+    ACTIVATION_LEAKY_RELU,
+    ACTIVATION_SOFTMAX,
+    ACTIVATION_IDENTITY
+} activation_type;
+
+// Slope of ACTIVATION_LEAKY_RELU for negative inputs
+#define ACTIVATION_LEAKY_RELU_SLOPE 0.01f
+
+// m = f(m), softmax normalizing every column (one column per sample)
+void matrix_apply_activation(matrix *m, activation_type type);
+
+// delta = error * f'(v), the derivative being computed from the output y = f(v)
+// The softmax derivative is approximated by its diagonal y * (1 - y).
+void matrix_activation_backward(const matrix *y, const matrix *error, matrix *delta, activation_type type);
+
+// Output layer losses, each fused with its gradient in one pass over the batch
+// They return the loss summed over the samples (columns) and write delta =
+// minus its gradient with respect to the input v of the activation. T holds
+// the targets, with the shape of y.
+// Mean squared error, 1/2 sum (t - y)^2 per sample, delta = (t - y) * f'(y)
+float matrix_mse_loss(const matrix *y, const matrix_view *T, matrix *delta, activation_type type);
+// Cross-entropy. With softmax, y holds the logits v: the loss is computed with
+// log-sum-exp and delta = t - softmax(v) * sum t, without storing the
+// probabilities. Otherwise y holds probabilities and the loss is the binary
+// cross-entropy of every output, delta = t - y.
+float matrix_cross_entropy_loss(const matrix *y, const matrix_view *T, matrix *delta, activation_type type);
+
+// Row kernels used by the GEMM epilogue
+// x = f(x + bias) over n contiguous values, softmax and custom only adding the bias
+void activation_forward_row(activation_type type, float *x, size_t n, float bias);
+// delta = delta * f'(y) over n contiguous values
+void activation_backward_row(activation_type type, const float *y, float *delta, size_t n);
+
+const char* activation_name(activation_type type);
+// Inverse of activation_name, ACTIVATION_CUSTOM for an unknown name
+activation_type activation_from_name(const char *name);
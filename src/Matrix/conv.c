@@ -0,0 +1,429 @@
+/**
+ * @file conv.c
+ * @brief 2D convolution kernels on batches stored one sample per column.
+ *
+ * The samples being the contiguous dimension of every matrix, im2col and
+ * col2im move whole runs of samples at once, and the products go through
+ * the GEMM engine with the bias and activation in its epilogue.
+ */
+
+#include "conv.h"
+#include "gemm.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_X86 1
+#endif
+
+// Below this many elements, im2col and col2im stay on the calling thread
+#define CONV_PARALLEL_THRESHOLD (1 << 16)
+// Largest patch (in_channels * kernel_height * kernel_width) convolved directly
+// Beyond it the im2col matrix is worth building for the GEMM.
+#define CONV_DIRECT_MAX_PATCH 32
+// Output channels and samples kept in registers by the direct kernel
+#define CONV_DIRECT_CHANNELS 4
+#define CONV_DIRECT_SAMPLES 16
+
+// Shape
+
+static size_t conv_output_extent(size_t in, size_t kernel, size_t stride, size_t padding, size_t dilation){
+    size_t span = dilation * (kernel - 1) + 1;
+    if(in + 2 * padding < span)
+        return 0;
+    return (in + 2 * padding - span) / stride + 1;
+}
+
+bool conv_shape_init(conv_shape *s){
+    if(s->in_channels == 0 || s->in_height == 0 || s->in_width == 0 || s->out_channels == 0
+       || s->kernel_height == 0 || s->kernel_width == 0 || s->stride == 0 || s->dilation == 0)
+        return false;
+
+    s->out_height = conv_output_extent(s->in_height, s->kernel_height, s->stride, s->padding, s->dilation);
+    s->out_width = conv_output_extent(s->in_width, s->kernel_width, s->stride, s->padding, s->dilation);
+    return s->out_height > 0 && s->out_width > 0;
+}
+
+size_t conv_input_size(const conv_shape *s){
+    return s->in_channels * s->in_height * s->in_width;
+}
+
+size_t conv_output_size(const conv_shape *s){
+    return s->out_channels * s->out_height * s->out_width;
+}
+
+size_t conv_patch_size(const conv_shape *s){
+    return s->in_channels * s->kernel_height * s->kernel_width;
+}
+
+size_t conv_positions(const conv_shape *s){
+    return s->out_height * s->out_width;
+}
+
+// Row of the input read by the tap (ki, kj) of the output position (oh, ow), -1 in the padding
+static inline long conv_input_row(const conv_shape *s, size_t ci, size_t ki, size_t kj, size_t oh, size_t ow){
+    long ih = (long) (oh * s->stride + ki * s->dilation) - (long) s->padding;
+    long iw = (long) (ow * s->stride + kj * s->dilation) - (long) s->padding;
+    if(ih < 0 || iw < 0 || ih >= (long) s->in_height || iw >= (long) s->in_width)
+        return -1;
+    return ((long) ci * s->in_height + ih) * s->in_width + iw;
+}
+
+// im2col and col2im
+
+typedef struct conv_lowering_args{
+    const conv_shape *s;
+    const matrix_view *X;
+    const matrix *cols;
+    matrix *dest;
+    size_t batch;
+} conv_lowering_args;
+
+// Fills the rows [begin, end) of the im2col matrix
+static void conv_im2col_range(void *arg, size_t begin, size_t end){
+    conv_lowering_args *args = arg;
+    const conv_shape *s = args->s;
+    const matrix_view *X = args->X;
+    size_t batch = args->batch;
+
+    for(size_t k = begin; k < end; k++){
+        size_t ci = k / (s->kernel_height * s->kernel_width);
+        size_t ki = k / s->kernel_width % s->kernel_height;
+        size_t kj = k % s->kernel_width;
+        float *out = args->cols->data + k * args->cols->stride;
+
+        for(size_t oh = 0; oh < s->out_height; oh++){
+            for(size_t ow = 0; ow < s->out_width; ow++, out += batch){
+                long f = conv_input_row(s, ci, ki, kj, oh, ow);
+                if(f < 0)
+                    memset(out, 0, batch * sizeof(float));
+                else if(X->cs == 1)
+                    memcpy(out, X->data + f * X->rs, batch * sizeof(float));
+                else{
+                    for(size_t n = 0; n < batch; n++)
+                        out[n] = X->data[f * X->rs + n * X->cs];
+                }
+            }
+        }
+    }
+}
+
+void matrix_im2col(const conv_shape *s, const matrix_view *X, matrix *cols){
+    size_t patch = conv_patch_size(s);
+    if(X->row != conv_input_size(s) || cols->row != patch || cols->col < conv_positions(s) * X->col){
+        fprintf(stderr, "matrix_im2col: Matrix dimensions do not match\n");
+        return;
+    }
+
+    conv_lowering_args args = {.s = s, .X = X, .cols = cols, .batch = X->col};
+    if(patch * conv_positions(s) * X->col < CONV_PARALLEL_THRESHOLD)
+        conv_im2col_range(&args, 0, patch);
+    else
+        thread_pool_parallel_for(patch, 1, conv_im2col_range, &args);
+}
+
+// Sums the patches of the input channels [begin, end), each channel only receiving its own taps
+static void conv_col2im_range(void *arg, size_t begin, size_t end){
+    conv_lowering_args *args = arg;
+    const conv_shape *s = args->s;
+    matrix *dest = args->dest;
+    size_t batch = args->batch;
+    size_t taps = s->kernel_height * s->kernel_width;
+
+    for(size_t ci = begin; ci < end; ci++){
+        for(size_t f = ci * s->in_height * s->in_width; f < (ci + 1) * s->in_height * s->in_width; f++)
+            memset(dest->data + f * dest->stride, 0, batch * sizeof(float));
+
+        for(size_t t = 0; t < taps; t++){
+            size_t ki = t / s->kernel_width, kj = t % s->kernel_width;
+            const float *in = args->cols->data + (ci * taps + t) * args->cols->stride;
+
+            for(size_t oh = 0; oh < s->out_height; oh++){
+                for(size_t ow = 0; ow < s->out_width; ow++, in += batch){
+                    long f = conv_input_row(s, ci, ki, kj, oh, ow);
+                    if(f < 0)
+                        continue;
+                    float *out = dest->data + f * dest->stride;
+                    for(size_t n = 0; n < batch; n++)
+                        out[n] += in[n];
+                }
+            }
+        }
+    }
+}
+
+void matrix_col2im(const conv_shape *s, const matrix *cols, matrix *dest){
+    if(dest->row != conv_input_size(s) || cols->row != conv_patch_size(s) || cols->col < conv_positions(s) * dest->col){
+        fprintf(stderr, "matrix_col2im: Matrix dimensions do not match\n");
+        return;
+    }
+
+    conv_lowering_args args = {.s = s, .cols = cols, .dest = dest, .batch = dest->col};
+    if(conv_patch_size(s) * conv_positions(s) * dest->col < CONV_PARALLEL_THRESHOLD)
+        conv_col2im_range(&args, 0, s->in_channels);
+    else
+        thread_pool_parallel_for(s->in_channels, 1, conv_col2im_range, &args);
+}
+
+// Channel rows
+// The output or delta of a layer is conv_output_size x batch: one row per
+// (channel, position). The GEMMs want it as out_channels rows of
+// positions * batch values, which is the same storage when the rows of the
+// matrix hold exactly the batch. Otherwise it goes through scratch.
+
+static bool conv_check_scratch(const conv_shape *s, const matrix *scratch, size_t batch, const char *caller){
+    if(scratch == NULL || scratch->row != s->out_channels || scratch->row * scratch->stride < s->out_channels * conv_positions(s) * batch){
+        fprintf(stderr, "%s: The scratch matrix is too small\n", caller);
+        return false;
+    }
+    return true;
+}
+
+// Channel rows stored in m itself, or in scratch
+static matrix conv_channel_rows(const conv_shape *s, const matrix *m, const matrix *scratch){
+    size_t width = conv_positions(s) * m->col;
+    float *data = m->stride == m->col ? m->data : scratch->data;
+    return (matrix){s->out_channels, width, width, data, false};
+}
+
+// Copies between m and its channel rows in scratch, nothing to do when they are in place
+static void conv_copy_channel_rows(const conv_shape *s, matrix *m, const matrix *rows, bool to_rows){
+    if(rows->data == m->data)
+        return;
+
+    matrix_view batch_rows = {.row = conv_output_size(s), .col = m->col, .data = m->data, .rs = m->stride, .cs = 1};
+    matrix_view channel_rows = {.row = conv_output_size(s), .col = m->col, .data = rows->data, .rs = m->col, .cs = 1};
+    if(to_rows)
+        matrix_view_copy_to(&batch_rows, &channel_rows);
+    else
+        matrix_view_copy_to(&channel_rows, &batch_rows);
+}
+
+// Forward
+
+static bool conv_check_forward(matrix *dest, const matrix *weights, const matrix_view *X, const matrix *bias,
+                               const conv_shape *s, const char *caller){
+    if(X->row != conv_input_size(s) || dest->row != conv_output_size(s) || dest->col != X->col
+       || weights->row != s->out_channels || weights->col != conv_patch_size(s)){
+        fprintf(stderr, "%s: Matrix dimensions do not match\n", caller);
+        return false;
+    }
+    if(bias != NULL && (bias->row * bias->col != s->out_channels || (bias->col == 1 && bias->stride != 1))){
+        fprintf(stderr, "%s: The bias must have one contiguous value per output channel\n", caller);
+        return false;
+    }
+    return true;
+}
+
+void matrix_conv_forward_cols(matrix *dest, const matrix *weights, const matrix_half *half_weights, const matrix_view *X,
+                              const matrix *bias, activation_type type, const conv_shape *s, matrix *cols, matrix *scratch){
+    if(!conv_check_forward(dest, weights, X, bias, s, "matrix_conv_forward")
+       || !conv_check_scratch(s, scratch, X->col, "matrix_conv_forward"))
+        return;
+
+    matrix_im2col(s, X, cols);
+
+    gemm_epilogue epilogue = {
+        .type = GEMM_EPILOGUE_BIAS_ACTIVATION,
+        .activation = type,
+        .bias = bias == NULL ? NULL : bias->data,
+    };
+
+    // out_channels x (positions * batch) = W * cols, the bias being one value per row
+    matrix rows = conv_channel_rows(s, dest, scratch);
+    const void *w = half_weights != NULL ? (const void*) half_weights->data : (const void*) weights->data;
+    gemm_mixed(rows.row, rows.col, cols->row, 1,
+               w, half_weights != NULL ? half_weights->type : MATRIX_FLOAT, half_weights != NULL ? half_weights->stride : weights->stride, 1,
+               cols->data, MATRIX_FLOAT, cols->stride, 1,
+               0, rows.data, rows.stride, 1, &epilogue);
+    conv_copy_channel_rows(s, dest, &rows, false);
+}
+
+typedef struct conv_direct_args{
+    const conv_shape *s;
+    matrix *dest;
+    const matrix *weights;
+    const matrix_view *X;
+    const matrix *bias;
+    activation_type type;
+} conv_direct_args;
+
+static bool conv_use_avx2(void){
+#ifdef CONV_X86
+    static int supported = -1;
+    if(supported < 0){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+static inline float* conv_direct_output(const conv_direct_args *a, size_t co, size_t oh, size_t ow){
+    const conv_shape *s = a->s;
+    return a->dest->data + ((co * s->out_height + oh) * s->out_width + ow) * a->dest->stride;
+}
+
+// Samples [n0, n1) of output channels [co, co + nco) at the position (oh, ow)
+static void conv_direct_samples(const conv_direct_args *a, size_t co, size_t nco, size_t oh, size_t ow, size_t n0, size_t n1){
+    const conv_shape *s = a->s;
+    for(size_t c = 0; c < nco; c++){
+        float *out = conv_direct_output(a, co + c, oh, ow);
+        const float *w = a->weights->data + (co + c) * a->weights->stride;
+        memset(out + n0, 0, (n1 - n0) * sizeof(float));
+        for(size_t k = 0; k < conv_patch_size(s); k++){
+            long f = conv_input_row(s, k / (s->kernel_height * s->kernel_width), k / s->kernel_width % s->kernel_height,
+                                    k % s->kernel_width, oh, ow);
+            if(f < 0)
+                continue;
+            const float *in = a->X->data + f * a->X->rs;
+            for(size_t n = n0; n < n1; n++)
+                out[n] += w[k] * in[n];
+        }
+    }
+}
+
+#ifdef CONV_X86
+// CONV_DIRECT_SAMPLES samples from n0 of up to CONV_DIRECT_CHANNELS output
+// channels, every input row loaded once for all of them
+__attribute__((target("avx2,fma")))
+static void conv_direct_block_avx2(const conv_direct_args *a, size_t co, size_t nco, size_t oh, size_t ow, size_t n0){
+    const conv_shape *s = a->s;
+    __m256 acc[CONV_DIRECT_CHANNELS][2];
+    const float *w[CONV_DIRECT_CHANNELS];
+    for(size_t c = 0; c < CONV_DIRECT_CHANNELS; c++){
+        acc[c][0] = _mm256_setzero_ps();
+        acc[c][1] = _mm256_setzero_ps();
+        // Missing channels repeat the last one and are not stored
+        w[c] = a->weights->data + (co + (c < nco ? c : nco - 1)) * a->weights->stride;
+    }
+
+    for(size_t ci = 0; ci < s->in_channels; ci++){
+        for(size_t ki = 0; ki < s->kernel_height; ki++){
+            long ih = (long) (oh * s->stride + ki * s->dilation) - (long) s->padding;
+            if(ih < 0 || ih >= (long) s->in_height)
+                continue;
+            for(size_t kj = 0; kj < s->kernel_width; kj++){
+                long iw = (long) (ow * s->stride + kj * s->dilation) - (long) s->padding;
+                if(iw < 0 || iw >= (long) s->in_width)
+                    continue;
+                size_t k = (ci * s->kernel_height + ki) * s->kernel_width + kj;
+                const float *in = a->X->data + ((ci * s->in_height + ih) * s->in_width + iw) * a->X->rs + n0;
+                __m256 x0 = _mm256_loadu_ps(in), x1 = _mm256_loadu_ps(in + 8);
+                for(size_t c = 0; c < CONV_DIRECT_CHANNELS; c++){
+                    __m256 wc = _mm256_set1_ps(w[c][k]);
+                    acc[c][0] = _mm256_fmadd_ps(wc, x0, acc[c][0]);
+                    acc[c][1] = _mm256_fmadd_ps(wc, x1, acc[c][1]);
+                }
+            }
+        }
+    }
+
+    for(size_t c = 0; c < nco; c++){
+        float *out = conv_direct_output(a, co + c, oh, ow) + n0;
+        _mm256_storeu_ps(out, acc[c][0]);
+        _mm256_storeu_ps(out + 8, acc[c][1]);
+    }
+}
+#endif
+
+// Computes the outputs of the (block of output channels, output row) pairs [begin, end)
+static void conv_direct_range(void *arg, size_t begin, size_t end){
+    conv_direct_args *args = arg;
+    const conv_shape *s = args->s;
+    size_t batch = args->X->col;
+#ifdef CONV_X86
+    size_t full = batch - batch % CONV_DIRECT_SAMPLES;
+#else
+    size_t full = 0;
+#endif
+
+    for(size_t item = begin; item < end; item++){
+        size_t co = item / s->out_height * CONV_DIRECT_CHANNELS, oh = item % s->out_height;
+        size_t nco = s->out_channels - co < CONV_DIRECT_CHANNELS ? s->out_channels - co : CONV_DIRECT_CHANNELS;
+
+        for(size_t ow = 0; ow < s->out_width; ow++){
+#ifdef CONV_X86
+            for(size_t n = 0; n < full; n += CONV_DIRECT_SAMPLES)
+                conv_direct_block_avx2(args, co, nco, oh, ow, n);
+#endif
+            if(full < batch)
+                conv_direct_samples(args, co, nco, oh, ow, full, batch);
+            for(size_t c = 0; c < nco; c++)
+                activation_forward_row(args->type, conv_direct_output(args, co + c, oh, ow), batch,
+                                       args->bias == NULL ? 0 : args->bias->data[co + c]);
+        }
+    }
+}
+
+void matrix_conv_forward(matrix *dest, const matrix *weights, const matrix_half *half_weights, const matrix_view *X,
+                         const matrix *bias, activation_type type, const conv_shape *s, matrix *cols, matrix *scratch){
+    // The direct kernel reads the taps straight from the images, the samples of a tap being contiguous
+    if(half_weights != NULL || X->cs != 1 || conv_patch_size(s) > CONV_DIRECT_MAX_PATCH
+       || X->col < CONV_DIRECT_SAMPLES || !conv_use_avx2()){
+        matrix_conv_forward_cols(dest, weights, half_weights, X, bias, type, s, cols, scratch);
+        return;
+    }
+    if(!conv_check_forward(dest, weights, X, bias, s, "matrix_conv_forward"))
+        return;
+
+    conv_direct_args args = {s, dest, weights, X, bias, type};
+    size_t nb_items = (s->out_channels + CONV_DIRECT_CHANNELS - 1) / CONV_DIRECT_CHANNELS * s->out_height;
+    if(conv_output_size(s) * conv_patch_size(s) * X->col < CONV_PARALLEL_THRESHOLD)
+        conv_direct_range(&args, 0, nb_items);
+    else
+        thread_pool_parallel_for(nb_items, 1, conv_direct_range, &args);
+}
+
+// Backward
+
+void matrix_conv_backward_weights(matrix *grads, matrix *bias_grads, float alpha, float beta, const matrix *delta,
+                                  const matrix *cols, const conv_shape *s, matrix *scratch){
+    size_t width = conv_positions(s) * delta->col;
+    if(delta->row != conv_output_size(s) || grads->row != s->out_channels || grads->col != conv_patch_size(s)
+       || cols->row != conv_patch_size(s) || cols->col < width || bias_grads->row * bias_grads->col != s->out_channels){
+        fprintf(stderr, "matrix_conv_backward_weights: Matrix dimensions do not match\n");
+        return;
+    }
+    if(!conv_check_scratch(s, scratch, delta->col, "matrix_conv_backward_weights"))
+        return;
+
+    matrix rows = conv_channel_rows(s, delta, scratch);
+    conv_copy_channel_rows(s, (matrix*) delta, &rows, true);
+
+    // grads = alpha * D * cols^T + beta * grads, cols^T being read in place
+    matrix_view g = matrix_view_of(grads);
+    matrix_view d = matrix_view_of(&rows);
+    matrix_view c = {.row = cols->row, .col = width, .data = cols->data, .rs = cols->stride, .cs = 1};
+    matrix_view ct = matrix_view_transpose(&c);
+    matrix_view_mul_to(&g, &d, &ct, alpha, beta);
+    matrix_row_sums_to(bias_grads, &rows, alpha, beta);
+}
+
+void matrix_conv_backward_input(matrix *dest, const matrix *weights, const matrix_half *half_weights, const matrix *delta,
+                                const conv_shape *s, matrix *dcols, matrix *scratch){
+    size_t width = conv_positions(s) * delta->col;
+    if(delta->row != conv_output_size(s) || dest->row != conv_input_size(s) || dest->col != delta->col
+       || weights->row != s->out_channels || weights->col != conv_patch_size(s)
+       || dcols->row != conv_patch_size(s) || dcols->col < width){
+        fprintf(stderr, "matrix_conv_backward_input: Matrix dimensions do not match\n");
+        return;
+    }
+    if(!conv_check_scratch(s, scratch, delta->col, "matrix_conv_backward_input"))
+        return;
+
+    matrix rows = conv_channel_rows(s, delta, scratch);
+    conv_copy_channel_rows(s, (matrix*) delta, &rows, true);
+
+    // dcols = W^T * D, W^T being read in place through swapped strides
+    const void *w = half_weights != NULL ? (const void*) half_weights->data : (const void*) weights->data;
+    gemm_mixed(dcols->row, width, s->out_channels, 1,
+               w, half_weights != NULL ? half_weights->type : MATRIX_FLOAT, 1, half_weights != NULL ? half_weights->stride : weights->stride,
+               rows.data, MATRIX_FLOAT, rows.stride, 1,
+               0, dcols->data, dcols->stride, 1, NULL);
+    matrix_col2im(s, dcols, dest);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include "matrix.h"
+#include "activation.h"
+#include "half.h"
+
+// 2D convolution kernels
+// A batch of images is a matrix with one sample per column, like the input of
+// a dense layer: the column of a sample holds its channels one after the
+// other, each a row-major height x width image (CHW).
+// The im2col matrix of a batch has one row per (input channel, kernel row,
+// kernel column) and one column per (output position, sample), the samples
+// varying fastest. The convolution of the whole batch is then a single GEMM,
+// and the samples of a position stay contiguous as they are in the images.
+
+typedef struct conv_shape{
+    size_t in_channels;
+    size_t in_height;
+    size_t in_width;
+    size_t out_channels;
+    size_t kernel_height;
+    size_t kernel_width;
+    size_t stride;
+    size_t padding;     // zeros added on every side of the images
+    size_t dilation;    // spacing of the kernel taps, 1 for a contiguous kernel
+    size_t out_height;  // set by conv_shape_init
+    size_t out_width;
+} conv_shape;
+
+// Computes out_height and out_width, false if the shape is invalid
+bool conv_shape_init(conv_shape *s);
+// in_channels * in_height * in_width
+size_t conv_input_size(const conv_shape *s);
+// out_channels * out_height * out_width
+size_t conv_output_size(const conv_shape *s);
+// Rows of the im2col matrix, and columns of the weights: in_channels * kernel_height * kernel_width
+size_t conv_patch_size(const conv_shape *s);
+// out_height * out_width
+size_t conv_positions(const conv_shape *s);
+
+// cols = im2col(X), X being conv_input_size x batch and cols conv_patch_size x (positions * batch)
+void matrix_im2col(const conv_shape *s, const matrix_view *X, matrix *cols);
+// dest = col2im(cols), the values of overlapping patches being summed
+void matrix_col2im(const conv_shape *s, const matrix *cols, matrix *dest);
+
+// The weights are out_channels x conv_patch_size, read from half_weights
+// when it is not NULL. The bias holds one value per output channel.
+// scratch is out_channels x (positions * batch), used when the batch does
+// not fill the rows of dest.
+
+// dest = f(conv(X) + bias), dest being conv_output_size x batch
+// Small patches are convolved directly, larger ones through im2col into cols.
+// Softmax and custom activations are not applied, like in the dense kernels.
+void matrix_conv_forward(matrix *dest, const matrix *weights, const matrix_half *half_weights, const matrix_view *X,
+                         const matrix *bias, activation_type type, const conv_shape *s, matrix *cols, matrix *scratch);
+// Same, always through im2col, cols keeping im2col(X) for the backward pass
+void matrix_conv_forward_cols(matrix *dest, const matrix *weights, const matrix_half *half_weights, const matrix_view *X,
+                              const matrix *bias, activation_type type, const conv_shape *s, matrix *cols, matrix *scratch);
+
+// grads = alpha * delta * cols^T + beta * grads, and
+// bias_grads = alpha * (sum of delta per output channel) + beta * bias_grads
+// delta is the conv_output_size x batch delta of the layer, cols the im2col of its input
+void matrix_conv_backward_weights(matrix *grads, matrix *bias_grads, float alpha, float beta, const matrix *delta,
+                                  const matrix *cols, const conv_shape *s, matrix *scratch);
+// dest = col2im(W^T * delta), the error reaching the input of the layer
+// dcols is conv_patch_size x (positions * batch)
+void matrix_conv_backward_input(matrix *dest, const matrix *weights, const matrix_half *half_weights, const matrix *delta,
+                                const conv_shape *s, matrix *dcols, matrix *scratch);
@@ -0,0 +1,96 @@
+/**
+ * @file dense.c
+ * @brief Dense layer kernels fusing the bias and activation into the GEMM.
+ */
+
+#include "dense.h"
+#include "gemm.h"
+#include <stdio.h>
+
+void matrix_dense_forward(matrix *dest, const matrix *weights, const matrix *X, const matrix *bias, activation_type type){
+    matrix_view view = matrix_view_of(X);
+    matrix_dense_forward_view(dest, weights, &view, bias, type);
+}
+
+// Checks the operands of dest = f(W * X + b), W being rows x cols
+static bool dense_forward_check(const matrix *dest, size_t rows, size_t cols, const matrix_view *X, const matrix *bias){
+    if(cols != X->row || dest->row != rows || dest->col != X->col){
+        fprintf(stderr, "matrix_dense_forward: Matrix dimensions do not match\n");
+        return false;
+    }
+    if(bias != NULL && (bias->row * bias->col != rows || (bias->col == 1 && bias->stride != 1))){
+        fprintf(stderr, "matrix_dense_forward: The bias must have one contiguous value per neuron\n");
+        return false;
+    }
+    return true;
+}
+
+// dest = f(W * X + b), W being rows x cols elements of the given type
+static void dense_forward(matrix *dest, const void *weights, matrix_type weights_type, size_t rows, size_t cols, size_t stride,
+                          const matrix_view *X, const matrix *bias, activation_type type){
+    if(!dense_forward_check(dest, rows, cols, X, bias))
+        return;
+
+    gemm_epilogue epilogue = {
+        .type = GEMM_EPILOGUE_BIAS_ACTIVATION,
+        .activation = type,
+        .bias = bias == NULL ? NULL : bias->data,
+    };
+
+    gemm_mixed(rows, X->col, cols, 1,
+               weights, weights_type, stride, 1,
+               X->data, MATRIX_FLOAT, X->rs, X->cs,
+               0, dest->data, dest->stride, 1, &epilogue);
+}
+
+// delta = (W^T * delta_next) * f'(y), W being rows x cols elements of the given type
+static void dense_backward(matrix *delta, const void *weights, matrix_type weights_type, size_t rows, size_t cols, size_t stride,
+                           const matrix *delta_next, const matrix *y, activation_type type){
+    if(rows != delta_next->row || delta->row != cols || delta->col != delta_next->col
+       || y->row != delta->row || y->col != delta->col){
+        fprintf(stderr, "matrix_dense_backward: Matrix dimensions do not match\n");
+        return;
+    }
+
+    gemm_epilogue epilogue = {
+        .type = GEMM_EPILOGUE_ACTIVATION_BACKWARD,
+        .activation = type,
+        .y = y->data,
+        .rsy = y->stride,
+        .csy = 1,
+    };
+
+    // W^T is read in place through swapped strides
+    gemm_mixed(cols, delta_next->col, rows, 1,
+               weights, weights_type, 1, stride,
+               delta_next->data, MATRIX_FLOAT, delta_next->stride, 1,
+               0, delta->data, delta->stride, 1, &epilogue);
+}
+
+void matrix_dense_forward_view(matrix *dest, const matrix *weights, const matrix_view *X, const matrix *bias, activation_type type){
+    dense_forward(dest, weights->data, MATRIX_FLOAT, weights->row, weights->col, weights->stride, X, bias, type);
+}
+
+void matrix_dense_forward_half(matrix *dest, const matrix_half *weights, const matrix_view *X, const matrix *bias, activation_type type){
+    dense_forward(dest, weights->data, weights->type, weights->row, weights->col, weights->stride, X, bias, type);
+}
+
+void matrix_dense_forward_sparse(matrix *dest, const matrix_csr *weights, const matrix_view *X, const matrix *bias, activation_type type){
+    if(!dense_forward_check(dest, weights->row, weights->col, X, bias))
+        return;
+
+    gemm_epilogue epilogue = {
+        .type = GEMM_EPILOGUE_BIAS_ACTIVATION,
+        .activation = type,
+        .bias = bias == NULL ? NULL : bias->data,
+    };
+    matrix_csr_mul_ex(dest, weights, X, &epilogue);
+}
+
+void matrix_dense_backward(matrix *delta, const matrix *weights, const matrix *delta_next, const matrix *y, activation_type type){
+    dense_backward(delta, weights->data, MATRIX_FLOAT, weights->row, weights->col, weights->stride, delta_next, y, type);
+}
+
+void matrix_dense_backward_half(matrix *delta, const matrix_half *weights, const matrix *delta_next, const matrix *y, activation_type type){
+    dense_backward(delta, weights->data, weights->type, weights->row, weights->col, weights->stride, delta_next, y, type);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "matrix.h"
+#include "activation.h"
+#include "half.h"
+#include "sparse.h"
+
+// Fused dense layer kernels, running the bias and activation work in the GEMM epilogue
+
+// dest = f(weights * X + bias), bias being a column vector (or NULL)
+// Softmax and custom activations are not fused: only the bias is applied and
+// the caller activates dest afterwards.
+void matrix_dense_forward(matrix *dest, const matrix *weights, const matrix *X, const matrix *bias, activation_type type);
+// Same, X being a view (e.g. a range of columns of the training data)
+void matrix_dense_forward_view(matrix *dest, const matrix *weights, const matrix_view *X, const matrix *bias, activation_type type);
+// Same with half precision weights, converted as the GEMM packs them
+void matrix_dense_forward_half(matrix *dest, const matrix_half *weights, const matrix_view *X, const matrix *bias, activation_type type);
+// Same with pruned weights, the product only going through their nonzeros
+void matrix_dense_forward_sparse(matrix *dest, const matrix_csr *weights, const matrix_view *X, const matrix *bias, activation_type type);
+
+// delta = (weights^T * delta_next) * f'(y), y being the output of the layer
+void matrix_dense_backward(matrix *delta, const matrix *weights, const matrix *delta_next, const matrix *y, activation_type type);
+void matrix_dense_backward_half(matrix *delta, const matrix_half *weights, const matrix *delta_next, const matrix *y, activation_type type);
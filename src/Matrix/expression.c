@@ -0,0 +1,352 @@
+/**
+ * @file expression.c
+ * @brief Single pass evaluation of elementwise expressions.
+ *
+ * The destination is cut in blocks of EXPR_BLOCK elements along its rows.
+ * A block is computed node after node, each node writing its values into a
+ * small buffer of the evaluating thread, so the intermediate values never
+ * leave the L1 cache. Contiguous inputs are read in place, the root writes
+ * straight into a contiguous destination. The nodes have AVX2 versions picked
+ * at runtime, activations reuse the row kernels of activation.c, and the
+ * blocks are split over the thread pool.
+ */
+
+#include "expression.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EXPR_X86 1
+#endif
+
+// Elements of a block, the buffers of all the nodes fitting in the L1 cache
+#define EXPR_BLOCK 128
+// Below this many elements, an evaluation stays on the calling thread
+#define EXPR_PARALLEL_THRESHOLD (1 << 16)
+// Smallest number of elements handed to a thread
+#define EXPR_PARALLEL_GRAIN (1 << 13)
+
+static bool expr_use_avx2(void){
+#ifdef EXPR_X86
+    static int supported = -1;
+    if(supported < 0){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Building
+
+void matrix_expr_init(matrix_expr *e){
+    e->nb_nodes = 0;
+    e->failed = false;
+}
+
+static bool expr_operand(const matrix_expr *e, int a){
+    return a >= 0 && (size_t) a < e->nb_nodes;
+}
+
+// Appends node, whose operands are checked for the number of operands of its operation
+static int expr_push(matrix_expr *e, matrix_expr_node node, int nb_operands, const char *caller){
+    if(e->nb_nodes == MATRIX_EXPR_MAX_NODES){
+        fprintf(stderr, "%s: The expression has more than %d nodes\n", caller, MATRIX_EXPR_MAX_NODES);
+        e->failed = true;
+        return -1;
+    }
+    if((nb_operands > 0 && !expr_operand(e, node.a)) || (nb_operands > 1 && !expr_operand(e, node.b))){
+        fprintf(stderr, "%s: Invalid operand\n", caller);
+        e->failed = true;
+        return -1;
+    }
+    e->nodes[e->nb_nodes] = node;
+    return (int) e->nb_nodes++;
+}
+
+int matrix_expr_matrix(matrix_expr *e, const matrix *m){
+    matrix_expr_node node = {.op = EXPR_INPUT, .input = matrix_view_of(m)};
+    return expr_push(e, node, 0, "matrix_expr_matrix");
+}
+
+int matrix_expr_view(matrix_expr *e, const matrix_view *v){
+    matrix_expr_node node = {.op = EXPR_INPUT, .input = *v};
+    return expr_push(e, node, 0, "matrix_expr_view");
+}
+
+int matrix_expr_scalar(matrix_expr *e, float value){
+    matrix_expr_node node = {.op = EXPR_SCALAR, .scalar = value};
+    return expr_push(e, node, 0, "matrix_expr_scalar");
+}
+
+static int expr_binary(matrix_expr *e, matrix_expr_op op, int a, int b, const char *caller){
+    matrix_expr_node node = {.op = op, .a = a, .b = b};
+    return expr_push(e, node, 2, caller);
+}
+
+static int expr_unary(matrix_expr *e, matrix_expr_op op, int a, const char *caller){
+    matrix_expr_node node = {.op = op, .a = a};
+    return expr_push(e, node, 1, caller);
+}
+
+int matrix_expr_add(matrix_expr *e, int a, int b){ return expr_binary(e, EXPR_ADD, a, b, "matrix_expr_add"); }
+int matrix_expr_sub(matrix_expr *e, int a, int b){ return expr_binary(e, EXPR_SUB, a, b, "matrix_expr_sub"); }
+int matrix_expr_mul(matrix_expr *e, int a, int b){ return expr_binary(e, EXPR_MUL, a, b, "matrix_expr_mul"); }
+int matrix_expr_div(matrix_expr *e, int a, int b){ return expr_binary(e, EXPR_DIV, a, b, "matrix_expr_div"); }
+int matrix_expr_min(matrix_expr *e, int a, int b){ return expr_binary(e, EXPR_MIN, a, b, "matrix_expr_min"); }
+int matrix_expr_max(matrix_expr *e, int a, int b){ return expr_binary(e, EXPR_MAX, a, b, "matrix_expr_max"); }
+int matrix_expr_neg(matrix_expr *e, int a){ return expr_unary(e, EXPR_NEG, a, "matrix_expr_neg"); }
+int matrix_expr_abs(matrix_expr *e, int a){ return expr_unary(e, EXPR_ABS, a, "matrix_expr_abs"); }
+int matrix_expr_sqrt(matrix_expr *e, int a){ return expr_unary(e, EXPR_SQRT, a, "matrix_expr_sqrt"); }
+
+int matrix_expr_activation(matrix_expr *e, int a, activation_type type){
+    if(type == ACTIVATION_SOFTMAX || type == ACTIVATION_CUSTOM){
+        fprintf(stderr, "matrix_expr_activation: Only elementwise built-in activations can be fused\n");
+        e->failed = true;
+        return -1;
+    }
+    matrix_expr_node node = {.op = EXPR_ACTIVATION, .a = a, .activation = type};
+    return expr_push(e, node, 1, "matrix_expr_activation");
+}
+
+int matrix_expr_activation_backward(matrix_expr *e, int delta, int y, activation_type type){
+    if(type == ACTIVATION_CUSTOM){
+        fprintf(stderr, "matrix_expr_activation_backward: A custom activation has no built-in kernel\n");
+        e->failed = true;
+        return -1;
+    }
+    matrix_expr_node node = {.op = EXPR_ACTIVATION_BACKWARD, .a = delta, .b = y, .activation = type};
+    return expr_push(e, node, 2, "matrix_expr_activation_backward");
+}
+
+int matrix_expr_apply(matrix_expr *e, int a, float (*f)(float)){
+    matrix_expr_node node = {.op = EXPR_APPLY, .a = a, .f = f};
+    return expr_push(e, node, 1, "matrix_expr_apply");
+}
+
+// Node kernels over n values
+
+static void expr_node_scalar(matrix_expr_op op, const float *a, const float *b, float *out, size_t n){
+    for(size_t t = 0; t < n; t++){
+        switch(op){
+            case EXPR_ADD: out[t] = a[t] + b[t]; break;
+            case EXPR_SUB: out[t] = a[t] - b[t]; break;
+            case EXPR_MUL: out[t] = a[t] * b[t]; break;
+            case EXPR_DIV: out[t] = a[t] / b[t]; break;
+            case EXPR_MIN: out[t] = a[t] < b[t] ? a[t] : b[t]; break;
+            case EXPR_MAX: out[t] = a[t] > b[t] ? a[t] : b[t]; break;
+            case EXPR_NEG: out[t] = -a[t]; break;
+            case EXPR_ABS: out[t] = fabsf(a[t]); break;
+            case EXPR_SQRT: out[t] = sqrtf(a[t]); break;
+            default: break;
+        }
+    }
+}
+
+#ifdef EXPR_X86
+__attribute__((target("avx2,fma")))
+static void expr_node_avx2(matrix_expr_op op, const float *a, const float *b, float *out, size_t n){
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    size_t t = 0;
+    for(; t + 8 <= n; t += 8){
+        __m256 x = _mm256_loadu_ps(a + t), r;
+        switch(op){
+            case EXPR_ADD: r = _mm256_add_ps(x, _mm256_loadu_ps(b + t)); break;
+            case EXPR_SUB: r = _mm256_sub_ps(x, _mm256_loadu_ps(b + t)); break;
+            case EXPR_MUL: r = _mm256_mul_ps(x, _mm256_loadu_ps(b + t)); break;
+            case EXPR_DIV: r = _mm256_div_ps(x, _mm256_loadu_ps(b + t)); break;
+            case EXPR_MIN: r = _mm256_min_ps(x, _mm256_loadu_ps(b + t)); break;
+            case EXPR_MAX: r = _mm256_max_ps(x, _mm256_loadu_ps(b + t)); break;
+            case EXPR_NEG: r = _mm256_xor_ps(x, sign); break;
+            case EXPR_ABS: r = _mm256_andnot_ps(sign, x); break;
+            case EXPR_SQRT: r = _mm256_sqrt_ps(x); break;
+            default: r = x; break;
+        }
+        _mm256_storeu_ps(out + t, r);
+    }
+    expr_node_scalar(op, a + t, b == NULL ? NULL : b + t, out + t, n - t);
+}
+#endif
+
+static void expr_node(matrix_expr_op op, const float *a, const float *b, float *out, size_t n){
+#ifdef EXPR_X86
+    if(expr_use_avx2()){
+        expr_node_avx2(op, a, b, out, n);
+        return;
+    }
+#endif
+    expr_node_scalar(op, a, b, out, n);
+}
+
+// Evaluation
+
+typedef struct expr_eval_args{
+    const matrix_expr *e;
+    int root;
+    bool live[MATRIX_EXPR_MAX_NODES];           // nodes the root depends on
+    matrix_view inputs[MATRIX_EXPR_MAX_NODES];  // inputs of the nodes, 0 strides broadcasting them
+    matrix_view dest;
+    size_t row_blocks;                          // blocks per row of dest
+} expr_eval_args;
+
+// Values of node k over the elements [j, j + n) of row i, in buf unless an input is read in place
+static const float* expr_eval_node(const expr_eval_args *args, int k, const float **values, float *buf, size_t i, size_t j, size_t n){
+    const matrix_expr_node *node = &args->e->nodes[k];
+    const matrix_view *v = &args->inputs[k];
+
+    switch(node->op){
+        case EXPR_INPUT:
+            if(v->cs == 1)
+                return v->data + i * v->rs + j;
+            for(size_t t = 0; t < n; t++)
+                buf[t] = v->data[i * v->rs + (j + t) * v->cs];
+            return buf;
+        case EXPR_SCALAR:
+            // filled once per task
+            return values[k];
+        case EXPR_ACTIVATION:
+            if(values[node->a] != buf)
+                memcpy(buf, values[node->a], n * sizeof(float));
+            activation_forward_row(node->activation, buf, n, 0);
+            return buf;
+        case EXPR_ACTIVATION_BACKWARD:
+            if(values[node->a] != buf)
+                memcpy(buf, values[node->a], n * sizeof(float));
+            activation_backward_row(node->activation, values[node->b], buf, n);
+            return buf;
+        case EXPR_APPLY:
+            for(size_t t = 0; t < n; t++)
+                buf[t] = node->f(values[node->a][t]);
+            return buf;
+        default:
+            expr_node(node->op, values[node->a], node->op <= EXPR_MAX ? values[node->b] : NULL, buf, n);
+            return buf;
+    }
+}
+
+// Blocks [begin, end) of dest, numbered row after row
+static void expr_eval_range(void *arg, size_t begin, size_t end){
+    const expr_eval_args *args = arg;
+    const matrix_expr *e = args->e;
+    const matrix_view *dest = &args->dest;
+    float buffers[MATRIX_EXPR_MAX_NODES][EXPR_BLOCK] __attribute__((aligned(32)));
+    const float *values[MATRIX_EXPR_MAX_NODES];
+
+    for(int k = 0; k <= args->root; k++){
+        values[k] = buffers[k];
+        if(args->live[k] && e->nodes[k].op == EXPR_SCALAR){
+            for(size_t t = 0; t < EXPR_BLOCK; t++)
+                buffers[k][t] = e->nodes[k].scalar;
+        }
+    }
+
+    for(size_t item = begin; item < end; item++){
+        size_t i = item / args->row_blocks;
+        size_t j = item % args->row_blocks * EXPR_BLOCK;
+        size_t n = dest->col - j < EXPR_BLOCK ? dest->col - j : EXPR_BLOCK;
+        float *out = dest->cs == 1 ? dest->data + i * dest->rs + j : NULL;
+
+        for(int k = 0; k <= args->root; k++){
+            if(!args->live[k])
+                continue;
+            // The root writes into dest, unless it still has to read an operand living there
+            const matrix_expr_node *node = &e->nodes[k];
+            bool in_dest = k == args->root && out != NULL
+                           && !(node->op == EXPR_ACTIVATION_BACKWARD && values[node->b] == out);
+            values[k] = expr_eval_node(args, k, values, in_dest ? out : buffers[k], i, j, n);
+        }
+
+        const float *result = values[args->root];
+        if(out != NULL){
+            if(result != out)
+                memmove(out, result, n * sizeof(float));
+        }else{
+            for(size_t t = 0; t < n; t++)
+                dest->data[i * dest->rs + (j + t) * dest->cs] = result[t];
+        }
+    }
+}
+
+// Checks the expression against dest and sets up the evaluation
+static bool expr_prepare(expr_eval_args *args, const matrix_expr *e, int root, const matrix_view *dest, const char *caller){
+    if(e->failed || root < 0 || (size_t) root >= e->nb_nodes){
+        fprintf(stderr, "%s: Invalid expression\n", caller);
+        return false;
+    }
+
+    args->e = e;
+    args->root = root;
+    args->dest = *dest;
+    memset(args->live, 0, sizeof(args->live));
+    args->live[root] = true;
+    for(int k = root; k >= 0; k--){
+        const matrix_expr_node *node = &e->nodes[k];
+        if(!args->live[k])
+            continue;
+        if(node->op == EXPR_INPUT){
+            matrix_view v = node->input;
+            if((v.row != dest->row && v.row != 1) || (v.col != dest->col && v.col != 1)){
+                fprintf(stderr, "%s: Matrix dimensions do not match\n", caller);
+                return false;
+            }
+            // a single row or column is read again for every row or column of dest
+            if(v.row != dest->row)
+                v.rs = 0;
+            if(v.col != dest->col)
+                v.cs = 0;
+            args->inputs[k] = v;
+        }else if(node->op != EXPR_SCALAR){
+            args->live[node->a] = true;
+            if(node->op <= EXPR_MAX || node->op == EXPR_ACTIVATION_BACKWARD)
+                args->live[node->b] = true;
+        }
+    }
+    return true;
+}
+
+static void expr_run(expr_eval_args *args){
+    if(args->dest.row == 0 || args->dest.col == 0)
+        return;
+    args->row_blocks = (args->dest.col + EXPR_BLOCK - 1) / EXPR_BLOCK;
+    size_t nb_blocks = args->dest.row * args->row_blocks;
+
+    if(args->dest.row * args->dest.col < EXPR_PARALLEL_THRESHOLD)
+        expr_eval_range(args, 0, nb_blocks);
+    else
+        thread_pool_parallel_for(nb_blocks, (EXPR_PARALLEL_GRAIN + EXPR_BLOCK - 1) / EXPR_BLOCK, expr_eval_range, args);
+}
+
+void matrix_expr_eval_view(const matrix_expr *e, int root, const matrix_view *dest){
+    expr_eval_args args;
+    if(expr_prepare(&args, e, root, dest, "matrix_expr_eval_view"))
+        expr_run(&args);
+}
+
+void matrix_expr_eval(const matrix_expr *e, int root, matrix *dest){
+    matrix_view view = matrix_view_of(dest);
+    expr_eval_args args;
+    if(!expr_prepare(&args, e, root, &view, "matrix_expr_eval"))
+        return;
+
+    // Contiguous operands of the shape of dest are one long row, padding never being read
+    bool flat = dest->stride == dest->col;
+    for(int k = 0; k <= root && flat; k++){
+        const matrix_view *v = &args.inputs[k];
+        if(args.live[k] && e->nodes[k].op == EXPR_INPUT)
+            flat = v->row == dest->row && v->col == dest->col && v->cs == 1 && (v->rs == v->col || v->row == 1);
+    }
+    if(flat){
+        size_t n = dest->row * dest->col;
+        args.dest = (matrix_view){1, n, dest->data, n, 1};
+        for(int k = 0; k <= root; k++){
+            if(args.live[k] && e->nodes[k].op == EXPR_INPUT)
+                args.inputs[k] = (matrix_view){1, n, args.inputs[k].data, n, 1};
+        }
+    }
+    expr_run(&args);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include "matrix.h"
+#include "activation.h"
+
+// Lazy elementwise expressions
+// An expression is built node by node over matrices, views and scalars, then
+// evaluated into a destination in a single pass: every block of elements goes
+// through the whole expression while it sits in the L1 cache, so a chain of
+// operations reads each input once and writes the result once, without
+// temporary matrices.
+// The builders return the index of the new node, or -1 when the expression is
+// full or an operand is invalid. The expression then refuses to evaluate.
+
+#define MATRIX_EXPR_MAX_NODES 32
+
+typedef enum matrix_expr_op{
+    EXPR_INPUT,
+    EXPR_SCALAR,
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIV,
+    EXPR_MIN,
+    EXPR_MAX,
+    EXPR_NEG,
+    EXPR_ABS,
+    EXPR_SQRT,
+    EXPR_ACTIVATION,            // built-in activation, softmax excluded
+    EXPR_ACTIVATION_BACKWARD,   // a * f'(b), b being the output of the activation
+    EXPR_APPLY                  // custom function, one element at a time
+} matrix_expr_op;
+
+typedef struct matrix_expr_node{
+    matrix_expr_op op;
+    int a;                      // operands, earlier nodes
+    int b;
+    matrix_view input;
+    float scalar;
+    activation_type activation;
+    float (*f)(float);
+} matrix_expr_node;
+
+typedef struct matrix_expr{
+    size_t nb_nodes;
+    bool failed;
+    matrix_expr_node nodes[MATRIX_EXPR_MAX_NODES];
+} matrix_expr;
+
+void matrix_expr_init(matrix_expr *e);
+
+// Leaves
+// An input with a single row or column is broadcast over the destination.
+int matrix_expr_matrix(matrix_expr *e, const matrix *m);
+int matrix_expr_view(matrix_expr *e, const matrix_view *v);
+int matrix_expr_scalar(matrix_expr *e, float value);
+
+// Operations on earlier nodes
+int matrix_expr_add(matrix_expr *e, int a, int b);
+int matrix_expr_sub(matrix_expr *e, int a, int b);
+int matrix_expr_mul(matrix_expr *e, int a, int b);
+int matrix_expr_div(matrix_expr *e, int a, int b);
+int matrix_expr_min(matrix_expr *e, int a, int b);
+int matrix_expr_max(matrix_expr *e, int a, int b);
+int matrix_expr_neg(matrix_expr *e, int a);
+int matrix_expr_abs(matrix_expr *e, int a);
+int matrix_expr_sqrt(matrix_expr *e, int a);
+int matrix_expr_activation(matrix_expr *e, int a, activation_type type);
+// delta * f'(y), y being the output of the activation
+int matrix_expr_activation_backward(matrix_expr *e, int delta, int y, activation_type type);
+int matrix_expr_apply(matrix_expr *e, int a, float (*f)(float));
+
+// dest = node root of the expression, for every element of dest
+// dest must not overlap the inputs, unless it is the same matrix or view.
+void matrix_expr_eval(const matrix_expr *e, int root, matrix *dest);
+void matrix_expr_eval_view(const matrix_expr *e, int root, const matrix_view *dest);
@@ -0,0 +1,618 @@
+/**
+ * @file gemm.c
+ * @brief Cache-blocked, register-blocked single precision GEMM.
+ *
+ * The loops follow the usual Goto/BLIS structure: B is packed into KC x NC
+ * panels that stay in L2/L3, A is packed into MC x KC blocks that stay in L2,
+ * and a micro-kernel keeps an MR x NR tile of C in registers while streaming
+ * through the packed panels. The micro-kernel is picked once at runtime from
+ * CPUID (AVX2+FMA, SSE or plain C). Setting MATRIX_GEMM_KERNEL to "avx2",
+ * "sse" or "scalar" forces a specific one.
+ *
+ * Large products are spread over the thread pool: the B panel is packed in
+ * parallel, then every thread packs its own blocks of A and computes a
+ * disjoint (MC rows x column chunk) region of C.
+ *
+ * gemm_ex can fuse a bias + activation (forward) or an activation
+ * derivative (backward) into the product: it runs on every tile just after
+ * the micro-kernel stores it, instead of in another pass over C.
+ *
+ * gemm_mixed reads half precision operands: they are converted to float
+ * while being packed, so the micro-kernels are the same and only the loads
+ * of A and B get narrower.
+ */
+
+#include "gemm.h"
+#include "../ThreadPool/threadPool.h"
+#include "../Profiler/profiler.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86 1
+#endif
+
+// Cache blocking parameters (multiples of every MR / NR below)
+#define GEMM_MC 144
+#define GEMM_KC 256
+#define GEMM_NC 4080
+
+// Largest micro-tile among the kernels, used for edge tiles
+#define GEMM_MR_MAX 6
+#define GEMM_NR_MAX 16
+
+// Below this many multiply-adds, packing costs more than it saves
+#define GEMM_SMALL_THRESHOLD (32 * 32 * 32)
+
+// Below this many multiply-adds, the product stays on the calling thread
+#define GEMM_PARALLEL_THRESHOLD (128 * 128 * 128)
+
+// Computes the MR x NR tile C = alpha * Ap * Bp + beta * C where C is row-major with leading dimension ldc
+typedef void (*gemm_kernel_fn)(size_t kc, float alpha, const float *Ap, const float *Bp, float beta, float *C, size_t ldc);
+
+typedef struct gemm_kernel{
+    const char *name;
+    size_t mr;
+    size_t nr;
+    gemm_kernel_fn fn;
+} gemm_kernel;
+
+// Micro-kernels
+
+static void kernel_scalar_4x4(size_t kc, float alpha, const float *Ap, const float *Bp, float beta, float *C, size_t ldc){
+    float ab[4][4] = {{0}};
+
+    for(size_t k = 0; k < kc; k++){
+        for(size_t i = 0; i < 4; i++){
+            for(size_t j = 0; j < 4; j++){
+                ab[i][j] += Ap[i] * Bp[j];
+            }
+        }
+        Ap += 4;
+        Bp += 4;
+    }
+
+    for(size_t i = 0; i < 4; i++){
+        for(size_t j = 0; j < 4; j++){
+            if(beta == 0)
+                C[i * ldc + j] = alpha * ab[i][j];
+            else
+                C[i * ldc + j] = alpha * ab[i][j] + beta * C[i * ldc + j];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+static void kernel_sse_4x8(size_t kc, float alpha, const float *Ap, const float *Bp, float beta, float *C, size_t ldc){
+    __m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps();
+    __m128 c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+    __m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps();
+    __m128 c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+
+    for(size_t k = 0; k < kc; k++){
+        __m128 b0 = _mm_load_ps(Bp);
+        __m128 b1 = _mm_load_ps(Bp + 4);
+        __m128 a;
+
+        a = _mm_set1_ps(Ap[0]);
+        c00 = _mm_add_ps(c00, _mm_mul_ps(a, b0));
+        c01 = _mm_add_ps(c01, _mm_mul_ps(a, b1));
+        a = _mm_set1_ps(Ap[1]);
+        c10 = _mm_add_ps(c10, _mm_mul_ps(a, b0));
+        c11 = _mm_add_ps(c11, _mm_mul_ps(a, b1));
+        a = _mm_set1_ps(Ap[2]);
+        c20 = _mm_add_ps(c20, _mm_mul_ps(a, b0));
+        c21 = _mm_add_ps(c21, _mm_mul_ps(a, b1));
+        a = _mm_set1_ps(Ap[3]);
+        c30 = _mm_add_ps(c30, _mm_mul_ps(a, b0));
+        c31 = _mm_add_ps(c31, _mm_mul_ps(a, b1));
+
+        Ap += 4;
+        Bp += 8;
+    }
+
+    __m128 va = _mm_set1_ps(alpha);
+    __m128 acc[4][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}};
+    for(size_t i = 0; i < 4; i++){
+        float *c = C + i * ldc;
+        __m128 r0 = _mm_mul_ps(va, acc[i][0]);
+        __m128 r1 = _mm_mul_ps(va, acc[i][1]);
+        if(beta != 0){
+            __m128 vb = _mm_set1_ps(beta);
+            r0 = _mm_add_ps(r0, _mm_mul_ps(vb, _mm_loadu_ps(c)));
+            r1 = _mm_add_ps(r1, _mm_mul_ps(vb, _mm_loadu_ps(c + 4)));
+        }
+        _mm_storeu_ps(c, r0);
+        _mm_storeu_ps(c + 4, r1);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_avx2_6x16(size_t kc, float alpha, const float *Ap, const float *Bp, float beta, float *C, size_t ldc){
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+    for(size_t k = 0; k < kc; k++){
+        __m256 b0 = _mm256_load_ps(Bp);
+        __m256 b1 = _mm256_load_ps(Bp + 8);
+        __m256 a;
+
+        a = _mm256_broadcast_ss(Ap + 0);
+        c00 = _mm256_fmadd_ps(a, b0, c00);
+        c01 = _mm256_fmadd_ps(a, b1, c01);
+        a = _mm256_broadcast_ss(Ap + 1);
+        c10 = _mm256_fmadd_ps(a, b0, c10);
+        c11 = _mm256_fmadd_ps(a, b1, c11);
+        a = _mm256_broadcast_ss(Ap + 2);
+        c20 = _mm256_fmadd_ps(a, b0, c20);
+        c21 = _mm256_fmadd_ps(a, b1, c21);
+        a = _mm256_broadcast_ss(Ap + 3);
+        c30 = _mm256_fmadd_ps(a, b0, c30);
+        c31 = _mm256_fmadd_ps(a, b1, c31);
+        a = _mm256_broadcast_ss(Ap + 4);
+        c40 = _mm256_fmadd_ps(a, b0, c40);
+        c41 = _mm256_fmadd_ps(a, b1, c41);
+        a = _mm256_broadcast_ss(Ap + 5);
+        c50 = _mm256_fmadd_ps(a, b0, c50);
+        c51 = _mm256_fmadd_ps(a, b1, c51);
+
+        Ap += 6;
+        Bp += 16;
+    }
+
+    __m256 va = _mm256_set1_ps(alpha);
+    __m256 acc[6][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    for(size_t i = 0; i < 6; i++){
+        float *c = C + i * ldc;
+        __m256 r0 = _mm256_mul_ps(va, acc[i][0]);
+        __m256 r1 = _mm256_mul_ps(va, acc[i][1]);
+        if(beta != 0){
+            __m256 vb = _mm256_set1_ps(beta);
+            r0 = _mm256_fmadd_ps(vb, _mm256_loadu_ps(c), r0);
+            r1 = _mm256_fmadd_ps(vb, _mm256_loadu_ps(c + 8), r1);
+        }
+        _mm256_storeu_ps(c, r0);
+        _mm256_storeu_ps(c + 8, r1);
+    }
+}
+#endif
+
+static const gemm_kernel gemm_kernel_scalar = {"scalar", 4, 4, kernel_scalar_4x4};
+#ifdef GEMM_X86
+static const gemm_kernel gemm_kernel_sse = {"sse", 4, 8, kernel_sse_4x8};
+static const gemm_kernel gemm_kernel_avx2 = {"avx2", 6, 16, kernel_avx2_6x16};
+#endif
+
+// Kernel selection
+
+static const gemm_kernel* gemm_select_kernel(void){
+    static const gemm_kernel *selected = NULL;
+
+    if(selected != NULL)
+        return selected;
+
+    const gemm_kernel *k = &gemm_kernel_scalar;
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        k = &gemm_kernel_avx2;
+    else if(__builtin_cpu_supports("sse"))
+        k = &gemm_kernel_sse;
+#endif
+
+    // Allow forcing a (supported) kernel, mostly to compare them
+    const char *forced = getenv("MATRIX_GEMM_KERNEL");
+    if(forced != NULL){
+        if(strcmp(forced, "scalar") == 0)
+            k = &gemm_kernel_scalar;
+#ifdef GEMM_X86
+        else if(strcmp(forced, "sse") == 0)
+            k = &gemm_kernel_sse;
+        else if(strcmp(forced, "avx2") == 0 && k == &gemm_kernel_avx2)
+            k = &gemm_kernel_avx2;
+#endif
+        else if(strcmp(forced, k->name) != 0)
+            fprintf(stderr, "gemm: Kernel '%s' is not available, using '%s'\n", forced, k->name);
+    }
+
+    selected = k;
+    return selected;
+}
+
+const char* gemm_kernel_name(void){
+    return gemm_select_kernel()->name;
+}
+
+// Packing buffers, kept per thread and grown on demand so steady-state calls do not allocate
+
+static _Thread_local float *pack_a_buffer = NULL;
+static _Thread_local size_t pack_a_capacity = 0;
+static _Thread_local float *pack_b_buffer = NULL;
+static _Thread_local size_t pack_b_capacity = 0;
+
+static float* gemm_reserve(float **buffer, size_t *capacity, size_t size){
+    if(size <= *capacity)
+        return *buffer;
+
+    // aligned_alloc requires a size multiple of the alignment
+    size_t bytes = (size * sizeof(float) + 63) & ~(size_t)63;
+    float *b = aligned_alloc(64, bytes);
+    if(b == NULL){
+        fprintf(stderr, "gemm: Failed to allocate memory for packing buffer\n");
+        return NULL;
+    }
+    PROFILE_ALLOC(bytes);
+
+    if(*buffer != NULL)
+        PROFILE_FREE();
+    free(*buffer);
+    *buffer = b;
+    *capacity = bytes / sizeof(float);
+    return b;
+}
+
+// Operands stored as any matrix_type
+
+// Address of the element index of an operand
+static inline const void* gemm_offset(const void *p, matrix_type type, size_t index){
+    return (const char*) p + index * matrix_type_size(type);
+}
+
+// Element index of an operand, as a float
+static inline float gemm_load(const void *p, matrix_type type, size_t index){
+    if(type == MATRIX_FLOAT)
+        return ((const float*) p)[index];
+    return half_to_float(type, ((const uint16_t*) p)[index]);
+}
+
+// Converts n elements of an operand, the first at index and the next ones every stride
+static void gemm_load_n(const void *p, matrix_type type, size_t index, size_t stride, float *dest, size_t n){
+    if(stride == 1 && type == MATRIX_FLOAT)
+        memcpy(dest, (const float*) p + index, n * sizeof(float));
+    else if(stride == 1)
+        half_to_float_n(type, (const uint16_t*) p + index, dest, n);
+    else if(type == MATRIX_FLOAT){
+        const float *f = (const float*) p + index;
+        for(size_t i = 0; i < n; i++)
+            dest[i] = f[i * stride];
+    }else{
+        for(size_t i = 0; i < n; i++)
+            dest[i] = gemm_load(p, type, index + i * stride);
+    }
+}
+
+// Packs an mc x kc block of A into row panels of mr rows, zero padding the last panel
+static void gemm_pack_a(size_t mc, size_t kc, const void *A, matrix_type type, size_t rsa, size_t csa, float *Ap, size_t mr){
+    if(type != MATRIX_FLOAT && csa == 1){
+        // Half rows are converted a whole row at a time, then interleaved
+        float row[GEMM_KC];
+        for(size_t i = 0; i < mc; i += mr){
+            size_t m = mc - i < mr ? mc - i : mr;
+
+            for(size_t ii = 0; ii < mr; ii++){
+                if(ii < m)
+                    gemm_load_n(A, type, (i + ii) * rsa, 1, row, kc);
+                else
+                    memset(row, 0, kc * sizeof(float));
+                for(size_t k = 0; k < kc; k++)
+                    Ap[k * mr + ii] = row[k];
+            }
+            Ap += kc * mr;
+        }
+        return;
+    }
+
+    for(size_t i = 0; i < mc; i += mr){
+        size_t m = mc - i < mr ? mc - i : mr;
+
+        for(size_t k = 0; k < kc; k++){
+            if(type == MATRIX_FLOAT){
+                const float *a = (const float*) A + i * rsa + k * csa;
+                for(size_t ii = 0; ii < m; ii++)
+                    Ap[ii] = a[ii * rsa];
+            }else{
+                gemm_load_n(A, type, i * rsa + k * csa, rsa, Ap, m);
+            }
+            for(size_t ii = m; ii < mr; ii++)
+                Ap[ii] = 0;
+            Ap += mr;
+        }
+    }
+}
+
+// Packs a kc x nc block of B into column panels of nr columns, zero padding the last panel
+static void gemm_pack_b(size_t kc, size_t nc, const void *B, matrix_type type, size_t rsb, size_t csb, float *Bp, size_t nr){
+    for(size_t j = 0; j < nc; j += nr){
+        size_t n = nc - j < nr ? nc - j : nr;
+
+        for(size_t k = 0; k < kc; k++){
+            gemm_load_n(B, type, j * csb + k * rsb, csb, Bp, n);
+            for(size_t jj = n; jj < nr; jj++)
+                Bp[jj] = 0;
+            Bp += nr;
+        }
+    }
+}
+
+// Applies the epilogue to the m x n tile C whose first element is (row0, col0) of the whole product
+static void gemm_apply_epilogue(const gemm_epilogue *ep, float *C, size_t rsc, size_t csc, size_t row0, size_t col0, size_t m, size_t n){
+    for(size_t i = 0; i < m; i++){
+        float *c = C + i * rsc;
+
+        if(ep->type == GEMM_EPILOGUE_BIAS_ACTIVATION){
+            float bias = ep->bias == NULL ? 0 : ep->bias[row0 + i];
+            if(csc == 1){
+                activation_forward_row(ep->activation, c, n, bias);
+            }else{
+                for(size_t j = 0; j < n; j++)
+                    activation_forward_row(ep->activation, c + j * csc, 1, bias);
+            }
+        }else if(ep->type == GEMM_EPILOGUE_ACTIVATION_BACKWARD){
+            const float *y = ep->y + (row0 + i) * ep->rsy + col0 * ep->csy;
+            if(csc == 1 && ep->csy == 1){
+                activation_backward_row(ep->activation, y, c, n);
+            }else{
+                for(size_t j = 0; j < n; j++)
+                    activation_backward_row(ep->activation, y + j * ep->csy, c + j * csc, 1);
+            }
+        }
+    }
+}
+
+// Multiplies a packed mc x kc block of A by a packed kc x nc panel of B into C
+// The epilogue, only given for the last K panel, runs on each tile while it is still in L1.
+static void gemm_macro_kernel(const gemm_kernel *kernel, size_t mc, size_t nc, size_t kc, float alpha,
+                              const float *Ap, const float *Bp, float beta, float *C, size_t rsc, size_t csc,
+                              const gemm_epilogue *ep, size_t row0, size_t col0){
+    const size_t mr = kernel->mr;
+    const size_t nr = kernel->nr;
+    float tile[GEMM_MR_MAX * GEMM_NR_MAX];
+
+    for(size_t j = 0; j < nc; j += nr){
+        size_t n = nc - j < nr ? nc - j : nr;
+
+        for(size_t i = 0; i < mc; i += mr){
+            size_t m = mc - i < mr ? mc - i : mr;
+            float *c = C + i * rsc + j * csc;
+            const float *a = Ap + i * kc;
+            const float *b = Bp + j * kc;
+
+            if(m == mr && n == nr && csc == 1){
+                kernel->fn(kc, alpha, a, b, beta, c, rsc);
+            }else{
+                // Edge or strided tile: compute into a local tile and merge
+                kernel->fn(kc, alpha, a, b, 0, tile, nr);
+                for(size_t ii = 0; ii < m; ii++){
+                    for(size_t jj = 0; jj < n; jj++){
+                        float *cij = c + ii * rsc + jj * csc;
+                        *cij = beta == 0 ? tile[ii * nr + jj] : tile[ii * nr + jj] + beta * *cij;
+                    }
+                }
+            }
+
+            if(ep != NULL)
+                gemm_apply_epilogue(ep, c, rsc, csc, row0 + i, col0 + j, m, n);
+        }
+    }
+}
+
+// Direct loops for small products, where packing would dominate
+static void gemm_small(size_t M, size_t N, size_t K, float alpha,
+                       const float *A, size_t rsa, size_t csa,
+                       const float *B, size_t rsb, size_t csb,
+                       float beta, float *C, size_t rsc, size_t csc){
+    for(size_t i = 0; i < M; i++){
+        for(size_t j = 0; j < N; j++){
+            float sum = 0;
+            for(size_t k = 0; k < K; k++)
+                sum += A[i * rsa + k * csa] * B[k * rsb + j * csb];
+
+            float *cij = C + i * rsc + j * csc;
+            *cij = beta == 0 ? alpha * sum : alpha * sum + beta * *cij;
+        }
+    }
+}
+
+// Same for operands stored as other types
+static void gemm_small_mixed(size_t M, size_t N, size_t K, float alpha,
+                             const void *A, matrix_type type_a, size_t rsa, size_t csa,
+                             const void *B, matrix_type type_b, size_t rsb, size_t csb,
+                             float beta, float *C, size_t rsc, size_t csc){
+    for(size_t i = 0; i < M; i++){
+        for(size_t j = 0; j < N; j++){
+            float sum = 0;
+            for(size_t k = 0; k < K; k++)
+                sum += gemm_load(A, type_a, i * rsa + k * csa) * gemm_load(B, type_b, k * rsb + j * csb);
+
+            float *cij = C + i * rsc + j * csc;
+            *cij = beta == 0 ? alpha * sum : alpha * sum + beta * *cij;
+        }
+    }
+}
+
+static void gemm_scale(size_t M, size_t N, float beta, float *C, size_t rsc, size_t csc){
+    for(size_t i = 0; i < M; i++){
+        for(size_t j = 0; j < N; j++){
+            float *cij = C + i * rsc + j * csc;
+            *cij = beta == 0 ? 0 : beta * *cij;
+        }
+    }
+}
+
+// One K panel of the product, shared by the threads working on it
+typedef struct gemm_panel{
+    const gemm_kernel *kernel;
+    size_t M;
+    size_t nc;
+    size_t kc;
+    float alpha;
+    float beta;
+    const void *A;
+    matrix_type type_a;
+    size_t rsa;
+    size_t csa;
+    const void *B;
+    matrix_type type_b;
+    size_t rsb;
+    size_t csb;
+    float *Bp;
+    float *C;
+    size_t rsc;
+    size_t csc;
+    size_t nb_col_chunks;
+    size_t col_chunk;
+    const gemm_epilogue *epilogue;  // NULL except on the last K panel
+    size_t col0;                    // first column of C covered by the panel
+} gemm_panel;
+
+// Packs the B panels [begin, end) of nr columns
+static void gemm_pack_b_task(void *arg, size_t begin, size_t end){
+    gemm_panel *p = arg;
+    const size_t nr = p->kernel->nr;
+    size_t first = begin * nr;
+    size_t last = end * nr < p->nc ? end * nr : p->nc;
+
+    gemm_pack_b(p->kc, last - first, gemm_offset(p->B, p->type_b, first * p->csb), p->type_b, p->rsb, p->csb,
+                p->Bp + first * p->kc, nr);
+}
+
+// Computes the (MC block, column chunk) units [begin, end) of C
+static void gemm_panel_task(void *arg, size_t begin, size_t end){
+    gemm_panel *p = arg;
+    const size_t mr = p->kernel->mr;
+
+    float *Ap = gemm_reserve(&pack_a_buffer, &pack_a_capacity, GEMM_MC * GEMM_KC);
+    if(Ap == NULL)
+        return;
+
+    for(size_t u = begin; u < end; u++){
+        size_t ic = (u / p->nb_col_chunks) * GEMM_MC;
+        size_t jr = (u % p->nb_col_chunks) * p->col_chunk;
+        size_t mc = p->M - ic < GEMM_MC ? p->M - ic : GEMM_MC;
+        size_t nc = p->nc - jr < p->col_chunk ? p->nc - jr : p->col_chunk;
+
+        gemm_pack_a(mc, p->kc, gemm_offset(p->A, p->type_a, ic * p->rsa), p->type_a, p->rsa, p->csa, Ap, mr);
+        gemm_macro_kernel(p->kernel, mc, nc, p->kc, p->alpha, Ap, p->Bp + jr * p->kc, p->beta,
+                          p->C + ic * p->rsc + jr * p->csc, p->rsc, p->csc,
+                          p->epilogue, ic, p->col0 + jr);
+    }
+}
+
+void gemm(const size_t M, const size_t N, const size_t K, float alpha,
+          const float *A, const size_t rsa, const size_t csa,
+          const float *B, const size_t rsb, const size_t csb,
+          float beta, float *C, const size_t rsc, const size_t csc){
+    gemm_ex(M, N, K, alpha, A, rsa, csa, B, rsb, csb, beta, C, rsc, csc, NULL);
+}
+
+void gemm_ex(const size_t M, const size_t N, const size_t K, float alpha,
+             const float *A, const size_t rsa, const size_t csa,
+             const float *B, const size_t rsb, const size_t csb,
+             float beta, float *C, const size_t rsc, const size_t csc,
+             const gemm_epilogue *epilogue){
+    gemm_mixed(M, N, K, alpha, A, MATRIX_FLOAT, rsa, csa, B, MATRIX_FLOAT, rsb, csb, beta, C, rsc, csc, epilogue);
+}
+
+// Direct loops for the float and mixed operands
+static void gemm_direct(size_t M, size_t N, size_t K, float alpha,
+                        const void *A, matrix_type type_a, size_t rsa, size_t csa,
+                        const void *B, matrix_type type_b, size_t rsb, size_t csb,
+                        float beta, float *C, size_t rsc, size_t csc){
+    if(type_a == MATRIX_FLOAT && type_b == MATRIX_FLOAT)
+        gemm_small(M, N, K, alpha, A, rsa, csa, B, rsb, csb, beta, C, rsc, csc);
+    else
+        gemm_small_mixed(M, N, K, alpha, A, type_a, rsa, csa, B, type_b, rsb, csb, beta, C, rsc, csc);
+}
+
+void gemm_mixed(const size_t M, const size_t N, const size_t K, float alpha,
+                const void *A, matrix_type type_a, const size_t rsa, const size_t csa,
+                const void *B, matrix_type type_b, const size_t rsb, const size_t csb,
+                float beta, float *C, const size_t rsc, const size_t csc,
+                const gemm_epilogue *epilogue){
+    if(M == 0 || N == 0)
+        return;
+
+    if(epilogue != NULL && epilogue->type == GEMM_EPILOGUE_NONE)
+        epilogue = NULL;
+
+    if(K == 0 || alpha == 0 || M * N * K < GEMM_SMALL_THRESHOLD){
+        if(K == 0 || alpha == 0)
+            gemm_scale(M, N, beta, C, rsc, csc);
+        else
+            gemm_direct(M, N, K, alpha, A, type_a, rsa, csa, B, type_b, rsb, csb, beta, C, rsc, csc);
+        if(epilogue != NULL)
+            gemm_apply_epilogue(epilogue, C, rsc, csc, 0, 0, M, N);
+        return;
+    }
+
+    const gemm_kernel *kernel = gemm_select_kernel();
+    const size_t nr = kernel->nr;
+
+    float *Bp = gemm_reserve(&pack_b_buffer, &pack_b_capacity, GEMM_KC * ((N < GEMM_NC ? N : GEMM_NC) + nr));
+    if(Bp == NULL){
+        gemm_direct(M, N, K, alpha, A, type_a, rsa, csa, B, type_b, rsb, csb, beta, C, rsc, csc);
+        if(epilogue != NULL)
+            gemm_apply_epilogue(epilogue, C, rsc, csc, 0, 0, M, N);
+        return;
+    }
+
+    // Serial below the threshold, otherwise enough units to keep every thread busy
+    size_t nb_threads = 1;
+    if(M * N * K >= GEMM_PARALLEL_THRESHOLD && !thread_pool_in_worker())
+        nb_threads = thread_pool_get_nb_threads();
+    size_t nb_row_blocks = (M + GEMM_MC - 1) / GEMM_MC;
+
+    for(size_t jc = 0; jc < N; jc += GEMM_NC){
+        size_t nc = N - jc < GEMM_NC ? N - jc : GEMM_NC;
+        size_t nb_panels = (nc + nr - 1) / nr;
+
+        // Split the columns when there are too few row blocks to go around
+        size_t nb_col_chunks = (2 * nb_threads + nb_row_blocks - 1) / nb_row_blocks;
+        if(nb_col_chunks > nb_panels)
+            nb_col_chunks = nb_panels;
+        size_t col_chunk = (nb_panels + nb_col_chunks - 1) / nb_col_chunks * nr;
+        nb_col_chunks = (nc + col_chunk - 1) / col_chunk;
+
+        for(size_t pc = 0; pc < K; pc += GEMM_KC){
+            gemm_panel p = {
+                .kernel = kernel,
+                .M = M,
+                .nc = nc,
+                .kc = K - pc < GEMM_KC ? K - pc : GEMM_KC,
+                .alpha = alpha,
+                // Only the first panel of K applies the caller's beta, the next ones accumulate
+                .beta = pc == 0 ? beta : 1,
+                .A = gemm_offset(A, type_a, pc * csa),
+                .type_a = type_a,
+                .rsa = rsa,
+                .csa = csa,
+                .B = gemm_offset(B, type_b, pc * rsb + jc * csb),
+                .type_b = type_b,
+                .rsb = rsb,
+                .csb = csb,
+                .Bp = Bp,
+                .C = C + jc * csc,
+                .rsc = rsc,
+                .csc = csc,
+                .nb_col_chunks = nb_col_chunks,
+                .col_chunk = col_chunk,
+                .epilogue = pc + GEMM_KC >= K ? epilogue : NULL,
+                .col0 = jc,
+            };
+
+            if(nb_threads == 1){
+                gemm_pack_b_task(&p, 0, nb_panels);
+                gemm_panel_task(&p, 0, nb_row_blocks * nb_col_chunks);
+            }else{
+                thread_pool_parallel_for(nb_panels, 1, gemm_pack_b_task, &p);
+                thread_pool_parallel_for(nb_row_blocks * nb_col_chunks, 1, gemm_panel_task, &p);
+            }
+        }
+    }
+}
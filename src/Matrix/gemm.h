@@ -0,0 +1,50 @@
+#pragma once
+#include <stddef.h>
+#include "activation.h"
+#include "half.h"
+
+// Work fused into the GEMM, applied to each tile of C right after its last K panel
+typedef enum gemm_epilogue_type{
+    GEMM_EPILOGUE_NONE,
+    GEMM_EPILOGUE_BIAS_ACTIVATION,      // C = f(C + bias), bias holding one value per row (or NULL)
+    GEMM_EPILOGUE_ACTIVATION_BACKWARD   // C = C * f'(y), y having the shape of C
+} gemm_epilogue_type;
+
+// Softmax and custom activations are not fused, only the bias is applied for them.
+typedef struct gemm_epilogue{
+    gemm_epilogue_type type;
+    activation_type activation;
+    const float *bias;
+    const float *y;
+    size_t rsy;
+    size_t csy;
+} gemm_epilogue;
+
+// General matrix multiplication: C = alpha * A * B + beta * C
+// A is M x K, B is K x N and C is M x N. Every operand is described by its
+// row stride (rs) and column stride (cs), so element (i, j) of A lives at
+// A[i * rsa + j * csa]. A row-major matrix has rs = col and cs = 1.
+// When beta is 0, C is never read.
+void gemm(const size_t M, const size_t N, const size_t K, float alpha,
+          const float *A, const size_t rsa, const size_t csa,
+          const float *B, const size_t rsb, const size_t csb,
+          float beta, float *C, const size_t rsc, const size_t csc);
+
+// Same as gemm, followed by the epilogue (may be NULL)
+void gemm_ex(const size_t M, const size_t N, const size_t K, float alpha,
+             const float *A, const size_t rsa, const size_t csa,
+             const float *B, const size_t rsb, const size_t csb,
+             float beta, float *C, const size_t rsc, const size_t csc,
+             const gemm_epilogue *epilogue);
+
+// Same as gemm_ex, A and B being stored as type_a and type_b
+// Half precision operands are converted to float as they are packed, the
+// products being accumulated in float. Strides count elements, not bytes.
+void gemm_mixed(const size_t M, const size_t N, const size_t K, float alpha,
+                const void *A, matrix_type type_a, const size_t rsa, const size_t csa,
+                const void *B, matrix_type type_b, const size_t rsb, const size_t csb,
+                float beta, float *C, const size_t rsc, const size_t csc,
+                const gemm_epilogue *epilogue);
+
+// Name of the micro-kernel selected at runtime ("avx2", "sse" or "scalar")
+const char* gemm_kernel_name(void);
@@ -0,0 +1,297 @@
+/**
+ * @file half.c
+ * @brief Half precision (fp16 and bf16) storage and conversions.
+ *
+ * The bulk conversions use F16C for fp16 and AVX2 integer operations for
+ * bf16 when the CPU has them, and the scalar conversions otherwise (and for
+ * the tails). Both round to nearest even, so every path gives the same bits.
+ */
+
+#include "half.h"
+#include "../ThreadPool/threadPool.h"
+#include "../Profiler/profiler.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALF_X86 1
+#endif
+
+// Below this many elements, a conversion stays on the calling thread
+#define HALF_PARALLEL_THRESHOLD (1 << 16)
+
+size_t matrix_type_size(matrix_type type){
+    return type == MATRIX_FLOAT ? sizeof(float) : sizeof(uint16_t);
+}
+
+static const char *matrix_type_names[] = {"fp32", "fp16", "bf16"};
+
+const char* matrix_type_name(matrix_type type){
+    return matrix_type_names[type];
+}
+
+int matrix_type_from_name(const char *name){
+    for(int t = MATRIX_FLOAT; t <= MATRIX_BF16; t++){
+        if(strcmp(name, matrix_type_names[t]) == 0)
+            return t;
+    }
+    return -1;
+}
+
+// Scalar conversions
+
+static float fp16_to_float(uint16_t h){
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t bits;
+    float f;
+
+    if(exponent == 0){
+        // zero or subnormal: mantissa * 2^-24, exact in float
+        f = mantissa * (1.0f / 16777216.0f);
+        memcpy(&bits, &f, 4);
+        bits |= sign;
+    }
+    else if(exponent == 31)
+        bits = sign | 0x7F800000 | mantissa << 13;
+    else
+        bits = sign | (exponent + 112) << 23 | mantissa << 13;
+
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+static uint16_t fp16_from_float(float f){
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7FFFFFFF;
+
+    // infinity, or NaN kept quiet
+    if(abs >= 0x7F800000)
+        return sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 | ((abs >> 13) & 0x3FF) : 0);
+    // at least 65520, which rounds past the largest half
+    if(abs >= 0x477FF000)
+        return sign | 0x7C00;
+    // below the smallest normal half: subnormal, rounded in float arithmetic
+    if(abs < 0x38800000){
+        float a;
+        memcpy(&a, &abs, 4);
+        return sign | (uint16_t) lrintf(a * 16777216.0f);
+    }
+    // rebias the exponent (127 -> 15) and round the 13 dropped bits to nearest even
+    abs += 0xC8000FFF + ((abs >> 13) & 1);
+    return sign | (abs >> 13);
+}
+
+static float bf16_to_float(uint16_t h){
+    uint32_t bits = (uint32_t) h << 16;
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+static uint16_t bf16_from_float(float f){
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    if((x & 0x7FFFFFFF) > 0x7F800000)
+        return (x >> 16) | 0x40;
+    return (x + 0x7FFF + ((x >> 16) & 1)) >> 16;
+}
+
+float half_to_float(matrix_type type, uint16_t h){
+    return type == MATRIX_FP16 ? fp16_to_float(h) : bf16_to_float(h);
+}
+
+uint16_t half_from_float(matrix_type type, float f){
+    return type == MATRIX_FP16 ? fp16_from_float(f) : bf16_from_float(f);
+}
+
+// Vectorized conversions
+
+#ifdef HALF_X86
+__attribute__((target("avx,f16c")))
+static size_t fp16_to_float_f16c(const uint16_t *src, float *dest, size_t n){
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dest + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (src + i))));
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+static size_t fp16_from_float_f16c(const float *src, uint16_t *dest, size_t n){
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i*) (dest + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t bf16_to_float_avx2(const uint16_t *src, float *dest, size_t n){
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (src + i)));
+        _mm256_storeu_si256((__m256i*) (dest + i), _mm256_slli_epi32(x, 16));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t bf16_from_float_avx2(const float *src, uint16_t *dest, size_t n){
+    const __m256i round = _mm256_set1_epi32(0x7FFF);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i quiet = _mm256_set1_epi32(0x40);
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8){
+        __m256 v = _mm256_loadu_ps(src + i);
+        __m256i x = _mm256_castps_si256(v);
+        __m256i high = _mm256_srli_epi32(x, 16);
+        __m256i r = _mm256_add_epi32(_mm256_add_epi32(x, round), _mm256_and_si256(high, one));
+        r = _mm256_srli_epi32(r, 16);
+        __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+        r = _mm256_blendv_epi8(r, _mm256_or_si256(high, quiet), nan);
+        // 32-bit lanes to 16-bit ones, packus working within the 128-bit halves
+        r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xD8);
+        _mm_storeu_si128((__m128i*) (dest + i), _mm256_castsi256_si128(r));
+    }
+    return i;
+}
+#endif
+
+static bool half_has_f16c = false;
+static bool half_has_avx2 = false;
+
+static void half_cpu_init(void){
+    static bool initialized = false;
+
+    if(initialized)
+        return;
+#ifdef HALF_X86
+    __builtin_cpu_init();
+    half_has_f16c = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    half_has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    initialized = true;
+}
+
+void half_to_float_n(matrix_type type, const uint16_t *src, float *dest, size_t n){
+    size_t i = 0;
+
+    half_cpu_init();
+#ifdef HALF_X86
+    if(type == MATRIX_FP16 && half_has_f16c)
+        i = fp16_to_float_f16c(src, dest, n);
+    else if(type == MATRIX_BF16 && half_has_avx2)
+        i = bf16_to_float_avx2(src, dest, n);
+#endif
+    for(; i < n; i++)
+        dest[i] = half_to_float(type, src[i]);
+}
+
+void half_from_float_n(matrix_type type, const float *src, uint16_t *dest, size_t n){
+    size_t i = 0;
+
+    half_cpu_init();
+#ifdef HALF_X86
+    if(type == MATRIX_FP16 && half_has_f16c)
+        i = fp16_from_float_f16c(src, dest, n);
+    else if(type == MATRIX_BF16 && half_has_avx2)
+        i = bf16_from_float_avx2(src, dest, n);
+#endif
+    for(; i < n; i++)
+        dest[i] = half_from_float(type, src[i]);
+}
+
+// Half matrix creation and destruction
+
+matrix_half* matrix_half_zeros(const size_t row, const size_t col, matrix_type type){
+    if(type != MATRIX_FP16 && type != MATRIX_BF16){
+        fprintf(stderr, "matrix_half_zeros: Not a half precision type\n");
+        return NULL;
+    }
+
+    matrix_half *m = malloc(sizeof(matrix_half));
+    if(m == NULL){
+        fprintf(stderr, "matrix_half_zeros: Failed to allocate memory for matrix\n");
+        return NULL;
+    }
+
+    // rows of whole cache lines
+    const size_t per_line = MATRIX_ALIGNMENT / sizeof(uint16_t);
+    size_t stride = (col + per_line - 1) / per_line * per_line;
+    size_t size = row * stride * sizeof(uint16_t);
+    m->data = aligned_alloc(MATRIX_ALIGNMENT, size > 0 ? size : MATRIX_ALIGNMENT);
+    if(m->data == NULL){
+        fprintf(stderr, "matrix_half_zeros: Failed to allocate memory for matrix data\n");
+        free(m);
+        return NULL;
+    }
+    memset(m->data, 0, size);
+    PROFILE_ALLOC(size);
+
+    m->row = row;
+    m->col = col;
+    m->stride = stride;
+    m->type = type;
+    return m;
+}
+
+matrix_half* matrix_half_from(const matrix *m, matrix_type type){
+    matrix_half *h = matrix_half_zeros(m->row, m->col, type);
+    if(h != NULL)
+        matrix_half_copy_from(h, m);
+    return h;
+}
+
+void matrix_half_destroy(matrix_half *m){
+    free(m->data);
+    PROFILE_FREE();
+    free(m);
+}
+
+// Conversions
+
+typedef struct matrix_half_copy_args{
+    matrix_half *half;
+    matrix *m;
+    bool to_half;
+} matrix_half_copy_args;
+
+static void matrix_half_copy_range(void *arg, size_t begin, size_t end){
+    matrix_half_copy_args *args = arg;
+    matrix_half *h = args->half;
+    matrix *m = args->m;
+
+    for(size_t i = begin; i < end; i++){
+        if(args->to_half)
+            half_from_float_n(h->type, m->data + i * m->stride, h->data + i * h->stride, m->col);
+        else
+            half_to_float_n(h->type, h->data + i * h->stride, m->data + i * m->stride, m->col);
+    }
+}
+
+static void matrix_half_copy(matrix_half *h, matrix *m, bool to_half, const char *caller){
+    if(h->row != m->row || h->col != m->col){
+        fprintf(stderr, "%s: Matrix dimensions do not match\n", caller);
+        return;
+    }
+
+    matrix_half_copy_args args = {h, m, to_half};
+    if(m->row * m->col < HALF_PARALLEL_THRESHOLD)
+        matrix_half_copy_range(&args, 0, m->row);
+    else
+        thread_pool_parallel_for(m->row, 1, matrix_half_copy_range, &args);
+}
+
+void matrix_half_copy_from(matrix_half *dest, const matrix *src){
+    matrix_half_copy(dest, (matrix*) src, true, "matrix_half_copy_from");
+}
+
+void matrix_half_copy_to(const matrix_half *src, matrix *dest){
+    matrix_half_copy((matrix_half*) src, dest, false, "matrix_half_copy_to");
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "matrix.h"
+
+// Storage types of matrix elements
+// Half precision values take 16 bits and are always converted to float before
+// any arithmetic, so they only save memory and bandwidth.
+typedef enum matrix_type{
+    MATRIX_FLOAT,
+    MATRIX_FP16,        // IEEE 754 binary16: 10-bit mantissa, range up to 65504
+    MATRIX_BF16         // bfloat16: the upper half of a float, 7-bit mantissa, full float range
+} matrix_type;
+
+size_t matrix_type_size(matrix_type type);
+const char* matrix_type_name(matrix_type type);
+// Inverse of matrix_type_name, -1 for an unknown name
+int matrix_type_from_name(const char *name);
+
+// Conversions of one value, rounding to nearest even
+float half_to_float(matrix_type type, uint16_t h);
+uint16_t half_from_float(matrix_type type, float f);
+
+// Conversions of n contiguous values, using F16C / AVX2 when available
+void half_to_float_n(matrix_type type, const uint16_t *src, float *dest, size_t n);
+void half_from_float_n(matrix_type type, const float *src, uint16_t *dest, size_t n);
+
+// Matrix stored in half precision, with the same layout as matrix
+// Element (i, j) lives at data[i * stride + j], every row starting on a
+// MATRIX_ALIGNMENT boundary.
+typedef struct matrix_half{
+    size_t row;
+    size_t col;
+    size_t stride;
+    matrix_type type;   // MATRIX_FP16 or MATRIX_BF16
+    uint16_t *data;
+} matrix_half;
+
+// Half matrix creation and destruction
+matrix_half* matrix_half_zeros(const size_t row, const size_t col, matrix_type type);
+// Rounded copy of m
+matrix_half* matrix_half_from(const matrix *m, matrix_type type);
+void matrix_half_destroy(matrix_half *m);
+
+// Elementwise conversions between the two storages, which must have the same shape
+void matrix_half_copy_from(matrix_half *dest, const matrix *src);
+void matrix_half_copy_to(const matrix_half *src, matrix *dest);
@@ -1,8 +1,167 @@
 #include "matrix.h"
+#include "gemm.h"
+#include "random.h"
+#include "../ThreadPool/threadPool.h"
+#include "../Profiler/profiler.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include <time.h>
+#include <string.h>
+
+// Elementwise kernels
+// Every elementwise operation goes through matrix_map, which splits large
+// matrices over the thread pool and keeps small ones on the calling thread.
+
+// Below this many elements, an elementwise loop stays on the calling thread
+#define MATRIX_PARALLEL_THRESHOLD (1 << 16)
+// Smallest chunk of elements handed to a thread
+#define MATRIX_PARALLEL_GRAIN (1 << 13)
+
+typedef enum matrix_map_op{
+    MAP_ADD,
+    MAP_ADD_SCALED,
+    MAP_SUB,
+    MAP_MUL,
+    MAP_SCALAR_ADD,
+    MAP_SCALAR_MUL,
+    MAP_SCALAR_DIV,
+    MAP_APPLY,
+    MAP_COPY,
+    MAP_FILL
+} matrix_map_op;
+
+typedef struct matrix_map_args{
+    matrix_map_op op;
+    float *dest;
+    const float *a;
+    const float *b;
+    float scalar;
+    float (*f)(float);
+} matrix_map_args;
+
+static void matrix_map_range(void *arg, size_t begin, size_t end){
+    const matrix_map_args *args = arg;
+    float *dest = args->dest;
+    const float *a = args->a;
+    const float *b = args->b;
+    const float scalar = args->scalar;
+
+    switch(args->op){
+        case MAP_ADD:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] + b[i];
+            break;
+        case MAP_ADD_SCALED:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] + scalar * b[i];
+            break;
+        case MAP_SUB:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] - b[i];
+            break;
+        case MAP_MUL:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] * b[i];
+            break;
+        case MAP_SCALAR_ADD:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] + scalar;
+            break;
+        case MAP_SCALAR_MUL:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] * scalar;
+            break;
+        case MAP_SCALAR_DIV:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i] / scalar;
+            break;
+        case MAP_APPLY:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = args->f(a[i]);
+            break;
+        case MAP_COPY:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = a[i];
+            break;
+        case MAP_FILL:
+            for(size_t i = begin; i < end; i++)
+                dest[i] = scalar;
+            break;
+    }
+}
+
+static void matrix_map(matrix_map_op op, float *dest, const float *a, const float *b, float scalar, float (*f)(float), size_t n){
+    matrix_map_args args = {op, dest, a, b, scalar, f};
+
+    if(n < MATRIX_PARALLEL_THRESHOLD)
+        matrix_map_range(&args, 0, n);
+    else
+        thread_pool_parallel_for(n, MATRIX_PARALLEL_GRAIN, matrix_map_range, &args);
+}
+
+static void matrix_view_map(matrix_map_op op, const matrix_view *dest, const matrix_view *a, const matrix_view *b, float scalar, float (*f)(float), const char *caller);
+
+// Elementwise operation on whole matrices
+// Operands sharing their stride are one flat loop, padding included, so
+// padded rows are processed as full aligned vectors. Others go row by row.
+static void matrix_map_whole(matrix_map_op op, matrix *dest, const matrix *a, const matrix *b, float scalar, float (*f)(float)){
+    if((a == NULL || a->stride == dest->stride) && (b == NULL || b->stride == dest->stride)){
+        matrix_map(op, dest->data, a == NULL ? NULL : a->data, b == NULL ? NULL : b->data, scalar, f, dest->row * dest->stride);
+        return;
+    }
+
+    matrix_view vd = matrix_view_of(dest);
+    matrix_view va = a == NULL ? vd : matrix_view_of(a);
+    matrix_view vb = b == NULL ? vd : matrix_view_of(b);
+    matrix_view_map(op, &vd, a == NULL ? NULL : &va, b == NULL ? NULL : &vb, scalar, f, "matrix_map_whole");
+}
+
+// Storage
+
+// Zeroed storage for row rows of stride floats, aligned on MATRIX_ALIGNMENT
+static float* matrix_alloc_data(const size_t row, const size_t stride){
+    size_t size = row * stride * sizeof(float);
+    size = (size + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+    if(size == 0)
+        size = MATRIX_ALIGNMENT;
+
+    float *data = aligned_alloc(MATRIX_ALIGNMENT, size);
+    if(data != NULL){
+        memset(data, 0, size);
+        PROFILE_ALLOC(size);
+    }
+    return data;
+}
+
+static matrix* matrix_alloc(const size_t row, const size_t col, const size_t stride, const char *caller){
+    matrix *m = malloc(sizeof(matrix));
+
+    if(m == NULL){
+        fprintf(stderr, "%s: Failed to allocate memory for matrix\n", caller);
+        return NULL;
+    }
+
+    m->row = row;
+    m->col = col;
+    m->stride = stride;
+    m->data = matrix_alloc_data(row, stride);
+    m->owns_data = true;
+    if(m->data == NULL){
+        fprintf(stderr, "%s: Failed to allocate memory for matrix\n", caller);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+size_t matrix_padded_stride(const size_t col){
+    const size_t floats = MATRIX_ALIGNMENT / sizeof(float);
+    return (col + floats - 1) / floats * floats;
+}
+
+matrix* matrix_zeros_padded(const size_t row, const size_t col){
+    return matrix_alloc(row, col, matrix_padded_stride(col), "matrix_zeros_padded");
+}
 
 // Matrix creation and destruction
 matrix* matrix_create(const size_t row, const size_t col, float value){
@@ -13,9 +172,7 @@ matrix* matrix_create(const size_t row, const size_t col, float value){
         return NULL;
     }
 
-    for(size_t i = 0; i < row * col; i++){
-        m->data[i] = value;
-    }
+    matrix_fill(m, value);
     return m;
 }
 
@@ -29,7 +186,7 @@ matrix* matrix_create_from_function(const size_t row, const size_t col, float (*
 
     for(size_t i = 0; i < row; i++){
         for(size_t j = 0; j < col; j++){
-            m->data[i * col + j] = f(i, j);
+            m->data[i * m->stride + j] = f(i, j);
         }
     }
     return m;
@@ -43,15 +200,31 @@ matrix* matrix_create_random(const size_t row, const size_t col, float lower, fl
         return NULL;
     }
 
-    srand(time(NULL));
-    for(size_t i = 0; i < row * col; i++){
-        m->data[i] = (float)rand() / RAND_MAX * (upper - lower) + lower;
+    matrix_fill_random(m, lower, upper);
+    return m;
+}
+
+matrix* matrix_wrap(const size_t row, const size_t col, float *data){
+    matrix *m = malloc(sizeof(matrix));
+
+    if(m == NULL){
+        fprintf(stderr, "matrix_wrap: Failed to allocate memory for matrix\n");
+        return NULL;
     }
+
+    m->row = row;
+    m->col = col;
+    m->stride = col;
+    m->data = data;
+    m->owns_data = false;
     return m;
 }
 
 void matrix_destroy(matrix *m){
-    free(m->data);
+    if(m->owns_data){
+        free(m->data);
+        PROFILE_FREE();
+    }
     free(m);
 }
 
@@ -62,7 +235,7 @@ float matrix_get(const matrix *m, const size_t row, const size_t col){
         return 0;
     }
 
-    return m->data[row * m->col + col];
+    return m->data[row * m->stride + col];
 }
 
 float matrix_set(matrix *m, const size_t row, const size_t col, float val){
@@ -71,7 +244,7 @@ float matrix_set(matrix *m, const size_t row, const size_t col, float val){
         return 0;
     }
 
-    m->data[row * m->col + col] = val;
+    m->data[row * m->stride + col] = val;
     return val;
 }
 
@@ -90,9 +263,7 @@ matrix* matrix_add(const matrix *m1, const matrix *m2){
         return NULL;
     }
 
-    for(size_t i = 0; i < m1->row * m1->col; i++){
-        m->data[i] = m1->data[i] + m2->data[i];
-    }
+    matrix_map_whole(MAP_ADD, m, m1, m2, 0, NULL);
     return m;
 }
 
@@ -102,9 +273,16 @@ void matrix_add_inplace(matrix *dest, const matrix *src){
         return;
     }
 
-    for(size_t i = 0; i < dest->row * dest->col; i++){
-        dest->data[i] += src->data[i];
+    matrix_map_whole(MAP_ADD, dest, dest, src, 0, NULL);
+}
+
+void matrix_add_scaled_inplace(matrix *dest, const matrix *src, float alpha){
+    if(dest->row != src->row || dest->col != src->col){
+        fprintf(stderr, "matrix_add_scaled_inplace: Matrix dimensions do not match\n");
+        return;
     }
+
+    matrix_map_whole(MAP_ADD_SCALED, dest, dest, src, alpha, NULL);
 }
 
 matrix* matrix_sub(const matrix *m1, const matrix *m2){
@@ -120,9 +298,7 @@ matrix* matrix_sub(const matrix *m1, const matrix *m2){
         return NULL;
     }
 
-    for(size_t i = 0; i < m1->row * m1->col; i++){
-        m->data[i] = m1->data[i] - m2->data[i];
-    }
+    matrix_map_whole(MAP_SUB, m, m1, m2, 0, NULL);
     return m;
 }
 
@@ -132,9 +308,7 @@ void matrix_sub_inplace(matrix *dest, const matrix *src){
         return;
     }
 
-    for(size_t i = 0; i < dest->row * dest->col; i++){
-        dest->data[i] -= src->data[i];
-    }
+    matrix_map_whole(MAP_SUB, dest, dest, src, 0, NULL);
 }
 
 matrix* matrix_mul(const matrix *m1, const matrix *m2){
@@ -150,16 +324,69 @@ matrix* matrix_mul(const matrix *m1, const matrix *m2){
         return NULL;
     }
 
-    for(size_t i = 0; i < m1->row; i++){
-        for(size_t j = 0; j < m2->col; j++){
-            for(size_t k = 0; k < m1->col; k++){
-                m->data[i * m->col + j] += m1->data[i * m1->col + k] * m2->data[k * m2->col + j];
-            }
-        }
+    gemm(m1->row, m2->col, m1->col, 1,
+         m1->data, m1->stride, 1,
+         m2->data, m2->stride, 1,
+         0, m->data, m->stride, 1);
+    return m;
+}
+
+// Allocates and computes op(m1) * op(m2), op transposing its operand when the flag is set
+static matrix* matrix_mul_transposed(const matrix *m1, bool transpose1, const matrix *m2, bool transpose2, const char *caller){
+    size_t row = transpose1 ? m1->col : m1->row;
+    size_t col = transpose2 ? m2->row : m2->col;
+    size_t inner1 = transpose1 ? m1->row : m1->col;
+    size_t inner2 = transpose2 ? m2->col : m2->row;
+
+    if(inner1 != inner2){
+        fprintf(stderr, "%s: Matrix dimensions do not match\n", caller);
+        return NULL;
     }
+
+    matrix *m = matrix_zeros(row, col);
+
+    if(m == NULL){
+        fprintf(stderr, "%s: Failed to allocate memory for matrix\n", caller);
+        return NULL;
+    }
+
+    matrix_mul_to(m, m1, transpose1, m2, transpose2, 1, 0);
     return m;
 }
 
+matrix* matrix_mul_nt(const matrix *m1, const matrix *m2){
+    return matrix_mul_transposed(m1, false, m2, true, "matrix_mul_nt");
+}
+
+matrix* matrix_mul_tn(const matrix *m1, const matrix *m2){
+    return matrix_mul_transposed(m1, true, m2, false, "matrix_mul_tn");
+}
+
+matrix* matrix_mul_tt(const matrix *m1, const matrix *m2){
+    return matrix_mul_transposed(m1, true, m2, true, "matrix_mul_tt");
+}
+
+void matrix_mul_to(matrix *dest, const matrix *m1, bool transpose1, const matrix *m2, bool transpose2, float alpha, float beta){
+    size_t row = transpose1 ? m1->col : m1->row;
+    size_t col = transpose2 ? m2->row : m2->col;
+    size_t inner = transpose1 ? m1->row : m1->col;
+
+    if(inner != (transpose2 ? m2->col : m2->row) || dest->row != row || dest->col != col){
+        fprintf(stderr, "matrix_mul_to: Matrix dimensions do not match\n");
+        return;
+    }
+
+    // A transposed operand is the same storage read with its strides swapped
+    gemm(row, col, inner, alpha,
+         m1->data, transpose1 ? 1 : m1->stride, transpose1 ? m1->stride : 1,
+         m2->data, transpose2 ? 1 : m2->stride, transpose2 ? m2->stride : 1,
+         beta, dest->data, dest->stride, 1);
+}
+
+void matrix_mul_add_nt(matrix *dest, float alpha, const matrix *m1, const matrix *m2){
+    matrix_mul_to(dest, m1, false, m2, true, alpha, 1);
+}
+
 matrix* matrix_scalar_add(const matrix *m, float scalar){
     matrix *res = matrix_get_copy(m);
 
@@ -173,9 +400,7 @@ matrix* matrix_scalar_add(const matrix *m, float scalar){
 }
 
 void matrix_scalar_add_inplace(matrix *m, float scalar){
-    for(size_t i = 0; i < m->row * m->col; i++){
-        m->data[i] += scalar;
-    }
+    matrix_map_whole(MAP_SCALAR_ADD, m, m, NULL, scalar, NULL);
 }
 
 matrix* matrix_scalar_sub(const matrix *m, float scalar){
@@ -191,9 +416,7 @@ matrix* matrix_scalar_sub(const matrix *m, float scalar){
 }
 
 void matrix_scalar_sub_inplace(matrix *m, float scalar){
-    for(size_t i = 0; i < m->row * m->col; i++){
-        m->data[i] -= scalar;
-    }
+    matrix_map_whole(MAP_SCALAR_ADD, m, m, NULL, -scalar, NULL);
 }
 
 matrix* matrix_scalar_mul(const matrix *m, float scalar){
@@ -209,9 +432,7 @@ matrix* matrix_scalar_mul(const matrix *m, float scalar){
 }
 
 void matrix_scalar_mul_inplace(matrix *m, float scalar){
-    for(size_t i = 0; i < m->row * m->col; i++){
-        m->data[i] *= scalar;
-    }
+    matrix_map_whole(MAP_SCALAR_MUL, m, m, NULL, scalar, NULL);
 }
 
 matrix* matrix_scalar_div(const matrix *m, float scalar){
@@ -227,9 +448,7 @@ matrix* matrix_scalar_div(const matrix *m, float scalar){
 }
 
 void matrix_scalar_div_inplace(matrix *m, float scalar){
-    for(size_t i = 0; i < m->row * m->col; i++){
-        m->data[i] /= scalar;
-    }
+    matrix_map_whole(MAP_SCALAR_DIV, m, m, NULL, scalar, NULL);
 }
 
 matrix* matrix_dot(const matrix *m1, const matrix *m2){
@@ -240,18 +459,41 @@ matrix* matrix_dot(const matrix *m1, const matrix *m2){
         return NULL;
     }
 
-    for(size_t i = 0; i < m1->row; i++){
-        for(size_t j = 0; j < m2->col; j++){
-            m->data[i * m->col + j] = m1->data[i * m1->col + j] * m2->data[i * m2->col + j];
-        }
-    }
+    matrix_map_whole(MAP_MUL, m, m1, m2, 0, NULL);
     return m;
 }
 
 void matrix_dot_inplace(matrix *dest, const matrix *src){
     // element by element multiplication
-    for(size_t i = 0; i < dest->row * dest->col; i++){
-        dest->data[i] *= src->data[i];
+    matrix_map_whole(MAP_MUL, dest, dest, src, 0, NULL);
+}
+
+// Transpose works on square tiles so both the reads and the writes stay in cache
+#define MATRIX_TRANSPOSE_BLOCK 32
+
+typedef struct matrix_transpose_args{
+    const matrix *src;
+    matrix *dest;
+} matrix_transpose_args;
+
+// Transposes the row blocks [begin, end) of src
+static void matrix_transpose_range(void *arg, size_t begin, size_t end){
+    const matrix_transpose_args *args = arg;
+    const matrix *m = args->src;
+    matrix *res = args->dest;
+
+    for(size_t ib = begin * MATRIX_TRANSPOSE_BLOCK; ib < end * MATRIX_TRANSPOSE_BLOCK && ib < m->row; ib += MATRIX_TRANSPOSE_BLOCK){
+        size_t ie = ib + MATRIX_TRANSPOSE_BLOCK < m->row ? ib + MATRIX_TRANSPOSE_BLOCK : m->row;
+
+        for(size_t jb = 0; jb < m->col; jb += MATRIX_TRANSPOSE_BLOCK){
+            size_t je = jb + MATRIX_TRANSPOSE_BLOCK < m->col ? jb + MATRIX_TRANSPOSE_BLOCK : m->col;
+
+            for(size_t i = ib; i < ie; i++){
+                for(size_t j = jb; j < je; j++){
+                    res->data[j * res->stride + i] = m->data[i * m->stride + j];
+                }
+            }
+        }
     }
 }
 
@@ -263,17 +505,33 @@ matrix* matrix_transpose(const matrix *m){
         return NULL;
     }
 
-    for(size_t i = 0; i < m->row; i++){
-        for(size_t j = 0; j < m->col; j++){
-            res->data[j * res->col + i] = m->data[i * m->col + j];
-        }
-    }
+    matrix_transpose_args args = {m, res};
+    size_t nb_blocks = (m->row + MATRIX_TRANSPOSE_BLOCK - 1) / MATRIX_TRANSPOSE_BLOCK;
+
+    if(m->row * m->col < MATRIX_PARALLEL_THRESHOLD)
+        matrix_transpose_range(&args, 0, nb_blocks);
+    else
+        thread_pool_parallel_for(nb_blocks, 1, matrix_transpose_range, &args);
     return res;
 }
 
 void matrix_apply(const matrix *m, float (*f)(float)){
-    for(size_t i = 0; i < m->row * m->col; i++){
-        m->data[i] = f(m->data[i]);
+    matrix_map_whole(MAP_APPLY, (matrix*) m, m, NULL, 0, f);
+}
+
+void matrix_row_sums_to(matrix *dest, const matrix *m, float alpha, float beta){
+    if(dest->row * dest->col != m->row){
+        fprintf(stderr, "matrix_row_sums_to: Matrix dimensions do not match\n");
+        return;
+    }
+
+    for(size_t i = 0; i < m->row; i++){
+        float sum = 0;
+        for(size_t j = 0; j < m->col; j++)
+            sum += m->data[i * m->stride + j];
+        // dest is a column or a row
+        float *d = dest->data + (dest->col == 1 ? i * dest->stride : i);
+        *d = beta == 0 ? alpha * sum : alpha * sum + beta * *d;
     }
 }
 
@@ -282,9 +540,11 @@ bool matrix_equals(const matrix *m1, const matrix *m2){
     if(m1->row != m2->row || m1->col != m2->col){
         return false;
     }
-    for(size_t i = 0; i < m1->row * m1->col; i++){
-        if(m1->data[i] != m2->data[i]){
-            return false;
+    for(size_t i = 0; i < m1->row; i++){
+        for(size_t j = 0; j < m1->col; j++){
+            if(m1->data[i * m1->stride + j] != m2->data[i * m2->stride + j]){
+                return false;
+            }
         }
     }
     return true;
@@ -300,7 +560,7 @@ matrix* matrix_get_row(const matrix *m, const size_t row){
     }
 
     for(size_t i = 0; i < m->col; i++){
-        res->data[i] = m->data[row * m->col + i];
+        res->data[i] = m->data[row * m->stride + i];
     }
     return res;
 }
@@ -314,20 +574,35 @@ matrix* matrix_get_col(const matrix *m, const size_t col){
     }
 
     for(size_t i = 0; i < m->row; i++){
-        res->data[i] = m->data[i * m->col + col];
+        res->data[i * res->stride] = m->data[i * m->stride + col];
     }
     return res;
 }
 
+void matrix_gather_cols_to(const matrix *m, const size_t *cols, matrix *dest){
+    if(m->row != dest->row){
+        fprintf(stderr, "matrix_gather_cols_to: Matrix dimensions do not match\n");
+        return;
+    }
+
+    for(size_t i = 0; i < m->row; i++){
+        const float *src_row = m->data + i * m->stride;
+        float *dest_row = dest->data + i * dest->stride;
+        for(size_t j = 0; j < dest->col; j++){
+            dest_row[j] = src_row[cols[j]];
+        }
+    }
+}
+
 void matrix_set_row(matrix *m, const float *row, const size_t row_index){
     for(size_t i = 0; i < m->col; i++){
-        m->data[row_index * m->col + i] = row[i];
+        m->data[row_index * m->stride + i] = row[i];
     }
 }
 
 void matrix_set_col(matrix *m, const float *col, const size_t col_index){
     for(size_t i = 0; i < m->row; i++){
-        m->data[i * m->col + col_index] = col[i];
+        m->data[i * m->stride + col_index] = col[i];
     }
 }
 
@@ -335,15 +610,26 @@ void matrix_set_col(matrix *m, const float *col, const size_t col_index){
 void matrix_print(const matrix *m){
     for(size_t i = 0; i < m->row; i++){
         for(size_t j = 0; j < m->col; j++){
-            printf("%f ", m->data[i * m->col + j]);
+            printf("%f ", m->data[i * m->stride + j]);
         }
         printf("\n");
     }
 }
 
 void matrix_fill(matrix *m, float value){
-    for(size_t i = 0; i < m->row * m->col; i++)
-        m->data[i] = value;
+    matrix_map_whole(MAP_FILL, m, NULL, NULL, value, NULL);
+}
+
+void matrix_fill_random(matrix *m, float lower, float upper){
+    random_stream s = random_new_stream();
+
+    // Element (i, j) takes value i * col + j of the stream, whatever the stride
+    if(m->stride == m->col){
+        random_uniform(m->data, m->row * m->col, &s, 0, lower, upper);
+        return;
+    }
+    for(size_t i = 0; i < m->row; i++)
+        random_uniform(m->data + i * m->stride, m->col, &s, (uint64_t) i * m->col, lower, upper);
 }
 
 void matrix_copy_to(const matrix *src, matrix *dest){
@@ -351,9 +637,7 @@ void matrix_copy_to(const matrix *src, matrix *dest){
         fprintf(stderr, "matrix_copy_to: Matrix dimensions do not match\n");
         return;
     }
-    for(size_t i = 0; i < src->row * src->col; i++){
-        dest->data[i] = src->data[i];
-    }
+    matrix_map_whole(MAP_COPY, dest, src, NULL, 0, NULL);
 }
 
 matrix* matrix_get_copy(const matrix *m){
@@ -372,14 +656,18 @@ matrix matrix_resize(const matrix *m, const size_t row, const size_t col){
     matrix res;
     res.row = row;
     res.col = col;
-    res.data = calloc(row * col, sizeof(float));
-    for(size_t i = 0; i < row; i++){
-        for(size_t j = 0; j < col; j++){
-            if(i < m->row && j < m->col){
-                res.data[i * col + j] = m->data[i * m->col + j];
-            }
-        }
-    }
+    res.stride = col;
+    res.data = matrix_alloc_data(row, col);
+    res.owns_data = true;
+
+    // copy the block both matrices have in common
+    size_t rows = row < m->row ? row : m->row;
+    size_t cols = col < m->col ? col : m->col;
+    matrix_view src = matrix_view_of(m);
+    matrix_view dest = matrix_view_of(&res);
+    src = matrix_view_block(&src, 0, 0, rows, cols);
+    dest = matrix_view_block(&dest, 0, 0, rows, cols);
+    matrix_view_copy_to(&src, &dest);
     return res;
 }
 
@@ -393,23 +681,13 @@ matrix* matrix_identity(const size_t size){
     }
 
     for(size_t i = 0; i < size; i++){
-        m->data[i * size + i] = 1;
+        m->data[i * m->stride + i] = 1;
     }
     return m;
 }
 
 matrix* matrix_zeros(const size_t row, const size_t col){
-    matrix *m = malloc(sizeof(matrix));
-
-    if(m == NULL){
-        fprintf(stderr, "matrix_zeros: Failed to allocate memory for matrix\n");
-        return NULL;
-    }
-
-    m->row = row;
-    m->col = col;
-    m->data = calloc(row * col, sizeof(float));
-    return m;
+    return matrix_alloc(row, col, col, "matrix_zeros");
 }
 
 matrix* matrix_ones(const size_t row, const size_t col){
@@ -422,4 +700,193 @@ matrix* matrix_ones(const size_t row, const size_t col){
 
     matrix_fill(m, 1);
     return m;
-}
\ No newline at end of file
+}
+// Matrix views
+matrix_view matrix_view_of(const matrix *m){
+    matrix_view v = {m->row, m->col, m->data, m->stride, 1};
+    return v;
+}
+
+matrix_view matrix_view_rows(const matrix *m, const size_t first, const size_t count){
+    matrix_view v = matrix_view_of(m);
+    return matrix_view_block(&v, first, 0, count, m->col);
+}
+
+matrix_view matrix_view_cols(const matrix *m, const size_t first, const size_t count){
+    matrix_view v = matrix_view_of(m);
+    return matrix_view_block(&v, 0, first, m->row, count);
+}
+
+matrix_view matrix_view_block(const matrix_view *v, const size_t row, const size_t col, const size_t rows, const size_t cols){
+    matrix_view res = {0, 0, NULL, 0, 0};
+
+    if(row > v->row || col > v->col || rows > v->row - row || cols > v->col - col){
+        fprintf(stderr, "matrix_view_block: Block out of bounds\n");
+        return res;
+    }
+
+    res.row = rows;
+    res.col = cols;
+    res.data = v->data + row * v->rs + col * v->cs;
+    res.rs = v->rs;
+    res.cs = v->cs;
+    return res;
+}
+
+matrix_view matrix_view_transpose(const matrix_view *v){
+    matrix_view res = {v->col, v->row, v->data, v->cs, v->rs};
+    return res;
+}
+
+matrix* matrix_view_copy(const matrix_view *v){
+    matrix *res = matrix_zeros(v->row, v->col);
+
+    if(res == NULL){
+        fprintf(stderr, "matrix_view_copy: Failed to allocate memory for matrix\n");
+        return NULL;
+    }
+
+    matrix_view dest = matrix_view_of(res);
+    matrix_view_copy_to(v, &dest);
+    return res;
+}
+
+// Elementwise kernels on views
+// Rows whose elements are all contiguous go through matrix_map_range, other
+// views are walked in square tiles so transposed operands stay in cache.
+
+typedef struct matrix_view_map_args{
+    matrix_map_op op;
+    const matrix_view *dest;
+    const matrix_view *a;
+    const matrix_view *b;
+    float scalar;
+    float (*f)(float);
+} matrix_view_map_args;
+
+static inline float matrix_map_value(matrix_map_op op, float a, float b, float scalar, float (*f)(float)){
+    switch(op){
+        case MAP_ADD: return a + b;
+        case MAP_ADD_SCALED: return a + scalar * b;
+        case MAP_SUB: return a - b;
+        case MAP_MUL: return a * b;
+        case MAP_SCALAR_ADD: return a + scalar;
+        case MAP_SCALAR_MUL: return a * scalar;
+        case MAP_SCALAR_DIV: return a / scalar;
+        case MAP_APPLY: return f(a);
+        case MAP_COPY: return a;
+        case MAP_FILL: return scalar;
+    }
+    return 0;
+}
+
+// Processes the row blocks [begin, end) of the views
+static void matrix_view_map_range(void *arg, size_t begin, size_t end){
+    const matrix_view_map_args *args = arg;
+    const matrix_view *d = args->dest;
+    const matrix_view *a = args->a;
+    const matrix_view *b = args->b;
+    size_t row_begin = begin * MATRIX_TRANSPOSE_BLOCK;
+    size_t row_end = end * MATRIX_TRANSPOSE_BLOCK < d->row ? end * MATRIX_TRANSPOSE_BLOCK : d->row;
+
+    if(d->cs == 1 && (a == NULL || a->cs == 1) && (b == NULL || b->cs == 1)){
+        for(size_t i = row_begin; i < row_end; i++){
+            matrix_map_args row = {
+                args->op,
+                d->data + i * d->rs,
+                a == NULL ? NULL : a->data + i * a->rs,
+                b == NULL ? NULL : b->data + i * b->rs,
+                args->scalar,
+                args->f
+            };
+            matrix_map_range(&row, 0, d->col);
+        }
+        return;
+    }
+
+    for(size_t ib = row_begin; ib < row_end; ib += MATRIX_TRANSPOSE_BLOCK){
+        size_t ie = ib + MATRIX_TRANSPOSE_BLOCK < row_end ? ib + MATRIX_TRANSPOSE_BLOCK : row_end;
+
+        for(size_t jb = 0; jb < d->col; jb += MATRIX_TRANSPOSE_BLOCK){
+            size_t je = jb + MATRIX_TRANSPOSE_BLOCK < d->col ? jb + MATRIX_TRANSPOSE_BLOCK : d->col;
+
+            for(size_t i = ib; i < ie; i++){
+                for(size_t j = jb; j < je; j++){
+                    float va = a == NULL ? 0 : a->data[i * a->rs + j * a->cs];
+                    float vb = b == NULL ? 0 : b->data[i * b->rs + j * b->cs];
+                    d->data[i * d->rs + j * d->cs] = matrix_map_value(args->op, va, vb, args->scalar, args->f);
+                }
+            }
+        }
+    }
+}
+
+// A view covering its data without gaps, in row-major order
+static bool matrix_view_is_dense(const matrix_view *v){
+    return v->cs == 1 && (v->rs == v->col || v->row == 1);
+}
+
+static void matrix_view_map(matrix_map_op op, const matrix_view *dest, const matrix_view *a, const matrix_view *b, float scalar, float (*f)(float), const char *caller){
+    if((a != NULL && (a->row != dest->row || a->col != dest->col)) || (b != NULL && (b->row != dest->row || b->col != dest->col))){
+        fprintf(stderr, "%s: Matrix dimensions do not match\n", caller);
+        return;
+    }
+
+    // Whole matrices are a single flat loop
+    if(matrix_view_is_dense(dest) && (a == NULL || matrix_view_is_dense(a)) && (b == NULL || matrix_view_is_dense(b))){
+        matrix_map(op, dest->data, a == NULL ? NULL : a->data, b == NULL ? NULL : b->data, scalar, f, dest->row * dest->col);
+        return;
+    }
+
+    matrix_view_map_args args = {op, dest, a, b, scalar, f};
+    size_t nb_blocks = (dest->row + MATRIX_TRANSPOSE_BLOCK - 1) / MATRIX_TRANSPOSE_BLOCK;
+
+    if(dest->row * dest->col < MATRIX_PARALLEL_THRESHOLD)
+        matrix_view_map_range(&args, 0, nb_blocks);
+    else
+        thread_pool_parallel_for(nb_blocks, 1, matrix_view_map_range, &args);
+}
+
+void matrix_view_add(const matrix_view *dest, const matrix_view *a, const matrix_view *b){
+    matrix_view_map(MAP_ADD, dest, a, b, 0, NULL, "matrix_view_add");
+}
+
+void matrix_view_sub(const matrix_view *dest, const matrix_view *a, const matrix_view *b){
+    matrix_view_map(MAP_SUB, dest, a, b, 0, NULL, "matrix_view_sub");
+}
+
+void matrix_view_dot(const matrix_view *dest, const matrix_view *a, const matrix_view *b){
+    matrix_view_map(MAP_MUL, dest, a, b, 0, NULL, "matrix_view_dot");
+}
+
+void matrix_view_add_scaled(const matrix_view *dest, const matrix_view *src, float alpha){
+    matrix_view_map(MAP_ADD_SCALED, dest, dest, src, alpha, NULL, "matrix_view_add_scaled");
+}
+
+void matrix_view_scalar_mul(const matrix_view *dest, float scalar){
+    matrix_view_map(MAP_SCALAR_MUL, dest, dest, NULL, scalar, NULL, "matrix_view_scalar_mul");
+}
+
+void matrix_view_apply(const matrix_view *dest, float (*f)(float)){
+    matrix_view_map(MAP_APPLY, dest, dest, NULL, 0, f, "matrix_view_apply");
+}
+
+void matrix_view_fill(const matrix_view *dest, float value){
+    matrix_view_map(MAP_FILL, dest, NULL, NULL, value, NULL, "matrix_view_fill");
+}
+
+void matrix_view_copy_to(const matrix_view *src, const matrix_view *dest){
+    matrix_view_map(MAP_COPY, dest, src, NULL, 0, NULL, "matrix_view_copy_to");
+}
+
+void matrix_view_mul_to(const matrix_view *dest, const matrix_view *a, const matrix_view *b, float alpha, float beta){
+    if(a->col != b->row || dest->row != a->row || dest->col != b->col){
+        fprintf(stderr, "matrix_view_mul_to: Matrix dimensions do not match\n");
+        return;
+    }
+
+    gemm(dest->row, dest->col, a->col, alpha,
+         a->data, a->rs, a->cs,
+         b->data, b->rs, b->cs,
+         beta, dest->data, dest->rs, dest->cs);
+}
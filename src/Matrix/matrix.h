@@ -2,17 +2,43 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+// Alignment of the matrix storage, in bytes (one cache line, a whole AVX-512 vector)
+#define MATRIX_ALIGNMENT 64
+
+// Element (i, j) lives at data[i * stride + j]. The elements between col and
+// stride are padding: they belong to the matrix and kernels may overwrite them,
+// so elementwise loops run over whole aligned rows without remainder handling.
 typedef struct matrix
 {
     size_t row;
     size_t col;
+    size_t stride;      // distance between the starts of two rows, at least col
     float *data;
+    bool owns_data;     // false when data belongs to someone else (e.g. a mapped model file)
 } matrix;
 
+// Non-owning window over the data of a matrix
+// Element (i, j) lives at data[i * rs + j * cs], so row ranges, column ranges,
+// blocks and transposes all share the data of the matrix they come from.
+typedef struct matrix_view
+{
+    size_t row;
+    size_t col;
+    float *data;
+    size_t rs;          // row stride
+    size_t cs;          // column stride
+} matrix_view;
+
 // Matrix creation and destruction
 matrix* matrix_create(const size_t row, const size_t col, float value);
 matrix* matrix_create_from_function(const size_t row, const size_t col, float (*f)(size_t, size_t));
 matrix* matrix_create_random(const size_t row, const size_t col, float lower, float upper);
+// Matrix over existing data, which matrix_destroy leaves alone
+matrix* matrix_wrap(const size_t row, const size_t col, float *data);
+// Zero matrix whose rows all start on a MATRIX_ALIGNMENT boundary
+matrix* matrix_zeros_padded(const size_t row, const size_t col);
+// Stride of the rows of matrix_zeros_padded
+size_t matrix_padded_stride(const size_t col);
 void matrix_destroy(matrix *m);
 
 // Matrix setter and getter
@@ -22,11 +48,21 @@ float matrix_set(matrix *m, const size_t row, const size_t col, float val);
 // Matrix operations
 matrix* matrix_add(const matrix *m1, const matrix *m2);
 void matrix_add_inplace(matrix *dest, const matrix *src);
+// dest += alpha * src
+void matrix_add_scaled_inplace(matrix *dest, const matrix *src, float alpha);
 
 matrix* matrix_sub(const matrix *m1, const matrix *m2);
 void matrix_sub_inplace(matrix *dest, const matrix *src);
 
 matrix* matrix_mul(const matrix *m1, const matrix *m2);
+// Products with transposed operands, reading m1 / m2 in place instead of transposing them
+matrix* matrix_mul_nt(const matrix *m1, const matrix *m2);
+matrix* matrix_mul_tn(const matrix *m1, const matrix *m2);
+matrix* matrix_mul_tt(const matrix *m1, const matrix *m2);
+// dest = alpha * op(m1) * op(m2) + beta * dest, op transposing its operand when the flag is set
+void matrix_mul_to(matrix *dest, const matrix *m1, bool transpose1, const matrix *m2, bool transpose2, float alpha, float beta);
+// dest += alpha * m1 * m2^T
+void matrix_mul_add_nt(matrix *dest, float alpha, const matrix *m1, const matrix *m2);
 
 matrix* matrix_scalar_add(const matrix *m, float scalar);
 void matrix_scalar_add_inplace(matrix *m, float scalar);
@@ -47,12 +83,17 @@ matrix* matrix_transpose(const matrix *m);
 
 void matrix_apply(const matrix *m, float (*f)(float));
 
+// dest = alpha * (sum of every row of m) + beta * dest, dest being a row x 1 column
+void matrix_row_sums_to(matrix *dest, const matrix *m, float alpha, float beta);
+
 // Matrix comparison
 bool matrix_equals(const matrix *m1, const matrix *m2);
 
 // Raw and column operations
 matrix* matrix_get_row(const matrix *m, const size_t row);
 matrix* matrix_get_col(const matrix *m, const size_t col);
+// Copies the columns cols[0..dest->col) of m into dest, without allocating
+void matrix_gather_cols_to(const matrix *m, const size_t *cols, matrix *dest);
 
 void matrix_set_row(matrix *m, const float *row, const size_t row_index);
 void matrix_set_col(matrix *m, const float *col, const size_t col_index);
@@ -60,12 +101,39 @@ void matrix_set_col(matrix *m, const float *col, const size_t col_index);
 // Matrix utility functions
 void matrix_print(const matrix *m);
 void matrix_fill(matrix *m, float value);
+// Uniform values in [lower, upper) from a new stream of src/Matrix/random
+void matrix_fill_random(matrix *m, float lower, float upper);
 
 void matrix_copy_to(const matrix *src, matrix *dest);
 matrix* matrix_get_copy(const matrix *m);
 
 matrix matrix_resize(const matrix *m, const size_t row, const size_t col);
 
+// Matrix views
+// Taking a view never copies. Out of range requests give an empty view.
+matrix_view matrix_view_of(const matrix *m);
+matrix_view matrix_view_rows(const matrix *m, const size_t first, const size_t count);
+matrix_view matrix_view_cols(const matrix *m, const size_t first, const size_t count);
+matrix_view matrix_view_block(const matrix_view *v, const size_t row, const size_t col, const size_t rows, const size_t cols);
+matrix_view matrix_view_transpose(const matrix_view *v);
+// Copies a view into a new matrix
+matrix* matrix_view_copy(const matrix_view *v);
+
+// View operations
+// dest has the shape of the operands and must not overlap them, unless it is the same view.
+void matrix_view_add(const matrix_view *dest, const matrix_view *a, const matrix_view *b);
+void matrix_view_sub(const matrix_view *dest, const matrix_view *a, const matrix_view *b);
+void matrix_view_dot(const matrix_view *dest, const matrix_view *a, const matrix_view *b);
+// dest += alpha * src
+void matrix_view_add_scaled(const matrix_view *dest, const matrix_view *src, float alpha);
+void matrix_view_scalar_mul(const matrix_view *dest, float scalar);
+void matrix_view_apply(const matrix_view *dest, float (*f)(float));
+void matrix_view_fill(const matrix_view *dest, float value);
+// dest = src, a transposed src view making it a transposition
+void matrix_view_copy_to(const matrix_view *src, const matrix_view *dest);
+// dest = alpha * a * b + beta * dest
+void matrix_view_mul_to(const matrix_view *dest, const matrix_view *a, const matrix_view *b, float alpha, float beta);
+
 // Special Matrices
 matrix* matrix_identity(const size_t size);
 matrix* matrix_zeros(const size_t row, const size_t col);
@@ -0,0 +1,237 @@
+/**
+ * @file optimizer.c
+ * @brief Fused SGD, Nesterov, Adam and AdamW updates.
+ *
+ * Every update is one pass over the parameters, the gradient and the state,
+ * with an AVX2/FMA version picked at runtime and a plain C fallback. Operands
+ * sharing their stride are one flat loop, padding included (it stays zero),
+ * others go row by row. Large parameters are split over the thread pool.
+ */
+
+#include "optimizer.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OPTIMIZER_X86 1
+#endif
+
+// Below this many elements, an update stays on the calling thread
+#define OPTIMIZER_PARALLEL_THRESHOLD (1 << 15)
+#define OPTIMIZER_PARALLEL_GRAIN (1 << 12)
+
+static const char *optimizer_names[] = {"sgd", "nesterov", "adam", "adamw"};
+
+// Constants of one update
+typedef struct optimizer_args{
+    optimizer_type type;
+    bool momentum;      // SGD keeping a velocity
+    float lr;
+    float scale;
+    float mu;
+    float decay;        // L2 coefficient added to the gradient
+    float shrink;       // AdamW factor of the weights before the update
+    float beta1;
+    float beta2;
+    float step_size;    // learning rate over the bias correction of the first moment
+    float rsqrt_c2;     // 1 / sqrt of the bias correction of the second moment
+    float epsilon;
+    matrix *params;
+    const matrix *direction;
+    matrix *s0;
+    matrix *s1;
+} optimizer_args;
+
+static bool optimizer_use_avx2(void){
+#ifdef OPTIMIZER_X86
+    static int supported = -1;
+    if(supported < 0){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+size_t optimizer_nb_states(const optimizer *opt){
+    switch(opt->type){
+        case OPTIMIZER_SGD:
+            return opt->momentum != 0 ? 1 : 0;
+        case OPTIMIZER_NESTEROV:
+            return 1;
+        case OPTIMIZER_ADAM:
+        case OPTIMIZER_ADAMW:
+            return 2;
+    }
+    return 0;
+}
+
+const char* optimizer_name(optimizer_type type){
+    return optimizer_names[type];
+}
+
+int optimizer_from_name(const char *name){
+    for(size_t i = 0; i < sizeof(optimizer_names) / sizeof(optimizer_names[0]); i++){
+        if(strcmp(name, optimizer_names[i]) == 0)
+            return (int) i;
+    }
+    return -1;
+}
+
+// Scalar kernel
+
+static void optimizer_update_scalar(const optimizer_args *a, float *w, const float *d, float *s0, float *s1, size_t n){
+    for(size_t i = 0; i < n; i++){
+        float g = a->decay * w[i] - a->scale * d[i];
+        switch(a->type){
+            case OPTIMIZER_SGD:
+                if(a->momentum){
+                    s0[i] = a->mu * s0[i] + g;
+                    g = s0[i];
+                }
+                w[i] -= a->lr * g;
+                break;
+            case OPTIMIZER_NESTEROV:
+                s0[i] = a->mu * s0[i] + g;
+                w[i] -= a->lr * (g + a->mu * s0[i]);
+                break;
+            case OPTIMIZER_ADAM:
+            case OPTIMIZER_ADAMW:
+                s0[i] = a->beta1 * s0[i] + (1 - a->beta1) * g;
+                s1[i] = a->beta2 * s1[i] + (1 - a->beta2) * g * g;
+                w[i] = a->shrink * w[i] - a->step_size * s0[i] / (sqrtf(s1[i]) * a->rsqrt_c2 + a->epsilon);
+                break;
+        }
+    }
+}
+
+// AVX2 kernel
+
+#ifdef OPTIMIZER_X86
+__attribute__((target("avx2,fma")))
+static void optimizer_update_avx2(const optimizer_args *a, float *w, const float *d, float *s0, float *s1, size_t n){
+    __m256 decay = _mm256_set1_ps(a->decay), scale = _mm256_set1_ps(a->scale);
+    __m256 lr = _mm256_set1_ps(a->lr), mu = _mm256_set1_ps(a->mu);
+    __m256 beta1 = _mm256_set1_ps(a->beta1), one_beta1 = _mm256_set1_ps(1 - a->beta1);
+    __m256 beta2 = _mm256_set1_ps(a->beta2), one_beta2 = _mm256_set1_ps(1 - a->beta2);
+    __m256 shrink = _mm256_set1_ps(a->shrink), step_size = _mm256_set1_ps(a->step_size);
+    __m256 rsqrt_c2 = _mm256_set1_ps(a->rsqrt_c2), epsilon = _mm256_set1_ps(a->epsilon);
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8){
+        __m256 wv = _mm256_loadu_ps(w + i);
+        // g = decay * w - scale * d
+        __m256 g = _mm256_fnmadd_ps(scale, _mm256_loadu_ps(d + i), _mm256_mul_ps(decay, wv));
+        switch(a->type){
+            case OPTIMIZER_SGD:
+                if(a->momentum){
+                    g = _mm256_fmadd_ps(mu, _mm256_loadu_ps(s0 + i), g);
+                    _mm256_storeu_ps(s0 + i, g);
+                }
+                wv = _mm256_fnmadd_ps(lr, g, wv);
+                break;
+            case OPTIMIZER_NESTEROV:{
+                __m256 v = _mm256_fmadd_ps(mu, _mm256_loadu_ps(s0 + i), g);
+                _mm256_storeu_ps(s0 + i, v);
+                wv = _mm256_fnmadd_ps(lr, _mm256_fmadd_ps(mu, v, g), wv);
+                break;
+            }
+            case OPTIMIZER_ADAM:
+            case OPTIMIZER_ADAMW:{
+                __m256 m = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(s0 + i), _mm256_mul_ps(one_beta1, g));
+                __m256 v = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(s1 + i), _mm256_mul_ps(one_beta2, _mm256_mul_ps(g, g)));
+                _mm256_storeu_ps(s0 + i, m);
+                _mm256_storeu_ps(s1 + i, v);
+                __m256 denominator = _mm256_fmadd_ps(_mm256_sqrt_ps(v), rsqrt_c2, epsilon);
+                wv = _mm256_fnmadd_ps(step_size, _mm256_div_ps(m, denominator), _mm256_mul_ps(shrink, wv));
+                break;
+            }
+        }
+        _mm256_storeu_ps(w + i, wv);
+    }
+
+    optimizer_update_scalar(a, w + i, d + i, s0 == NULL ? NULL : s0 + i, s1 == NULL ? NULL : s1 + i, n - i);
+}
+#endif
+
+static void optimizer_update(const optimizer_args *a, float *w, const float *d, float *s0, float *s1, size_t n){
+#ifdef OPTIMIZER_X86
+    if(optimizer_use_avx2()){
+        optimizer_update_avx2(a, w, d, s0, s1, n);
+        return;
+    }
+#endif
+    optimizer_update_scalar(a, w, d, s0, s1, n);
+}
+
+// Elements [begin, end) of operands sharing their stride
+static void optimizer_flat_range(void *arg, size_t begin, size_t end){
+    optimizer_args *a = arg;
+    optimizer_update(a, a->params->data + begin, a->direction->data + begin,
+                     a->s0 == NULL ? NULL : a->s0->data + begin, a->s1 == NULL ? NULL : a->s1->data + begin, end - begin);
+}
+
+// Rows [begin, end) of operands with different strides
+static void optimizer_rows_range(void *arg, size_t begin, size_t end){
+    optimizer_args *a = arg;
+    for(size_t i = begin; i < end; i++){
+        optimizer_update(a, a->params->data + i * a->params->stride, a->direction->data + i * a->direction->stride,
+                         a->s0 == NULL ? NULL : a->s0->data + i * a->s0->stride,
+                         a->s1 == NULL ? NULL : a->s1->data + i * a->s1->stride, a->params->col);
+    }
+}
+
+void matrix_optimizer_step(const optimizer *opt, matrix *params, const matrix *direction, float scale,
+                           matrix **states, size_t step, bool decay){
+    size_t nb_states = optimizer_nb_states(opt);
+    if(params->row != direction->row || params->col != direction->col){
+        fprintf(stderr, "matrix_optimizer_step: Matrix dimensions do not match\n");
+        return;
+    }
+    for(size_t k = 0; k < nb_states; k++){
+        if(states[k] == NULL || states[k]->row != params->row || states[k]->col != params->col){
+            fprintf(stderr, "matrix_optimizer_step: The optimizer state does not match the parameters\n");
+            return;
+        }
+    }
+
+    bool adam = opt->type == OPTIMIZER_ADAM || opt->type == OPTIMIZER_ADAMW;
+    float weight_decay = decay ? opt->weight_decay : 0;
+    optimizer_args a = {
+        .type = opt->type,
+        .momentum = opt->momentum != 0,
+        .lr = opt->learning_rate,
+        .scale = scale,
+        .mu = opt->momentum,
+        .decay = opt->type == OPTIMIZER_ADAMW ? 0 : weight_decay,
+        .shrink = opt->type == OPTIMIZER_ADAMW ? 1 - opt->learning_rate * weight_decay : 1,
+        .beta1 = opt->beta1,
+        .beta2 = opt->beta2,
+        .step_size = adam ? opt->learning_rate / (1 - powf(opt->beta1, (float) step)) : 0,
+        .rsqrt_c2 = adam ? 1 / sqrtf(1 - powf(opt->beta2, (float) step)) : 0,
+        .epsilon = opt->epsilon,
+        .params = params,
+        .direction = direction,
+        .s0 = nb_states > 0 ? states[0] : NULL,
+        .s1 = nb_states > 1 ? states[1] : NULL,
+    };
+
+    bool flat = direction->stride == params->stride;
+    for(size_t k = 0; k < nb_states; k++)
+        flat = flat && states[k]->stride == params->stride;
+
+    size_t n = params->row * params->stride;
+    if(flat && n < OPTIMIZER_PARALLEL_THRESHOLD)
+        optimizer_flat_range(&a, 0, n);
+    else if(flat)
+        thread_pool_parallel_for(n, OPTIMIZER_PARALLEL_GRAIN, optimizer_flat_range, &a);
+    else if(params->row * params->col < OPTIMIZER_PARALLEL_THRESHOLD)
+        optimizer_rows_range(&a, 0, params->row);
+    else
+        thread_pool_parallel_for(params->row, (OPTIMIZER_PARALLEL_GRAIN + params->col - 1) / params->col, optimizer_rows_range, &a);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include "matrix.h"
+
+// Fused optimizer updates
+// A step reads the parameters, their gradient and the optimizer state once
+// and writes the parameters and the state back, in a single pass.
+typedef enum optimizer_type{
+    OPTIMIZER_SGD,      // heavy ball momentum when momentum is not 0
+    OPTIMIZER_NESTEROV,
+    OPTIMIZER_ADAM,
+    OPTIMIZER_ADAMW     // Adam with the weight decay applied to the weights, not to the gradient
+} optimizer_type;
+
+typedef struct optimizer{
+    optimizer_type type;
+    float learning_rate;
+    float momentum;     // SGD and Nesterov
+    float beta1;        // Adam and AdamW decay rates of the first and second moments
+    float beta2;
+    float epsilon;
+    float weight_decay; // L2 penalty on the weights
+} optimizer;
+
+// Matrices of the shape of the parameters holding the state of the optimizer
+size_t optimizer_nb_states(const optimizer *opt);
+
+const char* optimizer_name(optimizer_type type);
+// Inverse of optimizer_name, -1 for an unknown name
+int optimizer_from_name(const char *name);
+
+// Updates params from direction, minus the gradient of the loss scaled by
+// scale (1 / batch for a gradient summed over the batch), and moves the state
+// in states[0 .. optimizer_nb_states). step counts the updates from 1 and
+// sets the Adam bias correction. The weight decay is only applied with decay,
+// so biases can leave it out.
+void matrix_optimizer_step(const optimizer *opt, matrix *params, const matrix *direction, float scale,
+                           matrix **states, size_t step, bool decay);
@@ -0,0 +1,253 @@
+/**
+ * @file qgemm.c
+ * @brief 8-bit integer matrix multiplication for quantized inference.
+ *
+ * Both operands hold one vector per row (weights of a neuron, activations of
+ * a sample), so every element of the product is a dot product of two
+ * contiguous byte vectors and no packing is needed. A micro-kernel computes
+ * a 4 x 2 tile of these dot products, reusing each loaded vector two or four
+ * times. The kernel is picked once at runtime from CPUID: AVX512-VNNI
+ * (vpdpbusd on 256-bit registers), AVX2 (pmaddubsw + pmaddwd) or plain C.
+ * Setting MATRIX_QGEMM_KERNEL to "vnni", "avx2" or "scalar" forces a
+ * specific one. All of them give the same integer sums.
+ *
+ * The samples are blocked so a block stays in L2 while every row of the
+ * weights goes over it, and the rows are spread over the thread pool.
+ */
+
+#include "qgemm.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QGEMM_X86 1
+#endif
+
+// Tile computed by the micro-kernels
+#define QGEMM_MR 4
+#define QGEMM_NR 2
+
+// Samples processed together, their activations staying in L2
+#define QGEMM_NC 128
+
+// Below this many multiply-adds, the product stays on the calling thread
+#define QGEMM_PARALLEL_THRESHOLD (128 * 128 * 128)
+
+// Computes the dot products of the rows a[0..MR) with the samples b[0..NR) over kp bytes
+typedef void (*qgemm_kernel_fn)(size_t kp, const int8_t *const *a, const uint8_t *const *b, int32_t c[QGEMM_MR][QGEMM_NR]);
+
+typedef struct qgemm_kernel{
+    const char *name;
+    qgemm_kernel_fn fn;
+} qgemm_kernel;
+
+size_t qgemm_padded_depth(size_t K){
+    return (K + QGEMM_K_ALIGN - 1) / QGEMM_K_ALIGN * QGEMM_K_ALIGN;
+}
+
+// Micro-kernels
+
+static void kernel_scalar(size_t kp, const int8_t *const *a, const uint8_t *const *b, int32_t c[QGEMM_MR][QGEMM_NR]){
+    for(size_t i = 0; i < QGEMM_MR; i++){
+        for(size_t j = 0; j < QGEMM_NR; j++){
+            int32_t sum = 0;
+            for(size_t k = 0; k < kp; k++)
+                sum += a[i][k] * b[j][k];
+            c[i][j] = sum;
+        }
+    }
+}
+
+#ifdef QGEMM_X86
+__attribute__((target("avx2")))
+static inline int32_t hsum_epi32_avx2(__m256i v){
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(size_t kp, const int8_t *const *a, const uint8_t *const *b, int32_t c[QGEMM_MR][QGEMM_NR]){
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+
+    // u8 * s8 pairs summed into int16 (no saturation below QGEMM_ACTIVATION_MAX), then int16 pairs into int32
+#define QGEMM_AVX2_STEP(acc, x, w) acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(x, w), ones))
+    for(size_t k = 0; k < kp; k += 32){
+        __m256i b0 = _mm256_loadu_si256((const __m256i*) (b[0] + k));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*) (b[1] + k));
+        __m256i w;
+
+        w = _mm256_loadu_si256((const __m256i*) (a[0] + k));
+        QGEMM_AVX2_STEP(c00, b0, w);
+        QGEMM_AVX2_STEP(c01, b1, w);
+        w = _mm256_loadu_si256((const __m256i*) (a[1] + k));
+        QGEMM_AVX2_STEP(c10, b0, w);
+        QGEMM_AVX2_STEP(c11, b1, w);
+        w = _mm256_loadu_si256((const __m256i*) (a[2] + k));
+        QGEMM_AVX2_STEP(c20, b0, w);
+        QGEMM_AVX2_STEP(c21, b1, w);
+        w = _mm256_loadu_si256((const __m256i*) (a[3] + k));
+        QGEMM_AVX2_STEP(c30, b0, w);
+        QGEMM_AVX2_STEP(c31, b1, w);
+    }
+#undef QGEMM_AVX2_STEP
+
+    c[0][0] = hsum_epi32_avx2(c00); c[0][1] = hsum_epi32_avx2(c01);
+    c[1][0] = hsum_epi32_avx2(c10); c[1][1] = hsum_epi32_avx2(c11);
+    c[2][0] = hsum_epi32_avx2(c20); c[2][1] = hsum_epi32_avx2(c21);
+    c[3][0] = hsum_epi32_avx2(c30); c[3][1] = hsum_epi32_avx2(c31);
+}
+
+__attribute__((target("avx2,avx512vnni,avx512vl")))
+static void kernel_vnni(size_t kp, const int8_t *const *a, const uint8_t *const *b, int32_t c[QGEMM_MR][QGEMM_NR]){
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+
+    // vpdpbusd sums four u8 * s8 products straight into int32
+    for(size_t k = 0; k < kp; k += 32){
+        __m256i b0 = _mm256_loadu_si256((const __m256i*) (b[0] + k));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*) (b[1] + k));
+        __m256i w;
+
+        w = _mm256_loadu_si256((const __m256i*) (a[0] + k));
+        c00 = _mm256_dpbusd_epi32(c00, b0, w);
+        c01 = _mm256_dpbusd_epi32(c01, b1, w);
+        w = _mm256_loadu_si256((const __m256i*) (a[1] + k));
+        c10 = _mm256_dpbusd_epi32(c10, b0, w);
+        c11 = _mm256_dpbusd_epi32(c11, b1, w);
+        w = _mm256_loadu_si256((const __m256i*) (a[2] + k));
+        c20 = _mm256_dpbusd_epi32(c20, b0, w);
+        c21 = _mm256_dpbusd_epi32(c21, b1, w);
+        w = _mm256_loadu_si256((const __m256i*) (a[3] + k));
+        c30 = _mm256_dpbusd_epi32(c30, b0, w);
+        c31 = _mm256_dpbusd_epi32(c31, b1, w);
+    }
+
+    c[0][0] = hsum_epi32_avx2(c00); c[0][1] = hsum_epi32_avx2(c01);
+    c[1][0] = hsum_epi32_avx2(c10); c[1][1] = hsum_epi32_avx2(c11);
+    c[2][0] = hsum_epi32_avx2(c20); c[2][1] = hsum_epi32_avx2(c21);
+    c[3][0] = hsum_epi32_avx2(c30); c[3][1] = hsum_epi32_avx2(c31);
+}
+#endif
+
+static const qgemm_kernel qgemm_kernel_scalar = {"scalar", kernel_scalar};
+#ifdef QGEMM_X86
+static const qgemm_kernel qgemm_kernel_avx2 = {"avx2", kernel_avx2};
+static const qgemm_kernel qgemm_kernel_vnni = {"vnni", kernel_vnni};
+#endif
+
+// Kernel selection
+
+static const qgemm_kernel* qgemm_select_kernel(void){
+    static const qgemm_kernel *selected = NULL;
+
+    if(selected != NULL)
+        return selected;
+
+    const qgemm_kernel *k = &qgemm_kernel_scalar;
+    const qgemm_kernel *best = k;
+#ifdef QGEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx2"))
+        best = &qgemm_kernel_vnni;
+    else if(__builtin_cpu_supports("avx2"))
+        best = &qgemm_kernel_avx2;
+    k = best;
+#endif
+
+    // Allow forcing a (supported) kernel, mostly to compare them
+    const char *forced = getenv("MATRIX_QGEMM_KERNEL");
+    if(forced != NULL){
+        if(strcmp(forced, "scalar") == 0)
+            k = &qgemm_kernel_scalar;
+#ifdef QGEMM_X86
+        else if(strcmp(forced, "avx2") == 0 && best != &qgemm_kernel_scalar)
+            k = &qgemm_kernel_avx2;
+#endif
+        else if(strcmp(forced, k->name) != 0)
+            fprintf(stderr, "qgemm: Kernel '%s' is not available, using '%s'\n", forced, k->name);
+    }
+
+    selected = k;
+    return selected;
+}
+
+const char* qgemm_kernel_name(void){
+    return qgemm_select_kernel()->name;
+}
+
+// Driver
+
+typedef struct qgemm_args{
+    const qgemm_kernel *kernel;
+    size_t M;
+    size_t N;
+    size_t kp;
+    const int8_t *A;
+    size_t lda;
+    const uint8_t *B;
+    size_t ldb;
+    const float *scale;
+    const int32_t *offset;
+    float *C;
+    size_t ldc;
+} qgemm_args;
+
+// Computes the blocks of QGEMM_MR rows [begin, end) of C
+// Edge tiles repeat their last row or sample and drop the extra results.
+static void qgemm_rows_task(void *arg, size_t begin, size_t end){
+    const qgemm_args *p = arg;
+    const int8_t *a[QGEMM_MR];
+    const uint8_t *b[QGEMM_NR];
+    int32_t c[QGEMM_MR][QGEMM_NR];
+
+    for(size_t jc = 0; jc < p->N; jc += QGEMM_NC){
+        size_t nc = p->N - jc < QGEMM_NC ? p->N - jc : QGEMM_NC;
+
+        for(size_t blk = begin; blk < end; blk++){
+            size_t i0 = blk * QGEMM_MR;
+            size_t m = p->M - i0 < QGEMM_MR ? p->M - i0 : QGEMM_MR;
+            for(size_t i = 0; i < QGEMM_MR; i++)
+                a[i] = p->A + (i0 + (i < m ? i : m - 1)) * p->lda;
+
+            for(size_t j0 = jc; j0 < jc + nc; j0 += QGEMM_NR){
+                size_t n = jc + nc - j0 < QGEMM_NR ? jc + nc - j0 : QGEMM_NR;
+                for(size_t j = 0; j < QGEMM_NR; j++)
+                    b[j] = p->B + (j0 + (j < n ? j : n - 1)) * p->ldb;
+
+                p->kernel->fn(p->kp, a, b, c);
+
+                for(size_t i = 0; i < m; i++){
+                    float *dest = p->C + (i0 + i) * p->ldc + j0;
+                    for(size_t j = 0; j < n; j++)
+                        dest[j] = p->scale[i0 + i] * (float) (c[i][j] - p->offset[i0 + i]);
+                }
+            }
+        }
+    }
+}
+
+void qgemm(size_t M, size_t N, size_t K,
+           const int8_t *A, size_t lda, const uint8_t *B, size_t ldb,
+           const float *scale, const int32_t *offset, float *C, size_t ldc){
+    if(M == 0 || N == 0)
+        return;
+
+    qgemm_args args = {qgemm_select_kernel(), M, N, qgemm_padded_depth(K), A, lda, B, ldb, scale, offset, C, ldc};
+    size_t nb_blocks = (M + QGEMM_MR - 1) / QGEMM_MR;
+
+    if(M * N * K < QGEMM_PARALLEL_THRESHOLD)
+        qgemm_rows_task(&args, 0, nb_blocks);
+    else
+        thread_pool_parallel_for(nb_blocks, 4, qgemm_rows_task, &args);
+}
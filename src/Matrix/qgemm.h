@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Quantized matrix multiplication for inference
+// The weights are signed 8-bit integers and the activations unsigned ones.
+// Activations only use [0, QGEMM_ACTIVATION_MAX]: pmaddubsw adds two
+// u8 * s8 products into a saturating 16-bit integer, and 2 * 127 * 127 is
+// the largest sum that cannot saturate, whatever the weights.
+#define QGEMM_ACTIVATION_MAX 127
+
+// Rows of both operands are padded with zeros to a multiple of this many bytes
+#define QGEMM_K_ALIGN 32
+
+// Row length of an operand of depth K
+size_t qgemm_padded_depth(size_t K);
+
+// C = diag(scale) * (A * B^T - offset * 1^T), accumulated in 32-bit integers
+// A holds M rows of K weights (row stride lda) and B holds N samples of K
+// activations (row stride ldb), both with their rows padded to
+// qgemm_padded_depth(K) bytes. C is M x N floats with row stride ldc.
+// offset[i] is usually the zero point of the activations times the sum of
+// row i of A, so that C holds the dequantized product.
+void qgemm(size_t M, size_t N, size_t K,
+           const int8_t *A, size_t lda, const uint8_t *B, size_t ldb,
+           const float *scale, const int32_t *offset, float *C, size_t ldc);
+
+// Name of the kernel selected at runtime ("vnni", "avx2" or "scalar")
+const char* qgemm_kernel_name(void);
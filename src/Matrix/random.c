@@ -0,0 +1,310 @@
+/**
+ * @file random.c
+ * @brief Philox4x32-10 counter-based random numbers.
+ *
+ * A stream is cut in groups of 32 values, made of the 4 words of the Philox
+ * blocks of 8 consecutive counters: value v of a group is word v / 8 of block
+ * v % 8. The AVX2 version computes the 8 blocks of a group at once, one
+ * counter per lane, so its words come out in the order of the values; two
+ * groups go through the rounds together and are converted in registers.
+ * Long ranges are split over the thread pool by groups.
+ */
+
+#include "random.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RANDOM_X86 1
+#endif
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+#define RANDOM_GROUP 32
+
+// Below this many values, a range stays on the calling thread
+#define RANDOM_PARALLEL_THRESHOLD (1 << 15)
+// Groups generated by a task of the thread pool
+#define RANDOM_PARALLEL_GRAIN 128
+
+static atomic_uint_fast64_t seed;
+static atomic_uint_fast64_t next_stream;
+static pthread_once_t seed_once = PTHREAD_ONCE_INIT;
+
+static bool random_use_avx2(void){
+#ifdef RANDOM_X86
+    static int supported = -1;
+    if(supported < 0){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2");
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Seeds
+
+static uint64_t splitmix64(uint64_t x){
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static void random_default_seed(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    atomic_store(&seed, splitmix64((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) ^ (uint64_t) getpid());
+}
+
+void random_seed(uint64_t value){
+    pthread_once(&seed_once, random_default_seed);
+    atomic_store(&seed, value);
+    atomic_store(&next_stream, 0);
+}
+
+random_stream random_new_stream(void){
+    pthread_once(&seed_once, random_default_seed);
+    return (random_stream){atomic_load(&seed), atomic_fetch_add(&next_stream, 1)};
+}
+
+// Groups
+
+static void philox_group_scalar(const random_stream *s, uint64_t group, uint32_t *out){
+    for(uint32_t b = 0; b < 8; b++){
+        uint64_t block = group * 8 + b;
+        uint32_t c0 = (uint32_t) block, c1 = (uint32_t) (block >> 32), c2 = (uint32_t) s->id, c3 = (uint32_t) (s->id >> 32);
+        uint32_t k0 = (uint32_t) s->key, k1 = (uint32_t) (s->key >> 32);
+        for(int r = 0; r < PHILOX_ROUNDS; r++){
+            uint64_t p0 = (uint64_t) PHILOX_M0 * c0, p1 = (uint64_t) PHILOX_M1 * c2;
+            c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+            c1 = (uint32_t) p1;
+            c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+            c3 = (uint32_t) p0;
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        out[b] = c0;
+        out[8 + b] = c1;
+        out[16 + b] = c2;
+        out[24 + b] = c3;
+    }
+}
+
+#ifdef RANDOM_X86
+// Low and high words of the 32 x 32 bit products of the lanes of a by m
+__attribute__((target("avx2")))
+static inline void philox_mulhilo_avx2(__m256i a, __m256i m, __m256i *lo, __m256i *hi){
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Counters of the 8 blocks of a group, from a multiple of 8 so the high word is shared
+__attribute__((target("avx2")))
+static inline void philox_counters_avx2(const random_stream *s, uint64_t group, __m256i *c){
+    uint64_t first = group * 8;
+    c[0] = _mm256_add_epi32(_mm256_set1_epi32((int) (uint32_t) first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    c[1] = _mm256_set1_epi32((int) (uint32_t) (first >> 32));
+    c[2] = _mm256_set1_epi32((int) (uint32_t) s->id);
+    c[3] = _mm256_set1_epi32((int) (uint32_t) (s->id >> 32));
+}
+
+__attribute__((target("avx2")))
+static inline void philox_round_avx2(__m256i *c, __m256i k0, __m256i k1){
+    __m256i m0 = _mm256_set1_epi64x(PHILOX_M0), m1 = _mm256_set1_epi64x(PHILOX_M1);
+    __m256i lo0, hi0, lo1, hi1;
+    philox_mulhilo_avx2(c[0], m0, &lo0, &hi0);
+    philox_mulhilo_avx2(c[2], m1, &lo1, &hi1);
+    c[0] = _mm256_xor_si256(_mm256_xor_si256(hi1, c[1]), k0);
+    c[1] = lo1;
+    c[2] = _mm256_xor_si256(_mm256_xor_si256(hi0, c[3]), k1);
+    c[3] = lo0;
+}
+
+__attribute__((target("avx2")))
+static void philox_group_avx2(const random_stream *s, uint64_t group, uint32_t *out){
+    __m256i c[4];
+    philox_counters_avx2(s, group, c);
+    uint32_t k0 = (uint32_t) s->key, k1 = (uint32_t) (s->key >> 32);
+    for(int r = 0; r < PHILOX_ROUNDS; r++){
+        philox_round_avx2(c, _mm256_set1_epi32((int) k0), _mm256_set1_epi32((int) k1));
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    for(int j = 0; j < 4; j++)
+        _mm256_storeu_si256((__m256i*) (out + 8 * j), c[j]);
+}
+
+// Two consecutive groups, their rounds interleaved to hide the latency of the multiplies
+__attribute__((target("avx2")))
+static void philox_pair_avx2(const random_stream *s, uint64_t group, __m256i *c){
+    philox_counters_avx2(s, group, c);
+    philox_counters_avx2(s, group + 1, c + 4);
+    uint32_t k0 = (uint32_t) s->key, k1 = (uint32_t) (s->key >> 32);
+    for(int r = 0; r < PHILOX_ROUNDS; r++){
+        __m256i kv0 = _mm256_set1_epi32((int) k0), kv1 = _mm256_set1_epi32((int) k1);
+        philox_round_avx2(c, kv0, kv1);
+        philox_round_avx2(c + 4, kv0, kv1);
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+#endif
+
+static void philox_group(const random_stream *s, uint64_t group, uint32_t *out){
+#ifdef RANDOM_X86
+    if(random_use_avx2()){
+        philox_group_avx2(s, group, out);
+        return;
+    }
+#endif
+    philox_group_scalar(s, group, out);
+}
+
+// Ranges
+
+typedef struct random_range_args{
+    float *dest;
+    size_t n;
+    const random_stream *s;
+    uint64_t offset;
+    bool bernoulli;
+    float a;        // lower bound, or probability of keeping
+    float b;        // upper bound, or kept value
+} random_range_args;
+
+// 24 bits of a value make a float in [0, 1) exactly. The uniform values are
+// a + bits * width with a rounded product then a rounded sum in every version,
+// so they do not depend on the path taking them.
+static float random_width(const random_range_args *args){
+    return (args->b - args->a) / (1 << 24);
+}
+
+static uint32_t random_threshold(const random_range_args *args){
+    return args->a >= 1 ? 1u << 24 : (uint32_t) (args->a * (1 << 24));
+}
+
+// Converts count values of a group, w and dest pointing at the first one
+static void random_convert(const random_range_args *args, const uint32_t *w, float *dest, size_t count){
+    if(args->bernoulli){
+        uint32_t threshold = random_threshold(args);
+        for(size_t i = 0; i < count; i++)
+            dest[i] = (w[i] >> 8) < threshold ? args->b : 0;
+    }else{
+        float width = random_width(args);
+        for(size_t i = 0; i < count; i++)
+            dest[i] = args->a + (float) (w[i] >> 8) * width;
+    }
+}
+
+#ifdef RANDOM_X86
+// Two groups lying whole inside the range, converted in registers
+__attribute__((target("avx2")))
+static void random_pair_avx2(const random_range_args *args, uint64_t group){
+    __m256i c[8];
+    philox_pair_avx2(args->s, group, c);
+    float *dest = args->dest + (group * RANDOM_GROUP - args->offset);
+    __m256 a = _mm256_set1_ps(args->a), b = _mm256_set1_ps(args->b);
+    __m256 width = _mm256_set1_ps(random_width(args));
+    __m256i threshold = _mm256_set1_epi32((int) random_threshold(args));
+    for(int j = 0; j < 8; j++){
+        __m256i bits = _mm256_srli_epi32(c[j], 8);
+        __m256 v;
+        if(args->bernoulli)
+            v = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(threshold, bits)), b);
+        else
+            v = _mm256_add_ps(a, _mm256_mul_ps(_mm256_cvtepi32_ps(bits), width));
+        _mm256_storeu_ps(dest + 8 * j, v);
+    }
+}
+#endif
+
+// Values of the groups [begin, end) of the range, counted from the group of its first value
+static void random_range(void *arg, size_t begin, size_t end){
+    random_range_args *args = arg;
+    uint64_t first_group = args->offset / RANDOM_GROUP;
+    // groups [whole_begin, whole_end) of the stream lie whole inside the range
+    uint64_t whole_begin = (args->offset + RANDOM_GROUP - 1) / RANDOM_GROUP;
+    uint64_t whole_end = (args->offset + args->n) / RANDOM_GROUP;
+    uint32_t words[RANDOM_GROUP];
+
+    for(size_t g = begin; g < end;){
+        uint64_t group = first_group + g;
+#ifdef RANDOM_X86
+        if(random_use_avx2() && g + 2 <= end && group >= whole_begin && group + 2 <= whole_end){
+            random_pair_avx2(args, group);
+            g += 2;
+            continue;
+        }
+#endif
+        // Part of the group inside [offset, offset + n)
+        philox_group(args->s, group, words);
+        uint64_t start = group * RANDOM_GROUP > args->offset ? group * RANDOM_GROUP : args->offset;
+        uint64_t stop = (group + 1) * RANDOM_GROUP < args->offset + args->n ? (group + 1) * RANDOM_GROUP : args->offset + args->n;
+        random_convert(args, words + (start - group * RANDOM_GROUP), args->dest + (start - args->offset), stop - start);
+        g++;
+    }
+}
+
+static void random_fill(random_range_args *args){
+    if(args->n == 0)
+        return;
+    size_t nb_groups = (args->offset + args->n - 1) / RANDOM_GROUP - args->offset / RANDOM_GROUP + 1;
+    if(args->n < RANDOM_PARALLEL_THRESHOLD)
+        random_range(args, 0, nb_groups);
+    else
+        thread_pool_parallel_for(nb_groups, RANDOM_PARALLEL_GRAIN, random_range, args);
+}
+
+void random_uniform(float *dest, size_t n, const random_stream *s, uint64_t offset, float lower, float upper){
+    random_range_args args = {dest, n, s, offset, false, lower, upper};
+    random_fill(&args);
+}
+
+void random_bernoulli(float *dest, size_t n, const random_stream *s, uint64_t offset, float keep, float scale){
+    random_range_args args = {dest, n, s, offset, true, keep, scale};
+    random_fill(&args);
+}
+
+// Sequential generator
+
+void random_generator_init(random_generator *g, random_stream stream){
+    g->stream = stream;
+    g->offset = 0;
+}
+
+uint32_t random_next(random_generator *g){
+    if(g->offset % RANDOM_GROUP == 0)
+        philox_group(&g->stream, g->offset / RANDOM_GROUP, g->buffer);
+    return g->buffer[g->offset++ % RANDOM_GROUP];
+}
+
+size_t random_below(random_generator *g, size_t n){
+    if(n > UINT32_MAX){
+        uint64_t x = (uint64_t) random_next(g) << 32 | random_next(g);
+        return (size_t) (x % n);
+    }
+
+    // Lemire's multiply and reject, unbiased
+    uint32_t bound = (uint32_t) n;
+    uint64_t m = (uint64_t) random_next(g) * bound;
+    if((uint32_t) m < bound){
+        uint32_t t = -bound % bound;
+        while((uint32_t) m < t)
+            m = (uint64_t) random_next(g) * bound;
+    }
+    return (size_t) (m >> 32);
+}
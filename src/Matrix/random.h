@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Counter-based random numbers (Philox4x32-10)
+// Every value is a function of the seed, of a stream and of its position in
+// the stream, so any thread can generate any range of a stream and the values
+// only depend on the seed. Streams are handed out in order, so a program
+// calling random_seed gets the same numbers on every run.
+
+typedef struct random_stream{
+    uint64_t key;   // seed at the creation of the stream
+    uint64_t id;
+} random_stream;
+
+// Sets the seed and restarts the streams, the default seed coming from the clock
+void random_seed(uint64_t seed);
+// A stream no other caller gets until the next random_seed
+random_stream random_new_stream(void);
+
+// dest[i] = value offset + i of the stream, uniform in [lower, upper)
+void random_uniform(float *dest, size_t n, const random_stream *s, uint64_t offset, float lower, float upper);
+// dest[i] = scale with probability keep and 0 otherwise, from the same values as random_uniform
+void random_bernoulli(float *dest, size_t n, const random_stream *s, uint64_t offset, float keep, float scale);
+
+// Sequential reader of a stream, for shuffles
+typedef struct random_generator{
+    random_stream stream;
+    uint64_t offset;        // position of the next value in the stream
+    uint32_t buffer[32];    // values of the current group of the stream
+} random_generator;
+
+void random_generator_init(random_generator *g, random_stream stream);
+uint32_t random_next(random_generator *g);
+// Uniform in [0, n), n > 0
+size_t random_below(random_generator *g, size_t n);
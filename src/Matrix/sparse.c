@@ -0,0 +1,412 @@
+/**
+ * @file sparse.c
+ * @brief Compressed sparse row matrices, magnitude pruning and sparse x dense products.
+ *
+ * The product computes every row of the result from the nonzeros of the same
+ * row of A: each nonzero adds a scaled row of X to it. The AVX2 version keeps
+ * 32 columns of the result in registers while it goes through the nonzeros,
+ * and gathers the inputs of the columns left over (a single sample in
+ * particular). The epilogue runs on each row as soon as it is complete.
+ */
+
+#include "sparse.h"
+#include "random.h"
+#include "../ThreadPool/threadPool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPARSE_X86 1
+#endif
+
+// Columns of the result kept in registers
+#define SPARSE_TILE 32
+// Below this many multiply-adds, a product stays on the calling thread
+#define SPARSE_PARALLEL_THRESHOLD (1 << 16)
+// Smallest number of multiply-adds handed to a thread
+#define SPARSE_PARALLEL_GRAIN (1 << 14)
+
+// Product timed by matrix_csr_crossover: a square layer on a batch of samples
+#define SPARSE_CROSSOVER_SIZE 512
+#define SPARSE_CROSSOVER_BATCH 64
+#define SPARSE_CROSSOVER_RUNS 5
+// Key of the private stream filling its operands, leaving the streams of random.h to the program
+#define SPARSE_CROSSOVER_KEY 0x5eed5ca7ULL
+
+static bool sparse_use_avx2(void){
+#ifdef SPARSE_X86
+    static int supported = -1;
+    if(supported < 0){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Sparse matrix creation and destruction
+
+matrix_csr* matrix_csr_from(const matrix *m){
+    if(m->col > UINT32_MAX){
+        fprintf(stderr, "matrix_csr_from: Too many columns\n");
+        return NULL;
+    }
+
+    matrix_csr *s = malloc(sizeof(matrix_csr));
+    if(s == NULL){
+        fprintf(stderr, "matrix_csr_from: Unable to allocate memory for the matrix\n");
+        return NULL;
+    }
+    s->row = m->row;
+    s->col = m->col;
+    s->nnz = matrix_count_nonzeros(m);
+    s->row_ptr = malloc((m->row + 1) * sizeof(size_t));
+    // one element at least, malloc(0) may return NULL
+    s->col_idx = malloc((s->nnz > 0 ? s->nnz : 1) * sizeof(uint32_t));
+    s->values = malloc((s->nnz > 0 ? s->nnz : 1) * sizeof(float));
+    if(s->row_ptr == NULL || s->col_idx == NULL || s->values == NULL){
+        fprintf(stderr, "matrix_csr_from: Unable to allocate memory for the matrix\n");
+        matrix_csr_destroy(s);
+        return NULL;
+    }
+
+    size_t k = 0;
+    for(size_t i = 0; i < m->row; i++){
+        s->row_ptr[i] = k;
+        const float *row = m->data + i * m->stride;
+        for(size_t j = 0; j < m->col; j++){
+            if(row[j] != 0){
+                s->col_idx[k] = (uint32_t) j;
+                s->values[k] = row[j];
+                k++;
+            }
+        }
+    }
+    s->row_ptr[m->row] = k;
+    return s;
+}
+
+void matrix_csr_destroy(matrix_csr *m){
+    if(m == NULL)
+        return;
+    free(m->row_ptr);
+    free(m->col_idx);
+    free(m->values);
+    free(m);
+}
+
+size_t matrix_csr_size(const matrix_csr *m){
+    return (m->row + 1) * sizeof(size_t) + m->nnz * (sizeof(uint32_t) + sizeof(float));
+}
+
+size_t matrix_count_nonzeros(const matrix *m){
+    size_t count = 0;
+    for(size_t i = 0; i < m->row; i++){
+        const float *row = m->data + i * m->stride;
+        for(size_t j = 0; j < m->col; j++)
+            count += row[j] != 0;
+    }
+    return count;
+}
+
+// Pruning
+
+// k-th smallest of the n values of a (quickselect), a being reordered
+static float select_kth(float *a, size_t n, size_t k){
+    ptrdiff_t lo = 0, hi = (ptrdiff_t) n - 1, target = (ptrdiff_t) k;
+    while(lo < hi){
+        // median of three, so the scans below stop inside [lo, hi]
+        float x = a[lo], y = a[lo + (hi - lo) / 2], z = a[hi];
+        float pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        ptrdiff_t i = lo, j = hi;
+        while(i <= j){
+            while(a[i] < pivot)
+                i++;
+            while(a[j] > pivot)
+                j--;
+            if(i <= j){
+                float t = a[i];
+                a[i++] = a[j];
+                a[j--] = t;
+            }
+        }
+        // [lo, j] <= pivot <= [i, hi], the values in between being the pivot
+        if(target <= j)
+            hi = j;
+        else if(target >= i)
+            lo = i;
+        else
+            return a[target];
+    }
+    return a[target];
+}
+
+void matrix_prune(matrix *m, float density){
+    if(!(density >= 0 && density <= 1)){
+        fprintf(stderr, "matrix_prune: The density must be between 0 and 1\n");
+        return;
+    }
+    size_t n = m->row * m->col;
+    // rounded to nearest, a float density such as 0.2f being slightly off
+    size_t keep = (size_t) ((double) density * n + 0.5);
+    if(keep >= n)
+        return;
+
+    float threshold = INFINITY;
+    if(keep > 0){
+        float *magnitudes = malloc(n * sizeof(float));
+        if(magnitudes == NULL){
+            fprintf(stderr, "matrix_prune: Unable to allocate memory for the magnitudes\n");
+            return;
+        }
+        for(size_t i = 0; i < m->row; i++){
+            for(size_t j = 0; j < m->col; j++)
+                magnitudes[i * m->col + j] = fabsf(m->data[i * m->stride + j]);
+        }
+        threshold = select_kth(magnitudes, n, n - keep);
+        free(magnitudes);
+    }
+
+    // Everything above the threshold stays, then the first elements equal to it up to keep
+    size_t above = 0;
+    for(size_t i = 0; i < m->row; i++){
+        for(size_t j = 0; j < m->col; j++)
+            above += fabsf(m->data[i * m->stride + j]) > threshold;
+    }
+    size_t ties = keep - above;
+    for(size_t i = 0; i < m->row; i++){
+        float *row = m->data + i * m->stride;
+        for(size_t j = 0; j < m->col; j++){
+            float magnitude = fabsf(row[j]);
+            if(magnitude > threshold)
+                continue;
+            if(magnitude == threshold && ties > 0)
+                ties--;
+            else
+                row[j] = 0;
+        }
+    }
+}
+
+// Product
+
+typedef struct csr_mul_args{
+    matrix *dest;
+    const matrix_csr *A;
+    const matrix_view *X;
+    const float *bias;
+    activation_type activation;
+    bool epilogue;
+} csr_mul_args;
+
+// Row i of dest, X being read through its strides
+static void csr_row_scalar(const csr_mul_args *args, size_t i, float *out){
+    const matrix_csr *A = args->A;
+    const matrix_view *X = args->X;
+    size_t n = X->col;
+
+    memset(out, 0, n * sizeof(float));
+    for(size_t k = A->row_ptr[i]; k < A->row_ptr[i + 1]; k++){
+        float w = A->values[k];
+        const float *x = X->data + A->col_idx[k] * X->rs;
+        if(X->cs == 1){
+            for(size_t j = 0; j < n; j++)
+                out[j] += w * x[j];
+        }else{
+            for(size_t j = 0; j < n; j++)
+                out[j] += w * x[j * X->cs];
+        }
+    }
+}
+
+#ifdef SPARSE_X86
+// Row i of dest, the rows of X being contiguous
+__attribute__((target("avx2,fma")))
+static void csr_row_avx2(const csr_mul_args *args, size_t i, float *out){
+    const matrix_csr *A = args->A;
+    const matrix_view *X = args->X;
+    size_t n = X->col, begin = A->row_ptr[i], end = A->row_ptr[i + 1];
+    size_t j = 0;
+
+    for(; j + SPARSE_TILE <= n; j += SPARSE_TILE){
+        __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+        __m256 c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+        for(size_t k = begin; k < end; k++){
+            __m256 w = _mm256_broadcast_ss(&A->values[k]);
+            const float *x = X->data + A->col_idx[k] * X->rs + j;
+            c0 = _mm256_fmadd_ps(w, _mm256_loadu_ps(x), c0);
+            c1 = _mm256_fmadd_ps(w, _mm256_loadu_ps(x + 8), c1);
+            c2 = _mm256_fmadd_ps(w, _mm256_loadu_ps(x + 16), c2);
+            c3 = _mm256_fmadd_ps(w, _mm256_loadu_ps(x + 24), c3);
+        }
+        _mm256_storeu_ps(out + j, c0);
+        _mm256_storeu_ps(out + j + 8, c1);
+        _mm256_storeu_ps(out + j + 16, c2);
+        _mm256_storeu_ps(out + j + 24, c3);
+    }
+    for(; j + 8 <= n; j += 8){
+        __m256 c = _mm256_setzero_ps();
+        for(size_t k = begin; k < end; k++)
+            c = _mm256_fmadd_ps(_mm256_broadcast_ss(&A->values[k]), _mm256_loadu_ps(X->data + A->col_idx[k] * X->rs + j), c);
+        _mm256_storeu_ps(out + j, c);
+    }
+
+    // Last columns: dot products of the row with columns of X, 8 nonzeros at a time
+    // when the offsets of the inputs fit the gather indices
+    bool gather = X->row * X->rs <= INT32_MAX;
+    const __m256i rs = _mm256_set1_epi32((int) X->rs);
+    for(; j < n; j++){
+        size_t k = begin;
+        float sum = 0;
+        if(gather){
+            __m256 c = _mm256_setzero_ps();
+            for(; k + 8 <= end; k += 8){
+                __m256i offsets = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*) &A->col_idx[k]), rs);
+                __m256 x = _mm256_i32gather_ps(X->data + j, offsets, 4);
+                c = _mm256_fmadd_ps(_mm256_loadu_ps(&A->values[k]), x, c);
+            }
+            __m128 s = _mm_add_ps(_mm256_castps256_ps128(c), _mm256_extractf128_ps(c, 1));
+            s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            sum = _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+        }
+        for(; k < end; k++)
+            sum += A->values[k] * X->data[A->col_idx[k] * X->rs + j];
+        out[j] = sum;
+    }
+}
+#endif
+
+static void csr_mul_range(void *arg, size_t begin, size_t end){
+    const csr_mul_args *args = arg;
+    for(size_t i = begin; i < end; i++){
+        float *out = args->dest->data + i * args->dest->stride;
+#ifdef SPARSE_X86
+        if(args->X->cs == 1 && sparse_use_avx2())
+            csr_row_avx2(args, i, out);
+        else
+#endif
+            csr_row_scalar(args, i, out);
+
+        if(args->epilogue)
+            activation_forward_row(args->activation, out, args->X->col, args->bias == NULL ? 0 : args->bias[i]);
+    }
+}
+
+void matrix_csr_mul_ex(matrix *dest, const matrix_csr *A, const matrix_view *X, const gemm_epilogue *epilogue){
+    if(A->col != X->row || dest->row != A->row || dest->col != X->col){
+        fprintf(stderr, "matrix_csr_mul_ex: Matrix dimensions do not match\n");
+        return;
+    }
+    if(epilogue != NULL && epilogue->type == GEMM_EPILOGUE_ACTIVATION_BACKWARD){
+        fprintf(stderr, "matrix_csr_mul_ex: Only the bias and activation epilogue is supported\n");
+        return;
+    }
+    if(dest->row == 0 || dest->col == 0)
+        return;
+
+    csr_mul_args args = {
+        .dest = dest,
+        .A = A,
+        .X = X,
+        .epilogue = epilogue != NULL && epilogue->type == GEMM_EPILOGUE_BIAS_ACTIVATION,
+    };
+    if(args.epilogue){
+        args.bias = epilogue->bias;
+        args.activation = epilogue->activation;
+    }
+
+    // the rows of A are assumed to hold similar numbers of nonzeros
+    size_t work = (A->nnz + A->row) * X->col;
+    if(work < SPARSE_PARALLEL_THRESHOLD)
+        csr_mul_range(&args, 0, A->row);
+    else
+        thread_pool_parallel_for(A->row, SPARSE_PARALLEL_GRAIN * A->row / work + 1, csr_mul_range, &args);
+}
+
+void matrix_csr_mul_to(matrix *dest, const matrix_csr *A, const matrix_view *X){
+    matrix_csr_mul_ex(dest, A, X, NULL);
+}
+
+// Crossover
+
+static float crossover = 0;
+static pthread_once_t crossover_once = PTHREAD_ONCE_INIT;
+
+static double crossover_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Shortest of SPARSE_CROSSOVER_RUNS products after a warmup one, by the CSR kernel when A_csr is given
+static double crossover_time(matrix *dest, const matrix *A, const matrix_csr *A_csr, const matrix *X){
+    matrix_view x = matrix_view_of(X);
+    double best = INFINITY;
+    for(int r = 0; r <= SPARSE_CROSSOVER_RUNS; r++){
+        double start = crossover_now();
+        if(A_csr != NULL)
+            matrix_csr_mul_to(dest, A_csr, &x);
+        else
+            gemm(A->row, X->col, A->col, 1, A->data, A->stride, 1, X->data, X->stride, 1, 0, dest->data, dest->stride, 1);
+        double elapsed = crossover_now() - start;
+        if(r > 0 && elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// Uniform values in [-1, 1) from the crossover stream, its id telling the operands apart
+static void crossover_fill(matrix *m, uint64_t id){
+    random_stream stream = {SPARSE_CROSSOVER_KEY, id};
+    for(size_t i = 0; i < m->row; i++)
+        random_uniform(&m->data[i * m->stride], m->col, &stream, i * m->col, -1, 1);
+}
+
+// Times both kernels on a layer pruned to decreasing densities and keeps the
+// densest one at which the CSR kernel wins
+static void crossover_measure(void){
+    static const float densities[] = {0.5f, 0.35f, 0.25f, 0.15f, 0.1f, 0.05f, 0.02f};
+
+    matrix *A = matrix_zeros(SPARSE_CROSSOVER_SIZE, SPARSE_CROSSOVER_SIZE);
+    matrix *X = matrix_zeros(SPARSE_CROSSOVER_SIZE, SPARSE_CROSSOVER_BATCH);
+    matrix *dest = matrix_zeros(SPARSE_CROSSOVER_SIZE, SPARSE_CROSSOVER_BATCH);
+    if(A == NULL || X == NULL || dest == NULL){
+        fprintf(stderr, "matrix_csr_crossover: Unable to allocate memory for the measurement\n");
+    }else{
+        crossover_fill(A, 0);
+        crossover_fill(X, 1);
+        double dense = crossover_time(dest, A, NULL, X);
+        // pruning a pruned matrix keeps the same largest elements
+        for(size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++){
+            matrix_prune(A, densities[d]);
+            matrix_csr *A_csr = matrix_csr_from(A);
+            if(A_csr == NULL)
+                break;
+            double sparse = crossover_time(dest, A, A_csr, X);
+            matrix_csr_destroy(A_csr);
+            if(sparse < dense){
+                crossover = densities[d];
+                break;
+            }
+        }
+    }
+    if(A != NULL)
+        matrix_destroy(A);
+    if(X != NULL)
+        matrix_destroy(X);
+    if(dest != NULL)
+        matrix_destroy(dest);
+}
+
+float matrix_csr_crossover(void){
+    pthread_once(&crossover_once, crossover_measure);
+    return crossover;
+}
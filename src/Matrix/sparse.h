@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "matrix.h"
+#include "gemm.h"
+
+// Compressed sparse row matrices
+// The nonzero elements of row i are values[row_ptr[i]] to values[row_ptr[i + 1] - 1],
+// in column order, their columns being in col_idx.
+typedef struct matrix_csr{
+    size_t row;
+    size_t col;
+    size_t nnz;
+    size_t *row_ptr;    // row + 1 offsets
+    uint32_t *col_idx;
+    float *values;
+} matrix_csr;
+
+// Sparse matrix creation and destruction
+// The nonzero elements of m, NULL if m has more than UINT32_MAX columns or on allocation failure.
+matrix_csr* matrix_csr_from(const matrix *m);
+void matrix_csr_destroy(matrix_csr *m);
+// Bytes taken by the arrays of m
+size_t matrix_csr_size(const matrix_csr *m);
+
+size_t matrix_count_nonzeros(const matrix *m);
+// Keeps the density * size elements (rounded) of largest magnitude of m and zeroes the others
+void matrix_prune(matrix *m, float density);
+
+// dest = A * X, X being a dense view
+void matrix_csr_mul_to(matrix *dest, const matrix_csr *A, const matrix_view *X);
+// Same, followed by the epilogue (NULL or a GEMM_EPILOGUE_BIAS_ACTIVATION one)
+void matrix_csr_mul_ex(matrix *dest, const matrix_csr *A, const matrix_view *X, const gemm_epilogue *epilogue);
+
+// Highest density at which matrix_csr_mul_to beats the dense GEMM (0 if none),
+// timed on the first call without taking a stream of random.h
+float matrix_csr_crossover(void);
@@ -0,0 +1,310 @@
+/**
+ * @file modelFile.c
+ * @brief Saving and loading of neural networks (format described in modelFile.h).
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modelFile.h"
+
+// The file is little-endian and its weights are read in place
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define NN_FILE_HOST_LITTLE_ENDIAN 0
+#else
+#define NN_FILE_HOST_LITTLE_ENDIAN 1
+#endif
+
+static uint64_t nn_file_align(uint64_t offset){
+    return (offset + NN_FILE_ALIGNMENT - 1) / NN_FILE_ALIGNMENT * NN_FILE_ALIGNMENT;
+}
+
+// Size of a layer entry in a file of the given version
+static size_t nn_file_layer_size(uint32_t version){
+    return version == 1 ? offsetof(nn_file_layer, kind) : sizeof(nn_file_layer);
+}
+
+// Entry i of the layer table of a mapped file, the fields missing from older versions being zero
+static nn_file_layer nn_file_get_layer(const char *data, uint32_t version, size_t i){
+    nn_file_layer l = {0};
+    memcpy(&l, data + sizeof(nn_file_header) + i * nn_file_layer_size(version), nn_file_layer_size(version));
+    return l;
+}
+
+static conv_shape nn_file_conv_shape(const nn_file_layer *l){
+    conv_shape s = {
+        .in_channels = l->conv[0], .in_height = l->conv[1], .in_width = l->conv[2],
+        .out_channels = l->conv[3], .kernel_height = l->conv[4], .kernel_width = l->conv[5],
+        .stride = l->conv[6], .padding = l->conv[7], .dilation = l->conv[8],
+    };
+    return s;
+}
+
+/**
+ * @brief Writes zeros up to the given offset of the file.
+ *
+ * @return false if the write failed.
+ */
+static bool nn_file_pad(FILE *f, uint64_t offset){
+    static const char zeros[NN_FILE_ALIGNMENT] = {0};
+    long position = ftell(f);
+    if(position < 0 || (uint64_t) position > offset)
+        return false;
+    return fwrite(zeros, 1, offset - position, f) == offset - position;
+}
+
+/**
+ * @brief Writes a compiled neural network to a model file.
+ *
+ * The file is written next to its destination and renamed over it, so the
+ * processes that mapped the previous version keep a valid mapping.
+ *
+ * @param nn The neural network.
+ * @param path The path of the model file.
+ * @return true on success, false otherwise.
+ */
+bool nn_save(const neural_network *nn, const char *path){
+    if(!NN_FILE_HOST_LITTLE_ENDIAN){
+        fprintf(stderr, "nn_save: Model files are little-endian and this host is not\n");
+        return false;
+    }
+    if(nn->nb_layers == 0 || nn->layers[nn->nb_layers - 1]->type != OUTPUT || nn->layers[0]->weights == NULL){
+        fprintf(stderr, "nn_save: Compile the network first\n");
+        return false;
+    }
+
+    nn_file_header header = {0};
+    memcpy(header.magic, NN_FILE_MAGIC, sizeof(NN_FILE_MAGIC));
+    header.version = NN_FILE_VERSION;
+    header.nb_layers = nn->nb_layers;
+    header.loss_function = nn->loss_function;
+    header.learning_rate = nn->learning_rate;
+
+    nn_file_layer *layers = calloc(nn->nb_layers, sizeof(nn_file_layer));
+    if(layers == NULL){
+        fprintf(stderr, "nn_save: Unable to allocate memory for the layer table\n");
+        return false;
+    }
+
+    // lay out the blobs after the layer table
+    uint64_t offset = sizeof(nn_file_header) + nn->nb_layers * sizeof(nn_file_layer);
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        layer *l = nn->layers[i];
+        if(l->activation_type == ACTIVATION_CUSTOM){
+            fprintf(stderr, "nn_save: Layer %zu uses a custom activation function\n", i);
+            free(layers);
+            return false;
+        }
+
+        layers[i].type = l->type;
+        layers[i].kind = l->kind;
+        layers[i].activation = l->activation_type;
+        layers[i].input_size = l->input_size;
+        layers[i].nb_neurons = l->nb_neurons;
+        if(l->kind == LAYER_CONV2D){
+            const conv_shape *s = &l->conv;
+            uint32_t conv[9] = {s->in_channels, s->in_height, s->in_width, s->out_channels,
+                                s->kernel_height, s->kernel_width, s->stride, s->padding, s->dilation};
+            memcpy(layers[i].conv, conv, sizeof(conv));
+        }
+        layers[i].weights_offset = nn_file_align(offset);
+        offset = layers[i].weights_offset + l->weights->row * l->weights->col * sizeof(float);
+        layers[i].bias_offset = nn_file_align(offset);
+        offset = layers[i].bias_offset + l->bias->row * sizeof(float);
+    }
+    header.file_size = offset;
+
+    size_t length = strlen(path);
+    char *tmp_path = malloc(length + 5);
+    if(tmp_path == NULL){
+        fprintf(stderr, "nn_save: Unable to allocate memory for the path\n");
+        free(layers);
+        return false;
+    }
+    memcpy(tmp_path, path, length);
+    memcpy(tmp_path + length, ".tmp", 5);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if(f == NULL){
+        fprintf(stderr, "nn_save: Unable to open %s: %s\n", tmp_path, strerror(errno));
+        free(layers);
+        free(tmp_path);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+           && fwrite(layers, sizeof(nn_file_layer), nn->nb_layers, f) == nn->nb_layers;
+    for(size_t i = 0; ok && i < nn->nb_layers; i++){
+        layer *l = nn->layers[i];
+        // the file rows are packed, whatever the stride of the matrices
+        ok = nn_file_pad(f, layers[i].weights_offset);
+        for(size_t r = 0; ok && r < l->weights->row; r++)
+            ok = fwrite(l->weights->data + r * l->weights->stride, sizeof(float), l->weights->col, f) == l->weights->col;
+        ok = ok && nn_file_pad(f, layers[i].bias_offset);
+        for(size_t r = 0; ok && r < l->bias->row; r++)
+            ok = fwrite(l->bias->data + r * l->bias->stride, sizeof(float), 1, f) == 1;
+    }
+    ok = fclose(f) == 0 && ok;
+
+    if(ok && rename(tmp_path, path) != 0)
+        ok = false;
+    if(!ok){
+        fprintf(stderr, "nn_save: Unable to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    free(layers);
+    free(tmp_path);
+    return ok;
+}
+
+/**
+ * @brief Checks the header and the layer table of a mapped model file.
+ *
+ * @return false if the file is not a valid model.
+ */
+static bool nn_file_check(const char *data, size_t size){
+    const nn_file_header *header = (const nn_file_header*) data;
+    if(size < sizeof(nn_file_header) || memcmp(header->magic, NN_FILE_MAGIC, sizeof(NN_FILE_MAGIC)) != 0){
+        fprintf(stderr, "nn_load: Not a model file\n");
+        return false;
+    }
+    uint32_t swapped = __builtin_bswap32(header->version);
+    if(swapped == 1 || swapped == NN_FILE_VERSION){
+        fprintf(stderr, "nn_load: The model file has the wrong byte order\n");
+        return false;
+    }
+    if(header->version != 1 && header->version != NN_FILE_VERSION){
+        fprintf(stderr, "nn_load: Unsupported model file version %u\n", header->version);
+        return false;
+    }
+    if(header->file_size != size || header->nb_layers < 2 || header->loss_function > CROSS_ENTROPY
+       || header->nb_layers > (size - sizeof(nn_file_header)) / nn_file_layer_size(header->version)){
+        fprintf(stderr, "nn_load: Corrupted model file header\n");
+        return false;
+    }
+
+    uint64_t previous_outputs = 0;
+    for(size_t i = 0; i < header->nb_layers; i++){
+        nn_file_layer entry = nn_file_get_layer(data, header->version, i);
+        const nn_file_layer *l = &entry;
+        layer_type expected = i == 0 ? INPUT : i == header->nb_layers - 1 ? OUTPUT : HIDDEN;
+
+        // shape of the weights, from the neurons or the convolution
+        uint64_t rows = l->nb_neurons, cols = l->input_size;
+        bool valid_kind = l->kind == LAYER_DENSE;
+        if(l->kind == LAYER_CONV2D){
+            // the small dimensions keep the products below from overflowing
+            conv_shape s = nn_file_conv_shape(l);
+            valid_kind = true;
+            for(size_t j = 0; j < 9; j++)
+                valid_kind = valid_kind && l->conv[j] <= UINT16_MAX;
+            valid_kind = valid_kind && conv_shape_init(&s)
+                      && conv_input_size(&s) == l->input_size && conv_output_size(&s) == l->nb_neurons;
+            rows = s.out_channels;
+            cols = conv_patch_size(&s);
+        }
+
+        bool valid = l->type == expected && valid_kind
+                  && l->activation > ACTIVATION_CUSTOM && l->activation <= ACTIVATION_IDENTITY
+                  && l->input_size > 0 && l->nb_neurons > 0
+                  && (i == 0 || l->input_size == previous_outputs)
+                  && l->weights_offset % NN_FILE_ALIGNMENT == 0 && l->bias_offset % NN_FILE_ALIGNMENT == 0
+                  && cols > 0 && cols <= size / sizeof(float) && rows <= size / sizeof(float) / cols
+                  && l->weights_offset <= size && rows * cols * sizeof(float) <= size - l->weights_offset
+                  && l->bias_offset <= size && rows * sizeof(float) <= size - l->bias_offset;
+        previous_outputs = l->nb_neurons;
+        if(!valid){
+            fprintf(stderr, "nn_load: Corrupted description of layer %zu\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Loads a model file written by nn_save.
+ *
+ * The file is mapped and the weights and biases of the layers point into the
+ * mapping, so nothing is copied. nn_destroy unmaps it.
+ *
+ * @param path The path of the model file.
+ * @return The compiled neural network, or NULL on failure.
+ */
+neural_network* nn_load(const char *path){
+    if(!NN_FILE_HOST_LITTLE_ENDIAN){
+        fprintf(stderr, "nn_load: Model files are little-endian and this host is not\n");
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "nn_load: Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        fprintf(stderr, "nn_load: Unable to read %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        fprintf(stderr, "nn_load: Unable to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if(!nn_file_check(data, size)){
+        munmap(data, size);
+        return NULL;
+    }
+
+    const nn_file_header *header = (const nn_file_header*) data;
+
+    neural_network *nn = neural_network_create();
+    nn_set_loss_function(nn, header->loss_function);
+    nn_set_learning_rate(nn, header->learning_rate);
+    nn->mapping = data;
+    nn->mapping_size = size;
+
+    for(size_t i = 0; i < header->nb_layers; i++){
+        nn_file_layer entry = nn_file_get_layer(data, header->version, i);
+        const nn_file_layer *l = &entry;
+        if(i == 0)
+            nn_set_input_layer_builtin(nn, l->nb_neurons, l->activation);
+        else if(i == header->nb_layers - 1)
+            nn_set_output_layer_builtin(nn, l->nb_neurons, l->activation);
+        else
+            nn_add_hidden_layer_builtin(nn, l->nb_neurons, l->activation);
+
+        layer *dest = nn->layers[i];
+        dest->input_size = l->input_size;
+        if(l->kind == LAYER_CONV2D){
+            dest->kind = LAYER_CONV2D;
+            dest->conv = nn_file_conv_shape(l);
+            conv_shape_init(&dest->conv);
+        }
+        size_t rows = layer_weights_rows(dest);
+        dest->weights = matrix_wrap(rows, layer_weights_cols(dest), (float*) (data + l->weights_offset));
+        dest->bias = matrix_wrap(rows, 1, (float*) (data + l->bias_offset));
+        if(dest->weights == NULL || dest->bias == NULL){
+            fprintf(stderr, "nn_load: Unable to allocate memory for the layers\n");
+            nn_destroy(nn);
+            return NULL;
+        }
+    }
+    // pruned layers are served by the sparse kernel
+    nn_sync_sparse_weights(nn);
+    return nn;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "neuralNetwork.h"
+
+// Binary model file, little-endian (nn_save and nn_load refuse to run on
+// big-endian hosts, since the weights are used in place):
+//   nn_file_header
+//   nn_file_layer for every layer
+//   the weights and bias of every layer (layer_weights_rows x layer_weights_cols
+//   and layer_weights_rows), row-major floats, each blob starting on a
+//   NN_FILE_ALIGNMENT boundary
+// The alignment lets nn_load point the matrices straight into the mapped file.
+// Version 1 files, whose layer entries stop before kind, hold dense layers only.
+#define NN_FILE_MAGIC "NNMODEL"
+#define NN_FILE_VERSION 2
+#define NN_FILE_ALIGNMENT 64
+
+typedef struct nn_file_header{
+    char magic[8];              // NN_FILE_MAGIC, NUL terminated
+    uint32_t version;
+    uint32_t nb_layers;
+    uint32_t loss_function;
+    float learning_rate;
+    uint64_t file_size;
+    uint8_t reserved[32];
+} nn_file_header;
+
+typedef struct nn_file_layer{
+    uint32_t type;              // layer_type
+    uint32_t activation;        // activation_type, never ACTIVATION_CUSTOM
+    uint64_t input_size;
+    uint64_t nb_neurons;
+    uint64_t weights_offset;    // from the start of the file
+    uint64_t bias_offset;
+    uint32_t kind;              // layer_kind
+    uint32_t conv[9];           // shape of a LAYER_CONV2D: in_channels, in_height, in_width, out_channels,
+                                // kernel_height, kernel_width, stride, padding, dilation
+} nn_file_layer;
+
+// Writes a compiled network to path, returns false on failure
+// Layers with custom activation functions cannot be saved.
+bool nn_save(const neural_network *nn, const char *path);
+
+// Maps the model file at path, NULL on failure
+// The weights are not copied: they stay in the page cache, shared by every
+// process that loads the same file. The mapping is private, so training a
+// loaded network never writes to the file.
+neural_network* nn_load(const char *path);
@@ -7,9 +7,17 @@
 #include <stdio.h>
 #include <math.h>
 #include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "neuralNetwork.h"
 #include "../Matrix/matrix.h"
+#include "../Matrix/dense.h"
+#include "../Matrix/expression.h"
+#include "../Matrix/random.h"
+#include "../ThreadPool/threadPool.h"
+#include "../Profiler/profiler.h"
+#include "../Dataset/dataset.h"
 #include "../list/list.h"
 
 // Layer creation and destruction
@@ -29,23 +37,124 @@ layer* layer_create(layer_type type, size_t nb_neurons, size_t input_size, float
 		exit(1);
 	}
     l->type = type;
+    l->kind = LAYER_DENSE;
 	l->input_size = input_size;
 	l->nb_neurons = nb_neurons;
+    l->conv = (conv_shape){0};
+	l->weights = NULL;
+	l->bias = NULL;
+	l->half_weights = NULL;
+    l->sparse_weights = NULL;
+    for(size_t k = 0; k < 2; k++){
+        l->states[k] = NULL;
+        l->bias_states[k] = NULL;
+    }
+	l->activation_type = ACTIVATION_CUSTOM;
 	l->activation = activation;
 	l->activation_prime = activation_prime;
 	return l;
 }
 
 /**
- * @brief Destroys a layer and frees the memory allocated for its weights->
+ * @brief Frees the optimizer state of a layer, the next training run starting from zero.
+ */
+static void layer_clear_optimizer_state(layer *l){
+    for(size_t k = 0; k < 2; k++){
+        if(l->states[k] != NULL)
+            matrix_destroy(l->states[k]);
+        if(l->bias_states[k] != NULL)
+            matrix_destroy(l->bias_states[k]);
+        l->states[k] = NULL;
+        l->bias_states[k] = NULL;
+    }
+}
+
+/**
+ * @brief Destroys a layer and frees the memory allocated for its weights and bias.
  * 
  * @param l The layer to destroy.
  */
 void layer_destroy(layer *l){
-	matrix_destroy(l->weights);
+	if(l->weights != NULL)
+		matrix_destroy(l->weights);
+	if(l->bias != NULL)
+		matrix_destroy(l->bias);
+	if(l->half_weights != NULL)
+		matrix_half_destroy(l->half_weights);
+    matrix_csr_destroy(l->sparse_weights);
+    layer_clear_optimizer_state(l);
 	free(l);
 }
 
+
+/**
+ * @brief Number of rows of the weights of a layer: its neurons, or the output channels of a convolution.
+ */
+size_t layer_weights_rows(const layer *l){
+    return l->kind == LAYER_CONV2D ? l->conv.out_channels : l->nb_neurons;
+}
+
+/**
+ * @brief Number of columns of the weights of a layer: its inputs, or the patch size of a convolution.
+ */
+size_t layer_weights_cols(const layer *l){
+    return l->kind == LAYER_CONV2D ? conv_patch_size(&l->conv) : l->input_size;
+}
+
+/**
+ * @brief Brings the half precision copy of the weights of a layer up to date.
+ * 
+ * The copy is created on first use, and dropped when the precision goes back to fp32.
+ * 
+ * @param l The layer.
+ * @param precision The precision of the network.
+ */
+static void layer_sync_half_weights(layer *l, matrix_type precision){
+    if(l->half_weights != NULL && (precision == MATRIX_FLOAT || l->half_weights->type != precision)){
+        matrix_half_destroy(l->half_weights);
+        l->half_weights = NULL;
+    }
+    if(precision == MATRIX_FLOAT || l->weights == NULL)
+        return;
+
+    if(l->half_weights == NULL){
+        l->half_weights = matrix_half_from(l->weights, precision);
+        if(l->half_weights == NULL){
+            fprintf(stderr, "layer_sync_half_weights: Unable to allocate memory for the weights\n");
+            exit(1);
+        }
+    }
+    else
+        matrix_half_copy_from(l->half_weights, l->weights);
+}
+
+/**
+ * @brief Keeps a CSR copy of the weights of a dense layer when it makes the inference faster.
+ * 
+ * The copy exists when the density of the weights is at most the crossover
+ * of matrix_csr_crossover, which is only timed once a layer is at most half
+ * full, and is dropped otherwise.
+ * 
+ * @param l The layer.
+ */
+static void layer_sync_sparse_weights(layer *l){
+    matrix_csr_destroy(l->sparse_weights);
+    l->sparse_weights = NULL;
+    if(l->kind != LAYER_DENSE || l->weights == NULL)
+        return;
+
+    size_t size = l->weights->row * l->weights->col;
+    size_t nonzeros = matrix_count_nonzeros(l->weights);
+    if(2 * nonzeros > size || nonzeros > matrix_csr_crossover() * size)
+        return;
+
+    l->sparse_weights = matrix_csr_from(l->weights);
+    if(l->sparse_weights == NULL){
+        fprintf(stderr, "layer_sync_sparse_weights: Unable to allocate memory for the weights\n");
+        exit(1);
+    }
+}
+
 // Neural network creation and destruction
 
 /**
@@ -68,7 +177,19 @@ neural_network* neural_network_create(){
     nn->learning_rate = 0.01;
     nn->dropout_rate = 0;
     nn->momentum_rate = 0;
+    nn->optimizer = OPTIMIZER_SGD;
+    nn->beta1 = 0.9;
+    nn->beta2 = 0.999;
+    nn->epsilon = 1e-8;
+    nn->weight_decay = 0;
+    nn->optimizer_step = 0;
+    nn->loss = 0;
     nn->batch_size = 1;
+    nn->shuffle = true;
+    nn->parallel_mode = PARALLEL_NONE;
+    nn->precision = MATRIX_FLOAT;
+    nn->mapping = NULL;
+    nn->mapping_size = 0;
 	return nn;
 }
 
@@ -81,6 +202,10 @@ void nn_destroy(neural_network *nn){
 	for(size_t i = 0; i < nn->nb_layers; i++){
         layer_destroy(nn->layers[i]);
     }
+
+    // the weights of a loaded model live in the mapping
+    if(nn->mapping != NULL)
+        munmap(nn->mapping, nn->mapping_size);
 }
 
 // Neural network parameters
@@ -135,8 +260,15 @@ void nn_set_output_layer(neural_network *nn, size_t nb_neurons, float (*activati
 
 	// add the output layer to the list
     // if the list is full, we double its size
-    if(nn->nb_layers == nn->max_layers)
-        nn->layers = malloc(2*nn->nb_layers * sizeof(layer*));
+    if(nn->nb_layers == nn->max_layers){
+        layer **layers = realloc(nn->layers, 2*nn->max_layers * sizeof(layer*));
+        if(layers == NULL){
+            fprintf(stderr, "nn_set_output_layer: Unable to allocate memory for the layers\n");
+            exit(1);
+        }
+        nn->layers = layers;
+        nn->max_layers *= 2;
+    }
     nn->layers[nn->nb_layers++] = l;
 }
 
@@ -168,12 +300,131 @@ void nn_add_hidden_layer(neural_network *nn, size_t nb_neurons, float (*activati
 
 	// add the output layer to the list
     // if the list is full, we double its size
-    if(nn->nb_layers == nn->max_layers)
-        nn->layers = malloc(2*nn->nb_layers * sizeof(layer*));
-
+    if(nn->nb_layers == nn->max_layers){
+        layer **layers = realloc(nn->layers, 2*nn->max_layers * sizeof(layer*));
+        if(layers == NULL){
+            fprintf(stderr, "nn_add_hidden_layer: Unable to allocate memory for the layers\n");
+            exit(1);
+        }
+        nn->layers = layers;
+        nn->max_layers *= 2;
+    }
     nn->layers[nn->nb_layers++] = l;
 }
 
+/**
+ * @brief Sets the input layer of the neural network with a built-in activation function.
+ * 
+ * Built-in activations run as vectorized kernels instead of one call through a pointer per element.
+ * 
+ * @param nn The neural network.
+ * @param nb_neurons The number of neurons in the input layer.
+ * @param activation The activation function for the input layer.
+ */
+void nn_set_input_layer_builtin(neural_network *nn, size_t nb_neurons, activation_type activation){
+	nn_set_input_layer(nn, nb_neurons, NULL, NULL);
+	nn->layers[nn->nb_layers - 1]->activation_type = activation;
+}
+
+/**
+ * @brief Sets the output layer of the neural network with a built-in activation function.
+ * 
+ * @param nn The neural network.
+ * @param nb_neurons The number of neurons in the output layer.
+ * @param activation The activation function for the output layer.
+ */
+void nn_set_output_layer_builtin(neural_network *nn, size_t nb_neurons, activation_type activation){
+	nn_set_output_layer(nn, nb_neurons, NULL, NULL);
+	nn->layers[nn->nb_layers - 1]->activation_type = activation;
+}
+
+/**
+ * @brief Adds a hidden layer to the neural network with a built-in activation function.
+ * 
+ * @param nn The neural network.
+ * @param nb_neurons The number of neurons in the hidden layer.
+ * @param activation The activation function for the hidden layer.
+ */
+void nn_add_hidden_layer_builtin(neural_network *nn, size_t nb_neurons, activation_type activation){
+	nn_add_hidden_layer(nn, nb_neurons, NULL, NULL);
+	nn->layers[nn->nb_layers - 1]->activation_type = activation;
+}
+
+/**
+ * @brief Computes the output shape of a convolution layer and checks it.
+ * 
+ * @param shape The shape of the layer, out_height and out_width being set.
+ * @param caller The name of the calling function, for the error message.
+ */
+static void nn_init_conv_shape(conv_shape *shape, const char *caller){
+    if(!conv_shape_init(shape)){
+        fprintf(stderr, "%s: Invalid convolution shape\n", caller);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Turns the layer just added to the network into a convolution layer.
+ * 
+ * @param nn The neural network.
+ * @param shape The initialized shape of the layer.
+ * @param caller The name of the calling function, for the error message.
+ */
+static void nn_last_layer_to_conv2d(neural_network *nn, const conv_shape *shape, const char *caller){
+    layer *l = nn->layers[nn->nb_layers - 1];
+
+    // the input layer gets its input size at compile time
+    if(l->type != INPUT && l->input_size != conv_input_size(shape)){
+        fprintf(stderr, "%s: The previous layer has %zu outputs, the convolution takes %zu x %zu x %zu inputs\n",
+                caller, l->input_size, shape->in_channels, shape->in_height, shape->in_width);
+        exit(1);
+    }
+    l->kind = LAYER_CONV2D;
+    l->conv = *shape;
+}
+
+/**
+ * @brief Sets the input layer of the neural network to a 2D convolution.
+ * 
+ * The samples given to the network are then images of shape.in_channels
+ * channels of shape.in_height x shape.in_width values (CHW).
+ * 
+ * @param nn The neural network.
+ * @param shape The shape of the convolution, out_height and out_width being computed.
+ * @param activation The activation function of the layer.
+ */
+void nn_set_input_conv2d_layer(neural_network *nn, conv_shape shape, activation_type activation){
+    nn_init_conv_shape(&shape, "nn_set_input_conv2d_layer");
+    nn_set_input_layer_builtin(nn, conv_output_size(&shape), activation);
+    nn_last_layer_to_conv2d(nn, &shape, "nn_set_input_conv2d_layer");
+}
+
+/**
+ * @brief Sets the output layer of the neural network to a 2D convolution.
+ * 
+ * @param nn The neural network.
+ * @param shape The shape of the convolution, out_height and out_width being computed.
+ * @param activation The activation function of the layer.
+ */
+void nn_set_output_conv2d_layer(neural_network *nn, conv_shape shape, activation_type activation){
+    nn_init_conv_shape(&shape, "nn_set_output_conv2d_layer");
+    nn_set_output_layer_builtin(nn, conv_output_size(&shape), activation);
+    nn_last_layer_to_conv2d(nn, &shape, "nn_set_output_conv2d_layer");
+}
+
+/**
+ * @brief Adds a 2D convolution hidden layer to the neural network.
+ * 
+ * @param nn The neural network.
+ * @param shape The shape of the convolution, out_height and out_width being computed.
+ * @param activation The activation function of the layer.
+ */
+void nn_add_hidden_conv2d_layer(neural_network *nn, conv_shape shape, activation_type activation){
+    nn_init_conv_shape(&shape, "nn_add_hidden_conv2d_layer");
+    nn_add_hidden_layer_builtin(nn, conv_output_size(&shape), activation);
+    nn_last_layer_to_conv2d(nn, &shape, "nn_add_hidden_conv2d_layer");
+}
+
 /**
  * @brief Sets the loss function of the neural network.
  * 
@@ -197,10 +448,18 @@ void nn_set_learning_rate(neural_network *nn, float learning_rate){
 /**
  * @brief Sets the dropout rate of the neural network.
  * 
+ * During training, every output of a layer other than the output layer is
+ * zeroed with this probability and the others are scaled by 1 / (1 - rate)
+ * (inverted dropout), so inference runs the layers unchanged.
+ * 
  * @param nn The neural network.
- * @param dropout_rate The dropout rate to be used for training the network.
+ * @param dropout_rate The dropout rate to be used for training the network, in [0, 1).
  */
 void nn_set_dropout_rate(neural_network *nn, float dropout_rate){
+	if(dropout_rate < 0 || dropout_rate >= 1){
+		fprintf(stderr, "nn_set_dropout_rate: The dropout rate must be in [0, 1)\n");
+		exit(1);
+	}
 	nn->dropout_rate = dropout_rate;
 }
 
@@ -214,6 +473,46 @@ void nn_set_momentum_rate(neural_network *nn, float momentum_rate){
 	nn->momentum_rate = momentum_rate;
 }
 
+/**
+ * @brief Sets the optimizer updating the weights and clears its state.
+ * 
+ * OPTIMIZER_SGD and OPTIMIZER_NESTEROV use the momentum rate, OPTIMIZER_ADAM
+ * and OPTIMIZER_ADAMW the Adam parameters.
+ * 
+ * @param nn The neural network.
+ * @param type The optimizer.
+ */
+void nn_set_optimizer(neural_network *nn, optimizer_type type){
+	nn->optimizer = type;
+	nn->optimizer_step = 0;
+	for(size_t i = 0; i < nn->nb_layers; i++)
+		layer_clear_optimizer_state(nn->layers[i]);
+}
+
+/**
+ * @brief Sets the decay rates of the moments and the epsilon of Adam and AdamW.
+ * 
+ * @param nn The neural network.
+ * @param beta1 The decay rate of the mean of the gradients (0.9 by default).
+ * @param beta2 The decay rate of the mean of their squares (0.999 by default).
+ * @param epsilon The term keeping the update finite (1e-8 by default).
+ */
+void nn_set_adam_parameters(neural_network *nn, float beta1, float beta2, float epsilon){
+	nn->beta1 = beta1;
+	nn->beta2 = beta2;
+	nn->epsilon = epsilon;
+}
+
+/**
+ * @brief Sets the weight decay of the optimizer, applied to the weights but not to the biases.
+ * 
+ * @param nn The neural network.
+ * @param weight_decay The L2 penalty (0 by default).
+ */
+void nn_set_weight_decay(neural_network *nn, float weight_decay){
+	nn->weight_decay = weight_decay;
+}
+
 /**
  * @brief Sets the batch size of the neural network.
  * 
@@ -221,219 +520,1326 @@ void nn_set_momentum_rate(neural_network *nn, float momentum_rate){
  * @param batch_size The batch size to be used for training the network.
  */
 void nn_set_batch_size(neural_network *nn, size_t batch_size){
+	if(batch_size == 0){
+		fprintf(stderr, "nn_set_batch_size: The batch size must be at least 1\n");
+		exit(1);
+	}
 	nn->batch_size = batch_size;
 }
 
+/**
+ * @brief Sets whether the samples are shuffled at the beginning of every epoch.
+ * 
+ * @param nn The neural network.
+ * @param shuffle true to visit the samples in a new random order every epoch.
+ */
+void nn_set_shuffle(neural_network *nn, bool shuffle){
+	nn->shuffle = shuffle;
+}
+
+/**
+ * @brief Sets how the training spreads the batches over the threads.
+ * 
+ * PARALLEL_DATA gives the same result for a fixed number of threads.
+ * PARALLEL_HOGWILD lets the threads update the weights concurrently,
+ * which is faster but not reproducible.
+ * 
+ * @param nn The neural network.
+ * @param mode The parallel training mode.
+ */
+void nn_set_parallel_mode(neural_network *nn, parallel_mode mode){
+	nn->parallel_mode = mode;
+}
+
+/**
+ * @brief Sets the precision of the weights read by the forward and backward passes.
+ * 
+ * In MATRIX_FP16 or MATRIX_BF16, every layer keeps a half precision copy of
+ * its weights, which the GEMMs convert to float as they load it: this halves
+ * the weight traffic of the passes, the products still being accumulated in
+ * float. The fp32 weights stay the master copy: the training updates them
+ * and refreshes the half copy after every step (mixed precision training).
+ * 
+ * @param nn The neural network, compiled or not.
+ * @param precision MATRIX_FLOAT, MATRIX_FP16 or MATRIX_BF16.
+ */
+void nn_set_precision(neural_network *nn, matrix_type precision){
+	nn->precision = precision;
+	for(size_t i = 0; i < nn->nb_layers; i++)
+		layer_sync_half_weights(nn->layers[i], precision);
+}
+
+/**
+ * @brief Refreshes the sparse copies of the weights of the layers.
+ * 
+ * nn_load, nn_prune and the training call it, code writing the weights
+ * directly must call it before the next inference.
+ * 
+ * @param nn The neural network.
+ */
+void nn_sync_sparse_weights(neural_network *nn){
+	for(size_t i = 0; i < nn->nb_layers; i++)
+		layer_sync_sparse_weights(nn->layers[i]);
+}
+
+/**
+ * @brief Prunes the weights of the dense layers, keeping the largest ones.
+ * 
+ * Every dense layer keeps the density * size weights (rounded) of largest
+ * magnitude and the others are set to 0. Once the density of a layer is
+ * below the crossover of matrix_csr_crossover, the inference only goes through
+ * its nonzero weights. Convolutions are left untouched. A later training run
+ * updates every weight again, so the pruned weights grow back.
+ * 
+ * @param nn The compiled neural network.
+ * @param density The fraction of the weights to keep, in [0, 1].
+ */
+void nn_prune(neural_network *nn, float density){
+	if(nn->nb_layers == 0 || nn->layers[0]->weights == NULL){
+		fprintf(stderr, "nn_prune: Compile the network first\n");
+		exit(1);
+	}
+	if(!(density >= 0 && density <= 1)){
+		fprintf(stderr, "nn_prune: The density must be between 0 and 1\n");
+		exit(1);
+	}
+
+	for(size_t i = 0; i < nn->nb_layers; i++){
+		layer *l = nn->layers[i];
+		if(l->kind != LAYER_DENSE)
+			continue;
+		matrix_prune(l->weights, density);
+		layer_sync_half_weights(l, nn->precision);
+		layer_sync_sparse_weights(l);
+	}
+}
+
 // Neural network training
 
+/**
+ * @brief Bound of the uniform initialization of the weights of a layer.
+ * 
+ * He initialization, sqrt(6 / fan_in), for the ReLU family, which zeroes half
+ * of its inputs, and Glorot (Xavier) initialization, sqrt(6 / (fan_in + fan_out)),
+ * otherwise. Every output value of a convolution reads kernel_height x kernel_width
+ * weights per output channel, which makes its fan out.
+ */
+static float layer_init_limit(const layer *l){
+    float fan_in = (float) layer_weights_cols(l);
+    float fan_out = (float) layer_weights_rows(l);
+    if(l->kind == LAYER_CONV2D)
+        fan_out *= (float) (l->conv.kernel_height * l->conv.kernel_width);
+
+    if(l->activation_type == ACTIVATION_RELU || l->activation_type == ACTIVATION_LEAKY_RELU)
+        return sqrtf(6 / fan_in);
+    return sqrtf(6 / (fan_in + fan_out));
+}
+
 /**
  * @brief Compiles the layers of the neural network by initializing the weights matrices.
  * 
- * The weights are initialized with random values from -1 to 1.
+ * The weights are initialized with uniform values scaled to the layer (see
+ * layer_init_limit) and the biases with 0.
  * The input layer is initialized with the input_layer_size x next_layer_size x.
  * The output layer is initialized with the output_layer_size x previous_layer_size.
  * The hidden layers are initialized with the next_layer_size x previous_layer_size.
  * 
  * @param nn The neural network.
  */
-void nn_compile_layers(neural_network *nn){
+static void nn_compile_layers(neural_network *nn){
+    layer *first = nn->layers[0];
+    if(first->kind == LAYER_CONV2D && first->input_size != conv_input_size(&first->conv)){
+        fprintf(stderr, "nn_compile: The samples have %zu values, the first convolution takes %zu x %zu x %zu\n",
+                first->input_size, first->conv.in_channels, first->conv.in_height, first->conv.in_width);
+        exit(1);
+    }
+
     // iterate over the layers and initialize the weights matrices
-    // begin with the input layer
-    nn->layers[0]->weights = matrix_create_random(nn->layers[0]->nb_neurons, nn->layers[0]->input_size, -1, 1);
+    // (nb_neurons x input_size, or out_channels x patch size for a convolution)
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        float limit = layer_init_limit(nn->layers[i]);
+        nn->layers[i]->weights = matrix_create_random(layer_weights_rows(nn->layers[i]), layer_weights_cols(nn->layers[i]), -limit, limit);
+    }
 
-    // iterate over the hidden layers
-    for(size_t i = 1; i < nn->nb_layers; i++)
-        nn->layers[i]->weights = matrix_create_random(nn->layers[i]->nb_neurons, nn->layers[i]->input_size, -1, 1);
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        nn->layers[i]->bias = matrix_zeros(layer_weights_rows(nn->layers[i]), 1);
+        layer_sync_half_weights(nn->layers[i], nn->precision);
+    }
 }   
 
 /**
- * @brief Trains the neural network using the specified input and output matrices for the specified number of epochs.
+ * @brief Sets the input size of the network and initializes the weights of all its layers.
+ * 
+ * nn_train does it on its first call, a network only used for inference must be compiled explicitly.
  * 
  * @param nn The neural network.
- * @param X The input matrix.
- * @param T The target matrix.
- * @param epochs The number of epochs to train the network.
+ * @param input_size The number of features of a sample.
  */
-void nn_train(neural_network *nn, matrix *X_data, matrix *T_data, size_t epochs){
-    if(nn->nb_layers == 0){
-            fprintf(stderr, "nn_train: Set the input layer first\n");
-            exit(1);
-    }
-    if(nn->layers[nn->nb_layers - 1]->type != OUTPUT){
-            fprintf(stderr, "nn_train: Set the output layer first\n");
-            exit(1);
-    }
-    if(X_data->col != T_data->col){
-            fprintf(stderr, "nn_train: Input and output matrices must have the same number of columns\n");
-            exit(1);
-    }
-
-    // If code not compiled ie the weights of input layer are not setted
-    if(((layer*)nn->layers[0])->input_size == 0){
-    	// The only missing is the input size of the input layer (which is the number of raw of the input matrix)
-    	// We therefore get the number of raw of the input matrix and set it as the input size of the input layer
-    	// compile the layers by setting the weights matrices
-        ((layer *) nn->layers[0])->input_size = X_data->row;
-        nn_compile_layers(nn);
+void nn_compile(neural_network *nn, size_t input_size){
+    if(nn->nb_layers == 0 || nn->layers[nn->nb_layers - 1]->type != OUTPUT){
+        fprintf(stderr, "nn_compile: Set the input and output layers first\n");
+        exit(1);
     }
 
+    nn->layers[0]->input_size = input_size;
+    nn_compile_layers(nn);
+}
 
-    // Lists to store all results
-    matrix** v_arr = malloc(nn->nb_layers * sizeof(matrix*));
-    matrix** y_arr = malloc(nn->nb_layers * sizeof(matrix*));
-    matrix** deltas_arr = malloc(nn->nb_layers * sizeof(matrix*));
-
-    for(size_t e = 0; e < epochs; e++){
-/*         // Normalize all weights by dividing by the absolute maximum value
-        for(size_t i = 0; i < nn->nb_layers; i++){
-            matrix *w = nn->layers[i]->weights;
-            float max = -1;
-            for(size_t j = 0; j < w->row * w->col; j++){
-                if(fabs(w->data[j]) > max)
-                    max = fabs(w->data[j]);
-            }
-            matrix_scalar_div_inplace(w, max);
-        }
+/**
+ * @brief Creates and compiles a network with random weights from a text description.
+ * 
+ * The description is the input size followed by the layers, separated by
+ * commas: "784,128:relu,10:softmax". Each layer is a number of neurons and an
+ * optional activation name (sigmoid by default). The first layer is the input
+ * layer and the last one the output layer.
+ * 
+ * @param spec The description of the network.
+ * @return The compiled neural network.
  */
+neural_network* nn_create_from_spec(const char *spec){
+    char *copy = strdup(spec);
+    if(copy == NULL){
+        fprintf(stderr, "nn_create_from_spec: Unable to allocate memory for the description\n");
+        exit(1);
+    }
+    size_t counts[64];
+    activation_type types[64];
+    size_t n = 0;
 
-        // select one X
-        size_t index = e % X_data->col;
-        matrix *X = matrix_get_col(X_data, index);
-        matrix *T = matrix_get_col(T_data, index);
-
-        // Forward propagation
-        for(size_t i = 0; i < nn->nb_layers; i++){
-            matrix *v;
-            // Compute W*X
-            if(i == 0)
-                v = matrix_mul(nn->layers[i]->weights, X);
-            else
-                v = matrix_mul(nn->layers[i]->weights, y_arr[i - 1]);
-            v_arr[i] = v;
-
-            // Compute Y = f(W*X)
-            y_arr[i] = matrix_get_copy(v);
-            matrix_apply(y_arr[i], nn->layers[i]->activation);
+    for(char *save = NULL, *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+        if(n == 64){
+            fprintf(stderr, "nn_create_from_spec: Too many layers\n");
+            exit(1);
+        }
 
-            if(i == nn->nb_layers - 1)
-                matrix_print(y_arr[i]);
+        char *end;
+        long count = strtol(tok, &end, 10);
+        if(end == tok || count <= 0){
+            fprintf(stderr, "nn_create_from_spec: Invalid layer size '%s'\n", tok);
+            exit(1);
         }
 
-        // Backward propagation
-        for(int i = nn->nb_layers - 1; i >= 0; i--){
-            matrix *error;
-            if((size_t) i == nn->nb_layers - 1){
-                // Compute the output layer delta
-                error = matrix_sub(T, y_arr[i]);
-
-                if(nn->loss_function == CROSS_ENTROPY)
-                    // delta = error
-                    deltas_arr[i] = error;
-                else{
-                    // delta = error * f'(v)
-                    deltas_arr[i] = matrix_get_copy(y_arr[i]);
-                    matrix_apply(deltas_arr[i], nn->layers[i]->activation_prime);
-                    matrix_dot_inplace(deltas_arr[i], error);
-                }
-            }else{
-                // Compute the hidden layer delta
-                matrix *w_t = matrix_transpose(nn->layers[i + 1]->weights);
-
-                // delta = W_t * delta_next * f'(v)
-                error = matrix_mul(w_t, deltas_arr[i + 1]);
-
-                // sigmoid prime
-                deltas_arr[i] = matrix_get_copy(y_arr[i]);
-                matrix_apply(deltas_arr[i], nn->layers[i]->activation_prime);
-                matrix_dot_inplace(error, y_arr[i]);
-
-                // Free w_t and error
-                matrix_destroy(w_t);
+        types[n] = ACTIVATION_SIGMOID;
+        if(*end == ':'){
+            types[n] = activation_from_name(end + 1);
+            if(types[n] == ACTIVATION_CUSTOM){
+                fprintf(stderr, "nn_create_from_spec: Unknown activation '%s'\n", end + 1);
+                exit(1);
             }
         }
+        else if(*end != '\0'){
+            fprintf(stderr, "nn_create_from_spec: Invalid layer '%s'\n", tok);
+            exit(1);
+        }
+        counts[n++] = count;
+    }
+    free(copy);
 
-        // Update the weights
-        for(size_t i = 0; i < nn->nb_layers; i++){
-            matrix *y_t = matrix_transpose(i == 0 ? X : y_arr[i - 1]);
-            matrix *dw = matrix_mul(deltas_arr[i], y_t);
+    // The input size, the input layer and the output layer at least
+    if(n < 3){
+        fprintf(stderr, "nn_create_from_spec: Expected an input size and at least two layers\n");
+        exit(1);
+    }
 
-            // dw_alpha = dw * alpha
-            matrix_scalar_mul_inplace(dw, nn->learning_rate);
-            // W = W + dw_alpha
-            matrix_add_inplace(nn->layers[i]->weights, dw);
+    neural_network *nn = neural_network_create();
+    nn_set_input_layer_builtin(nn, counts[1], types[1]);
+    for(size_t i = 2; i < n - 1; i++)
+        nn_add_hidden_layer_builtin(nn, counts[i], types[i]);
+    nn_set_output_layer_builtin(nn, counts[n - 1], types[n - 1]);
+    nn_compile(nn, counts[0]);
+    return nn;
+}
 
-            // Free dw
-            matrix_destroy(y_t);
-            matrix_destroy(dw);
-        }
-    }
+// Layer activation
 
-    // Inference
-    matrix* output = nn_predict(nn, X_data);
-    matrix_print(output);
-    matrix_destroy(output);
+/**
+ * @brief Applies the activation function of a layer in place.
+ * 
+ * Built-in activations use the vectorized kernels, custom ones are called once per element.
+ * 
+ * @param l The layer.
+ * @param y The pre-activations of the layer, replaced by its outputs.
+ */
+static void layer_activate(const layer *l, matrix *y){
+    if(l->activation_type == ACTIVATION_CUSTOM)
+        matrix_apply(y, l->activation);
+    else
+        matrix_apply_activation(y, l->activation_type);
+}
 
-    // Free all results
-    for(size_t i = 0; i < nn->nb_layers; i++){
-        matrix_destroy(v_arr[i]);
-        matrix_destroy(y_arr[i]);
-        matrix_destroy(deltas_arr[i]);
-    }
-    free(v_arr);
-    free(y_arr);
-    free(deltas_arr);
+/**
+ * @brief Views a convolution buffer shared by the layers as a rows x cols matrix.
+ * 
+ * @param buffer The shared buffer, holding at least rows x cols values.
+ */
+static matrix nn_conv_buffer(const matrix *buffer, size_t rows, size_t cols){
+    return (matrix){rows, cols, cols, buffer->data, false};
 }
 
 /**
- * @brief Predicts the output for the given input matrix using the neural network.
+ * @brief Sizes per sample of the largest convolution buffers of a network.
  * 
  * @param nn The neural network.
- * @param X The input matrix.
- * @return The predicted output matrix.
+ * @param cols_size Receives the largest im2col matrix (patch size x positions), 0 without convolutions.
+ * @param rows_size Receives the largest output (out_channels x positions).
  */
-matrix* nn_predict(neural_network *nn, matrix *X){
-    if(nn->nb_layers == 0){
-            fprintf(stderr, "nn_train: Set the input layer first\n");
-            exit(1);
-    }
-    if(nn->layers[nn->nb_layers - 1]->type != OUTPUT){
-            fprintf(stderr, "nn_train: Set the output layer first\n");
-            exit(1);
+static void nn_conv_buffer_sizes(const neural_network *nn, size_t *cols_size, size_t *rows_size){
+    *cols_size = 0;
+    *rows_size = 0;
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        const layer *l = nn->layers[i];
+        if(l->kind != LAYER_CONV2D)
+            continue;
+        if(conv_patch_size(&l->conv) * conv_positions(&l->conv) > *cols_size)
+            *cols_size = conv_patch_size(&l->conv) * conv_positions(&l->conv);
+        if(l->nb_neurons > *rows_size)
+            *rows_size = l->nb_neurons;
     }
+}
 
-    // If code not compiled ie the weights of input layer are not setted
+/**
+ * @brief Computes the output of a layer, Y = f(W * X + b) or Y = f(conv(X) + b).
+ * 
+ * The bias and the built-in activations are fused into the product. Softmax
+ * (which needs whole columns) and custom activations are applied afterwards.
+ * 
+ * @param l The layer.
+ * @param X The input of the layer, one column per sample.
+ * @param y The output of the layer.
+ * @param cols The im2col matrix of a convolution (unused by dense layers).
+ * @param scratch The channel rows of a convolution (unused by dense layers).
+ * @param keep_cols Whether cols must keep the im2col of X for the backward pass.
+ * @param logits Whether a softmax layer stops at its logits, for the fused cross-entropy.
+ */
+static void layer_forward(const layer *l, const matrix_view *X, matrix *y, matrix *cols, matrix *scratch, bool keep_cols, bool logits){
+    if(l->kind == LAYER_CONV2D && keep_cols)
+        matrix_conv_forward_cols(y, l->weights, l->half_weights, X, l->bias, l->activation_type, &l->conv, cols, scratch);
+    else if(l->kind == LAYER_CONV2D)
+        matrix_conv_forward(y, l->weights, l->half_weights, X, l->bias, l->activation_type, &l->conv, cols, scratch);
+    else if(l->sparse_weights != NULL)
+        matrix_dense_forward_sparse(y, l->sparse_weights, X, l->bias, l->activation_type);
+    else if(l->half_weights != NULL)
+        matrix_dense_forward_half(y, l->half_weights, X, l->bias, l->activation_type);
+    else
+        matrix_dense_forward_view(y, l->weights, X, l->bias, l->activation_type);
+
+    if((l->activation_type == ACTIVATION_SOFTMAX && !logits) || l->activation_type == ACTIVATION_CUSTOM)
+        layer_activate(l, y);
+}
+
+/**
+ * @brief Computes delta = error * f'(v) for a layer, from its output y = f(v).
+ * 
+ * @param l The layer.
+ * @param y The outputs of the layer.
+ * @param error The error reaching the layer.
+ * @param delta The result.
+ */
+static void layer_activation_backward(const layer *l, const matrix *y, const matrix *error, matrix *delta){
+    if(l->activation_type == ACTIVATION_CUSTOM){
+        // delta = error * f'(y) in one pass over the batch
+        matrix_expr e;
+        matrix_expr_init(&e);
+        int prime = matrix_expr_apply(&e, matrix_expr_matrix(&e, y), l->activation_prime);
+        matrix_expr_eval(&e, matrix_expr_mul(&e, matrix_expr_matrix(&e, error), prime), delta);
+    }else{
+        matrix_activation_backward(y, error, delta, l->activation_type);
+    }
+}
+
+// Work counted by the profiler
+
+/**
+ * @brief Floating point operations of the product of the weights of a layer by a batch.
+ * 
+ * A convolution applies its weights at every output position, a pruned layer
+ * only its nonzero weights.
+ */
+static inline uint64_t layer_product_flops(const layer *l, size_t batch){
+    if(l->sparse_weights != NULL)
+        return 2 * (uint64_t) l->sparse_weights->nnz * batch;
+    size_t positions = l->kind == LAYER_CONV2D ? conv_positions(&l->conv) : 1;
+    return 2 * (uint64_t) layer_weights_rows(l) * layer_weights_cols(l) * positions * batch;
+}
+
+/**
+ * @brief Least memory traffic of the product of the weights of a layer by a batch:
+ * the weights, the input and the output are each touched once.
+ */
+static inline uint64_t layer_product_bytes(const layer *l, size_t batch){
+    if(l->sparse_weights != NULL)
+        return matrix_csr_size(l->sparse_weights) + (uint64_t) (l->input_size + l->nb_neurons) * batch * sizeof(float);
+    size_t weight_size = l->half_weights != NULL ? sizeof(uint16_t) : sizeof(float);
+    return (uint64_t) layer_weights_rows(l) * layer_weights_cols(l) * weight_size + (uint64_t) (l->input_size + l->nb_neurons) * batch * sizeof(float);
+}
+
+// Training workspace creation and destruction
+
+/**
+ * @brief Creates the buffers needed by a training step on batches of batch_size samples.
+ * 
+ * The layers must be compiled. Every activation, error and delta matrix is
+ * allocated here once, so a training step performs no heap allocation.
+ * 
+ * @param nn The neural network.
+ * @param batch_size The number of samples processed by a training step.
+ * @return The created workspace.
+ */
+nn_workspace* nn_workspace_create(const neural_network *nn, size_t batch_size){
+    nn_workspace *ws = malloc(sizeof(nn_workspace));
+    if(ws == NULL){
+        fprintf(stderr, "nn_workspace_create: Unable to allocate memory for the workspace\n");
+        exit(1);
+    }
+
+    ws->nb_layers = nn->nb_layers;
+    ws->batch_size = batch_size;
+    ws->X = matrix_zeros_padded(nn->layers[0]->input_size, batch_size);
+    ws->T = matrix_zeros_padded(nn->layers[nn->nb_layers - 1]->nb_neurons, batch_size);
+    ws->y = malloc(nn->nb_layers * sizeof(matrix*));
+    ws->errors = malloc(nn->nb_layers * sizeof(matrix*));
+    ws->deltas = malloc(nn->nb_layers * sizeof(matrix*));
+    ws->grads = malloc(nn->nb_layers * sizeof(matrix*));
+    ws->bias_grads = malloc(nn->nb_layers * sizeof(matrix*));
+    ws->cols = calloc(nn->nb_layers, sizeof(matrix*));
+    ws->masks = calloc(nn->nb_layers, sizeof(matrix*));
+    ws->dropped = calloc(nn->nb_layers, sizeof(matrix*));
+    if(ws->X == NULL || ws->T == NULL || ws->y == NULL || ws->errors == NULL || ws->deltas == NULL || ws->grads == NULL
+       || ws->bias_grads == NULL || ws->cols == NULL || ws->masks == NULL || ws->dropped == NULL){
+        fprintf(stderr, "nn_workspace_create: Unable to allocate memory for the workspace\n");
+        exit(1);
+    }
+
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        ws->y[i] = matrix_zeros_padded(nn->layers[i]->nb_neurons, batch_size);
+        ws->errors[i] = matrix_zeros_padded(nn->layers[i]->nb_neurons, batch_size);
+        ws->deltas[i] = matrix_zeros_padded(nn->layers[i]->nb_neurons, batch_size);
+        ws->grads[i] = matrix_zeros(layer_weights_rows(nn->layers[i]), layer_weights_cols(nn->layers[i]));
+        ws->bias_grads[i] = matrix_zeros(layer_weights_rows(nn->layers[i]), 1);
+        if(ws->y[i] == NULL || ws->errors[i] == NULL || ws->deltas[i] == NULL || ws->grads[i] == NULL
+           || ws->bias_grads[i] == NULL){
+            fprintf(stderr, "nn_workspace_create: Unable to allocate memory for the workspace\n");
+            exit(1);
+        }
+
+        // the output layer is never dropped
+        if(nn->dropout_rate > 0 && i < nn->nb_layers - 1){
+            ws->masks[i] = matrix_zeros_padded(nn->layers[i]->nb_neurons, batch_size);
+            ws->dropped[i] = matrix_zeros_padded(nn->layers[i]->nb_neurons, batch_size);
+            if(ws->masks[i] == NULL || ws->dropped[i] == NULL){
+                fprintf(stderr, "nn_workspace_create: Unable to allocate memory for the workspace\n");
+                exit(1);
+            }
+        }
+
+        // the im2col matrix of a convolution is kept from the forward pass to the weight update
+        const layer *l = nn->layers[i];
+        if(l->kind == LAYER_CONV2D){
+            ws->cols[i] = matrix_zeros(conv_patch_size(&l->conv), conv_positions(&l->conv) * batch_size);
+            if(ws->cols[i] == NULL){
+                fprintf(stderr, "nn_workspace_create: Unable to allocate memory for the workspace\n");
+                exit(1);
+            }
+        }
+    }
+
+    size_t cols_size, rows_size;
+    nn_conv_buffer_sizes(nn, &cols_size, &rows_size);
+    ws->conv_dcols = NULL;
+    ws->conv_scratch = NULL;
+    if(cols_size > 0){
+        ws->conv_dcols = matrix_zeros(1, cols_size * batch_size);
+        ws->conv_scratch = matrix_zeros(1, rows_size * batch_size);
+        if(ws->conv_dcols == NULL || ws->conv_scratch == NULL){
+            fprintf(stderr, "nn_workspace_create: Unable to allocate memory for the workspace\n");
+            exit(1);
+        }
+    }
+
+    // every workspace draws its masks from its own stream
+    ws->loss = 0;
+    ws->keep = 1 - nn->dropout_rate;
+    ws->dropout_stream = random_new_stream();
+    ws->dropout_offset = 0;
+    return ws;
+}
+
+/**
+ * @brief Destroys a training workspace and frees all its buffers.
+ * 
+ * @param ws The workspace to destroy.
+ */
+void nn_workspace_destroy(nn_workspace *ws){
+    for(size_t i = 0; i < ws->nb_layers; i++){
+        matrix_destroy(ws->y[i]);
+        matrix_destroy(ws->errors[i]);
+        matrix_destroy(ws->deltas[i]);
+        matrix_destroy(ws->grads[i]);
+        matrix_destroy(ws->bias_grads[i]);
+        if(ws->cols[i] != NULL)
+            matrix_destroy(ws->cols[i]);
+        if(ws->masks[i] != NULL){
+            matrix_destroy(ws->masks[i]);
+            matrix_destroy(ws->dropped[i]);
+        }
+    }
+    if(ws->conv_dcols != NULL){
+        matrix_destroy(ws->conv_dcols);
+        matrix_destroy(ws->conv_scratch);
+    }
+    free(ws->cols);
+    free(ws->masks);
+    free(ws->dropped);
+    free(ws->y);
+    free(ws->errors);
+    free(ws->deltas);
+    free(ws->grads);
+    free(ws->bias_grads);
+    matrix_destroy(ws->X);
+    matrix_destroy(ws->T);
+    free(ws);
+}
+
+/**
+ * @brief Resizes the batches of a workspace to batch_size samples, at most the size it was created with.
+ * 
+ * Used for the last, smaller, batch of an epoch. The buffers are row-major
+ * so a narrower batch is just the beginning of the same storage.
+ * 
+ * @param ws The workspace.
+ * @param batch_size The number of samples of the next batch.
+ */
+void nn_workspace_set_batch(nn_workspace *ws, size_t batch_size){
+    if(batch_size > ws->batch_size){
+        fprintf(stderr, "nn_workspace_set_batch: The workspace was created for batches of %zu samples\n", ws->batch_size);
+        exit(1);
+    }
+
+    ws->X->col = batch_size;
+    ws->T->col = batch_size;
+    ws->batch_X = matrix_view_of(ws->X);
+    ws->batch_T = matrix_view_of(ws->T);
+    for(size_t i = 0; i < ws->nb_layers; i++){
+        ws->y[i]->col = batch_size;
+        ws->errors[i]->col = batch_size;
+        ws->deltas[i]->col = batch_size;
+        if(ws->masks[i] != NULL){
+            ws->masks[i]->col = batch_size;
+            ws->dropped[i]->col = batch_size;
+        }
+    }
+}
+
+/**
+ * @brief Input of layer i in a training step: the batch, or the output of the previous layer after its dropout.
+ */
+static matrix_view nn_layer_input(const nn_workspace *ws, size_t i){
+    if(i == 0)
+        return ws->batch_X;
+    return matrix_view_of(ws->dropped[i - 1] != NULL ? ws->dropped[i - 1] : ws->y[i - 1]);
+}
+
+/**
+ * @brief Draws a new dropout mask for layer i and applies it: dropped = y * mask.
+ * 
+ * The mask holds 1 / keep for the kept outputs and 0 for the others, so the
+ * expected input of the next layer is the one it sees at inference.
+ */
+static void nn_dropout_forward(nn_workspace *ws, size_t i){
+    matrix *mask = ws->masks[i];
+    // whole rows of the buffer, the values only depend on the stream position
+    size_t n = mask->row * mask->stride;
+    random_bernoulli(mask->data, n, &ws->dropout_stream, ws->dropout_offset, ws->keep, 1 / ws->keep);
+    ws->dropout_offset += n;
+
+    matrix_view dropped = matrix_view_of(ws->dropped[i]);
+    matrix_view y = matrix_view_of(ws->y[i]);
+    matrix_view m = matrix_view_of(mask);
+    matrix_view_dot(&dropped, &y, &m);
+}
+
+/**
+ * @brief True when the output layer is a softmax trained with the cross-entropy,
+ * whose loss and gradient are computed together from the logits.
+ */
+static bool nn_softmax_cross_entropy(const neural_network *nn){
+    return nn->loss_function == CROSS_ENTROPY && nn->layers[nn->nb_layers - 1]->activation_type == ACTIVATION_SOFTMAX;
+}
+
+/**
+ * @brief Computes the delta of the output layer and adds the loss of the batch to ws->loss.
+ * 
+ * The loss and its gradient come out of a single pass over the outputs and
+ * the targets. Only custom activations need a second pass for their derivative.
+ * 
+ * @param nn The neural network.
+ * @param ws The training workspace, after the forward pass.
+ */
+static void nn_output_backward(const neural_network *nn, nn_workspace *ws){
+    size_t last = nn->nb_layers - 1;
+    const layer *l = nn->layers[last];
+
+    if(nn->loss_function == CROSS_ENTROPY){
+        // delta = T - Y, a softmax layer keeping its logits in ws->y
+        ws->loss += matrix_cross_entropy_loss(ws->y[last], &ws->batch_T, ws->deltas[last], l->activation_type);
+    }else if(l->activation_type != ACTIVATION_CUSTOM){
+        // delta = (T - Y) * f'(v)
+        ws->loss += matrix_mse_loss(ws->y[last], &ws->batch_T, ws->deltas[last], l->activation_type);
+    }else{
+        // error = T - Y, then delta = error * f'(v)
+        ws->loss += matrix_mse_loss(ws->y[last], &ws->batch_T, ws->errors[last], ACTIVATION_IDENTITY);
+        layer_activation_backward(l, ws->y[last], ws->errors[last], ws->deltas[last]);
+    }
+}
+
+/**
+ * @brief Runs one forward and backward pass on the batch stored in ws->X / ws->T.
+ * 
+ * Every intermediate result is written into the workspace buffers. Each
+ * column of ws->X is a sample, so every layer is a matrix-matrix product
+ * over the whole batch.
+ * 
+ * @param nn The neural network.
+ * @param ws The training workspace holding the batch, receives the deltas.
+ */
+static void nn_backpropagate(const neural_network *nn, nn_workspace *ws){
+    size_t last = nn->nb_layers - 1;
+
+    // Forward propagation
+    // Compute Y = f(W*X + b)
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        PROFILE_BEGIN(scope);
+        const layer *l = nn->layers[i];
+        matrix_view input = nn_layer_input(ws, i);
+        matrix scratch = {0};
+        if(l->kind == LAYER_CONV2D)
+            scratch = nn_conv_buffer(ws->conv_scratch, l->conv.out_channels, conv_positions(&l->conv) * ws->batch_size);
+        layer_forward(l, &input, ws->y[i], ws->cols[i], &scratch, true, i == last && nn_softmax_cross_entropy(nn));
+        if(ws->masks[i] != NULL)
+            nn_dropout_forward(ws, i);
+        PROFILE_END(scope, i, PROFILE_FORWARD, layer_product_flops(nn->layers[i], ws->batch_X.col), layer_product_bytes(nn->layers[i], ws->batch_X.col));
+    }
+
+    // Backward propagation
+    for(size_t i = last + 1; i-- > 0;){
+        const layer *l = nn->layers[i];
+        PROFILE_BEGIN(scope);
+
+        if(i == last){
+            nn_output_backward(nn, ws);
+            PROFILE_END(scope, i, PROFILE_BACKWARD, 3 * (uint64_t) l->nb_neurons * ws->batch_X.col,
+                        3 * (uint64_t) l->nb_neurons * ws->batch_X.col * sizeof(float));
+            continue;
+        }else if(nn->layers[i + 1]->kind == LAYER_CONV2D){
+            // error = col2im(W_next^T * delta_next)
+            const layer *next = nn->layers[i + 1];
+            size_t width = conv_positions(&next->conv) * ws->batch_size;
+            matrix dcols = nn_conv_buffer(ws->conv_dcols, conv_patch_size(&next->conv), width);
+            matrix scratch = nn_conv_buffer(ws->conv_scratch, next->conv.out_channels, width);
+            matrix_conv_backward_input(ws->errors[i], next->weights, next->half_weights, ws->deltas[i + 1], &next->conv, &dcols, &scratch);
+        }else if(l->activation_type != ACTIVATION_CUSTOM){
+            // delta = W_next^T * delta_next * f'(v), the derivative fused into the product
+            const layer *next = nn->layers[i + 1];
+            if(next->half_weights != NULL)
+                matrix_dense_backward_half(ws->deltas[i], next->half_weights, ws->deltas[i + 1], ws->y[i], l->activation_type);
+            else
+                matrix_dense_backward(ws->deltas[i], next->weights, ws->deltas[i + 1], ws->y[i], l->activation_type);
+            // dropped outputs pass no error back, kept ones were scaled
+            if(ws->masks[i] != NULL)
+                matrix_dot_inplace(ws->deltas[i], ws->masks[i]);
+            PROFILE_END(scope, i, PROFILE_BACKWARD, layer_product_flops(next, ws->batch_X.col), layer_product_bytes(next, ws->batch_X.col));
+            continue;
+        }else{
+            // error = W_next^T * delta_next, W_next is read in place
+            matrix_mul_to(ws->errors[i], nn->layers[i + 1]->weights, true, ws->deltas[i + 1], false, 1, 0);
+        }
+
+        // delta = error * f'(v)
+        layer_activation_backward(l, ws->y[i], ws->errors[i], ws->deltas[i]);
+        if(ws->masks[i] != NULL)
+            matrix_dot_inplace(ws->deltas[i], ws->masks[i]);
+        PROFILE_END(scope, i, PROFILE_BACKWARD, layer_product_flops(nn->layers[i + 1], ws->batch_X.col),
+                    layer_product_bytes(nn->layers[i + 1], ws->batch_X.col));
+    }
+}
+
+// Weight updates
+
+/**
+ * @brief Optimizer described by the training parameters of the network.
+ */
+static optimizer nn_optimizer(const neural_network *nn){
+    return (optimizer){
+        .type = nn->optimizer,
+        .learning_rate = nn->learning_rate,
+        .momentum = nn->momentum_rate,
+        .beta1 = nn->beta1,
+        .beta2 = nn->beta2,
+        .epsilon = nn->epsilon,
+        .weight_decay = nn->weight_decay,
+    };
+}
+
+/**
+ * @brief True when the update is W = W + rate * gradient, which the GEMMs accumulate straight into the weights.
+ */
+static bool nn_plain_sgd(const neural_network *nn){
+    return nn->optimizer == OPTIMIZER_SGD && nn->momentum_rate == 0 && nn->weight_decay == 0;
+}
+
+/**
+ * @brief Allocates the optimizer state the layers are missing, starting from zero.
+ * 
+ * @param nn The compiled neural network.
+ */
+static void nn_prepare_optimizer(neural_network *nn){
+    optimizer opt = nn_optimizer(nn);
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        layer *l = nn->layers[i];
+        for(size_t k = 0; k < optimizer_nb_states(&opt); k++){
+            if(l->states[k] == NULL)
+                l->states[k] = matrix_zeros(l->weights->row, l->weights->col);
+            if(l->bias_states[k] == NULL)
+                l->bias_states[k] = matrix_zeros(l->bias->row, l->bias->col);
+            if(l->states[k] == NULL || l->bias_states[k] == NULL){
+                fprintf(stderr, "nn_train: Unable to allocate memory for the optimizer state\n");
+                exit(1);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Bytes moved by the update of the weights of a layer: the weights and their gradient read, the weights written, and the state read and written.
+ */
+static inline uint64_t layer_update_bytes(const layer *l, const optimizer *opt){
+    return (3 + 2 * optimizer_nb_states(opt)) * (uint64_t) l->weights->row * l->weights->col * sizeof(float);
+}
+
+/**
+ * @brief Computes the gradients of layer i on the workspace batch.
+ * 
+ * grads[i] = delta * Y_prev^T and bias_grads[i] = sum of the deltas, both
+ * being minus the gradient of the loss summed over the batch.
+ * 
+ * @param nn The neural network.
+ * @param ws The workspace, after nn_backpropagate.
+ * @param i The layer.
+ */
+static void nn_layer_gradients(const neural_network *nn, nn_workspace *ws, size_t i){
+    const layer *l = nn->layers[i];
+    if(l->kind == LAYER_CONV2D){
+        matrix scratch = nn_conv_buffer(ws->conv_scratch, l->conv.out_channels, conv_positions(&l->conv) * ws->batch_size);
+        matrix_conv_backward_weights(ws->grads[i], ws->bias_grads[i], 1, 0, ws->deltas[i], ws->cols[i], &l->conv, &scratch);
+    }else{
+        matrix_view grads = matrix_view_of(ws->grads[i]);
+        matrix_view delta = matrix_view_of(ws->deltas[i]);
+        matrix_view input = nn_layer_input(ws, i);
+        matrix_view input_t = matrix_view_transpose(&input);
+        matrix_view_mul_to(&grads, &delta, &input_t, 1, 0);
+        matrix_row_sums_to(ws->bias_grads[i], ws->deltas[i], 1, 0);
+    }
+}
+
+/**
+ * @brief Updates the weights and bias of layer i from their gradients in one fused pass each.
+ * 
+ * @param nn The neural network.
+ * @param opt The optimizer of the network.
+ * @param i The layer.
+ * @param grads The gradient of the weights, summed over the batch.
+ * @param bias_grads The gradient of the bias.
+ * @param scale 1 / batch, turning the sums into means.
+ * @param step The number of the update, from 1.
+ */
+static void nn_layer_update(neural_network *nn, const optimizer *opt, size_t i, const matrix *grads, const matrix *bias_grads,
+                            float scale, size_t step){
+    layer *l = nn->layers[i];
+    matrix_optimizer_step(opt, l->weights, grads, scale, l->states, step, true);
+    matrix_optimizer_step(opt, l->bias, bias_grads, scale, l->bias_states, step, false);
+    layer_sync_half_weights(l, nn->precision);
+}
+
+/**
+ * @brief Trains on the batch stored in ws->X / ws->T and updates the weights.
+ * 
+ * The weight update averages the gradient of the batch. Plain SGD accumulates
+ * it straight into the weights, the other optimizers go through the workspace
+ * gradients and a fused update.
+ * 
+ * @param nn The neural network.
+ * @param ws The training workspace holding the batch.
+ */
+static void nn_train_step(neural_network *nn, nn_workspace *ws){
+    nn_backpropagate(nn, ws);
+
+    size_t batch = ws->batch_X.col;
+    if(!nn_plain_sgd(nn)){
+        // Hogwild steps share the counter, like the weights
+        optimizer opt = nn_optimizer(nn);
+        size_t step = __atomic_add_fetch(&nn->optimizer_step, 1, __ATOMIC_RELAXED);
+        for(size_t i = 0; i < nn->nb_layers; i++){
+            PROFILE_BEGIN(scope);
+            nn_layer_gradients(nn, ws, i);
+            nn_layer_update(nn, &opt, i, ws->grads[i], ws->bias_grads[i], 1.0f / batch, step);
+            PROFILE_END(scope, i, PROFILE_UPDATE, layer_product_flops(nn->layers[i], batch),
+                        layer_product_bytes(nn->layers[i], batch) + layer_update_bytes(nn->layers[i], &opt));
+        }
+        return;
+    }
+
+    // Update the weights
+    // W = W + alpha / batch * delta * Y_prev^T in a single accumulate, Y_prev is read in place
+    // b = b + alpha / batch * sum of the deltas over the batch
+    float rate = nn->learning_rate / batch;
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        PROFILE_BEGIN(scope);
+        layer *l = nn->layers[i];
+        if(l->kind == LAYER_CONV2D){
+            // W = W + alpha / batch * delta * cols^T, cols being the im2col of the input kept by the forward pass
+            matrix scratch = nn_conv_buffer(ws->conv_scratch, l->conv.out_channels, conv_positions(&l->conv) * ws->batch_size);
+            matrix_conv_backward_weights(l->weights, l->bias, rate, 1, ws->deltas[i], ws->cols[i], &l->conv, &scratch);
+        }else{
+            matrix_view weights = matrix_view_of(l->weights);
+            matrix_view delta = matrix_view_of(ws->deltas[i]);
+            matrix_view input = nn_layer_input(ws, i);
+            matrix_view input_t = matrix_view_transpose(&input);
+            matrix_view_mul_to(&weights, &delta, &input_t, rate, 1);
+            matrix_row_sums_to(l->bias, ws->deltas[i], rate, 1);
+        }
+        layer_sync_half_weights(nn->layers[i], nn->precision);
+        // the weights are read and written back
+        PROFILE_END(scope, i, PROFILE_UPDATE, layer_product_flops(nn->layers[i], batch),
+                    layer_product_bytes(l, batch) + (uint64_t) l->weights->row * l->weights->col * sizeof(float));
+    }
+}
+
+/**
+ * @brief Shuffles the n indices of order in place (Fisher-Yates).
+ */
+static void nn_shuffle_indices(size_t *order, size_t n, random_generator *rng){
+    for(size_t i = n; i > 1; i--){
+        size_t j = random_below(rng, i);
+        size_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/**
+ * @brief Makes the samples order[0..n) of X_data / T_data the workspace batch.
+ * 
+ * Consecutive samples are used in place through views of their columns,
+ * others are gathered into the workspace buffers.
+ */
+static void nn_load_batch(nn_workspace *ws, const matrix *X_data, const matrix *T_data, const size_t *order, size_t n){
+    nn_workspace_set_batch(ws, n);
+
+    bool consecutive = true;
+    for(size_t j = 1; j < n && consecutive; j++)
+        consecutive = order[j] == order[0] + j;
+
+    if(consecutive && n > 0){
+        ws->batch_X = matrix_view_cols(X_data, order[0], n);
+        ws->batch_T = matrix_view_cols(T_data, order[0], n);
+    }else{
+        matrix_gather_cols_to(X_data, order, ws->X);
+        matrix_gather_cols_to(T_data, order, ws->T);
+    }
+}
+
+// Data-parallel and Hogwild training
+
+typedef struct nn_parallel_job{
+    neural_network *nn;
+    const matrix *X_data;
+    const matrix *T_data;
+    const size_t *order;    // samples of the current batch (data) or epoch (Hogwild)
+    size_t nb_samples;
+    size_t batch_size;
+    size_t nb_units;
+    nn_workspace **ws;      // one per unit
+    size_t stride;          // current level of the gradient reduction
+} nn_parallel_job;
+
+// Computes the gradients of the shards [begin, end) of the current batch
+static void nn_shard_task(void *arg, size_t begin, size_t end){
+    nn_parallel_job *job = arg;
+    size_t shard_size = (job->nb_samples + job->nb_units - 1) / job->nb_units;
+
+    for(size_t s = begin; s < end; s++){
+        nn_workspace *ws = job->ws[s];
+        size_t first = s * shard_size < job->nb_samples ? s * shard_size : job->nb_samples;
+        size_t count = job->nb_samples - first < shard_size ? job->nb_samples - first : shard_size;
+
+        // An empty shard ends up with zero gradients
+        nn_load_batch(ws, job->X_data, job->T_data, job->order + first, count);
+        nn_backpropagate(job->nn, ws);
+        for(size_t i = 0; i < job->nn->nb_layers; i++){
+            PROFILE_BEGIN(scope);
+            nn_layer_gradients(job->nn, ws, i);
+            PROFILE_END(scope, i, PROFILE_UPDATE, layer_product_flops(job->nn->layers[i], count), layer_product_bytes(job->nn->layers[i], count));
+        }
+    }
+}
+
+// Adds the gradients of shard p + stride into shard p for the (pair, layer) items [begin, end)
+static void nn_reduce_task(void *arg, size_t begin, size_t end){
+    nn_parallel_job *job = arg;
+    size_t nb_layers = job->nn->nb_layers;
+
+    for(size_t item = begin; item < end; item++){
+        size_t dest = (item / nb_layers) * 2 * job->stride;
+        size_t src = dest + job->stride;
+        size_t l = item % nb_layers;
+
+        if(src < job->nb_units){
+            matrix_add_inplace(job->ws[dest]->grads[l], job->ws[src]->grads[l]);
+            matrix_add_inplace(job->ws[dest]->bias_grads[l], job->ws[src]->bias_grads[l]);
+        }
+    }
+}
+
+// Trains on the batches u, u + nb_units, ... of the epoch, updating the shared weights without locking
+static void nn_hogwild_task(void *arg, size_t begin, size_t end){
+    nn_parallel_job *job = arg;
+    size_t nb_batches = (job->nb_samples + job->batch_size - 1) / job->batch_size;
+
+    for(size_t u = begin; u < end; u++){
+        for(size_t b = u; b < nb_batches; b += job->nb_units){
+            size_t first = b * job->batch_size;
+            size_t count = job->nb_samples - first < job->batch_size ? job->nb_samples - first : job->batch_size;
+
+            nn_load_batch(job->ws[u], job->X_data, job->T_data, job->order + first, count);
+            nn_train_step(job->nn, job->ws[u]);
+        }
+    }
+}
+
+/**
+ * @brief Trains one epoch with every batch split in shards computed in parallel.
+ * 
+ * Each shard has private gradient buffers. They are summed by a pairwise
+ * tree whose shape only depends on the number of shards, so the result is
+ * reproducible for a fixed thread count, then applied to the weights once.
+ */
+static void nn_train_epoch_data_parallel(nn_parallel_job *job, const size_t *order, size_t nb_samples){
+    neural_network *nn = job->nn;
+
+    for(size_t b = 0; b < nb_samples; b += job->batch_size){
+        job->order = order + b;
+        job->nb_samples = nb_samples - b < job->batch_size ? nb_samples - b : job->batch_size;
+
+        thread_pool_parallel_for(job->nb_units, 1, nn_shard_task, job);
+
+        for(job->stride = 1; job->stride < job->nb_units; job->stride *= 2){
+            size_t nb_pairs = (job->nb_units + 2 * job->stride - 1) / (2 * job->stride);
+            thread_pool_parallel_for(nb_pairs * nn->nb_layers, 1, nn_reduce_task, job);
+        }
+
+        // One fused update with the mean of the shard gradients
+        optimizer opt = nn_optimizer(nn);
+        size_t step = ++nn->optimizer_step;
+        for(size_t i = 0; i < nn->nb_layers; i++){
+            PROFILE_BEGIN(scope);
+            nn_layer_update(nn, &opt, i, job->ws[0]->grads[i], job->ws[0]->bias_grads[i], 1.0f / job->nb_samples, step);
+            PROFILE_END(scope, i, PROFILE_UPDATE, 2 * (uint64_t) nn->layers[i]->weights->row * nn->layers[i]->weights->col,
+                        layer_update_bytes(nn->layers[i], &opt));
+        }
+    }
+}
+
+/**
+ * @brief Checks the layers before training, compiles them on the first call
+ * and allocates the optimizer state.
+ * 
+ * @param nn The neural network.
+ * @param input_size The number of features of a sample.
+ */
+static void nn_train_prepare(neural_network *nn, size_t input_size){
+    if(nn->nb_layers == 0){
+            fprintf(stderr, "nn_train: Set the input layer first\n");
+            exit(1);
+    }
+    if(nn->layers[nn->nb_layers - 1]->type != OUTPUT){
+            fprintf(stderr, "nn_train: Set the output layer first\n");
+            exit(1);
+    }
+
+    // If code not compiled ie the weights of input layer are not setted
     if(((layer*)nn->layers[0])->input_size == 0){
     	// The only missing is the input size of the input layer (which is the number of raw of the input matrix)
     	// We therefore get the number of raw of the input matrix and set it as the input size of the input layer
     	// compile the layers by setting the weights matrices
-        ((layer *) nn->layers[0])->input_size = X->row;
+        ((layer *) nn->layers[0])->input_size = input_size;
         nn_compile_layers(nn);
     }
+    nn_prepare_optimizer(nn);
 
-    matrix** y_arr = malloc(nn->nb_layers * sizeof(matrix*));
-    // Forward propagation
+    // the passes read the dense weights, whose updates would leave the sparse copies stale
     for(size_t i = 0; i < nn->nb_layers; i++){
-        matrix *v;
-        // Compute W*X
-        if(i == 0)
-            v = matrix_mul(nn->layers[i]->weights, X);
-        else
-            v = matrix_mul(nn->layers[i]->weights, y_arr[i - 1]);
+        matrix_csr_destroy(nn->layers[i]->sparse_weights);
+        nn->layers[i]->sparse_weights = NULL;
+    }
+}
 
-        // Compute Y = f(W*X)
-        y_arr[i] = matrix_get_copy(v);
-        matrix_apply(y_arr[i], nn->layers[i]->activation);
+/**
+ * @brief Creates the workspaces of the units of a training run, one per thread in the parallel modes.
+ * 
+ * @param nn The neural network.
+ * @param mode The parallel mode of the run.
+ * @param batch_size The number of samples of a batch.
+ * @param max_units The largest useful number of units.
+ * @param nb_units Receives the number of workspaces.
+ * @return The workspaces.
+ */
+static nn_workspace** nn_train_workspaces(const neural_network *nn, parallel_mode mode, size_t batch_size, size_t max_units, size_t *nb_units){
+    // One unit of work per thread: a shard of every batch, or a subset of the batches
+    *nb_units = 1;
+    if(mode != PARALLEL_NONE){
+        *nb_units = thread_pool_get_nb_threads();
+        if(*nb_units > max_units)
+            *nb_units = max_units;
+    }
 
-        if(i == nn->nb_layers - 1)
-            matrix_print(y_arr[i]);
+    // All the buffers of the training steps are allocated once here
+    size_t unit_batch_size = mode == PARALLEL_DATA ? (batch_size + *nb_units - 1) / *nb_units : batch_size;
+    nn_workspace **ws = malloc(*nb_units * sizeof(nn_workspace*));
+    if(ws == NULL){
+        fprintf(stderr, "nn_train: Unable to allocate memory for the workspaces\n");
+        exit(1);
     }
+    for(size_t u = 0; u < *nb_units; u++)
+        ws[u] = nn_workspace_create(nn, unit_batch_size);
+    return ws;
+}
 
-    matrix* output = matrix_get_copy(y_arr[nn->nb_layers - 1]);
+/**
+ * @brief Mean loss of the nb_samples samples the workspaces trained on, their sums starting over.
+ */
+static float nn_collect_loss(nn_workspace **ws, size_t nb_units, size_t nb_samples){
+    double loss = 0;
+    for(size_t u = 0; u < nb_units; u++){
+        loss += ws[u]->loss;
+        ws[u]->loss = 0;
+    }
+    return nb_samples > 0 ? (float) (loss / nb_samples) : 0;
+}
 
-    // Free all results
-    for(size_t i = 0; i < nn->nb_layers; i++)
-        matrix_destroy(y_arr[i]);
-    free(y_arr);
+/**
+ * @brief Trains the neural network using the specified input and output matrices for the specified number of epochs.
+ * 
+ * Each column of X is a sample. An epoch is a full pass over the samples in
+ * mini-batches of nn->batch_size columns, in a new random order when
+ * nn->shuffle is set. nn->parallel_mode selects how batches are spread
+ * over the thread pool. nn->loss receives the mean loss of every epoch.
+ * 
+ * @param nn The neural network.
+ * @param X The input matrix.
+ * @param T The target matrix.
+ * @param epochs The number of epochs to train the network.
+ */
+void nn_train(neural_network *nn, matrix *X_data, matrix *T_data, size_t epochs){
+    if(X_data->col != T_data->col){
+            fprintf(stderr, "nn_train: Input and output matrices must have the same number of columns\n");
+            exit(1);
+    }
+    nn_train_prepare(nn, X_data->row);
+
+    size_t nb_samples = X_data->col;
+    size_t batch_size = nn->batch_size < nb_samples ? nn->batch_size : nb_samples;
+    size_t nb_batches = (nb_samples + batch_size - 1) / batch_size;
+
+    size_t nb_units;
+    nn_workspace **ws = nn_train_workspaces(nn, nn->parallel_mode, batch_size, nn->parallel_mode == PARALLEL_DATA ? batch_size : nb_batches, &nb_units);
+
+    nn_parallel_job job = {
+        .nn = nn,
+        .X_data = X_data,
+        .T_data = T_data,
+        .batch_size = batch_size,
+        .nb_units = nb_units,
+        .ws = ws,
+    };
+
+    size_t *order = malloc(nb_samples * sizeof(size_t));
+    if(order == NULL){
+        fprintf(stderr, "nn_train: Unable to allocate memory for the sample order\n");
+        exit(1);
+    }
+    for(size_t i = 0; i < nb_samples; i++)
+        order[i] = i;
+    random_generator rng;
+    random_generator_init(&rng, random_new_stream());
+
+    for(size_t e = 0; e < epochs; e++){
+        if(nn->shuffle)
+            nn_shuffle_indices(order, nb_samples, &rng);
+
+        if(nn->parallel_mode == PARALLEL_DATA){
+            nn_train_epoch_data_parallel(&job, order, nb_samples);
+        }else if(nn->parallel_mode == PARALLEL_HOGWILD){
+            job.order = order;
+            job.nb_samples = nb_samples;
+            thread_pool_parallel_for(nb_units, 1, nn_hogwild_task, &job);
+        }else{
+            for(size_t b = 0; b < nb_samples; b += batch_size){
+                // gather the next batch of samples, the last one may be smaller
+                nn_load_batch(ws[0], X_data, T_data, order + b, nb_samples - b < batch_size ? nb_samples - b : batch_size);
+                nn_train_step(nn, ws[0]);
+            }
+        }
+        nn->loss = nn_collect_loss(ws, nb_units, nb_samples);
+    }
+    nn_sync_sparse_weights(nn);
+
+    free(order);
+    for(size_t u = 0; u < nb_units; u++)
+        nn_workspace_destroy(ws[u]);
+    free(ws);
+}
+
+/**
+ * @brief Trains the neural network on a dataset streamed from its files.
+ * 
+ * The batches are assembled by a background loader while the previous one
+ * is trained on, so only two batches are ever in memory. Batches arrive one
+ * at a time, so PARALLEL_HOGWILD is run like PARALLEL_DATA. nn->loss
+ * receives the mean loss of every epoch.
+ * 
+ * @param nn The neural network.
+ * @param ds The dataset.
+ * @param epochs The number of epochs to train the network.
+ */
+void nn_train_dataset(neural_network *nn, const dataset *ds, size_t epochs){
+    nn_train_prepare(nn, ds->input_size);
+    if(nn->layers[0]->input_size != ds->input_size || nn->layers[nn->nb_layers - 1]->nb_neurons != ds->output_size){
+        fprintf(stderr, "nn_train_dataset: The dataset does not match the network\n");
+        exit(1);
+    }
+
+    size_t batch_size = nn->batch_size < ds->nb_samples ? nn->batch_size : ds->nb_samples;
+    parallel_mode mode = nn->parallel_mode == PARALLEL_HOGWILD ? PARALLEL_DATA : nn->parallel_mode;
+    size_t nb_units;
+    nn_workspace **ws = nn_train_workspaces(nn, mode, batch_size, batch_size, &nb_units);
+
+    // The batches are contiguous: the shards take their samples in order
+    size_t *order = malloc(batch_size * sizeof(size_t));
+    if(order == NULL){
+        fprintf(stderr, "nn_train_dataset: Unable to allocate memory for the sample order\n");
+        exit(1);
+    }
+    for(size_t i = 0; i < batch_size; i++)
+        order[i] = i;
+
+    nn_parallel_job job = {
+        .nn = nn,
+        .batch_size = batch_size,
+        .nb_units = nb_units,
+        .ws = ws,
+    };
+
+    dataset_loader *loader = dataset_loader_create(ds, batch_size, nn->shuffle, epochs);
+    size_t epoch_samples = 0;
+    for(dataset_batch *batch = dataset_loader_next(loader); batch != NULL; batch = dataset_loader_next(loader)){
+        if(mode != PARALLEL_NONE){
+            job.X_data = batch->X;
+            job.T_data = batch->T;
+            nn_train_epoch_data_parallel(&job, order, batch->X->col);
+        }else{
+            // the loader batch is used in place
+            nn_load_batch(ws[0], batch->X, batch->T, order, batch->X->col);
+            nn_train_step(nn, ws[0]);
+        }
+
+        epoch_samples += batch->X->col;
+        if(batch->last){
+            nn->loss = nn_collect_loss(ws, nb_units, epoch_samples);
+            epoch_samples = 0;
+        }
+    }
+    dataset_loader_destroy(loader);
+    nn_sync_sparse_weights(nn);
+
+    free(order);
+    for(size_t u = 0; u < nb_units; u++)
+        nn_workspace_destroy(ws[u]);
+    free(ws);
+}
+
+// Neural network inference
+
+/**
+ * @brief Creates the scratch space needed to run inference on up to max_batch samples at a time.
+ * 
+ * A context belongs to one caller (thread) and makes nn_predict_into allocation free.
+ * 
+ * @param nn The compiled neural network.
+ * @param max_batch The largest number of samples processed in one pass.
+ * @return The created context.
+ */
+nn_context* nn_context_create(const neural_network *nn, size_t max_batch){
+    if(nn->nb_layers == 0 || nn->layers[0]->weights == NULL){
+        fprintf(stderr, "nn_context_create: Compile the network first\n");
+        exit(1);
+    }
+    if(max_batch == 0){
+        fprintf(stderr, "nn_context_create: The batch size must be at least 1\n");
+        exit(1);
+    }
+
+    nn_context *ctx = malloc(sizeof(nn_context));
+    if(ctx == NULL){
+        fprintf(stderr, "nn_context_create: Unable to allocate memory for the context\n");
+        exit(1);
+    }
+
+    ctx->max_batch = max_batch;
+    ctx->max_neurons = 0;
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        if(nn->layers[i]->nb_neurons > ctx->max_neurons)
+            ctx->max_neurons = nn->layers[i]->nb_neurons;
+    }
+
+    ctx->buffers[0] = matrix_zeros_padded(ctx->max_neurons, max_batch);
+    ctx->buffers[1] = matrix_zeros_padded(ctx->max_neurons, max_batch);
+    ctx->output = matrix_zeros_padded(nn->layers[nn->nb_layers - 1]->nb_neurons, max_batch);
+    if(ctx->buffers[0] == NULL || ctx->buffers[1] == NULL || ctx->output == NULL){
+        fprintf(stderr, "nn_context_create: Unable to allocate memory for the context\n");
+        exit(1);
+    }
+
+    size_t cols_size, rows_size;
+    nn_conv_buffer_sizes(nn, &cols_size, &rows_size);
+    ctx->conv_cols = NULL;
+    ctx->conv_scratch = NULL;
+    if(cols_size > 0){
+        ctx->conv_cols = matrix_zeros(1, cols_size * max_batch);
+        ctx->conv_scratch = matrix_zeros(1, rows_size * max_batch);
+        if(ctx->conv_cols == NULL || ctx->conv_scratch == NULL){
+            fprintf(stderr, "nn_context_create: Unable to allocate memory for the context\n");
+            exit(1);
+        }
+    }
+    return ctx;
+}
+
+/**
+ * @brief Destroys an inference context and frees its buffers.
+ * 
+ * @param ctx The context to destroy.
+ */
+void nn_context_destroy(nn_context *ctx){
+    matrix_destroy(ctx->buffers[0]);
+    matrix_destroy(ctx->buffers[1]);
+    matrix_destroy(ctx->output);
+    if(ctx->conv_cols != NULL){
+        matrix_destroy(ctx->conv_cols);
+        matrix_destroy(ctx->conv_scratch);
+    }
+    free(ctx);
+}
+
+/**
+ * @brief Runs the layers on a batch of at most ctx->max_batch samples.
+ */
+static void nn_forward_batch(const neural_network *nn, const matrix_view *X, matrix *out, nn_context *ctx){
+    matrix_view in = *X;
+    matrix y[2];
+
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        // The last layer writes straight into the output, the others alternate between the buffers
+        matrix *dest = out;
+        if(i < nn->nb_layers - 1){
+            dest = &y[i % 2];
+            dest->row = nn->layers[i]->nb_neurons;
+            dest->col = X->col;
+            dest->stride = ctx->buffers[i % 2]->stride;
+            dest->data = ctx->buffers[i % 2]->data;
+            dest->owns_data = false;
+        }
+
+        PROFILE_BEGIN(scope);
+        const layer *l = nn->layers[i];
+        matrix cols = {0}, scratch = {0};
+        if(l->kind == LAYER_CONV2D){
+            cols = nn_conv_buffer(ctx->conv_cols, conv_patch_size(&l->conv), conv_positions(&l->conv) * ctx->max_batch);
+            scratch = nn_conv_buffer(ctx->conv_scratch, l->conv.out_channels, conv_positions(&l->conv) * ctx->max_batch);
+        }
+        layer_forward(l, &in, dest, &cols, &scratch, false, false);
+        PROFILE_END(scope, i, PROFILE_FORWARD, layer_product_flops(nn->layers[i], X->col), layer_product_bytes(nn->layers[i], X->col));
+        in = matrix_view_of(dest);
+    }
+}
+
+/**
+ * @brief Predicts the outputs of the samples of X (one per column) into out.
+ * 
+ * The network is only read, so many threads can predict with the same
+ * network as long as each one uses its own context. No memory is allocated.
+ * 
+ * @param nn The compiled neural network.
+ * @param X The input matrix (input_size x nb_samples).
+ * @param out The output matrix (output_size x nb_samples).
+ * @param ctx The caller's context.
+ */
+void nn_predict_into(const neural_network *nn, const matrix *X, matrix *out, nn_context *ctx){
+    if(nn->nb_layers == 0 || nn->layers[nn->nb_layers - 1]->type != OUTPUT || nn->layers[0]->weights == NULL){
+        fprintf(stderr, "nn_predict_into: Compile the network first\n");
+        exit(1);
+    }
+
+    size_t output_size = nn->layers[nn->nb_layers - 1]->nb_neurons;
+    if(X->row != nn->layers[0]->input_size || out->row != output_size || out->col != X->col){
+        fprintf(stderr, "nn_predict_into: Matrix dimensions do not match the network\n");
+        return;
+    }
+
+    if(X->col <= ctx->max_batch){
+        matrix_view input = matrix_view_of(X);
+        nn_forward_batch(nn, &input, out, ctx);
+        return;
+    }
+
+    // Too many samples for the context: go through the context in chunks of columns,
+    // the input chunks being read in place
+    for(size_t b = 0; b < X->col; b += ctx->max_batch){
+        size_t n = X->col - b < ctx->max_batch ? X->col - b : ctx->max_batch;
+        matrix_view in_chunk = matrix_view_cols(X, b, n);
+        matrix out_chunk = {output_size, n, ctx->output->stride, ctx->output->data, false};
+
+        nn_forward_batch(nn, &in_chunk, &out_chunk, ctx);
+
+        matrix_view src = matrix_view_of(&out_chunk);
+        matrix_view dest = matrix_view_cols(out, b, n);
+        matrix_view_copy_to(&src, &dest);
+    }
+}
+
+/**
+ * @brief Predicts the output for the given input matrix using the neural network.
+ * 
+ * Convenience wrapper around nn_predict_into allocating the result and a context.
+ * 
+ * @param nn The compiled neural network.
+ * @param X The input matrix.
+ * @return The predicted output matrix.
+ */
+matrix* nn_predict(const neural_network *nn, const matrix *X){
+    if(nn->nb_layers == 0 || nn->layers[nn->nb_layers - 1]->type != OUTPUT || nn->layers[0]->weights == NULL){
+        fprintf(stderr, "nn_predict: Compile the network first\n");
+        exit(1);
+    }
+
+    matrix *output = matrix_zeros(nn->layers[nn->nb_layers - 1]->nb_neurons, X->col);
+    if(output == NULL){
+        fprintf(stderr, "nn_predict: Unable to allocate memory for the output\n");
+        exit(1);
+    }
+
+    nn_context *ctx = nn_context_create(nn, X->col > 0 ? X->col : 1);
+    nn_predict_into(nn, X, output, ctx);
+    nn_context_destroy(ctx);
 
     return output;
 }
@@ -1,7 +1,15 @@
+#pragma once
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "../Matrix/matrix.h"
+#include "../Matrix/activation.h"
+#include "../Matrix/half.h"
+#include "../Matrix/sparse.h"
+#include "../Matrix/conv.h"
+#include "../Matrix/optimizer.h"
+#include "../Matrix/random.h"
+#include "../Dataset/dataset.h"
 #include "../list/list.h"
 
 typedef enum layer_type{
@@ -10,16 +18,38 @@ typedef enum layer_type{
     OUTPUT
 } layer_type;
 
+// What a layer computes, its position being given by layer_type
+typedef enum layer_kind{
+    LAYER_DENSE,        // W * X + b, W being nb_neurons x input_size
+    LAYER_CONV2D        // 2D convolution of images, W being out_channels x conv_patch_size
+} layer_kind;
+
 typedef enum loss_function{
     MEAN_SQUARED_ERROR,
     CROSS_ENTROPY
 } loss_function;
 
+// How nn_train spreads a batch over the thread pool
+typedef enum parallel_mode{
+    PARALLEL_NONE,      // one batch at a time, only the matrix kernels are parallel
+    PARALLEL_DATA,      // every batch is split in shards whose gradients are reduced before the update
+    PARALLEL_HOGWILD    // every thread trains on its own batches and updates the weights without locking
+} parallel_mode;
+
 typedef struct layer{
     layer_type type;
+    layer_kind kind;
 	size_t input_size;
-    size_t nb_neurons;
+    size_t nb_neurons;                  // outputs per sample, conv_output_size for a convolution
+    conv_shape conv;                    // geometry of a LAYER_CONV2D layer
 	matrix *weights;
+    matrix *bias;                       // one value per neuron, or per output channel of a convolution
+    matrix_half *half_weights;          // weights rounded to the network precision, read by the GEMMs (NULL in fp32)
+    matrix_csr *sparse_weights;         // nonzero weights of a pruned dense layer, read by the inference
+                                        // (NULL when the layer is too dense for the sparse kernel to win)
+    matrix *states[2];                  // optimizer state of the weights and of the bias, allocated by
+    matrix *bias_states[2];             // the first training run needing it
+    activation_type activation_type;    // ACTIVATION_CUSTOM uses the function pointers below
     float (*activation)(float);
     float (*activation_prime)(float);
 } layer;
@@ -32,12 +62,61 @@ typedef struct neural_network{
     float learning_rate;
     float dropout_rate;
     float momentum_rate;
+    optimizer_type optimizer;
+    float beta1;            // Adam and AdamW moment decay rates
+    float beta2;
+    float epsilon;
+    float weight_decay;
+    size_t optimizer_step;  // updates made since the optimizer was set
+    float loss;             // mean loss of the samples of the last training epoch
     size_t batch_size;
+    bool shuffle;
+    parallel_mode parallel_mode;
+    matrix_type precision;  // storage of the weights read by the forward and backward passes
+    void *mapping;          // model file mapped by nn_load, the weights pointing into it
+    size_t mapping_size;
 } neural_network;
 
+// Buffers used by a training step, sized once from the layer shapes and the batch size
+typedef struct nn_workspace{
+    size_t nb_layers;
+    size_t batch_size;
+    matrix *X;          // input batch (input_size x batch_size)
+    matrix *T;          // target batch (output_size x batch_size)
+    matrix_view batch_X;// samples of the current batch: X, or columns of the training data
+    matrix_view batch_T;
+    matrix **y;         // output of every layer (nb_neurons x batch_size)
+    matrix **errors;    // error reaching every layer, before f'
+    matrix **deltas;    // error * f'(y) of every layer
+    matrix **grads;     // delta * Y_prev^T of every layer (shape of the weights)
+    matrix **bias_grads;// sum of the deltas over the batch (shape of the bias)
+    matrix **cols;      // im2col of the input of every convolution layer, NULL for dense layers
+    matrix *conv_dcols; // convolution scratch space shared by the layers, NULL without convolutions
+    matrix *conv_scratch;
+    matrix **masks;     // dropout mask of every hidden layer, 0 or 1 / keep, NULL without dropout
+    matrix **dropped;   // y * mask, the input of the next layer, NULL without dropout
+    float keep;         // 1 - dropout rate of the network
+    random_stream dropout_stream;
+    uint64_t dropout_offset;
+    double loss;        // loss summed over the samples trained on since the last epoch ended
+} nn_workspace;
+
+// Scratch space of one inference caller, so a shared network can serve many threads
+typedef struct nn_context{
+    size_t max_batch;
+    size_t max_neurons;
+    matrix *buffers[2]; // layer outputs, used alternately (max_neurons x max_batch)
+    matrix *output;     // output chunk when X has more columns than max_batch
+    matrix *conv_cols;  // convolution scratch space shared by the layers, NULL without convolutions
+    matrix *conv_scratch;
+} nn_context;
+
 // Layer creation and destruction
 layer* layer_create(layer_type type, size_t nb_neurons, size_t input_size, float (*activation)(float), float (*activation_prime)(float));
 void layer_destroy(layer *l);
+// Shape of the weights of a compiled or uncompiled layer
+size_t layer_weights_rows(const layer *l);
+size_t layer_weights_cols(const layer *l);
 
 // Neural network creation and destruction
 neural_network *neural_network_create();
@@ -47,15 +126,53 @@ void nn_destroy(neural_network *nn);
 void nn_set_input_layer(neural_network *nn, size_t nb_neurons, float (*activation)(float), float (*activation_prime)(float));
 void nn_set_output_layer(neural_network *nn, size_t nb_neurons, float (*activation)(float), float (*activation_prime)(float));
 void nn_add_hidden_layer(neural_network *nn, size_t nb_neurons, float (*activation)(float), float (*activation_prime)(float));
+void nn_set_input_layer_builtin(neural_network *nn, size_t nb_neurons, activation_type activation);
+void nn_set_output_layer_builtin(neural_network *nn, size_t nb_neurons, activation_type activation);
+void nn_add_hidden_layer_builtin(neural_network *nn, size_t nb_neurons, activation_type activation);
+// Convolution layers, shape giving everything but out_height and out_width
+// The input of a layer must be the output of the previous one seen as images.
+void nn_set_input_conv2d_layer(neural_network *nn, conv_shape shape, activation_type activation);
+void nn_set_output_conv2d_layer(neural_network *nn, conv_shape shape, activation_type activation);
+void nn_add_hidden_conv2d_layer(neural_network *nn, conv_shape shape, activation_type activation);
 void nn_set_loss_function(neural_network *nn, loss_function loss_function);
 void nn_set_learning_rate(neural_network *nn, float learning_rate);
 void nn_set_dropout_rate(neural_network *nn, float dropout_rate);
 void nn_set_momentum_rate(neural_network *nn, float momentum_rate);
+// OPTIMIZER_SGD by default, with momentum when the momentum rate is not 0
+// Setting the optimizer clears its state.
+void nn_set_optimizer(neural_network *nn, optimizer_type type);
+void nn_set_adam_parameters(neural_network *nn, float beta1, float beta2, float epsilon);
+void nn_set_weight_decay(neural_network *nn, float weight_decay);
 void nn_set_batch_size(neural_network *nn, size_t batch_size);
+void nn_set_shuffle(neural_network *nn, bool shuffle);
+void nn_set_parallel_mode(neural_network *nn, parallel_mode mode);
+// MATRIX_FP16 or MATRIX_BF16 keep a half precision copy of the weights for the
+// passes, the fp32 weights staying the master copy updated by the training
+void nn_set_precision(neural_network *nn, matrix_type precision);
+// Magnitude pruning of every dense layer to the given fraction of its weights
+// The inference switches to a sparse kernel for the layers whose density is
+// below the crossover measured by matrix_csr_crossover.
+void nn_prune(neural_network *nn, float density);
+// Refreshes the sparse copies of the weights, after they were written directly
+void nn_sync_sparse_weights(neural_network *nn);
+
+// Training workspace creation and destruction
+nn_workspace* nn_workspace_create(const neural_network *nn, size_t batch_size);
+void nn_workspace_destroy(nn_workspace *ws);
+void nn_workspace_set_batch(nn_workspace *ws, size_t batch_size);
 
 // Neural network training
+void nn_compile(neural_network *nn, size_t input_size);
+// Compiled network with random weights from "input_size,neurons[:activation],..."
+neural_network* nn_create_from_spec(const char *spec);
 void nn_train(neural_network *nn, matrix *X, matrix *y, size_t epochs);
-matrix *nn_predict(neural_network *nn, matrix *X);
+void nn_train_dataset(neural_network *nn, const dataset *ds, size_t epochs);
+
+// Neural network inference
+nn_context* nn_context_create(const neural_network *nn, size_t max_batch);
+void nn_context_destroy(nn_context *ctx);
+void nn_predict_into(const neural_network *nn, const matrix *X, matrix *out, nn_context *ctx);
+matrix *nn_predict(const neural_network *nn, const matrix *X);
 
 // Neural network display
 void nn_display_layers(neural_network *nn);
\ No newline at end of file
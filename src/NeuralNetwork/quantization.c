@@ -0,0 +1,368 @@
+/**
+ * @file quantization.c
+ * @brief Post-training int8 quantization and quantized inference.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "quantization.h"
+#include "../Matrix/dense.h"
+
+// Samples run at once by the calibration
+#define QUANTIZE_CALIBRATION_BATCH 256
+
+// Features of a sample quantized before moving to the next sample
+#define QUANTIZE_BLOCK 32
+
+static void* quantize_alloc(size_t size){
+    // aligned_alloc requires a size multiple of the alignment
+    void *p = aligned_alloc(MATRIX_ALIGNMENT, (size + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT);
+    if(p == NULL){
+        fprintf(stderr, "nn_quantize: Unable to allocate memory for the quantized network\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void view_min_max(const matrix_view *v, float *min, float *max){
+    for(size_t i = 0; i < v->row; i++){
+        for(size_t j = 0; j < v->col; j++){
+            float x = v->data[i * v->rs + j * v->cs];
+            if(x < *min)
+                *min = x;
+            if(x > *max)
+                *max = x;
+        }
+    }
+}
+
+/**
+ * @brief Runs the float network on the calibration samples and records the
+ * range reached by the inputs of every layer.
+ */
+static void nn_calibrate(const neural_network *nn, const matrix *X, float *min, float *max){
+    size_t max_neurons = 0;
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        min[i] = 0;
+        max[i] = 0;
+        if(nn->layers[i]->nb_neurons > max_neurons)
+            max_neurons = nn->layers[i]->nb_neurons;
+    }
+
+    matrix *buffers[2] = {matrix_zeros_padded(max_neurons, QUANTIZE_CALIBRATION_BATCH),
+                          matrix_zeros_padded(max_neurons, QUANTIZE_CALIBRATION_BATCH)};
+    if(buffers[0] == NULL || buffers[1] == NULL){
+        fprintf(stderr, "nn_quantize: Unable to allocate memory for the calibration\n");
+        exit(1);
+    }
+
+    for(size_t b = 0; b < X->col; b += QUANTIZE_CALIBRATION_BATCH){
+        size_t n = X->col - b < QUANTIZE_CALIBRATION_BATCH ? X->col - b : QUANTIZE_CALIBRATION_BATCH;
+        matrix_view in = matrix_view_cols(X, b, n);
+
+        // the output of the last layer is not quantized
+        for(size_t i = 0; i < nn->nb_layers - 1; i++){
+            const layer *l = nn->layers[i];
+            matrix y = {l->nb_neurons, n, buffers[i % 2]->stride, buffers[i % 2]->data, false};
+
+            view_min_max(&in, &min[i], &max[i]);
+            matrix_dense_forward_view(&y, l->weights, &in, l->bias, l->activation_type);
+            if(l->activation_type == ACTIVATION_SOFTMAX)
+                matrix_apply_activation(&y, ACTIVATION_SOFTMAX);
+            in = matrix_view_of(&y);
+        }
+        view_min_max(&in, &min[nn->nb_layers - 1], &max[nn->nb_layers - 1]);
+    }
+
+    matrix_destroy(buffers[0]);
+    matrix_destroy(buffers[1]);
+}
+
+/**
+ * @brief Quantizes the weights of a layer, one scale per neuron.
+ */
+static void quantize_layer(const layer *src, quantized_layer *l, float min, float max){
+    l->input_size = src->input_size;
+    l->nb_neurons = src->nb_neurons;
+    l->stride = qgemm_padded_depth(src->input_size);
+    l->activation_type = src->activation_type;
+
+    // The range contains 0 so that zero inputs (and padding) are exact
+    l->input_min = min;
+    l->input_max = max;
+    l->input_scale = max > min ? (max - min) / QGEMM_ACTIVATION_MAX : 1;
+    l->input_zero_point = (int32_t) lrintf(-min / l->input_scale);
+
+    l->weights = quantize_alloc(l->nb_neurons * l->stride);
+    l->scales = quantize_alloc(l->nb_neurons * sizeof(float));
+    l->offsets = quantize_alloc(l->nb_neurons * sizeof(int32_t));
+    l->bias = quantize_alloc(l->nb_neurons * sizeof(float));
+    memset(l->weights, 0, l->nb_neurons * l->stride);
+
+    for(size_t i = 0; i < l->nb_neurons; i++){
+        const float *w = src->weights->data + i * src->weights->stride;
+        int8_t *q = l->weights + i * l->stride;
+
+        float max_abs = 0;
+        for(size_t k = 0; k < l->input_size; k++)
+            max_abs = fmaxf(max_abs, fabsf(w[k]));
+        float scale = max_abs > 0 ? max_abs / 127 : 1;
+
+        int32_t sum = 0;
+        for(size_t k = 0; k < l->input_size; k++){
+            long v = lrintf(w[k] / scale);
+            q[k] = v < -127 ? -127 : v > 127 ? 127 : v;
+            sum += q[k];
+        }
+
+        l->scales[i] = scale * l->input_scale;
+        l->offsets[i] = l->input_zero_point * sum;
+        l->bias[i] = src->bias->data[i * src->bias->stride];
+    }
+}
+
+// Quantized network creation and destruction
+
+/**
+ * @brief Quantizes a compiled neural network to int8.
+ *
+ * @param nn The compiled neural network.
+ * @param calibration Representative samples (input_size x nb_samples).
+ * @return The quantized network, or NULL if the network cannot be quantized.
+ */
+nn_quantized* nn_quantize(const neural_network *nn, const matrix *calibration){
+    if(nn->nb_layers == 0 || nn->layers[nn->nb_layers - 1]->type != OUTPUT || nn->layers[0]->weights == NULL){
+        fprintf(stderr, "nn_quantize: Compile the network first\n");
+        exit(1);
+    }
+    if(calibration->row != nn->layers[0]->input_size || calibration->col == 0){
+        fprintf(stderr, "nn_quantize: The calibration samples do not match the network\n");
+        return NULL;
+    }
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        if(nn->layers[i]->activation_type == ACTIVATION_CUSTOM){
+            fprintf(stderr, "nn_quantize: Layer %zu uses a custom activation function\n", i);
+            return NULL;
+        }
+        if(nn->layers[i]->kind != LAYER_DENSE){
+            fprintf(stderr, "nn_quantize: Layer %zu is not a dense layer\n", i);
+            return NULL;
+        }
+    }
+
+    float *min = malloc(nn->nb_layers * sizeof(float));
+    float *max = malloc(nn->nb_layers * sizeof(float));
+    nn_quantized *q = malloc(sizeof(nn_quantized));
+    if(min == NULL || max == NULL || q == NULL){
+        fprintf(stderr, "nn_quantize: Unable to allocate memory for the quantized network\n");
+        exit(1);
+    }
+    q->nb_layers = nn->nb_layers;
+    q->layers = calloc(nn->nb_layers, sizeof(quantized_layer));
+    if(q->layers == NULL){
+        fprintf(stderr, "nn_quantize: Unable to allocate memory for the quantized network\n");
+        exit(1);
+    }
+
+    nn_calibrate(nn, calibration, min, max);
+    for(size_t i = 0; i < nn->nb_layers; i++)
+        quantize_layer(nn->layers[i], &q->layers[i], min[i], max[i]);
+
+    free(min);
+    free(max);
+    return q;
+}
+
+void nn_quantized_destroy(nn_quantized *q){
+    for(size_t i = 0; i < q->nb_layers; i++){
+        free(q->layers[i].weights);
+        free(q->layers[i].scales);
+        free(q->layers[i].offsets);
+        free(q->layers[i].bias);
+    }
+    free(q->layers);
+    free(q);
+}
+
+size_t nn_quantized_size(const nn_quantized *q){
+    size_t size = 0;
+    for(size_t i = 0; i < q->nb_layers; i++){
+        const quantized_layer *l = &q->layers[i];
+        size += l->nb_neurons * (l->stride + sizeof(float) + sizeof(int32_t) + sizeof(float));
+    }
+    return size;
+}
+
+// Quantized inference
+
+/**
+ * @brief Creates the buffers needed to run batches of up to max_batch samples.
+ *
+ * @param q The quantized network.
+ * @param max_batch The largest number of samples run at once.
+ * @return The context.
+ */
+nn_quantized_context* nn_quantized_context_create(const nn_quantized *q, size_t max_batch){
+    if(max_batch == 0){
+        fprintf(stderr, "nn_quantized_context_create: The batch size must be at least 1\n");
+        exit(1);
+    }
+
+    size_t max_neurons = 0, max_stride = 0;
+    for(size_t i = 0; i < q->nb_layers; i++){
+        if(q->layers[i].nb_neurons > max_neurons)
+            max_neurons = q->layers[i].nb_neurons;
+        if(q->layers[i].stride > max_stride)
+            max_stride = q->layers[i].stride;
+    }
+
+    nn_quantized_context *ctx = malloc(sizeof(nn_quantized_context));
+    if(ctx == NULL){
+        fprintf(stderr, "nn_quantized_context_create: Unable to allocate memory for the context\n");
+        exit(1);
+    }
+
+    ctx->max_batch = max_batch;
+    ctx->activations = quantize_alloc(max_batch * max_stride);
+    memset(ctx->activations, 0, max_batch * max_stride);
+    ctx->buffers[0] = matrix_zeros_padded(max_neurons, max_batch);
+    ctx->buffers[1] = matrix_zeros_padded(max_neurons, max_batch);
+    ctx->output = matrix_zeros_padded(q->layers[q->nb_layers - 1].nb_neurons, max_batch);
+    if(ctx->buffers[0] == NULL || ctx->buffers[1] == NULL || ctx->output == NULL){
+        fprintf(stderr, "nn_quantized_context_create: Unable to allocate memory for the context\n");
+        exit(1);
+    }
+    return ctx;
+}
+
+void nn_quantized_context_destroy(nn_quantized_context *ctx){
+    free(ctx->activations);
+    matrix_destroy(ctx->buffers[0]);
+    matrix_destroy(ctx->buffers[1]);
+    matrix_destroy(ctx->output);
+    free(ctx);
+}
+
+/**
+ * @brief Quantizes the inputs of a layer into one row of dest per sample.
+ *
+ * The rows are padded with zeros to the stride of the layer, as qgemm expects
+ * of both operands, the buffer holding the bytes of earlier batches.
+ */
+static void quantize_inputs(const quantized_layer *l, const matrix_view *X, uint8_t *dest){
+    const float inv_scale = 1 / l->input_scale;
+    const float zero_point = l->input_zero_point;
+
+    for(size_t k0 = 0; k0 < X->row; k0 += QUANTIZE_BLOCK){
+        size_t nk = X->row - k0 < QUANTIZE_BLOCK ? X->row - k0 : QUANTIZE_BLOCK;
+
+        for(size_t j = 0; j < X->col; j++){
+            const float *x = X->data + k0 * X->rs + j * X->cs;
+            uint8_t *d = dest + j * l->stride + k0;
+            for(size_t k = 0; k < nk; k++){
+                float v = x[k * X->rs] * inv_scale + zero_point;
+                v = v < 0 ? 0 : v > QGEMM_ACTIVATION_MAX ? QGEMM_ACTIVATION_MAX : v;
+                d[k] = (uint8_t) (v + 0.5f);
+            }
+        }
+    }
+    for(size_t j = 0; j < X->col; j++)
+        memset(dest + j * l->stride + X->row, 0, l->stride - X->row);
+}
+
+static void quantized_layer_forward(const quantized_layer *l, const matrix_view *X, matrix *y, uint8_t *activations){
+    quantize_inputs(l, X, activations);
+    qgemm(l->nb_neurons, X->col, l->input_size, l->weights, l->stride, activations, l->stride,
+          l->scales, l->offsets, y->data, y->stride);
+
+    for(size_t i = 0; i < l->nb_neurons; i++)
+        activation_forward_row(l->activation_type, y->data + i * y->stride, y->col, l->bias[i]);
+    if(l->activation_type == ACTIVATION_SOFTMAX)
+        matrix_apply_activation(y, ACTIVATION_SOFTMAX);
+}
+
+/**
+ * @brief Runs the layers on a batch of at most ctx->max_batch samples.
+ */
+static void nn_quantized_forward_batch(const nn_quantized *q, const matrix_view *X, matrix *out, nn_quantized_context *ctx){
+    matrix_view in = *X;
+    matrix y[2];
+
+    for(size_t i = 0; i < q->nb_layers; i++){
+        // The last layer writes straight into the output, the others alternate between the buffers
+        matrix *dest = out;
+        if(i < q->nb_layers - 1){
+            dest = &y[i % 2];
+            dest->row = q->layers[i].nb_neurons;
+            dest->col = X->col;
+            dest->stride = ctx->buffers[i % 2]->stride;
+            dest->data = ctx->buffers[i % 2]->data;
+            dest->owns_data = false;
+        }
+
+        quantized_layer_forward(&q->layers[i], &in, dest, ctx->activations);
+        in = matrix_view_of(dest);
+    }
+}
+
+/**
+ * @brief Predicts the outputs of the samples of X (one per column) into out
+ * with the quantized network.
+ *
+ * As with nn_predict_into, the network is only read and no memory is
+ * allocated, so many threads can share it with one context each.
+ *
+ * @param q The quantized network.
+ * @param X The input matrix (input_size x nb_samples).
+ * @param out The output matrix (output_size x nb_samples).
+ * @param ctx The caller's context.
+ */
+void nn_quantized_predict_into(const nn_quantized *q, const matrix *X, matrix *out, nn_quantized_context *ctx){
+    size_t output_size = q->layers[q->nb_layers - 1].nb_neurons;
+    if(X->row != q->layers[0].input_size || out->row != output_size || out->col != X->col){
+        fprintf(stderr, "nn_quantized_predict_into: Matrix dimensions do not match the network\n");
+        return;
+    }
+
+    if(X->col <= ctx->max_batch){
+        matrix_view input = matrix_view_of(X);
+        nn_quantized_forward_batch(q, &input, out, ctx);
+        return;
+    }
+
+    for(size_t b = 0; b < X->col; b += ctx->max_batch){
+        size_t n = X->col - b < ctx->max_batch ? X->col - b : ctx->max_batch;
+        matrix_view in_chunk = matrix_view_cols(X, b, n);
+        matrix out_chunk = {output_size, n, ctx->output->stride, ctx->output->data, false};
+
+        nn_quantized_forward_batch(q, &in_chunk, &out_chunk, ctx);
+
+        matrix_view src = matrix_view_of(&out_chunk);
+        matrix_view dest = matrix_view_cols(out, b, n);
+        matrix_view_copy_to(&src, &dest);
+    }
+}
+
+/**
+ * @brief Predicts the output for the given input matrix using the quantized network.
+ *
+ * @param q The quantized network.
+ * @param X The input matrix.
+ * @return The predicted output matrix.
+ */
+matrix* nn_quantized_predict(const nn_quantized *q, const matrix *X){
+    matrix *output = matrix_zeros(q->layers[q->nb_layers - 1].nb_neurons, X->col);
+    if(output == NULL){
+        fprintf(stderr, "nn_quantized_predict: Unable to allocate memory for the output\n");
+        exit(1);
+    }
+
+    nn_quantized_context *ctx = nn_quantized_context_create(q, X->col > 0 ? X->col : 1);
+    nn_quantized_predict_into(q, X, output, ctx);
+    nn_quantized_context_destroy(ctx);
+
+    return output;
+}
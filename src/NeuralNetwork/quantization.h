@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+
+#include "neuralNetwork.h"
+#include "../Matrix/qgemm.h"
+
+// Post-training 8-bit quantization for inference
+// The weights of every neuron are quantized symmetrically to int8 with their
+// own scale. The inputs of every layer are quantized to [0, QGEMM_ACTIVATION_MAX]
+// with a scale and a zero point picked from the range they reach on
+// calibration samples. The products are accumulated in int32 and dequantized
+// before the bias and the activation, which stay in float.
+typedef struct quantized_layer{
+    size_t input_size;
+    size_t nb_neurons;
+    size_t stride;              // bytes per row of weights, qgemm_padded_depth(input_size)
+    int8_t *weights;            // nb_neurons x stride
+    float *scales;              // weight scale of every neuron times input_scale
+    int32_t *offsets;           // input_zero_point times the sum of the weights of every neuron
+    float *bias;
+    activation_type activation_type;
+    float input_min;            // calibrated range of the inputs, always containing 0
+    float input_max;
+    float input_scale;          // input = input_scale * (q - input_zero_point)
+    int32_t input_zero_point;
+} quantized_layer;
+
+typedef struct nn_quantized{
+    quantized_layer *layers;
+    size_t nb_layers;
+} nn_quantized;
+
+// Scratch space of one inference caller, like nn_context
+typedef struct nn_quantized_context{
+    size_t max_batch;
+    uint8_t *activations;       // quantized inputs of a layer, one sample per row of the largest stride
+    matrix *buffers[2];         // layer outputs, used alternately (max_neurons x max_batch)
+    matrix *output;             // output chunk when X has more columns than max_batch
+} nn_quantized_context;
+
+// Quantizes a compiled network, calibrating the input ranges of the layers
+// on the samples of calibration (input_size x nb_samples)
+// The network is only read and can be destroyed afterwards. Returns NULL for
+// networks with custom activation functions.
+nn_quantized* nn_quantize(const neural_network *nn, const matrix *calibration);
+void nn_quantized_destroy(nn_quantized *q);
+
+// Bytes taken by the weights and the per-neuron parameters
+size_t nn_quantized_size(const nn_quantized *q);
+
+// Quantized inference, same contract as nn_predict_into / nn_predict
+nn_quantized_context* nn_quantized_context_create(const nn_quantized *q, size_t max_batch);
+void nn_quantized_context_destroy(nn_quantized_context *ctx);
+void nn_quantized_predict_into(const nn_quantized *q, const matrix *X, matrix *out, nn_quantized_context *ctx);
+matrix* nn_quantized_predict(const nn_quantized *q, const matrix *X);
@@ -0,0 +1,286 @@
+/**
+ * @file tiling.c
+ * @brief Tiled inference of large images with overlap blending.
+ *
+ * The tiles of a batch are gathered into the columns of one input matrix, so
+ * the network runs them together through its GEMMs, and the gather and the
+ * blending are spread over the thread pool.
+ *
+ * The tiles form a grid and the blending weight of a pixel of a tile is the
+ * product of a row weight and a column weight. The sum of the weights reaching
+ * a pixel is then the product of the row sum and the column sum, so the
+ * weights are normalized per axis and no image sized weight map is needed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tiling.h"
+#include "../ThreadPool/threadPool.h"
+
+// Values copied or blended by a task of the thread pool
+#define TILING_PARALLEL_GRAIN (1 << 12)
+
+// Weight of the margin pixels, only kept where no other tile covers them
+#define TILING_MARGIN_WEIGHT 1e-6f
+
+// Placement of the tiles along the rows or the columns of the image
+typedef struct tiling_axis{
+    size_t size;        // of the image
+    size_t tile;
+    size_t count;       // tiles along the axis
+    size_t *starts;     // first pixel of every tile
+    float *weights;     // normalized blending weight of every pixel of every tile (count x tile)
+} tiling_axis;
+
+typedef struct tiling_job{
+    const nn_tiling *tiling;
+    const matrix *image;
+    matrix *out;
+    const tiling_axis *rows;
+    const tiling_axis *cols;
+    size_t height;
+    size_t out_channels;
+    size_t first;       // index of the first tile of the batch
+    size_t nb_tiles;
+    size_t band;        // first image row reached by the batch
+    size_t band_height;
+    matrix *X;          // tiles of the batch, one per column
+    matrix *Y;          // outputs of the tiles
+} tiling_job;
+
+// Weight of pixel i of a tile, ramping up to 1 over the overlap past the margin
+// A side on the border of the image (first or last) shares its pixels with no
+// other tile, its own values there being exact, and keeps them at full weight.
+static float tiling_ramp(size_t i, size_t tile, size_t overlap, size_t margin, bool first, bool last){
+    size_t d = SIZE_MAX;    // distance to the nearest side shared with another tile
+    if(!first)
+        d = i + 1;
+    if(!last && tile - i < d)
+        d = tile - i;
+    if(d <= margin)
+        return TILING_MARGIN_WEIGHT;
+    size_t span = overlap > 2 * margin ? overlap - 2 * margin : 0;
+    return d - margin > span ? 1.0f : (float) (d - margin) / (float) (span + 1);
+}
+
+/**
+ * @brief Places the tiles along an axis and normalizes their weights.
+ *
+ * The tiles advance by tile - overlap pixels, the last one being moved back
+ * to end on the border of the image, which is at least one tile long.
+ */
+static void tiling_axis_init(tiling_axis *a, size_t size, size_t tile, size_t overlap, size_t margin){
+    size_t step = tile - overlap;
+    a->size = size;
+    a->tile = tile;
+    a->count = (size - tile + step - 1) / step + 1;
+    a->starts = malloc(a->count * sizeof(size_t));
+    a->weights = malloc(a->count * tile * sizeof(float));
+    float *sums = calloc(size, sizeof(float));
+    if(a->starts == NULL || a->weights == NULL || sums == NULL){
+        fprintf(stderr, "nn_predict_tiled: Unable to allocate memory for the tiles\n");
+        exit(1);
+    }
+
+    for(size_t k = 0; k < a->count; k++){
+        a->starts[k] = k * step < size - tile ? k * step : size - tile;
+        // the last tile, moved back, may overlap the previous one by more than overlap
+        bool first = a->starts[k] == 0, last = a->starts[k] + tile >= size;
+        for(size_t i = 0; i < tile; i++)
+            a->weights[k * tile + i] = tiling_ramp(i, tile, overlap, margin, first, last);
+        for(size_t i = 0; i < tile; i++)
+            sums[a->starts[k] + i] += a->weights[k * tile + i];
+    }
+    for(size_t k = 0; k < a->count; k++){
+        for(size_t i = 0; i < tile; i++)
+            a->weights[k * tile + i] /= sums[a->starts[k] + i];
+    }
+    free(sums);
+}
+
+static void tiling_axis_destroy(tiling_axis *a){
+    free(a->starts);
+    free(a->weights);
+}
+
+// Gathers rows [begin, end) of X, row (c, i, j) holding pixel (i, j) of channel c of every tile
+static void tiling_gather_range(void *arg, size_t begin, size_t end){
+    tiling_job *job = arg;
+    const nn_tiling *t = job->tiling;
+    size_t plane = t->tile_height * t->tile_width;
+
+    for(size_t f = begin; f < end; f++){
+        size_t c = f / plane, i = f % plane / t->tile_width, j = f % t->tile_width;
+        float *x = &job->X->data[f * job->X->stride];
+        for(size_t b = 0; b < job->nb_tiles; b++){
+            size_t tile = job->first + b;
+            size_t y = job->rows->starts[tile / job->cols->count] + i;
+            size_t col = job->cols->starts[tile % job->cols->count] + j;
+            x[b] = job->image->data[(c * job->height + y) * job->image->stride + col];
+        }
+    }
+}
+
+// Blends the outputs of the batch into rows [begin, end) of the band, over every output channel
+static void tiling_blend_range(void *arg, size_t begin, size_t end){
+    tiling_job *job = arg;
+    const nn_tiling *t = job->tiling;
+
+    for(size_t r = begin; r < end; r++){
+        size_t c = r / job->band_height, y = job->band + r % job->band_height;
+        float *o = &job->out->data[(c * job->height + y) * job->out->stride];
+        for(size_t b = 0; b < job->nb_tiles; b++){
+            size_t tile = job->first + b;
+            size_t ty = tile / job->cols->count, tx = tile % job->cols->count;
+            size_t sy = job->rows->starts[ty], sx = job->cols->starts[tx];
+            if(y < sy || y >= sy + t->tile_height)
+                continue;
+
+            size_t i = y - sy;
+            float wy = job->rows->weights[ty * t->tile_height + i];
+            const float *wx = &job->cols->weights[tx * t->tile_width];
+            const float *v = &job->Y->data[(c * t->tile_height + i) * t->tile_width * job->Y->stride + b];
+            for(size_t j = 0; j < t->tile_width; j++)
+                o[sx + j] += wy * wx[j] * v[j * job->Y->stride];
+        }
+    }
+}
+
+/**
+ * @brief Tiling of a network made of convolutions.
+ *
+ * @param nn The compiled neural network.
+ * @param overlap The pixels shared by neighbouring tiles.
+ * @param batch The tiles run through the network together.
+ * @return The tiling, the tiles having the size of the input images of the convolution.
+ */
+nn_tiling nn_tiling_of(const neural_network *nn, size_t overlap, size_t batch){
+    if(nn->nb_layers == 0 || nn->layers[0]->kind != LAYER_CONV2D){
+        fprintf(stderr, "nn_tiling_of: The first layer is not a convolution\n");
+        exit(1);
+    }
+
+    // Every convolution moves the border effects further in by half its dilated kernel
+    size_t margin = 0;
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        const conv_shape *s = &nn->layers[i]->conv;
+        if(nn->layers[i]->kind != LAYER_CONV2D){
+            fprintf(stderr, "nn_tiling_of: Layer %zu is not a convolution\n", i);
+            exit(1);
+        }
+        size_t kernel = s->kernel_height > s->kernel_width ? s->kernel_height : s->kernel_width;
+        margin += ((kernel - 1) * s->dilation + 1) / 2;
+    }
+
+    const conv_shape *s = &nn->layers[0]->conv;
+    return (nn_tiling){s->in_channels, s->in_height, s->in_width, overlap, margin, batch};
+}
+
+/**
+ * @brief Channels of the output of the network for a tiling.
+ *
+ * @return The output size over the pixels of a tile, or 0 when it does not divide it.
+ */
+size_t nn_tiling_out_channels(const neural_network *nn, const nn_tiling *tiling){
+    size_t plane = tiling->tile_height * tiling->tile_width;
+    size_t output_size = nn->layers[nn->nb_layers - 1]->nb_neurons;
+    return plane > 0 && output_size % plane == 0 ? output_size / plane : 0;
+}
+
+/**
+ * @brief Predicts the output image of a network tile by tile.
+ *
+ * The tiles are gathered in raster order, batch by batch, into a tile batch
+ * matrix run through the network. Their outputs are added to out with the
+ * blending weights, the rows of out being cleared as the batches first reach them.
+ *
+ * @param nn The compiled neural network, mapping a tile to out_channels tiles.
+ * @param image The (channels * height) x width input image, at least one tile in each dimension.
+ * @param out The (out_channels * height) x width output image.
+ * @param tiling The tile size, overlap and batch.
+ */
+void nn_predict_tiled(const neural_network *nn, const matrix *image, matrix *out, const nn_tiling *tiling){
+    if(nn->nb_layers == 0 || nn->layers[nn->nb_layers - 1]->type != OUTPUT || nn->layers[0]->weights == NULL){
+        fprintf(stderr, "nn_predict_tiled: Compile the network first\n");
+        exit(1);
+    }
+
+    const nn_tiling *t = tiling;
+    size_t plane = t->tile_height * t->tile_width;
+    if(plane == 0 || t->channels == 0 || t->batch == 0 || t->overlap >= t->tile_height || t->overlap >= t->tile_width){
+        fprintf(stderr, "nn_predict_tiled: Invalid tiling\n");
+        exit(1);
+    }
+    size_t out_channels = nn_tiling_out_channels(nn, t);
+    if(nn->layers[0]->input_size != t->channels * plane || out_channels == 0){
+        fprintf(stderr, "nn_predict_tiled: The network does not map %zu x %zu x %zu tiles to tiles of the same size\n",
+                t->channels, t->tile_height, t->tile_width);
+        exit(1);
+    }
+
+    size_t height = image->row / t->channels;
+    if(image->row % t->channels != 0 || out->row != out_channels * height || out->col != image->col){
+        fprintf(stderr, "nn_predict_tiled: Matrix dimensions do not match the network\n");
+        return;
+    }
+    // A smaller image would be padded to a tile, and the layers past the first
+    // would see the outputs of the padding instead of zeros
+    if(height < t->tile_height || image->col < t->tile_width){
+        fprintf(stderr, "nn_predict_tiled: The %zu x %zu image is smaller than a %zu x %zu tile\n",
+                height, image->col, t->tile_height, t->tile_width);
+        return;
+    }
+
+    tiling_axis rows, cols;
+    tiling_axis_init(&rows, height, t->tile_height, t->overlap, t->margin);
+    tiling_axis_init(&cols, image->col, t->tile_width, t->overlap, t->margin);
+    size_t nb_tiles = rows.count * cols.count;
+    size_t batch = t->batch < nb_tiles ? t->batch : nb_tiles;
+
+    matrix *X = matrix_zeros_padded(t->channels * plane, batch);
+    matrix *Y = matrix_zeros_padded(out_channels * plane, batch);
+    if(X == NULL || Y == NULL){
+        fprintf(stderr, "nn_predict_tiled: Unable to allocate memory for the tiles\n");
+        exit(1);
+    }
+    nn_context *ctx = nn_context_create(nn, batch);
+
+    tiling_job job = {.tiling = t, .image = image, .out = out, .rows = &rows, .cols = &cols,
+                      .height = height, .out_channels = out_channels};
+    size_t cleared = 0;     // rows of out below this one hold blended values
+    for(size_t first = 0; first < nb_tiles; first += batch){
+        size_t n = nb_tiles - first < batch ? nb_tiles - first : batch;
+        matrix x = {X->row, n, X->stride, X->data, false};
+        matrix y = {Y->row, n, Y->stride, Y->data, false};
+        job.first = first;
+        job.nb_tiles = n;
+        job.X = &x;
+        job.Y = &y;
+
+        size_t grain = (TILING_PARALLEL_GRAIN + n - 1) / n;
+        thread_pool_parallel_for(x.row, grain, tiling_gather_range, &job);
+        nn_predict_into(nn, &x, &y, ctx);
+
+        // The tiles are in raster order, so the batch covers a band of rows
+        size_t last = rows.starts[(first + n - 1) / cols.count] + t->tile_height;
+        job.band = rows.starts[first / cols.count];
+        job.band_height = last - job.band;
+        for(; cleared < job.band + job.band_height; cleared++){
+            for(size_t c = 0; c < out_channels; c++)
+                memset(&out->data[(c * height + cleared) * out->stride], 0, out->col * sizeof(float));
+        }
+
+        grain = (TILING_PARALLEL_GRAIN + n * t->tile_width - 1) / (n * t->tile_width);
+        thread_pool_parallel_for(out_channels * job.band_height, grain, tiling_blend_range, &job);
+    }
+
+    nn_context_destroy(ctx);
+    matrix_destroy(X);
+    matrix_destroy(Y);
+    tiling_axis_destroy(&rows);
+    tiling_axis_destroy(&cols);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+
+#include "neuralNetwork.h"
+
+// Tiled inference of images larger than the input of an image-to-image network
+// An image is a (channels * height) x width matrix holding its channels one
+// after the other, row c * height + y being row y of channel c. The network
+// maps a channels x tile_height x tile_width tile (CHW in one sample column)
+// to out_channels x tile_height x tile_width values.
+// The tiles overlap by overlap pixels and are run through the network in
+// batches of batch tiles. Their outputs are blended with weights ramping down
+// over the overlap, so seams do not show. The margin pixels of a tile get a
+// negligible weight where another tile covers them: with an overlap of at
+// least twice the margin, the tiles then give the output of the whole image.
+// The memory used besides the image and the output depends on the tile size
+// and the batch, not on the image.
+typedef struct nn_tiling{
+    size_t channels;
+    size_t tile_height;
+    size_t tile_width;
+    size_t overlap;     // pixels shared by neighbouring tiles, less than the tile size
+    size_t margin;      // border pixels of a tile whose output sees the padding of the tile
+    size_t batch;       // tiles run through the network together
+} nn_tiling;
+
+// Tiling of a network made of convolutions, the tiles having the size of the
+// input of the first one and the margin reaching as far as their kernels
+nn_tiling nn_tiling_of(const neural_network *nn, size_t overlap, size_t batch);
+
+// Channels of the output of the network for the tiling
+size_t nn_tiling_out_channels(const neural_network *nn, const nn_tiling *tiling);
+
+// out = network applied tile by tile to image, out being (out_channels * height) x width
+// The image must be at least one tile high and one tile wide, smaller ones are rejected.
+void nn_predict_tiled(const neural_network *nn, const matrix *image, matrix *out, const nn_tiling *tiling);
@@ -0,0 +1,273 @@
+/**
+ * @file profiler.c
+ * @brief Counters and trace events recorded by the PROFILE_* hooks.
+ *
+ * The counters are updated with relaxed atomic additions, so the data
+ * parallel and Hogwild workers can record at the same time. Trace events go
+ * to a buffer allocated when recording starts, each thread claiming a slot
+ * with an atomic counter.
+ */
+
+#include "profiler.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_HAS_TSC 1
+#endif
+
+typedef struct profile_slot{
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t cycles;
+    atomic_uint_fast64_t nanoseconds;
+    atomic_uint_fast64_t flops;
+    atomic_uint_fast64_t bytes;
+} profile_slot;
+
+typedef struct profile_event{
+    uint64_t start;         // nanoseconds since the trace started
+    uint64_t duration;
+    uint64_t flops;
+    uint64_t bytes;
+    uint32_t layer;
+    uint32_t thread;
+    profile_phase phase;
+} profile_event;
+
+static profile_slot slots[PROFILE_MAX_LAYERS][PROFILE_NB_PHASES];
+static atomic_size_t nb_layers = 0;
+
+static atomic_uint_fast64_t allocations = 0;
+static atomic_uint_fast64_t allocated_bytes = 0;
+static atomic_uint_fast64_t frees = 0;
+
+static profile_event *events = NULL;
+static size_t max_events = 0;
+static atomic_size_t nb_events = 0;
+static uint64_t trace_origin = 0;
+
+// Trace thread ids, given out in order of first use
+static atomic_uint next_thread = 1;
+static _Thread_local uint32_t thread_id = 0;
+
+static const char *phase_names[] = {"forward", "backward", "update"};
+
+bool profile_enabled(void){
+#ifdef NN_PROFILE
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char* profile_phase_name(profile_phase phase){
+    return phase_names[phase];
+}
+
+static uint64_t profile_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Recording
+
+profile_scope profile_begin(void){
+    profile_scope scope = {0, profile_now()};
+#ifdef PROFILE_HAS_TSC
+    scope.cycles = __rdtsc();
+#endif
+    return scope;
+}
+
+void profile_end(const profile_scope *scope, size_t layer, profile_phase phase, uint64_t flops, uint64_t bytes){
+    uint64_t end = profile_now();
+    uint64_t cycles = 0;
+#ifdef PROFILE_HAS_TSC
+    cycles = __rdtsc() - scope->cycles;
+#endif
+    if(layer >= PROFILE_MAX_LAYERS)
+        return;
+
+    profile_slot *s = &slots[layer][phase];
+    atomic_fetch_add_explicit(&s->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->cycles, cycles, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->nanoseconds, end - scope->nanoseconds, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->flops, flops, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->bytes, bytes, memory_order_relaxed);
+
+    size_t seen = atomic_load_explicit(&nb_layers, memory_order_relaxed);
+    while(seen <= layer && !atomic_compare_exchange_weak(&nb_layers, &seen, layer + 1))
+        ;
+
+    // Calls that began before the trace started are left out of it
+    if(events == NULL || scope->nanoseconds < trace_origin)
+        return;
+    size_t e = atomic_fetch_add_explicit(&nb_events, 1, memory_order_relaxed);
+    if(e >= max_events)
+        return;
+    if(thread_id == 0)
+        thread_id = atomic_fetch_add(&next_thread, 1);
+    events[e] = (profile_event){
+        .start = scope->nanoseconds - trace_origin,
+        .duration = end - scope->nanoseconds,
+        .flops = flops,
+        .bytes = bytes,
+        .layer = layer,
+        .thread = thread_id,
+        .phase = phase,
+    };
+}
+
+void profile_count_allocation(size_t bytes){
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocated_bytes, bytes, memory_order_relaxed);
+}
+
+void profile_count_free(void){
+    atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+}
+
+// Queries
+
+size_t profile_nb_layers(void){
+    return atomic_load(&nb_layers);
+}
+
+profile_counters profile_get(size_t layer, profile_phase phase){
+    profile_counters c = {0};
+    if(layer >= PROFILE_MAX_LAYERS)
+        return c;
+
+    profile_slot *s = &slots[layer][phase];
+    c.calls = atomic_load_explicit(&s->calls, memory_order_relaxed);
+    c.cycles = atomic_load_explicit(&s->cycles, memory_order_relaxed);
+    c.nanoseconds = atomic_load_explicit(&s->nanoseconds, memory_order_relaxed);
+    c.flops = atomic_load_explicit(&s->flops, memory_order_relaxed);
+    c.bytes = atomic_load_explicit(&s->bytes, memory_order_relaxed);
+    return c;
+}
+
+profile_counters profile_get_phase(profile_phase phase){
+    profile_counters total = {0};
+    for(size_t l = 0; l < profile_nb_layers(); l++){
+        profile_counters c = profile_get(l, phase);
+        total.calls += c.calls;
+        total.cycles += c.cycles;
+        total.nanoseconds += c.nanoseconds;
+        total.flops += c.flops;
+        total.bytes += c.bytes;
+    }
+    return total;
+}
+
+profile_allocations profile_get_allocations(void){
+    return (profile_allocations){
+        .count = atomic_load(&allocations),
+        .bytes = atomic_load(&allocated_bytes),
+        .frees = atomic_load(&frees),
+    };
+}
+
+void profile_reset(void){
+    for(size_t l = 0; l < PROFILE_MAX_LAYERS; l++){
+        for(size_t p = 0; p < PROFILE_NB_PHASES; p++){
+            profile_slot *s = &slots[l][p];
+            atomic_store(&s->calls, 0);
+            atomic_store(&s->cycles, 0);
+            atomic_store(&s->nanoseconds, 0);
+            atomic_store(&s->flops, 0);
+            atomic_store(&s->bytes, 0);
+        }
+    }
+    atomic_store(&nb_layers, 0);
+    atomic_store(&allocations, 0);
+    atomic_store(&allocated_bytes, 0);
+    atomic_store(&frees, 0);
+    atomic_store(&nb_events, 0);
+    trace_origin = profile_now();
+}
+
+static void profile_print_row(FILE *f, const char *layer, profile_phase phase, profile_counters c){
+    double seconds = c.nanoseconds * 1e-9;
+    fprintf(f, "%-6s %-9s %10llu %12.3f %14.3f", layer, phase_names[phase], (unsigned long long) c.calls,
+            seconds * 1e3, c.cycles * 1e-6);
+    if(seconds > 0)
+        fprintf(f, " %9.2f %9.2f", c.flops / seconds * 1e-9, c.bytes / seconds * 1e-9);
+    fprintf(f, "\n");
+}
+
+void profile_print(FILE *f){
+    fprintf(f, "%-6s %-9s %10s %12s %14s %9s %9s\n", "layer", "phase", "calls", "time (ms)", "Mcycles", "GFLOP/s", "GB/s");
+    for(size_t l = 0; l < profile_nb_layers(); l++){
+        char name[24];
+        snprintf(name, sizeof(name), "%zu", l);
+        for(int p = 0; p < PROFILE_NB_PHASES; p++){
+            profile_counters c = profile_get(l, p);
+            if(c.calls > 0)
+                profile_print_row(f, name, p, c);
+        }
+    }
+    for(int p = 0; p < PROFILE_NB_PHASES; p++)
+        profile_print_row(f, "all", p, profile_get_phase(p));
+
+    profile_allocations a = profile_get_allocations();
+    fprintf(f, "allocations: %llu (%llu bytes), frees: %llu\n",
+            (unsigned long long) a.count, (unsigned long long) a.bytes, (unsigned long long) a.frees);
+}
+
+// Trace export
+
+bool profile_trace_start(size_t capacity){
+    profile_trace_stop();
+    events = malloc(capacity * sizeof(profile_event));
+    if(events == NULL){
+        fprintf(stderr, "profile_trace_start: Unable to allocate memory for the trace events\n");
+        return false;
+    }
+    max_events = capacity;
+    atomic_store(&nb_events, 0);
+    trace_origin = profile_now();
+    return true;
+}
+
+void profile_trace_stop(void){
+    free(events);
+    events = NULL;
+    max_events = 0;
+    atomic_store(&nb_events, 0);
+}
+
+bool profile_trace_write(const char *path){
+    FILE *f = fopen(path, "w");
+    if(f == NULL){
+        fprintf(stderr, "profile_trace_write: Unable to open %s\n", path);
+        return false;
+    }
+
+    size_t n = atomic_load(&nb_events);
+    if(n > max_events){
+        fprintf(stderr, "profile_trace_write: %zu events dropped, the trace holds %zu\n", n - max_events, max_events);
+        n = max_events;
+    }
+
+    // Complete events ("ph": "X"), times in microseconds
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for(size_t i = 0; i < n; i++){
+        const profile_event *e = &events[i];
+        fprintf(f, "{\"name\": \"layer %u %s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"pid\": 1, \"tid\": %u, \"args\": {\"layer\": %u, \"flops\": %llu, \"bytes\": %llu}}%s\n",
+                e->layer, phase_names[e->phase], phase_names[e->phase], e->start * 1e-3, e->duration * 1e-3,
+                e->thread, e->layer, (unsigned long long) e->flops, (unsigned long long) e->bytes,
+                i + 1 < n ? "," : "");
+    }
+    fprintf(f, "]}\n");
+
+    if(fclose(f) != 0){
+        fprintf(stderr, "profile_trace_write: Unable to write %s\n", path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Hot-path instrumentation of the training and inference loops
+//
+// The hooks are the PROFILE_* macros below. They only record when the code
+// is built with NN_PROFILE defined (make PROFILE=1) and expand to nothing
+// otherwise, so a normal build pays nothing. The query functions always
+// exist and report zeros when nothing was recorded.
+
+// Layers beyond this index are not recorded
+#define PROFILE_MAX_LAYERS 64
+
+typedef enum profile_phase{
+    PROFILE_FORWARD,    // W * X + b and the activation
+    PROFILE_BACKWARD,   // errors and deltas
+    PROFILE_UPDATE,     // weight gradients and their application
+    PROFILE_NB_PHASES
+} profile_phase;
+
+// Totals of the calls recorded for one layer and phase
+typedef struct profile_counters{
+    uint64_t calls;
+    uint64_t cycles;        // time stamp counter ticks, 0 where there is none
+    uint64_t nanoseconds;
+    uint64_t flops;         // floating point operations the calls performed
+    uint64_t bytes;         // least memory traffic of the calls
+} profile_counters;
+
+// Heap allocations of matrix storage and GEMM packing buffers
+typedef struct profile_allocations{
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t frees;
+} profile_allocations;
+
+// True when the library was built with NN_PROFILE
+bool profile_enabled(void);
+const char* profile_phase_name(profile_phase phase);
+
+// Queries, safe while other threads record
+// profile_nb_layers is one past the highest layer recorded.
+size_t profile_nb_layers(void);
+profile_counters profile_get(size_t layer, profile_phase phase);
+// Sum over the layers
+profile_counters profile_get_phase(profile_phase phase);
+profile_allocations profile_get_allocations(void);
+// Clears every counter and the recorded trace events
+void profile_reset(void);
+// Table of the counters per layer and phase
+void profile_print(FILE *f);
+
+// Chrome trace-event export (chrome://tracing, Perfetto)
+// Recording keeps at most max_events events, the later ones are dropped.
+bool profile_trace_start(size_t max_events);
+void profile_trace_stop(void);
+bool profile_trace_write(const char *path);
+
+// Recording, used through the macros
+typedef struct profile_scope{
+    uint64_t cycles;
+    uint64_t nanoseconds;
+} profile_scope;
+
+profile_scope profile_begin(void);
+void profile_end(const profile_scope *scope, size_t layer, profile_phase phase, uint64_t flops, uint64_t bytes);
+void profile_count_allocation(size_t bytes);
+void profile_count_free(void);
+
+#ifdef NN_PROFILE
+#define PROFILE_BEGIN(scope) profile_scope scope = profile_begin()
+#define PROFILE_END(scope, layer, phase, flops, bytes) profile_end(&(scope), (layer), (phase), (flops), (bytes))
+#define PROFILE_ALLOC(bytes) profile_count_allocation(bytes)
+#define PROFILE_FREE() profile_count_free()
+#else
+#define PROFILE_BEGIN(scope) ((void) 0)
+#define PROFILE_END(scope, layer, phase, flops, bytes) ((void) 0)
+#define PROFILE_ALLOC(bytes) ((void) 0)
+#define PROFILE_FREE() ((void) 0)
+#endif
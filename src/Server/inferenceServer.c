@@ -0,0 +1,231 @@
+/**
+ * @file inferenceServer.c
+ * @brief Dynamic batching of inference requests.
+ *
+ * Callers submit single samples. A batcher thread waits until max_batch
+ * requests are queued or the oldest one reaches its deadline, then runs the
+ * whole batch as one nn_predict_into call. Small batches keep the tail
+ * latency bounded, and large ones get the GEMM throughput.
+ */
+
+#include "inferenceServer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Number of recent latencies kept for the percentiles
+#define INFERENCE_SERVER_LATENCY_WINDOW (1 << 16)
+
+double inference_server_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void* inference_server_batcher(void *arg){
+    inference_server *server = arg;
+    const neural_network *nn = server->nn;
+    size_t input_size = nn->layers[0]->input_size;
+    size_t output_size = nn->layers[nn->nb_layers - 1]->nb_neurons;
+
+    pthread_mutex_lock(&server->lock);
+    for(;;){
+        while(server->head == NULL && !server->stopping)
+            pthread_cond_wait(&server->queue_cond, &server->lock);
+        if(server->head == NULL)
+            break;
+
+        // Wait for a full batch, at most until the deadline of the oldest request
+        double deadline = server->head->submit_time + server->max_delay;
+        while(server->nb_queued < server->max_batch && !server->stopping){
+            double now = inference_server_now();
+            if(now >= deadline)
+                break;
+
+            struct timespec t;
+            t.tv_sec = (time_t) deadline;
+            t.tv_nsec = (long)((deadline - t.tv_sec) * 1e9);
+            pthread_cond_timedwait(&server->queue_cond, &server->lock, &t);
+        }
+
+        size_t n = 0;
+        while(server->head != NULL && n < server->max_batch){
+            server->batch[n++] = server->head;
+            server->head = server->head->next;
+        }
+        if(server->head == NULL)
+            server->tail = NULL;
+        server->nb_queued -= n;
+        pthread_mutex_unlock(&server->lock);
+
+        // One column per request
+        server->X->col = n;
+        server->Y->col = n;
+        for(size_t j = 0; j < n; j++){
+            for(size_t i = 0; i < input_size; i++)
+                server->X->data[i * server->X->stride + j] = server->batch[j]->input[i];
+        }
+
+        nn_predict_into(nn, server->X, server->Y, server->ctx);
+
+        for(size_t j = 0; j < n; j++){
+            for(size_t i = 0; i < output_size; i++)
+                server->batch[j]->output[i] = server->Y->data[i * server->Y->stride + j];
+        }
+
+        double now = inference_server_now();
+        pthread_mutex_lock(&server->lock);
+        for(size_t j = 0; j < n; j++){
+            server->latencies[server->nb_requests % INFERENCE_SERVER_LATENCY_WINDOW] = (now - server->batch[j]->submit_time) * 1e6;
+            server->nb_requests++;
+            server->batch[j]->done = true;
+        }
+        server->nb_batches++;
+        server->last_response = now;
+        pthread_cond_broadcast(&server->done_cond);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+// Server creation and destruction
+
+inference_server* inference_server_create(const neural_network *nn, size_t max_batch, double max_delay_ms){
+    inference_server *server = malloc(sizeof(inference_server));
+    if(server == NULL){
+        fprintf(stderr, "inference_server_create: Unable to allocate memory for the server\n");
+        exit(1);
+    }
+
+    if(max_batch == 0)
+        max_batch = 1;
+
+    server->nn = nn;
+    server->max_batch = max_batch;
+    server->max_delay = max_delay_ms * 1e-3;
+    server->head = NULL;
+    server->tail = NULL;
+    server->nb_queued = 0;
+    server->stopping = false;
+
+    server->ctx = nn_context_create(nn, max_batch);
+    server->X = matrix_zeros_padded(nn->layers[0]->input_size, max_batch);
+    server->Y = matrix_zeros_padded(nn->layers[nn->nb_layers - 1]->nb_neurons, max_batch);
+    server->batch = malloc(max_batch * sizeof(inference_request*));
+    server->latencies = malloc(INFERENCE_SERVER_LATENCY_WINDOW * sizeof(double));
+    if(server->X == NULL || server->Y == NULL || server->batch == NULL || server->latencies == NULL){
+        fprintf(stderr, "inference_server_create: Unable to allocate memory for the server\n");
+        exit(1);
+    }
+    server->nb_requests = 0;
+    server->nb_batches = 0;
+    server->first_request = 0;
+    server->last_response = 0;
+
+    // The deadlines are computed on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->queue_cond, &attr);
+    pthread_cond_init(&server->done_cond, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if(pthread_create(&server->batcher, NULL, inference_server_batcher, server) != 0){
+        fprintf(stderr, "inference_server_create: Unable to start the batcher thread\n");
+        exit(1);
+    }
+    return server;
+}
+
+void inference_server_destroy(inference_server *server){
+    // The queued requests are still served before the batcher exits
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    pthread_cond_signal(&server->queue_cond);
+    pthread_mutex_unlock(&server->lock);
+    pthread_join(server->batcher, NULL);
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->queue_cond);
+    pthread_cond_destroy(&server->done_cond);
+
+    nn_context_destroy(server->ctx);
+    matrix_destroy(server->X);
+    matrix_destroy(server->Y);
+    free(server->batch);
+    free(server->latencies);
+    free(server);
+}
+
+// Requests
+
+void inference_server_submit(inference_server *server, inference_request *request){
+    request->done = false;
+    request->next = NULL;
+    request->submit_time = inference_server_now();
+
+    pthread_mutex_lock(&server->lock);
+    if(server->first_request == 0)
+        server->first_request = request->submit_time;
+
+    if(server->tail == NULL)
+        server->head = request;
+    else
+        server->tail->next = request;
+    server->tail = request;
+    server->nb_queued++;
+
+    // Wake the batcher for the first request, or when the batch is full
+    if(server->nb_queued == 1 || server->nb_queued >= server->max_batch)
+        pthread_cond_signal(&server->queue_cond);
+    pthread_mutex_unlock(&server->lock);
+}
+
+void inference_server_wait(inference_server *server, inference_request *request){
+    pthread_mutex_lock(&server->lock);
+    while(!request->done)
+        pthread_cond_wait(&server->done_cond, &server->lock);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Statistics
+
+static int compare_double(const void *a, const void *b){
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void inference_server_get_stats(inference_server *server, inference_stats *stats){
+    pthread_mutex_lock(&server->lock);
+    size_t n = server->nb_requests < INFERENCE_SERVER_LATENCY_WINDOW ? server->nb_requests : INFERENCE_SERVER_LATENCY_WINDOW;
+    double *sorted = malloc((n > 0 ? n : 1) * sizeof(double));
+    if(sorted != NULL)
+        memcpy(sorted, server->latencies, n * sizeof(double));
+
+    stats->nb_requests = server->nb_requests;
+    stats->nb_batches = server->nb_batches;
+    stats->mean_batch_size = server->nb_batches > 0 ? (double) server->nb_requests / server->nb_batches : 0;
+    double elapsed = server->last_response - server->first_request;
+    stats->throughput = elapsed > 0 ? server->nb_requests / elapsed : 0;
+    pthread_mutex_unlock(&server->lock);
+
+    stats->p50_latency_us = 0;
+    stats->p99_latency_us = 0;
+    if(sorted != NULL && n > 0){
+        qsort(sorted, n, sizeof(double), compare_double);
+        stats->p50_latency_us = sorted[(n - 1) / 2];
+        stats->p99_latency_us = sorted[(size_t)((n - 1) * 0.99)];
+    }
+    free(sorted);
+}
+
+void inference_server_print_stats(inference_server *server, FILE *f){
+    inference_stats stats;
+    inference_server_get_stats(server, &stats);
+
+    fprintf(f, "requests: %zu, batches: %zu (mean size %.1f)\n", stats.nb_requests, stats.nb_batches, stats.mean_batch_size);
+    fprintf(f, "latency: p50 %.1f us, p99 %.1f us\n", stats.p50_latency_us, stats.p99_latency_us);
+    fprintf(f, "throughput: %.1f requests/s\n", stats.throughput);
+}
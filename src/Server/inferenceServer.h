@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "../NeuralNetwork/neuralNetwork.h"
+
+// One sample to run through the network
+typedef struct inference_request{
+    const float *input;     // input_size values
+    float *output;          // output_size values, filled by the server
+    double submit_time;
+    bool done;
+    struct inference_request *next;
+} inference_request;
+
+typedef struct inference_stats{
+    size_t nb_requests;
+    size_t nb_batches;
+    double mean_batch_size;
+    double p50_latency_us;
+    double p99_latency_us;
+    double throughput;      // requests per second since the first request
+} inference_stats;
+
+// Coalesces concurrent single-sample requests into batches
+// A batch is run as soon as max_batch requests are queued, or when the oldest
+// queued request has waited max_delay_ms.
+typedef struct inference_server{
+    const neural_network *nn;
+    size_t max_batch;
+    double max_delay;
+
+    pthread_t batcher;
+    pthread_mutex_t lock;
+    pthread_cond_t queue_cond;
+    pthread_cond_t done_cond;
+    inference_request *head;
+    inference_request *tail;
+    size_t nb_queued;
+    bool stopping;
+
+    // Owned by the batcher thread
+    nn_context *ctx;
+    matrix *X;
+    matrix *Y;
+    inference_request **batch;
+
+    // Statistics, protected by lock
+    double *latencies;      // ring of the most recent latencies, in microseconds
+    size_t nb_requests;
+    size_t nb_batches;
+    double first_request;
+    double last_response;
+} inference_server;
+
+// Server creation and destruction
+inference_server* inference_server_create(const neural_network *nn, size_t max_batch, double max_delay_ms);
+void inference_server_destroy(inference_server *server);
+
+// Requests
+void inference_server_submit(inference_server *server, inference_request *request);
+void inference_server_wait(inference_server *server, inference_request *request);
+
+// Statistics
+void inference_server_get_stats(inference_server *server, inference_stats *stats);
+void inference_server_print_stats(inference_server *server, FILE *f);
+
+double inference_server_now(void);
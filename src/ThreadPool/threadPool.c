@@ -0,0 +1,217 @@
+/**
+ * @file threadPool.c
+ * @brief Persistent worker pool used to split matrix kernels across cores.
+ *
+ * Workers are started once and sleep on a condition variable between jobs.
+ * A job is a parallel loop: iterations are cut in chunks that the workers
+ * and the submitting thread grab with an atomic counter.
+ */
+
+#include "threadPool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+typedef struct thread_pool_job{
+    thread_pool_task task;
+    void *arg;
+    size_t n;
+    size_t chunk;
+    atomic_size_t next;
+} thread_pool_job;
+
+typedef struct thread_pool{
+    pthread_t *workers;
+    size_t nb_workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned long generation;
+    size_t active;
+    bool shutdown;
+
+    thread_pool_job job;
+} thread_pool;
+
+static thread_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+static atomic_bool pool_started = false;
+
+// Held by the thread currently running a job, or (re)sizing the pool
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local bool in_worker = false;
+
+static void thread_pool_run_chunks(thread_pool_job *job){
+    for(;;){
+        size_t begin = atomic_fetch_add(&job->next, job->chunk);
+        if(begin >= job->n)
+            break;
+        size_t end = job->n - begin < job->chunk ? job->n : begin + job->chunk;
+        job->task(job->arg, begin, end);
+    }
+}
+
+static void* thread_pool_worker(void *arg){
+    in_worker = true;
+
+    // Generation at the time the worker was started, jobs after it are ours
+    unsigned long seen = (unsigned long)(uintptr_t) arg;
+    pthread_mutex_lock(&pool.lock);
+    for(;;){
+        while(pool.generation == seen && !pool.shutdown)
+            pthread_cond_wait(&pool.work_cond, &pool.lock);
+        if(pool.shutdown)
+            break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        thread_pool_run_chunks(&pool.job);
+
+        pthread_mutex_lock(&pool.lock);
+        if(--pool.active == 0)
+            pthread_cond_signal(&pool.done_cond);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static size_t thread_pool_default_size(void){
+    const char *env = getenv("MATRIX_NUM_THREADS");
+    if(env != NULL){
+        long n = strtol(env, NULL, 10);
+        if(n > 0)
+            return n;
+        fprintf(stderr, "thread_pool: Invalid MATRIX_NUM_THREADS '%s', ignoring it\n", env);
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (size_t) cores : 1;
+}
+
+// Must be called with submit_lock held
+static void thread_pool_stop(void){
+    if(!pool_started)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(size_t i = 0; i < pool.nb_workers; i++)
+        pthread_join(pool.workers[i], NULL);
+
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.nb_workers = 0;
+    pool.shutdown = false;
+    pool_started = false;
+}
+
+// Must be called with submit_lock held
+static void thread_pool_start(size_t nb_threads){
+    if(nb_threads == 0)
+        nb_threads = thread_pool_default_size();
+
+    // The submitting thread is one of the threads
+    pool.nb_workers = nb_threads - 1;
+    pool.workers = malloc((pool.nb_workers + 1) * sizeof(pthread_t));
+    if(pool.workers == NULL){
+        fprintf(stderr, "thread_pool: Unable to allocate memory for the workers\n");
+        exit(1);
+    }
+
+    for(size_t i = 0; i < pool.nb_workers; i++){
+        if(pthread_create(&pool.workers[i], NULL, thread_pool_worker, (void*)(uintptr_t) pool.generation) != 0){
+            fprintf(stderr, "thread_pool: Unable to start worker %zu, running with %zu\n", i, i + 1);
+            pool.nb_workers = i;
+            break;
+        }
+    }
+    pool_started = true;
+}
+
+void thread_pool_init(size_t nb_threads){
+    pthread_mutex_lock(&submit_lock);
+    thread_pool_stop();
+    thread_pool_start(nb_threads);
+    pthread_mutex_unlock(&submit_lock);
+}
+
+void thread_pool_destroy(void){
+    pthread_mutex_lock(&submit_lock);
+    thread_pool_stop();
+    pthread_mutex_unlock(&submit_lock);
+}
+
+size_t thread_pool_get_nb_threads(void){
+    // Only takes the lock to start the pool, so it can be called from inside a task
+    if(!pool_started){
+        pthread_mutex_lock(&submit_lock);
+        if(!pool_started)
+            thread_pool_start(0);
+        pthread_mutex_unlock(&submit_lock);
+    }
+    return pool.nb_workers + 1;
+}
+
+bool thread_pool_in_worker(void){
+    return in_worker;
+}
+
+void thread_pool_parallel_for(size_t n, size_t grain, thread_pool_task task, void *arg){
+    if(n == 0)
+        return;
+    if(grain == 0)
+        grain = 1;
+
+    // Nested or concurrent calls run on the calling thread
+    if(in_worker || n <= grain || pthread_mutex_trylock(&submit_lock) != 0){
+        task(arg, 0, n);
+        return;
+    }
+
+    if(!pool_started)
+        thread_pool_start(0);
+
+    if(pool.nb_workers == 0){
+        pthread_mutex_unlock(&submit_lock);
+        task(arg, 0, n);
+        return;
+    }
+
+    // A few chunks per thread to even out imbalance
+    size_t nb_threads = pool.nb_workers + 1;
+    size_t chunk = (n + 4 * nb_threads - 1) / (4 * nb_threads);
+    if(chunk < grain)
+        chunk = grain;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job.task = task;
+    pool.job.arg = arg;
+    pool.job.n = n;
+    pool.job.chunk = chunk;
+    atomic_store(&pool.job.next, 0);
+    pool.active = pool.nb_workers;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    in_worker = true;
+    thread_pool_run_chunks(&pool.job);
+    in_worker = false;
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.active > 0)
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&submit_lock);
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+// Body of a parallel loop, called with a half-open range [begin, end) of iterations
+typedef void (*thread_pool_task)(void *arg, size_t begin, size_t end);
+
+// Pool creation and destruction
+// The pool is created lazily on first use with MATRIX_NUM_THREADS threads
+// (or one per online core). thread_pool_init resizes it explicitly,
+// nb_threads = 0 meaning "use the default". It must not be called while
+// another thread is running a parallel loop.
+void thread_pool_init(size_t nb_threads);
+void thread_pool_destroy(void);
+
+size_t thread_pool_get_nb_threads(void);
+bool thread_pool_in_worker(void);
+
+// Runs task over [0, n) split in chunks of at least grain iterations.
+// The calling thread takes part in the work and the call returns once every
+// chunk is done. Calls made from inside a task, or while another thread owns
+// the pool, run serially on the calling thread.
+void thread_pool_parallel_for(size_t n, size_t grain, thread_pool_task task, void *arg);
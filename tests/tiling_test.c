@@ -0,0 +1,147 @@
+// Tiled inference against a whole-image pass
+//
+// Runs images of several shapes through nn_predict_tiled and through a network
+// built for the whole image with the same weights, and fails when the outputs
+// differ. Images smaller than a tile must be rejected, the output untouched.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "../src/Matrix/random.h"
+#include "../src/NeuralNetwork/tiling.h"
+
+#define TEST_CHANNELS 3
+#define TEST_OUT_CHANNELS 2
+// Largest difference allowed between the tiled and the whole-image outputs
+#define TEST_TOLERANCE 1e-4
+// Value left in the output of a rejected image
+#define TEST_UNTOUCHED 42.0f
+
+// Two kernel x kernel convolutions keeping the size of height x width images
+static neural_network* conv_network(size_t height, size_t width, size_t kernel){
+    conv_shape first = {.in_channels = TEST_CHANNELS, .in_height = height, .in_width = width, .out_channels = 5,
+                        .kernel_height = kernel, .kernel_width = kernel, .stride = 1, .padding = kernel / 2, .dilation = 1};
+    conv_shape second = first;
+    second.in_channels = 5;
+    second.out_channels = TEST_OUT_CHANNELS;
+
+    neural_network *nn = neural_network_create();
+    nn_set_input_conv2d_layer(nn, first, ACTIVATION_TANH);
+    nn_set_output_conv2d_layer(nn, second, ACTIVATION_IDENTITY);
+    nn_compile(nn, TEST_CHANNELS * height * width);
+    return nn;
+}
+
+// Largest difference between the tiled and the whole-image outputs of a height x width image
+static double tiled_error(size_t height, size_t width, size_t tile_height, size_t tile_width,
+                          size_t kernel, size_t overlap, size_t batch){
+    neural_network *nn = conv_network(tile_height, tile_width, kernel);
+    neural_network *whole = conv_network(height, width, kernel);
+    for(size_t i = 0; i < nn->nb_layers; i++){
+        matrix_copy_to(nn->layers[i]->weights, whole->layers[i]->weights);
+        matrix_copy_to(nn->layers[i]->bias, whole->layers[i]->bias);
+    }
+
+    matrix *image = matrix_create_random(TEST_CHANNELS * height, width, -1, 1);
+    matrix *out = matrix_zeros(TEST_OUT_CHANNELS * height, width);
+    // the whole image as one sample, its rows one after the other
+    matrix *sample = matrix_zeros(TEST_CHANNELS * height * width, 1);
+    for(size_t r = 0; r < image->row; r++){
+        for(size_t x = 0; x < width; x++)
+            sample->data[(r * width + x) * sample->stride] = image->data[r * image->stride + x];
+    }
+
+    nn_tiling tiling = nn_tiling_of(nn, overlap, batch);
+    nn_predict_tiled(nn, image, out, &tiling);
+    matrix *expected = nn_predict(whole, sample);
+    double error = 0;
+    for(size_t r = 0; r < out->row; r++){
+        for(size_t x = 0; x < width; x++)
+            error = fmax(error, fabs(out->data[r * out->stride + x] - expected->data[(r * width + x) * expected->stride]));
+    }
+
+    matrix_destroy(expected);
+    matrix_destroy(sample);
+    matrix_destroy(image);
+    matrix_destroy(out);
+    nn_destroy(nn);
+    nn_destroy(whole);
+    return error;
+}
+
+// Whether a height x width image, smaller than a tile, leaves the output untouched
+static bool tiled_rejects(size_t height, size_t width, size_t tile_height, size_t tile_width, size_t kernel){
+    neural_network *nn = conv_network(tile_height, tile_width, kernel);
+    matrix *image = matrix_create_random(TEST_CHANNELS * height, width, -1, 1);
+    matrix *out = matrix_create(TEST_OUT_CHANNELS * height, width, TEST_UNTOUCHED);
+
+    nn_tiling tiling = nn_tiling_of(nn, 2, 4);
+    nn_predict_tiled(nn, image, out, &tiling);
+    bool untouched = true;
+    for(size_t r = 0; r < out->row; r++){
+        for(size_t x = 0; x < width; x++)
+            untouched = untouched && out->data[r * out->stride + x] == TEST_UNTOUCHED;
+    }
+
+    matrix_destroy(image);
+    matrix_destroy(out);
+    nn_destroy(nn);
+    return untouched;
+}
+
+typedef struct tiled_case{
+    size_t height, width;
+    size_t tile_height, tile_width;
+    size_t kernel, overlap, batch;
+} tiled_case;
+
+int main(void){
+    random_seed(1);
+    int failures = 0;
+
+    const tiled_case cases[] = {
+        {12, 16, 12, 16, 3, 8, 8},      // exactly one tile
+        {13, 17, 12, 16, 3, 8, 8},      // one pixel past a tile on both axes
+        {12, 53, 12, 16, 3, 8, 3},      // one tile high
+        {41, 16, 12, 16, 3, 8, 3},      // one tile wide
+        {41, 53, 12, 16, 3, 6, 8},      // the last tiles moved back onto the border
+        {41, 53, 12, 16, 3, 7, 8},
+        {41, 53, 12, 16, 3, 8, 8},
+        {41, 53, 12, 16, 3, 9, 8},
+        {41, 53, 12, 16, 3, 10, 8},
+        {41, 53, 12, 16, 3, 11, 8},
+        {64, 64, 16, 16, 3, 8, 100},    // tiles that fit exactly, in one batch
+        {100, 77, 20, 12, 3, 6, 3},
+        {37, 53, 8, 8, 1, 0, 64},       // pointwise kernels, no overlap
+        {50, 45, 20, 20, 5, 10, 4},
+    };
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+        const tiled_case *c = &cases[i];
+        double error = tiled_error(c->height, c->width, c->tile_height, c->tile_width, c->kernel, c->overlap, c->batch);
+        if(error > TEST_TOLERANCE){
+            fprintf(stderr, "FAIL: %zu x %zu image, %zu x %zu tiles, %zu x %zu kernels, overlap %zu: differs by %g\n",
+                    c->height, c->width, c->tile_height, c->tile_width, c->kernel, c->kernel, c->overlap, error);
+            failures++;
+        }
+    }
+
+    const tiled_case small[] = {
+        {9, 53, 16, 16, 3, 0, 0},       // smaller than a tile along the rows
+        {30, 7, 16, 16, 5, 0, 0},       // along the columns
+        {9, 7, 16, 16, 3, 0, 0},        // along both
+    };
+    for(size_t i = 0; i < sizeof(small) / sizeof(small[0]); i++){
+        const tiled_case *c = &small[i];
+        if(!tiled_rejects(c->height, c->width, c->tile_height, c->tile_width, c->kernel)){
+            fprintf(stderr, "FAIL: %zu x %zu image smaller than a %zu x %zu tile was not rejected\n",
+                    c->height, c->width, c->tile_height, c->tile_width);
+            failures++;
+        }
+    }
+
+    if(failures > 0)
+        return 1;
+    printf("tiling_test: OK\n");
+    return 0;
+}